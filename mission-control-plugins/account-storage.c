@@ -85,6 +85,7 @@
 #include <mission-control-plugins/mcp-signals-marshal.h>
 #include <mission-control-plugins/implementation.h>
 #include <mission-control-plugins/debug-internal.h>
+#include <mission-control-plugins/accounting-internal.h>
 #include <glib.h>
 
 #define MCP_DEBUG_TYPE  MCP_DEBUG_ACCOUNT_STORAGE
@@ -478,6 +479,8 @@ mcp_account_storage_get_attribute (McpAccountStorage *storage,
     McpAttributeFlags *flags)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  GVariant *ret;
 
   SDEBUG (storage, "%s.%s (type '%.*s')", account, attribute,
       (int) g_variant_type_get_string_length (type),
@@ -486,7 +489,10 @@ mcp_account_storage_get_attribute (McpAccountStorage *storage,
   g_return_val_if_fail (iface != NULL, FALSE);
   g_return_val_if_fail (iface->get_attribute != NULL, FALSE);
 
-  return iface->get_attribute (storage, am, account, attribute, type, flags);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->get_attribute (storage, am, account, attribute, type, flags);
+  _mcp_accounting_end (storage, "get_attribute", started);
+  return ret;
 }
 
 /**
@@ -524,6 +530,8 @@ mcp_account_storage_get_parameter (McpAccountStorage *storage,
     McpParameterFlags *flags)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  GVariant *ret;
 
   if (type == NULL)
     SDEBUG (storage, "%s.%s (if type is stored)", account, parameter);
@@ -535,7 +543,10 @@ mcp_account_storage_get_parameter (McpAccountStorage *storage,
   g_return_val_if_fail (iface != NULL, FALSE);
   g_return_val_if_fail (iface->get_parameter != NULL, FALSE);
 
-  return iface->get_parameter (storage, am, account, parameter, type, flags);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->get_parameter (storage, am, account, parameter, type, flags);
+  _mcp_accounting_end (storage, "get_parameter", started);
+  return ret;
 }
 
 /**
@@ -567,13 +578,18 @@ mcp_account_storage_list_typed_parameters (McpAccountStorage *storage,
     const gchar *account)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  gchar **ret;
 
   SDEBUG (storage, "%s", account);
 
   g_return_val_if_fail (iface != NULL, NULL);
   g_return_val_if_fail (iface->list_typed_parameters != NULL, NULL);
 
-  return iface->list_typed_parameters (storage, am, account);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->list_typed_parameters (storage, am, account);
+  _mcp_accounting_end (storage, "list_typed_parameters", started);
+  return ret;
 }
 
 /**
@@ -602,13 +618,18 @@ mcp_account_storage_list_untyped_parameters (McpAccountStorage *storage,
     const gchar *account)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  gchar **ret;
 
   SDEBUG (storage, "%s", account);
 
   g_return_val_if_fail (iface != NULL, NULL);
   g_return_val_if_fail (iface->list_untyped_parameters != NULL, NULL);
 
-  return iface->list_untyped_parameters (storage, am, account);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->list_untyped_parameters (storage, am, account);
+  _mcp_accounting_end (storage, "list_untyped_parameters", started);
+  return ret;
 }
 
 /**
@@ -646,6 +667,8 @@ mcp_account_storage_set_attribute (McpAccountStorage *storage,
     McpAttributeFlags flags)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  McpAccountStorageSetResult ret;
 
   SDEBUG (storage, "%s.%s (type '%s')", account, attribute,
       value == NULL ? "null" : g_variant_get_type_string (value));
@@ -655,7 +678,10 @@ mcp_account_storage_set_attribute (McpAccountStorage *storage,
   g_return_val_if_fail (iface->set_attribute != NULL,
       MCP_ACCOUNT_STORAGE_SET_RESULT_FAILED);
 
-  return iface->set_attribute (storage, am, account, attribute, value, flags);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->set_attribute (storage, am, account, attribute, value, flags);
+  _mcp_accounting_end (storage, "set_attribute", started);
+  return ret;
 }
 
 /**
@@ -694,6 +720,8 @@ mcp_account_storage_set_parameter (McpAccountStorage *storage,
     McpParameterFlags flags)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  McpAccountStorageSetResult ret;
 
   SDEBUG (storage, "%s.%s (type '%s')", account, parameter,
       value == NULL ? "null" : g_variant_get_type_string (value));
@@ -704,7 +732,10 @@ mcp_account_storage_set_parameter (McpAccountStorage *storage,
   g_return_val_if_fail (iface->set_parameter != NULL,
       MCP_ACCOUNT_STORAGE_SET_RESULT_FAILED);
 
-  return iface->set_parameter (storage, am, account, parameter, value, flags);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->set_parameter (storage, am, account, parameter, value, flags);
+  _mcp_accounting_end (storage, "set_parameter", started);
+  return ret;
 }
 
 /**
@@ -764,13 +795,18 @@ mcp_account_storage_create (McpAccountStorage *storage,
     GError **error)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  gchar *ret;
 
   SDEBUG (storage, "%s/%s \"%s\"", manager, protocol, identification);
 
   g_return_val_if_fail (iface != NULL, NULL);
   g_return_val_if_fail (iface->create != NULL, NULL);
 
-  return iface->create (storage, am, manager, protocol, identification, error);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->create (storage, am, manager, protocol, identification, error);
+  _mcp_accounting_end (storage, "create", started);
+  return ret;
 }
 
 /**
@@ -811,6 +847,7 @@ mcp_account_storage_delete_async (McpAccountStorage *storage,
   g_return_if_fail (iface != NULL);
   g_return_if_fail (iface->delete_async != NULL);
 
+  _mcp_accounting_wrap_async (storage, "delete_async", &callback, &user_data);
   iface->delete_async (storage, am, account, cancellable, callback, user_data);
 }
 
@@ -830,12 +867,17 @@ mcp_account_storage_delete_finish (McpAccountStorage *storage,
     GError **error)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  gboolean ret;
 
   SDEBUG (storage, "");
   g_return_val_if_fail (iface != NULL, FALSE);
   g_return_val_if_fail (iface->delete_finish != NULL, FALSE);
 
-  return iface->delete_finish (storage, result, error);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->delete_finish (storage, result, error);
+  _mcp_accounting_end (storage, "delete_finish", started);
+  return ret;
 }
 
 /**
@@ -878,12 +920,17 @@ mcp_account_storage_commit (McpAccountStorage *storage,
     const gchar *account)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  gboolean ret;
 
   SDEBUG (storage, "called for %s", account ? account : "<all accounts>");
   g_return_val_if_fail (iface != NULL, FALSE);
   g_return_val_if_fail (iface->commit != NULL, FALSE);
 
-  return iface->commit (storage, am, account);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->commit (storage, am, account);
+  _mcp_accounting_end (storage, "commit", started);
+  return ret;
 }
 
 /**
@@ -920,12 +967,17 @@ mcp_account_storage_list (McpAccountStorage *storage,
     McpAccountManager *am)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  GList *ret;
 
   SDEBUG (storage, "");
   g_return_val_if_fail (iface != NULL, NULL);
   g_return_val_if_fail (iface->list != NULL, NULL);
 
-  return iface->list (storage, am);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->list (storage, am);
+  _mcp_accounting_end (storage, "list", started);
+  return ret;
 }
 
 /**
@@ -959,6 +1011,7 @@ mcp_account_storage_get_identifier (McpAccountStorage *storage,
     GValue *identifier)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
 
   SDEBUG (storage, "%s", account);
   g_return_if_fail (iface != NULL);
@@ -966,7 +1019,9 @@ mcp_account_storage_get_identifier (McpAccountStorage *storage,
   g_return_if_fail (identifier != NULL);
   g_return_if_fail (!G_IS_VALUE (identifier));
 
+  started = _mcp_accounting_begin (storage);
   iface->get_identifier (storage, account, identifier);
+  _mcp_accounting_end (storage, "get_identifier", started);
 }
 
 /**
@@ -1001,12 +1056,17 @@ mcp_account_storage_get_additional_info (McpAccountStorage *storage,
     const gchar *account)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  GHashTable *ret;
 
   SDEBUG (storage, "%s", account);
   g_return_val_if_fail (iface != NULL, FALSE);
   g_return_val_if_fail (iface->get_additional_info != NULL, FALSE);
 
-  return iface->get_additional_info (storage, account);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->get_additional_info (storage, account);
+  _mcp_accounting_end (storage, "get_additional_info", started);
+  return ret;
 }
 
 /**
@@ -1037,12 +1097,17 @@ mcp_account_storage_get_restrictions (McpAccountStorage *storage,
     const gchar *account)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  TpStorageRestrictionFlags ret;
 
   SDEBUG (storage, "%s", account);
   g_return_val_if_fail (iface != NULL, 0);
   g_return_val_if_fail (iface->get_restrictions != NULL, 0);
 
-  return iface->get_restrictions (storage, account);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->get_restrictions (storage, account);
+  _mcp_accounting_end (storage, "get_restrictions", started);
+  return ret;
 }
 
 /**
@@ -1196,12 +1261,17 @@ mcp_account_storage_get_flags (McpAccountStorage *storage,
     const gchar *account)
 {
   McpAccountStorageIface *iface = MCP_ACCOUNT_STORAGE_GET_IFACE (storage);
+  gint64 started;
+  McpAccountStorageFlags ret;
 
   g_return_val_if_fail (iface != NULL, MCP_ACCOUNT_STORAGE_FLAG_NONE);
   g_return_val_if_fail (iface->get_flags != NULL,
       MCP_ACCOUNT_STORAGE_FLAG_NONE);
 
-  return iface->get_flags (storage, account);
+  started = _mcp_accounting_begin (storage);
+  ret = iface->get_flags (storage, account);
+  _mcp_accounting_end (storage, "get_flags", started);
+  return ret;
 }
 
 /**
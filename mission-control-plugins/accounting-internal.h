@@ -0,0 +1,42 @@
+/* Mission Control plugin API - per-plugin call accounting
+ *
+ * Copyright © 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef MCP_ACCOUNTING_INTERNAL_H
+#define MCP_ACCOUNTING_INTERNAL_H
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* These are not exported from the library: only symbols starting with
+ * mcp_ are. @vfunc must always be a string literal. */
+
+gint64 _mcp_accounting_begin (gpointer plugin);
+void _mcp_accounting_end (gpointer plugin, const gchar *vfunc,
+    gint64 started);
+
+void _mcp_accounting_wrap_async (gpointer plugin, const gchar *vfunc,
+    GAsyncReadyCallback *callback, gpointer *user_data);
+
+void _mcp_accounting_delay_started (gconstpointer delay, const gchar *what);
+void _mcp_accounting_delay_ended (gconstpointer delay);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,385 @@
+/* Mission Control plugin API - per-plugin call accounting
+ *
+ * Copyright © 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * The wrappers through which Mission Control calls plugin virtual methods
+ * count the calls and the wall time spent in them, per plugin type and per
+ * virtual method. Asynchronous methods are timed until their callback runs,
+ * and delays started with mcp_dispatch_operation_start_delay() or
+ * mcp_request_start_delay() are timed until they are ended, and charged to
+ * the plugin whose method was running when the delay started.
+ *
+ * Plugins are only ever called from the main thread, so none of this is
+ * locked.
+ */
+
+#include "config.h"
+
+#include <mission-control-plugins/mission-control-plugins.h>
+#include <mission-control-plugins/accounting-internal.h>
+
+#include <string.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#define ACCOUNTING_DOMAIN "mcp/calls"
+
+typedef struct {
+  GType type;
+  /* a string literal */
+  const gchar *vfunc;
+  guint64 calls;
+  gint64 total_usec;
+  gint64 max_usec;
+  /* delays that have been started but not yet ended */
+  guint in_progress;
+} CallStats;
+
+typedef struct {
+  GType type;
+  const gchar *vfunc;
+  gint64 started;
+  GAsyncReadyCallback callback;
+  gpointer user_data;
+} AsyncCall;
+
+/* owned CallStats => itself */
+static GHashTable *call_stats = NULL;
+/* GType of each plugin whose method is currently running, innermost last */
+static GArray *running = NULL;
+/* borrowed delay token => owned AsyncCall, with no callback */
+static GHashTable *delays = NULL;
+
+static guint
+call_stats_hash (gconstpointer p)
+{
+  const CallStats *stats = p;
+
+  return g_direct_hash ((gpointer) stats->type) ^
+    g_direct_hash (stats->vfunc);
+}
+
+static gboolean
+call_stats_equal (gconstpointer a,
+    gconstpointer b)
+{
+  const CallStats *left = a;
+  const CallStats *right = b;
+
+  return left->type == right->type && left->vfunc == right->vfunc;
+}
+
+static CallStats *
+lookup (GType type,
+    const gchar *vfunc)
+{
+  CallStats key;
+  CallStats *stats;
+
+  key.type = type;
+  key.vfunc = vfunc;
+
+  if (G_UNLIKELY (call_stats == NULL))
+    call_stats = g_hash_table_new_full (call_stats_hash, call_stats_equal,
+        g_free, NULL);
+
+  stats = g_hash_table_lookup (call_stats, &key);
+
+  if (stats == NULL)
+    {
+      stats = g_new0 (CallStats, 1);
+      stats->type = type;
+      stats->vfunc = vfunc;
+      g_hash_table_add (call_stats, stats);
+    }
+
+  return stats;
+}
+
+static void
+record (GType type,
+    const gchar *vfunc,
+    gint64 elapsed)
+{
+  CallStats *stats = lookup (type, vfunc);
+
+  stats->calls++;
+  stats->total_usec += elapsed;
+  stats->max_usec = MAX (stats->max_usec, elapsed);
+}
+
+gint64
+_mcp_accounting_begin (gpointer plugin)
+{
+  GType type = G_OBJECT_TYPE (plugin);
+
+  if (G_UNLIKELY (running == NULL))
+    running = g_array_new (FALSE, FALSE, sizeof (GType));
+
+  g_array_append_val (running, type);
+  return g_get_monotonic_time ();
+}
+
+void
+_mcp_accounting_end (gpointer plugin,
+    const gchar *vfunc,
+    gint64 started)
+{
+  g_return_if_fail (running != NULL && running->len > 0);
+
+  g_array_set_size (running, running->len - 1);
+  record (G_OBJECT_TYPE (plugin), vfunc, g_get_monotonic_time () - started);
+}
+
+static void
+async_call_cb (GObject *source,
+    GAsyncResult *result,
+    gpointer user_data)
+{
+  AsyncCall *call = user_data;
+
+  record (call->type, call->vfunc, g_get_monotonic_time () - call->started);
+
+  if (call->callback != NULL)
+    call->callback (source, result, call->user_data);
+
+  g_slice_free (AsyncCall, call);
+}
+
+/*
+ * Replace *@callback and *@user_data, which are about to be passed to
+ * @plugin's @vfunc, with a wrapper that records the time until the
+ * callback is called and then chains up to the original.
+ */
+void
+_mcp_accounting_wrap_async (gpointer plugin,
+    const gchar *vfunc,
+    GAsyncReadyCallback *callback,
+    gpointer *user_data)
+{
+  AsyncCall *call = g_slice_new0 (AsyncCall);
+
+  call->type = G_OBJECT_TYPE (plugin);
+  call->vfunc = vfunc;
+  call->started = g_get_monotonic_time ();
+  call->callback = *callback;
+  call->user_data = *user_data;
+
+  *callback = async_call_cb;
+  *user_data = call;
+}
+
+static void
+async_call_free (gpointer p)
+{
+  g_slice_free (AsyncCall, p);
+}
+
+void
+_mcp_accounting_delay_started (gconstpointer delay,
+    const gchar *what)
+{
+  AsyncCall *call;
+
+  if (delay == NULL)
+    return;
+
+  if (G_UNLIKELY (delays == NULL))
+    delays = g_hash_table_new_full (NULL, NULL, NULL, async_call_free);
+
+  call = g_slice_new0 (AsyncCall);
+
+  /* if no plugin method is running, the delay was started from a
+   * callback and we can't tell whose it is */
+  if (running != NULL && running->len > 0)
+    call->type = g_array_index (running, GType, running->len - 1);
+  else
+    call->type = G_TYPE_INVALID;
+
+  call->vfunc = what;
+  call->started = g_get_monotonic_time ();
+  g_hash_table_insert (delays, (gpointer) delay, call);
+  lookup (call->type, call->vfunc)->in_progress++;
+}
+
+void
+_mcp_accounting_delay_ended (gconstpointer delay)
+{
+  AsyncCall *call;
+
+  if (delays == NULL)
+    return;
+
+  call = g_hash_table_lookup (delays, delay);
+
+  if (call == NULL)
+    return;
+
+  lookup (call->type, call->vfunc)->in_progress--;
+  record (call->type, call->vfunc, g_get_monotonic_time () - call->started);
+  g_hash_table_remove (delays, delay);
+}
+
+static const gchar *
+type_name (GType type)
+{
+  if (type == G_TYPE_INVALID)
+    return "(unknown)";
+
+  return g_type_name (type);
+}
+
+static gint
+call_stats_cmp (gconstpointer a,
+    gconstpointer b)
+{
+  const CallStats *left = a;
+  const CallStats *right = b;
+  gint ret = strcmp (type_name (left->type), type_name (right->type));
+
+  if (ret != 0)
+    return ret;
+
+  return strcmp (left->vfunc, right->vfunc);
+}
+
+/**
+ * mcp_debug_dump_call_stats:
+ *
+ * Send the number of calls made to each plugin's virtual methods, and
+ * the time spent in them, to the Telepathy Debug interface in the
+ * "mcp/calls" domain. Asynchronous methods are timed until their
+ * callback is called, and dispatch operation or request delays are
+ * charged to the plugin that started them, under the names
+ * "dispatch-operation-delay" and "request-delay". Delays that are still
+ * in progress are listed separately.
+ *
+ * Mission Control calls this when it exits.
+ *
+ * Since: 5.17.0
+ */
+void
+mcp_debug_dump_call_stats (void)
+{
+  TpDebugSender *dbg;
+  GList *list, *l;
+  GHashTableIter iter;
+  gpointer v;
+  gint64 now;
+
+  if (call_stats == NULL && delays == NULL)
+    return;
+
+  dbg = tp_debug_sender_dup ();
+
+  if (call_stats != NULL)
+    {
+      list = g_list_sort (g_hash_table_get_values (call_stats),
+          call_stats_cmp);
+
+      for (l = list; l != NULL; l = l->next)
+        {
+          CallStats *stats = l->data;
+
+          /* delays that haven't ended yet are listed below */
+          if (stats->calls == 0)
+            continue;
+
+          tp_debug_sender_add_message_printf (dbg, NULL, NULL,
+              ACCOUNTING_DOMAIN, G_LOG_LEVEL_DEBUG,
+              "%s %s: %" G_GUINT64_FORMAT " calls, %" G_GINT64_FORMAT
+              "us total, %" G_GINT64_FORMAT "us max",
+              type_name (stats->type), stats->vfunc, stats->calls,
+              stats->total_usec, stats->max_usec);
+        }
+
+      g_list_free (list);
+    }
+
+  if (delays != NULL)
+    {
+      now = g_get_monotonic_time ();
+      g_hash_table_iter_init (&iter, delays);
+
+      while (g_hash_table_iter_next (&iter, NULL, &v))
+        {
+          AsyncCall *call = v;
+
+          tp_debug_sender_add_message_printf (dbg, NULL, NULL,
+              ACCOUNTING_DOMAIN, G_LOG_LEVEL_DEBUG,
+              "%s %s: still in progress after %" G_GINT64_FORMAT "us",
+              type_name (call->type), call->vfunc, now - call->started);
+        }
+    }
+
+  g_object_unref (dbg);
+}
+
+/**
+ * McpCallStatsFunc:
+ * @plugin: the type name of a plugin, or "(unknown)" for delays that
+ *  were started outside any plugin method
+ * @vfunc: the name of one of its virtual methods, or
+ *  "dispatch-operation-delay" or "request-delay"
+ * @calls: the number of calls that have finished
+ * @total_usec: the total time they took, in microseconds
+ * @max_usec: the longest time one of them took, in microseconds
+ * @in_progress: the number of delays that have started but not ended
+ * @user_data: the data passed to mcp_debug_foreach_call_stats()
+ *
+ * Signature of a callback to receive the statistics recorded for one
+ * virtual method of one plugin.
+ *
+ * Since: 5.17.0
+ */
+
+/**
+ * mcp_debug_foreach_call_stats:
+ * @func: called for each plugin and virtual method that has been called,
+ *  sorted by plugin and then by method
+ * @user_data: passed to @func
+ *
+ * Read the statistics that mcp_debug_dump_call_stats() logs, for example
+ * to make them available while Mission Control is running.
+ *
+ * Since: 5.17.0
+ */
+void
+mcp_debug_foreach_call_stats (McpCallStatsFunc func,
+    gpointer user_data)
+{
+  GList *list, *l;
+
+  g_return_if_fail (func != NULL);
+
+  if (call_stats == NULL)
+    return;
+
+  list = g_list_sort (g_hash_table_get_values (call_stats), call_stats_cmp);
+
+  for (l = list; l != NULL; l = l->next)
+    {
+      CallStats *stats = l->data;
+
+      func (type_name (stats->type), stats->vfunc, stats->calls,
+          stats->total_usec, stats->max_usec, stats->in_progress, user_data);
+    }
+
+  g_list_free (list);
+}
@@ -45,6 +45,19 @@ typedef enum {
 gboolean mcp_is_debugging (McpDebugFlags type);
 void mcp_debug_init (void);
 
+void mcp_debug_dump_call_stats (void);
+
+typedef void (*McpCallStatsFunc) (const gchar *plugin,
+    const gchar *vfunc,
+    guint64 calls,
+    gint64 total_usec,
+    gint64 max_usec,
+    guint in_progress,
+    gpointer user_data);
+
+void mcp_debug_foreach_call_stats (McpCallStatsFunc func,
+    gpointer user_data);
+
 G_END_DECLS
 
 #endif
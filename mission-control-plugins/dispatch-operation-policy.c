@@ -63,6 +63,7 @@
 #include "config.h"
 
 #include <mission-control-plugins/mission-control-plugins.h>
+#include <mission-control-plugins/accounting-internal.h>
 
 GType
 mcp_dispatch_operation_policy_get_type (void)
@@ -171,7 +172,12 @@ mcp_dispatch_operation_policy_check (McpDispatchOperationPolicy *policy,
   g_return_if_fail (iface != NULL);
 
   if (iface->check != NULL)
-    iface->check (policy, dispatch_operation);
+    {
+      gint64 started = _mcp_accounting_begin (policy);
+
+      iface->check (policy, dispatch_operation);
+      _mcp_accounting_end (policy, "check", started);
+    }
 }
 
 /**
@@ -227,6 +233,8 @@ mcp_dispatch_operation_policy_handler_is_suitable_async (
 
   if (iface->handler_is_suitable_async != NULL)
     {
+      _mcp_accounting_wrap_async (policy, "handler_is_suitable_async",
+          &callback, &user_data);
       iface->handler_is_suitable_async (policy, handler, unique_name,
           dispatch_operation, callback, user_data);
     }
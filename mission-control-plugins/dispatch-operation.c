@@ -41,6 +41,7 @@
 
 #include <mission-control-plugins/mission-control-plugins.h>
 #include <mission-control-plugins/implementation.h>
+#include <mission-control-plugins/accounting-internal.h>
 
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
@@ -258,10 +259,14 @@ McpDispatchOperationDelay *
 mcp_dispatch_operation_start_delay (McpDispatchOperation *self)
 {
   McpDispatchOperationIface *iface = MCP_DISPATCH_OPERATION_GET_IFACE (self);
+  McpDispatchOperationDelay *delay;
 
   g_return_val_if_fail (iface != NULL, NULL);
   g_return_val_if_fail (iface->start_delay != NULL, NULL);
-  return iface->start_delay (self);
+
+  delay = iface->start_delay (self);
+  _mcp_accounting_delay_started (delay, "dispatch-operation-delay");
+  return delay;
 }
 
 /**
@@ -281,6 +286,7 @@ mcp_dispatch_operation_end_delay (McpDispatchOperation *self,
   g_return_if_fail (iface != NULL);
   g_return_if_fail (delay != NULL);
   g_return_if_fail (iface->end_delay != NULL);
+  _mcp_accounting_delay_ended (delay);
   iface->end_delay (self, delay);
 }
 
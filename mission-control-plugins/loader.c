@@ -43,6 +43,8 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include <gmodule.h>
 #include <mission-control-plugins/mission-control-plugins.h>
 #include <mission-control-plugins/debug.h>
@@ -89,7 +91,38 @@ mcp_set_debug (gboolean debug)
   debugging = debug;
 }
 
+/* plugin objects, highest priority first */
 static GList *plugins = NULL;
+static GQuark priority_quark = 0;
+
+static gint
+plugin_object_get_priority (GObject *object)
+{
+  return GPOINTER_TO_INT (g_object_get_qdata (object, priority_quark));
+}
+
+/* Insert @object before the first object whose priority is no higher, so
+ * that among plugins with the same priority, the last one added comes
+ * first, as it always has */
+static void
+add_object_with_priority (GObject *object,
+    gint priority)
+{
+  GList *l;
+
+  if (G_UNLIKELY (priority_quark == 0))
+    priority_quark = g_quark_from_static_string ("mcp-plugin-priority");
+
+  g_object_set_qdata (object, priority_quark, GINT_TO_POINTER (priority));
+
+  for (l = plugins; l != NULL; l = l->next)
+    {
+      if (plugin_object_get_priority (l->data) <= priority)
+        break;
+    }
+
+  plugins = g_list_insert_before (plugins, l, g_object_ref (object));
+}
 
 /**
  * mcp_add_object:
@@ -110,7 +143,7 @@ mcp_add_object (gpointer object)
 {
   g_return_if_fail (G_IS_OBJECT (object));
 
-  plugins = g_list_prepend (plugins, g_object_ref (object));
+  add_object_with_priority (object, 0);
 }
 
 /**
@@ -137,6 +170,219 @@ mcp_add_object (gpointer object)
  *  number of objects supported by this plugin
  */
 
+/* A plugin with a manifest, which we have not loaded yet */
+typedef struct {
+    gchar *path;
+    gchar *name;
+    /* names of the GInterfaces implemented by its objects */
+    gchar **interfaces;
+    gint priority;
+} PendingPlugin;
+
+/* PendingPlugin, highest priority first */
+static GList *pending_plugins = NULL;
+
+static void
+pending_plugin_free (PendingPlugin *pending)
+{
+  g_free (pending->path);
+  g_free (pending->name);
+  g_strfreev (pending->interfaces);
+  g_slice_free (PendingPlugin, pending);
+}
+
+static gint
+pending_plugin_cmp (gconstpointer a,
+    gconstpointer b)
+{
+  const PendingPlugin *x = a;
+  const PendingPlugin *y = b;
+
+  return (y->priority > x->priority) - (y->priority < x->priority);
+}
+
+static void
+load_plugin (const gchar *full_path,
+    const gchar *name,
+    gint priority)
+{
+  gint64 start = g_get_monotonic_time ();
+  GModule *module;
+
+  module = g_module_open (full_path, G_MODULE_BIND_LOCAL);
+  if (module)
+    DEBUG ("g_module_open (%s, ...) = %p", full_path, module);
+  else
+    DEBUG ("g_module_open (%s, ...) = %s", full_path, g_module_error ());
+
+  if (module != NULL)
+    {
+      gpointer symbol;
+
+      if (g_module_symbol (module, MCP_PLUGIN_REF_NTH_OBJECT_SYMBOL,
+            &symbol))
+        {
+          GObject *(* ref_nth) (guint) = symbol;
+          guint n = 0;
+          GObject *object;
+
+          /* In practice, approximately no GModules can safely be unloaded.
+           * For those that can, if there's ever a need for it, we can add
+           * an API for "please don't make me resident". */
+          g_module_make_resident (module);
+
+          for (object = ref_nth (n);
+              object != NULL;
+              object = ref_nth (++n))
+            {
+              add_object_with_priority (object, priority);
+              g_object_unref (object);
+            }
+
+          DEBUG ("%u plugin object(s) found in %s, loaded in %" G_GINT64_FORMAT
+              "us", n, name, g_get_monotonic_time () - start);
+        }
+      else
+        {
+          DEBUG ("%s does not have symbol %s", name,
+              MCP_PLUGIN_REF_NTH_OBJECT_SYMBOL);
+          g_module_close (module);
+        }
+    }
+}
+
+/*
+ * If @full_path has a manifest, add it to pending_plugins and return %TRUE.
+ */
+static gboolean
+defer_plugin (const gchar *full_path,
+    const gchar *name)
+{
+  GKeyFile *manifest = g_key_file_new ();
+  gchar *manifest_path;
+  GError *error = NULL;
+  PendingPlugin *pending = NULL;
+
+  manifest_path = g_strdup_printf ("%.*s" MCP_PLUGIN_MANIFEST_SUFFIX,
+      (gint) (strlen (full_path) - strlen ("." G_MODULE_SUFFIX)), full_path);
+
+  if (!g_file_test (manifest_path, G_FILE_TEST_EXISTS))
+    goto finally;
+
+  if (!g_key_file_load_from_file (manifest, manifest_path, G_KEY_FILE_NONE,
+        &error))
+    {
+      DEBUG ("ignoring %s: %s", manifest_path, error->message);
+      goto finally;
+    }
+
+  pending = g_slice_new0 (PendingPlugin);
+  pending->interfaces = g_key_file_get_string_list (manifest,
+      MCP_PLUGIN_MANIFEST_GROUP, "Interfaces", NULL, &error);
+
+  if (pending->interfaces == NULL)
+    {
+      DEBUG ("ignoring %s: %s", manifest_path, error->message);
+      pending_plugin_free (pending);
+      pending = NULL;
+      goto finally;
+    }
+
+  /* defaults to 0 if missing or invalid */
+  pending->priority = g_key_file_get_integer (manifest,
+      MCP_PLUGIN_MANIFEST_GROUP, "Priority", NULL);
+  pending->path = g_strdup (full_path);
+  pending->name = g_strdup (name);
+  pending_plugins = g_list_insert_sorted (pending_plugins, pending,
+      pending_plugin_cmp);
+  DEBUG ("%s will be loaded when needed (priority %d)", name,
+      pending->priority);
+
+finally:
+  g_clear_error (&error);
+  g_key_file_free (manifest);
+  g_free (manifest_path);
+  return (pending != NULL);
+}
+
+static gboolean
+pending_plugin_implements (const PendingPlugin *pending,
+    const gchar *iface_name)
+{
+  gchar **iter;
+
+  for (iter = pending->interfaces; *iter != NULL; iter++)
+    {
+      if (strcmp (*iter, iface_name) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Load the pending plugins that implement @iface, or all of them if @iface
+ * is 0 */
+static void
+load_pending_plugins (GType iface)
+{
+  const gchar *iface_name = (iface == 0 ? NULL : g_type_name (iface));
+  GList *l = pending_plugins;
+
+  while (l != NULL)
+    {
+      PendingPlugin *pending = l->data;
+      GList *next = l->next;
+
+      if (iface_name == NULL ||
+          pending_plugin_implements (pending, iface_name))
+        {
+          pending_plugins = g_list_delete_link (pending_plugins, l);
+          load_plugin (pending->path, pending->name, pending->priority);
+          pending_plugin_free (pending);
+        }
+
+      l = next;
+    }
+}
+
+/**
+ * MCP_PLUGIN_MANIFEST_SUFFIX:
+ *
+ * The suffix of a plugin's manifest, which replaces "."
+ * %G_MODULE_SUFFIX in the plugin's filename: for instance, the manifest for
+ * mcp-testplugin.so is mcp-testplugin.mcp-manifest.
+ *
+ * Since: 5.17.0
+ */
+
+/**
+ * MCP_PLUGIN_MANIFEST_GROUP:
+ *
+ * The group in a plugin's manifest that describes it. A manifest is
+ * optional; it is a #GKeyFile with the following keys in this group:
+ *
+ * <variablelist>
+ * <varlistentry><term>Interfaces (string list, required)</term>
+ * <listitem>The names of all the plugin interfaces that the plugin's objects
+ * implement, such as "McpRequestPolicy;McpAccountStorage;"</listitem>
+ * </varlistentry>
+ * <varlistentry><term>Priority (integer, optional)</term>
+ * <listitem>The plugin's objects come before those of plugins with a lower
+ * priority in the lists returned by mcp_list_objects() and
+ * mcp_list_objects_implementing(), so Mission Control consults them first;
+ * the default is 0, which is also the priority of plugins without a
+ * manifest. The order of plugins with the same priority is
+ * unspecified.</listitem>
+ * </varlistentry>
+ * </variablelist>
+ *
+ * A plugin with a manifest is not loaded until Mission Control needs one of
+ * the listed interfaces, so a plugin must not have a manifest unless it
+ * lists every interface it implements.
+ *
+ * Since: 5.17.0
+ */
+
 /**
  * mcp_read_dir:
  * @path: full path to a plugins directory
@@ -146,6 +392,10 @@ mcp_add_object (gpointer object)
  * contains the symbol mcp_plugin_ref_nth_object(), the plugin is made
  * resident, then that symbol is called as a function until it returns %NULL.
  *
+ * If the plugin has a manifest (see %MCP_PLUGIN_MANIFEST_GROUP), it is not
+ * loaded yet, but only when mcp_list_objects_implementing() is called with
+ * one of the interfaces it implements.
+ *
  * Mission Control uses this function to load its plugins; plugins shouldn't
  * call it.
  */
@@ -168,7 +418,6 @@ mcp_read_dir (const gchar *path)
       entry = g_dir_read_name (dir))
     {
       gchar *full_path;
-      GModule *module;
 
       if (!g_str_has_prefix (entry, PLUGIN_PREFIX))
         {
@@ -176,6 +425,9 @@ mcp_read_dir (const gchar *path)
           continue;
         }
 
+      if (g_str_has_suffix (entry, MCP_PLUGIN_MANIFEST_SUFFIX))
+        continue;
+
       if (!g_str_has_suffix (entry, "." G_MODULE_SUFFIX))
         {
           DEBUG ("%s is not a loadable module", entry);
@@ -184,45 +436,8 @@ mcp_read_dir (const gchar *path)
 
       full_path = g_build_filename (path, entry, NULL);
 
-      module = g_module_open (full_path, G_MODULE_BIND_LOCAL);
-      if (module)
-        DEBUG ("g_module_open (%s, ...) = %p", full_path, module);
-      else
-        DEBUG ("g_module_open (%s, ...) = %s", full_path, g_module_error ());
-
-      if (module != NULL)
-        {
-          gpointer symbol;
-
-          if (g_module_symbol (module, MCP_PLUGIN_REF_NTH_OBJECT_SYMBOL,
-                &symbol))
-            {
-              GObject *(* ref_nth) (guint) = symbol;
-              guint n = 0;
-              GObject *object;
-
-              /* In practice, approximately no GModules can safely be unloaded.
-               * For those that can, if there's ever a need for it, we can add
-               * an API for "please don't make me resident". */
-              g_module_make_resident (module);
-
-              for (object = ref_nth (n);
-                  object != NULL;
-                  object = ref_nth (++n))
-                {
-                  mcp_add_object (object);
-                  g_object_unref (object);
-                }
-
-              DEBUG ("%u plugin object(s) found in %s", n, entry);
-            }
-          else
-            {
-              DEBUG ("%s does not have symbol %s", entry,
-                  MCP_PLUGIN_REF_NTH_OBJECT_SYMBOL);
-              g_module_close (module);
-            }
-        }
+      if (!defer_plugin (full_path, entry))
+        load_plugin (full_path, entry, 0);
 
       g_free (full_path);
     }
@@ -233,15 +448,43 @@ mcp_read_dir (const gchar *path)
 /**
  * mcp_list_objects:
  *
- * Return a list of objects that might implement plugin interfaces.
+ * Return a list of objects that might implement plugin interfaces. This
+ * loads all the plugins that have not been loaded yet; if you are only
+ * interested in one interface, mcp_list_objects_implementing() is faster.
  *
  * Mission Control uses this function to iterate through the loaded plugin
  * objects; plugins shouldn't need to call it.
  *
- * Returns: a constant list of plugin objects
+ * Returns: a constant list of plugin objects, highest priority first (see
+ *  %MCP_PLUGIN_MANIFEST_GROUP)
  */
 const GList *
 mcp_list_objects (void)
 {
+  load_pending_plugins (0);
+  return plugins;
+}
+
+/**
+ * mcp_list_objects_implementing:
+ * @iface: a plugin interface, such as %MCP_TYPE_REQUEST_POLICY
+ *
+ * Return a list of objects that might implement plugin interfaces,
+ * including all those that implement @iface. Plugins whose manifest says
+ * they do not implement @iface are not loaded.
+ *
+ * Mission Control uses this function to iterate through the loaded plugin
+ * objects; plugins shouldn't need to call it.
+ *
+ * Returns: a constant list of plugin objects, highest priority first (see
+ *  %MCP_PLUGIN_MANIFEST_GROUP), which must still be checked for @iface
+ * Since: 5.17.0
+ */
+const GList *
+mcp_list_objects_implementing (GType iface)
+{
+  g_return_val_if_fail (G_TYPE_IS_INTERFACE (iface), plugins);
+
+  load_pending_plugins (iface);
   return plugins;
 }
@@ -40,6 +40,11 @@ void mcp_read_dir (const gchar *path);
 
 const GList *mcp_list_objects (void);
 
+#define MCP_PLUGIN_MANIFEST_SUFFIX ".mcp-manifest"
+#define MCP_PLUGIN_MANIFEST_GROUP "Mission Control Plugin"
+
+const GList *mcp_list_objects_implementing (GType iface);
+
 G_END_DECLS
 
 #endif
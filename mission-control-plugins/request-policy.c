@@ -60,6 +60,7 @@
 #include "config.h"
 
 #include <mission-control-plugins/mission-control-plugins.h>
+#include <mission-control-plugins/accounting-internal.h>
 
 /**
  * McpRequestPolicyIface:
@@ -131,7 +132,12 @@ mcp_request_policy_check (McpRequestPolicy *policy,
   g_return_if_fail (iface != NULL);
 
   if (iface->check != NULL)
-    iface->check (policy, request);
+    {
+      gint64 started = _mcp_accounting_begin (policy);
+
+      iface->check (policy, request);
+      _mcp_accounting_end (policy, "check", started);
+    }
 }
 
 /**
@@ -30,6 +30,7 @@
 
 #include <mission-control-plugins/mission-control-plugins.h>
 #include <mission-control-plugins/implementation.h>
+#include <mission-control-plugins/accounting-internal.h>
 
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
@@ -182,10 +183,14 @@ McpRequestDelay *
 mcp_request_start_delay (McpRequest *self)
 {
   McpRequestIface *iface = MCP_REQUEST_GET_IFACE (self);
+  McpRequestDelay *delay;
 
   g_return_val_if_fail (iface != NULL, NULL);
   g_return_val_if_fail (iface->start_delay != NULL, NULL);
-  return iface->start_delay (self);
+
+  delay = iface->start_delay (self);
+  _mcp_accounting_delay_started (delay, "request-delay");
+  return delay;
 }
 
 void
@@ -196,5 +201,6 @@ mcp_request_end_delay (McpRequest *self, McpRequestDelay *delay)
   g_return_if_fail (iface != NULL);
   g_return_if_fail (delay != NULL);
   g_return_if_fail (iface->end_delay != NULL);
+  _mcp_accounting_delay_ended (delay);
   iface->end_delay (self, delay);
 }
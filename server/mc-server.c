@@ -40,7 +40,10 @@
 
 #include <telepathy-glib/telepathy-glib.h>
 
+#include <mission-control-plugins/mission-control-plugins.h>
+
 #include "mcd-service.h"
+#include "mcd-trace.h"
 
 static TpDebugSender *debug_sender;
 static McdService *mcd = NULL;
@@ -61,6 +64,8 @@ on_abort (McdService * _mcd)
     g_debug ("Exiting now ...");
 
     mcd_debug_print_tree (_mcd);
+    mcd_trace_dump ();
+    mcp_debug_dump_call_stats ();
 
     g_debug ("MC now exits .. bye bye");
     mcd_service_stop (_mcd);
@@ -193,6 +198,18 @@ main (int argc, char **argv)
 
     mcd_service_run (MCD_OBJECT (mcd));
 
+    if (g_getenv ("MC_TRACE_FILE") != NULL)
+    {
+        GError *error = NULL;
+
+        if (!mcd_trace_write_chrome_json (g_getenv ("MC_TRACE_FILE"),
+                                          &error))
+        {
+            g_warning ("Unable to write trace: %s", error->message);
+            g_clear_error (&error);
+        }
+    }
+
     g_clear_object (&mcd);
     tp_clear_object (&debug_sender);
 
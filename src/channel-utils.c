@@ -28,6 +28,9 @@
 
 #include "channel-utils.h"
 
+#include <string.h>
+
+#include <dbus/dbus-glib.h>
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
@@ -150,4 +153,223 @@ _mcd_tp_channel_details_free (GPtrArray *channels)
     g_boxed_free (TP_ARRAY_TYPE_CHANNEL_DETAILS_LIST, channels);
 }
 
+/*
+ * Canonical keys for property values, shared by McdPropertyView and the
+ * compiled client filters: "name=t:value", where t is 's', 'o', 'b', or
+ * 'n' for integers of any type and signedness, so that (as the
+ * ChannelFilter spec requires) an integer filter matches a property of
+ * any integer type with the same value.
+ *
+ * Returns FALSE if no filter can match a value like @value.
+ */
+gboolean
+_mcd_property_key_append_gvalue (GString *key,
+                                 const gchar *name,
+                                 const GValue *value)
+{
+    GType type = G_VALUE_TYPE (value);
+
+    g_string_append_printf (key, "%s=", name);
+
+    if (type == G_TYPE_STRING)
+        g_string_append_printf (key, "s:%s", g_value_get_string (value));
+    else if (type == DBUS_TYPE_G_OBJECT_PATH)
+        g_string_append_printf (key, "o:%s",
+                                (const gchar *) g_value_get_boxed (value));
+    else if (type == G_TYPE_BOOLEAN)
+        g_string_append_printf (key, "b:%d", !!g_value_get_boolean (value));
+    else if (type == G_TYPE_UCHAR)
+        g_string_append_printf (key, "n:%u", g_value_get_uchar (value));
+    else if (type == G_TYPE_UINT)
+        g_string_append_printf (key, "n:%u", g_value_get_uint (value));
+    else if (type == G_TYPE_UINT64)
+        g_string_append_printf (key, "n:%" G_GUINT64_FORMAT,
+                                g_value_get_uint64 (value));
+    else if (type == G_TYPE_INT)
+        g_string_append_printf (key, "n:%d", g_value_get_int (value));
+    else if (type == G_TYPE_INT64)
+        g_string_append_printf (key, "n:%" G_GINT64_FORMAT,
+                                g_value_get_int64 (value));
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+static gboolean
+mcd_property_key_append_variant (GString *key,
+                                 GVariant *value)
+{
+    switch (g_variant_classify (value))
+    {
+        case G_VARIANT_CLASS_STRING:
+            g_string_append_printf (key, "s:%s",
+                                    g_variant_get_string (value, NULL));
+            return TRUE;
+        case G_VARIANT_CLASS_OBJECT_PATH:
+            g_string_append_printf (key, "o:%s",
+                                    g_variant_get_string (value, NULL));
+            return TRUE;
+        case G_VARIANT_CLASS_BOOLEAN:
+            g_string_append_printf (key, "b:%d",
+                                    !!g_variant_get_boolean (value));
+            return TRUE;
+        case G_VARIANT_CLASS_BYTE:
+            g_string_append_printf (key, "n:%u", g_variant_get_byte (value));
+            return TRUE;
+        case G_VARIANT_CLASS_UINT16:
+            g_string_append_printf (key, "n:%u", g_variant_get_uint16 (value));
+            return TRUE;
+        case G_VARIANT_CLASS_UINT32:
+            g_string_append_printf (key, "n:%u", g_variant_get_uint32 (value));
+            return TRUE;
+        case G_VARIANT_CLASS_UINT64:
+            g_string_append_printf (key, "n:%" G_GUINT64_FORMAT,
+                                    g_variant_get_uint64 (value));
+            return TRUE;
+        case G_VARIANT_CLASS_INT16:
+            g_string_append_printf (key, "n:%d", g_variant_get_int16 (value));
+            return TRUE;
+        case G_VARIANT_CLASS_INT32:
+            g_string_append_printf (key, "n:%d", g_variant_get_int32 (value));
+            return TRUE;
+        case G_VARIANT_CLASS_INT64:
+            g_string_append_printf (key, "n:%" G_GINT64_FORMAT,
+                                    g_variant_get_int64 (value));
+            return TRUE;
+        default:
+            /* no filter can match any other type */
+            return FALSE;
+    }
+}
+
+/*
+ * McdPropertyView:
+ *
+ * A channel's immutable properties, hashed by name, with each value
+ * already converted to its canonical key. Matching a channel against many
+ * clients' filters then needs no further GVariant access.
+ */
+struct _McdPropertyView
+{
+    gint ref_count;
+    GVariant *properties;
+    /* property name (borrowed from properties) => owned canonical key */
+    GHashTable *keys;
+};
+
+/*
+ * _mcd_property_view_new:
+ * @properties: an a{sv} of channel properties
+ *
+ * Returns: (transfer full): a view of @properties
+ */
+McdPropertyView *
+_mcd_property_view_new (GVariant *properties)
+{
+    McdPropertyView *view;
+    GVariantIter iter;
+    const gchar *name;
+    GVariant *value;
+    GString *key;
+
+    g_return_val_if_fail (g_variant_is_of_type (properties,
+            G_VARIANT_TYPE_VARDICT), NULL);
+
+    view = g_slice_new (McdPropertyView);
+    view->ref_count = 1;
+    view->properties = g_variant_ref_sink (properties);
+    view->keys = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                        g_free);
+    key = g_string_sized_new (128);
+
+    g_variant_iter_init (&iter, view->properties);
+
+    while (g_variant_iter_next (&iter, "{&sv}", &name, &value))
+    {
+        g_string_printf (key, "%s=", name);
+
+        if (mcd_property_key_append_variant (key, value))
+            g_hash_table_insert (view->keys, (gchar *) name,
+                                 g_strdup (key->str));
+
+        g_variant_unref (value);
+    }
+
+    g_string_free (key, TRUE);
+    return view;
+}
+
+/*
+ * Returns: (transfer full): a view of @channel's immutable properties, or
+ *  %NULL if they are not known yet
+ */
+McdPropertyView *
+_mcd_property_view_new_for_tp_chan (TpChannel *channel)
+{
+    McdPropertyView *view;
+    GVariant *properties;
+
+    properties = tp_channel_dup_immutable_properties (channel);
 
+    if (properties == NULL)
+        return NULL;
+
+    view = _mcd_property_view_new (properties);
+    g_variant_unref (properties);
+    return view;
+}
+
+McdPropertyView *
+_mcd_property_view_ref (McdPropertyView *view)
+{
+    g_atomic_int_inc (&view->ref_count);
+    return view;
+}
+
+void
+_mcd_property_view_unref (McdPropertyView *view)
+{
+    if (!g_atomic_int_dec_and_test (&view->ref_count))
+        return;
+
+    g_hash_table_unref (view->keys);
+    g_variant_unref (view->properties);
+    g_slice_free (McdPropertyView, view);
+}
+
+/*
+ * Returns: (transfer none): the canonical key for property @name, or %NULL
+ *  if it is absent or no filter could match it
+ */
+const gchar *
+_mcd_property_view_get_key (McdPropertyView *view,
+                            const gchar *name)
+{
+    return g_hash_table_lookup (view->keys, name);
+}
+
+/* Returns: (transfer none): the properties the view was made from */
+GVariant *
+_mcd_property_view_get_properties (McdPropertyView *view)
+{
+    return view->properties;
+}
+
+/* Returns: approximately how many bytes @view holds on to, including the
+ * serialized properties */
+gsize
+_mcd_property_view_get_retained_bytes (McdPropertyView *view)
+{
+    GHashTableIter iter;
+    gpointer v;
+    gsize size = sizeof (McdPropertyView) +
+        g_variant_get_size (view->properties);
+
+    g_hash_table_iter_init (&iter, view->keys);
+
+    while (g_hash_table_iter_next (&iter, NULL, &v))
+        size += MCD_DEBUG_HASH_ENTRY_SIZE + strlen (v) + 1;
+
+    return size;
+}
@@ -40,6 +40,25 @@ GPtrArray *_mcd_tp_channel_details_build_from_tp_chan (TpChannel *channel);
 G_GNUC_INTERNAL
 void _mcd_tp_channel_details_free (GPtrArray *channels);
 
+typedef struct _McdPropertyView McdPropertyView;
+
+G_GNUC_INTERNAL McdPropertyView *_mcd_property_view_new (
+    GVariant *properties);
+G_GNUC_INTERNAL McdPropertyView *_mcd_property_view_new_for_tp_chan (
+    TpChannel *channel);
+G_GNUC_INTERNAL McdPropertyView *_mcd_property_view_ref (
+    McdPropertyView *view);
+G_GNUC_INTERNAL void _mcd_property_view_unref (McdPropertyView *view);
+G_GNUC_INTERNAL const gchar *_mcd_property_view_get_key (
+    McdPropertyView *view, const gchar *name);
+G_GNUC_INTERNAL GVariant *_mcd_property_view_get_properties (
+    McdPropertyView *view);
+G_GNUC_INTERNAL gsize _mcd_property_view_get_retained_bytes (
+    McdPropertyView *view);
+
+G_GNUC_INTERNAL gboolean _mcd_property_key_append_gvalue (GString *key,
+    const gchar *name, const GValue *value);
+
 /* NULL-safe for @channel; @verb is for debug */
 G_GNUC_INTERNAL gboolean _mcd_tp_channel_should_close (TpChannel *channel,
                                                        const gchar *verb);
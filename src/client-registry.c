@@ -27,6 +27,8 @@
 
 #include "mcd-debug.h"
 
+#include <string.h>
+
 #include <dbus/dbus.h>
 #include <dbus/dbus-glib.h>
 #include <dbus/dbus-glib-lowlevel.h>
@@ -43,6 +45,7 @@ enum
 {
     S_CLIENT_ADDED,
     S_READY,
+    S_DEFERRED_CLIENTS_READY,
     N_SIGNALS
 };
 
@@ -67,8 +70,53 @@ struct _McdClientRegistryPrivate
    * */
   gsize startup_lock;
   gboolean startup_completed;
+
+  /* Clients whose introspection was deferred (see
+   * _mcd_client_proxy_introspect_deferred), which no longer hold a startup
+   * lock but are not ready yet.
+   * owned McdClientProxy => GUINT_TO_POINTER (TRUE) if we have started
+   *  introspecting it, or FALSE if not */
+  GHashTable *deferred_clients;
+
+  /* The capabilities of all clients, shared between all connections until
+   * some client's capabilities change, or NULL if not yet built.
+   * caps_snapshots holds a McdClientCapsSnapshot reference for each
+   * borrowed GValueArray in caps_vas. */
+  GPtrArray *caps_snapshots;
+  GPtrArray *caps_vas;
+
+  /* incremented whenever a client is added or removed, or its filters
+   * change */
+  guint generation;
+
+  /* Possible Handlers for each kind of channel or request, valid while
+   * handlers_cache_generation == generation.
+   * owned gchar * signature -> (transfer container) GList of borrowed
+   *  McdClientProxy, most preferred first; possibly NULL
+   * handler_filter_keys are the sorted property names mentioned in any
+   * Handler's filters, from which the signatures are built. */
+  GHashTable *handlers_cache;
+  GPtrArray *handler_filter_keys;
+  guint handlers_cache_generation;
 };
 
+/* large enough for every channel class a real system has, small enough
+ * that a burst of unusual channels can't make it grow without bound */
+#define MAX_HANDLERS_CACHE_SIZE 64
+
+static void
+_mcd_client_registry_invalidate_caps (McdClientRegistry *self)
+{
+  tp_clear_pointer (&self->priv->caps_vas, g_ptr_array_unref);
+  tp_clear_pointer (&self->priv->caps_snapshots, g_ptr_array_unref);
+}
+
+static void
+_mcd_client_registry_bump_generation (McdClientRegistry *self)
+{
+  self->priv->generation++;
+}
+
 static void
 _mcd_client_registry_inc_startup_lock (McdClientRegistry *self)
 {
@@ -103,9 +151,109 @@ _mcd_client_registry_dec_startup_lock (McdClientRegistry *self)
 
 static void mcd_client_registry_ready_cb (McdClientProxy *client,
     McdClientRegistry *self);
+
+/*
+ * _mcd_client_registry_is_introspecting_deferred:
+ *
+ * Returns: %TRUE if _mcd_client_registry_start_deferred_introspection()
+ *  started introspecting a client that is not ready yet, in which case
+ *  deferred-clients-ready will be emitted
+ */
+gboolean
+_mcd_client_registry_is_introspecting_deferred (McdClientRegistry *self)
+{
+  GHashTableIter iter;
+  gpointer v;
+
+  g_return_val_if_fail (MCD_IS_CLIENT_REGISTRY (self), FALSE);
+
+  if (self->priv->deferred_clients == NULL)
+    return FALSE;
+
+  g_hash_table_iter_init (&iter, self->priv->deferred_clients);
+
+  while (g_hash_table_iter_next (&iter, NULL, &v))
+    {
+      if (GPOINTER_TO_UINT (v))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/*
+ * Stop waiting for @client, which was deferred: it is either ready or gone.
+ * If it was the last deferred client being introspected, emit
+ * deferred-clients-ready.
+ *
+ * Returns: %TRUE if @client was deferred
+ */
+static gboolean
+mcd_client_registry_forget_deferred (McdClientRegistry *self,
+    McdClientProxy *client)
+{
+  gpointer v;
+
+  if (self->priv->deferred_clients == NULL ||
+      !g_hash_table_lookup_extended (self->priv->deferred_clients, client,
+        NULL, &v))
+    return FALSE;
+
+  g_hash_table_remove (self->priv->deferred_clients, client);
+
+  if (GPOINTER_TO_UINT (v) &&
+      !_mcd_client_registry_is_introspecting_deferred (self))
+    g_signal_emit (self, signals[S_DEFERRED_CLIENTS_READY], 0);
+
+  return TRUE;
+}
+
 static void mcd_client_registry_gone_cb (McdClientProxy *client,
     McdClientRegistry *self);
 
+static void
+mcd_client_registry_caps_changed_cb (McdClientProxy *client,
+    McdClientRegistry *self)
+{
+  _mcd_client_registry_invalidate_caps (self);
+}
+
+static void
+mcd_client_registry_client_changed_cb (McdClientProxy *client,
+    McdClientRegistry *self)
+{
+  _mcd_client_registry_bump_generation (self);
+}
+
+static void
+mcd_client_registry_filters_changed_cb (McdClientProxy *client,
+    McdClientRegistry *self)
+{
+  /* the Handler filters and capability tokens are part of the cached
+   * capabilities, whether or not handler-capabilities-changed follows */
+  _mcd_client_registry_invalidate_caps (self);
+  _mcd_client_registry_bump_generation (self);
+}
+
+static void
+mcd_client_registry_introspection_deferred_cb (McdClientProxy *client,
+    McdClientRegistry *self)
+{
+  gboolean already_deferred = g_hash_table_lookup_extended (
+      self->priv->deferred_clients, client, NULL, NULL);
+
+  DEBUG ("%s", tp_proxy_get_bus_name (client));
+
+  g_hash_table_insert (self->priv->deferred_clients, g_object_ref (client),
+      GUINT_TO_POINTER (FALSE));
+
+  /* paired with the one in _mcd_client_registry_found_name: we don't
+   * wait for this client any more, mcd_client_registry_ready_cb will
+   * know not to release it again */
+  if (!already_deferred)
+    _mcd_client_registry_dec_startup_lock (self);
+}
+
 static void
 _mcd_client_registry_found_name (McdClientRegistry *self,
     const gchar *well_known_name,
@@ -164,10 +312,29 @@ _mcd_client_registry_found_name (McdClientRegistry *self,
                     G_CALLBACK (mcd_client_registry_ready_cb),
                     self);
 
+  g_signal_connect (client, "introspection-deferred",
+                    G_CALLBACK (mcd_client_registry_introspection_deferred_cb),
+                    self);
+
   g_signal_connect (client, "gone",
                     G_CALLBACK (mcd_client_registry_gone_cb),
                     self);
 
+  g_signal_connect (client, "handler-capabilities-changed",
+                    G_CALLBACK (mcd_client_registry_caps_changed_cb),
+                    self);
+
+  g_signal_connect (client, "filters-changed",
+                    G_CALLBACK (mcd_client_registry_filters_changed_cb),
+                    self);
+
+  g_signal_connect (client, "responsiveness-changed",
+                    G_CALLBACK (mcd_client_registry_client_changed_cb),
+                    self);
+
+  _mcd_client_registry_invalidate_caps (self);
+  _mcd_client_registry_bump_generation (self);
+
   g_signal_emit (self, signals[S_CLIENT_ADDED], 0, client);
 }
 
@@ -179,15 +346,66 @@ _mcd_client_registry_lookup (McdClientRegistry *self,
   return g_hash_table_lookup (self->priv->clients, well_known_name);
 }
 
+/*
+ * _mcd_client_registry_best_handler_bypasses_approval:
+ * @possible_handlers: well-known names of Handlers, best first
+ *
+ * Returns: %TRUE if the best of @possible_handlers that still exists has
+ *  BypassApproval
+ */
+gboolean
+_mcd_client_registry_best_handler_bypasses_approval (McdClientRegistry *self,
+    const gchar * const *possible_handlers)
+{
+  const gchar * const *iter;
+
+  g_return_val_if_fail (MCD_IS_CLIENT_REGISTRY (self), FALSE);
+
+  for (iter = possible_handlers; iter != NULL && *iter != NULL; iter++)
+    {
+      McdClientProxy *handler = g_hash_table_lookup (self->priv->clients,
+          *iter);
+
+      /* Because handlers are sorted with the best ones first, and handlers
+       * with BypassApproval are "better", we can be sure that if we've
+       * found a handler that still exists and does not bypass approval, no
+       * handler bypasses approval. */
+      if (handler != NULL)
+        {
+          gboolean bypass = _mcd_client_proxy_get_bypass_approval (handler);
+
+          DEBUG ("%s has BypassApproval=%c", *iter, bypass ? 'T' : 'F');
+          return bypass;
+        }
+    }
+
+  /* If no handler still exists, we don't bypass approval, although if that
+   * happens we're basically doomed anyway */
+  return FALSE;
+}
+
 static void
 mcd_client_registry_disconnect_client_signals (gpointer k G_GNUC_UNUSED,
     gpointer v,
     gpointer data)
 {
   g_signal_handlers_disconnect_by_func (v, mcd_client_registry_ready_cb, data);
+  g_signal_handlers_disconnect_by_func (v,
+      mcd_client_registry_introspection_deferred_cb, data);
   g_signal_handlers_disconnect_by_func (v, mcd_client_registry_gone_cb, data);
-
-  if (!_mcd_client_proxy_is_ready (v))
+  g_signal_handlers_disconnect_by_func (v,
+      mcd_client_registry_caps_changed_cb, data);
+  g_signal_handlers_disconnect_by_func (v,
+      mcd_client_registry_filters_changed_cb, data);
+  g_signal_handlers_disconnect_by_func (v,
+      mcd_client_registry_client_changed_cb, data);
+
+  if (mcd_client_registry_forget_deferred (data, v))
+    {
+      /* it already released its startup lock when it was deferred */
+      DEBUG ("deferred client %s disappeared", tp_proxy_get_bus_name (v));
+    }
+  else if (!_mcd_client_proxy_is_ready (v))
     {
       /* we'll never receive the ready signal now, so release the lock that
        * it would otherwise have released */
@@ -212,6 +430,8 @@ _mcd_client_registry_remove (McdClientRegistry *self,
     }
 
   g_hash_table_remove (self->priv->clients, well_known_name);
+  _mcd_client_registry_invalidate_caps (self);
+  _mcd_client_registry_bump_generation (self);
 }
 
 void _mcd_client_registry_init_hash_iter (McdClientRegistry *self,
@@ -232,6 +452,10 @@ _mcd_client_registry_init (McdClientRegistry *self)
   self->priv->startup_lock = 1;
   self->priv->clients = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
       g_object_unref);
+  self->priv->handlers_cache = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) g_list_free);
+  self->priv->deferred_clients = g_hash_table_new_full (NULL, NULL,
+      g_object_unref, NULL);
 }
 
 static void
@@ -465,6 +689,10 @@ mcd_client_registry_dispose (GObject *object)
     }
 
   tp_clear_pointer (&self->priv->clients, g_hash_table_unref);
+  tp_clear_pointer (&self->priv->deferred_clients, g_hash_table_unref);
+  _mcd_client_registry_invalidate_caps (self);
+  tp_clear_pointer (&self->priv->handlers_cache, g_hash_table_unref);
+  tp_clear_pointer (&self->priv->handler_filter_keys, g_ptr_array_unref);
 
   if (chain_up != NULL)
     chain_up (object);
@@ -500,6 +728,16 @@ _mcd_client_registry_class_init (McdClientRegistryClass *cls)
       0, NULL, NULL,
       g_cclosure_marshal_VOID__VOID,
       G_TYPE_NONE, 0);
+
+  /* Emitted when every client that
+   * _mcd_client_registry_start_deferred_introspection() started to
+   * introspect is ready, or has gone */
+  signals[S_DEFERRED_CLIENTS_READY] = g_signal_new ("deferred-clients-ready",
+      G_OBJECT_CLASS_TYPE (cls),
+      G_SIGNAL_RUN_LAST,
+      0, NULL, NULL,
+      g_cclosure_marshal_VOID__VOID,
+      G_TYPE_NONE, 0);
 }
 
 McdClientRegistry *
@@ -519,10 +757,59 @@ mcd_client_registry_ready_cb (McdClientProxy *client,
   g_signal_handlers_disconnect_by_func (client,
       mcd_client_registry_ready_cb, self);
 
+  /* its interfaces are now known */
+  _mcd_client_registry_bump_generation (self);
+
+  /* if it was deferred, it already released its startup lock */
+  if (mcd_client_registry_forget_deferred (self, client))
+    return;
+
   /* paired with the one in _mcd_client_registry_found_name */
   _mcd_client_registry_dec_startup_lock (self);
 }
 
+/*
+ * _mcd_client_registry_start_deferred_introspection:
+ *
+ * Start introspecting any clients whose introspection was deferred because
+ * they were not running and had no .client file; deferred-clients-ready
+ * will be emitted when they are all ready.
+ *
+ * Returns: %TRUE if introspection of any clients was started
+ */
+gboolean
+_mcd_client_registry_start_deferred_introspection (McdClientRegistry *self)
+{
+  GHashTableIter iter;
+  gpointer k, v;
+  GPtrArray *started;
+  guint i;
+
+  g_return_val_if_fail (MCD_IS_CLIENT_REGISTRY (self), FALSE);
+
+  started = g_ptr_array_new_with_free_func (g_object_unref);
+  g_hash_table_iter_init (&iter, self->priv->deferred_clients);
+
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      if (!GPOINTER_TO_UINT (v))
+        {
+          g_hash_table_iter_replace (&iter, GUINT_TO_POINTER (TRUE));
+          g_ptr_array_add (started, g_object_ref (k));
+        }
+    }
+
+  /* this may re-enter mcd_client_registry_ready_cb, so don't do it while
+   * iterating */
+  for (i = 0; i < started->len; i++)
+    _mcd_client_proxy_introspect_deferred (g_ptr_array_index (started, i));
+
+  DEBUG ("started introspecting %u deferred client(s)", started->len);
+  i = started->len;
+  g_ptr_array_unref (started);
+  return (i > 0);
+}
+
 static void
 mcd_client_registry_gone_cb (McdClientProxy *client,
     McdClientRegistry *self)
@@ -530,26 +817,44 @@ mcd_client_registry_gone_cb (McdClientProxy *client,
   _mcd_client_registry_remove (self, tp_proxy_get_bus_name (client));
 }
 
+/*
+ * _mcd_client_registry_dup_client_caps:
+ *
+ * Returns: (transfer full): a new reference to an a(sa(a{sv})as) suitable
+ *  for UpdateCapabilities, describing all clients. The array is shared
+ *  between callers and must not be modified; the structs in it are only
+ *  guaranteed to remain valid until the main loop next runs.
+ */
 GPtrArray *
 _mcd_client_registry_dup_client_caps (McdClientRegistry *self)
 {
-  GPtrArray *vas;
   GHashTableIter iter;
   gpointer p;
 
   g_return_val_if_fail (MCD_IS_CLIENT_REGISTRY (self), NULL);
 
-  vas = g_ptr_array_sized_new (g_hash_table_size (self->priv->clients));
+  if (self->priv->caps_vas == NULL)
+    {
+      guint n = g_hash_table_size (self->priv->clients);
 
-  g_hash_table_iter_init (&iter, self->priv->clients);
+      self->priv->caps_vas = g_ptr_array_sized_new (n);
+      self->priv->caps_snapshots = g_ptr_array_new_full (n,
+          (GDestroyNotify) _mcd_client_caps_snapshot_unref);
 
-  while (g_hash_table_iter_next (&iter, NULL, &p))
-    {
-      g_ptr_array_add (vas,
-          _mcd_client_proxy_dup_handler_capabilities (p));
+      g_hash_table_iter_init (&iter, self->priv->clients);
+
+      while (g_hash_table_iter_next (&iter, NULL, &p))
+        {
+          McdClientCapsSnapshot *snapshot =
+            _mcd_client_proxy_ref_caps_snapshot (p);
+
+          g_ptr_array_add (self->priv->caps_snapshots, snapshot);
+          g_ptr_array_add (self->priv->caps_vas,
+              _mcd_client_caps_snapshot_get_value_array (snapshot));
+        }
     }
 
-  return vas;
+  return g_ptr_array_ref (self->priv->caps_vas);
 }
 
 gboolean
@@ -562,6 +867,7 @@ _mcd_client_registry_is_ready (McdClientRegistry *self)
 typedef struct
 {
     McdClientProxy *client;
+    gboolean unresponsive;
     gboolean bypass;
     gsize quality;
 } PossibleHandler;
@@ -573,6 +879,10 @@ possible_handler_cmp (gconstpointer a_,
   const PossibleHandler *a = a_;
   const PossibleHandler *b = b_;
 
+  /* Handlers that keep timing out are only tried if all else fails */
+  if (a->unresponsive != b->unresponsive)
+    return a->unresponsive ? -1 : 1;
+
   if (a->bypass)
     {
       if (!b->bypass)
@@ -600,11 +910,11 @@ possible_handler_cmp (gconstpointer a_,
   return 0;
 }
 
-GList *
-_mcd_client_registry_list_possible_handlers (McdClientRegistry *self,
+static GList *
+mcd_client_registry_find_possible_handlers (McdClientRegistry *self,
     const gchar *preferred_handler,
-    GVariant *request_props,
-    TpChannel *channel,
+    McdPropertyView *request_props,
+    McdPropertyView *channel_props,
     const gchar *must_have_unique_name)
 {
   GList *handlers = NULL;
@@ -635,7 +945,7 @@ _mcd_client_registry_list_possible_handlers (McdClientRegistry *self,
             continue;
         }
 
-      if (channel == NULL)
+      if (channel_props == NULL)
         {
           /* We don't know the channel's properties (the next part will not
            * execute), so we must work out the quality of match from the
@@ -643,25 +953,24 @@ _mcd_client_registry_list_possible_handlers (McdClientRegistry *self,
            * channel, with the requested properties, plus Requested == TRUE.
            */
           g_assert (request_props != NULL);
-          quality = _mcd_client_match_filters (request_props,
-              _mcd_client_proxy_get_handler_filters (client), TRUE);
+          quality = _mcd_client_proxy_match_handler_filters (client,
+              request_props, TRUE);
         }
       else
         {
-          GVariant *properties;
-
-          g_assert (TP_IS_CHANNEL (channel));
-          properties = tp_channel_dup_immutable_properties (channel);
-          quality = _mcd_client_match_filters (properties,
-              _mcd_client_proxy_get_handler_filters (client), FALSE);
-          g_variant_unref (properties);
+          quality = _mcd_client_proxy_match_handler_filters (client,
+              channel_props, FALSE);
         }
 
       if (quality > 0)
         {
           PossibleHandler *ph = g_slice_new0 (PossibleHandler);
 
+          /* responsiveness-changed invalidates the cache when this
+           * changes, including when the penalty runs out */
           ph->client = client;
+          ph->unresponsive =
+            (_mcd_client_proxy_get_unresponsive_until (client) != 0);
           ph->bypass = _mcd_client_proxy_get_bypass_approval (client);
           ph->quality = quality;
 
@@ -712,6 +1021,234 @@ _mcd_client_registry_list_possible_handlers (McdClientRegistry *self,
   return handlers;
 }
 
+static GPtrArray *mcd_client_registry_collect_filter_keys (
+    McdClientRegistry *self, gboolean include_observers);
+
+/* The result of mcd_client_registry_find_possible_handlers() only depends
+ * on the clients, the preferred handler, whether we are matching a
+ * request or a channel, and the values of the properties that some
+ * Handler's filter mentions; so those make up the signature. */
+static gchar *
+mcd_client_registry_dup_handlers_signature (McdClientRegistry *self,
+    const gchar *preferred_handler,
+    McdPropertyView *request_props,
+    McdPropertyView *channel_props)
+{
+  McdPropertyView *props;
+  GString *signature = g_string_new (NULL);
+  guint i;
+
+  if (channel_props != NULL)
+    {
+      props = channel_props;
+      g_string_append_c (signature, 'c');
+    }
+  else
+    {
+      props = request_props;
+      g_string_append_c (signature, 'r');
+    }
+
+  g_string_append (signature, preferred_handler != NULL ?
+      preferred_handler : "");
+  g_string_append_c (signature, '\n');
+
+  for (i = 0; i < self->priv->handler_filter_keys->len; i++)
+    {
+      const gchar *key = _mcd_property_view_get_key (props,
+          g_ptr_array_index (self->priv->handler_filter_keys, i));
+
+      if (key != NULL)
+        g_string_append (signature, key);
+
+      g_string_append_c (signature, '\n');
+    }
+
+  return g_string_free (signature, FALSE);
+}
+
+/*
+ * _mcd_client_registry_list_possible_handlers:
+ * @preferred_handler: (allow-none): the preferred handler of the request
+ * @request_props: (allow-none): the properties of the request, used if
+ *  @channel_props is %NULL
+ * @channel_props: (allow-none): the channel's immutable properties
+ * @must_have_unique_name: (allow-none): if not %NULL, only consider
+ *  Handlers with this unique name
+ *
+ * Returns: (transfer container) (element-type McdClientProxy): the Handlers
+ *  that could handle the channel, most preferred first. Results are cached
+ *  until the clients or their filters change, so dispatching further
+ *  channels of a kind already seen skips matching and sorting.
+ */
+GList *
+_mcd_client_registry_list_possible_handlers (McdClientRegistry *self,
+    const gchar *preferred_handler,
+    McdPropertyView *request_props,
+    McdPropertyView *channel_props,
+    const gchar *must_have_unique_name)
+{
+  McdClientRegistryPrivate *priv;
+  gchar *signature;
+  gpointer cached;
+  GList *handlers;
+
+  g_return_val_if_fail (MCD_IS_CLIENT_REGISTRY (self), NULL);
+  g_return_val_if_fail (request_props != NULL || channel_props != NULL,
+      NULL);
+  priv = self->priv;
+
+  /* redispatching to an existing process is rare enough not to cache */
+  if (must_have_unique_name != NULL)
+    return mcd_client_registry_find_possible_handlers (self,
+        preferred_handler, request_props, channel_props,
+        must_have_unique_name);
+
+  if (priv->handlers_cache_generation != priv->generation ||
+      priv->handler_filter_keys == NULL)
+    {
+      DEBUG ("clients changed, discarding %u cached handler list(s)",
+          g_hash_table_size (priv->handlers_cache));
+      g_hash_table_remove_all (priv->handlers_cache);
+      tp_clear_pointer (&priv->handler_filter_keys, g_ptr_array_unref);
+      priv->handler_filter_keys = mcd_client_registry_collect_filter_keys (
+          self, FALSE);
+      priv->handlers_cache_generation = priv->generation;
+    }
+
+  signature = mcd_client_registry_dup_handlers_signature (self,
+      preferred_handler, request_props, channel_props);
+
+  if (g_hash_table_lookup_extended (priv->handlers_cache, signature, NULL,
+        &cached))
+    {
+      g_free (signature);
+      return g_list_copy (cached);
+    }
+
+  handlers = mcd_client_registry_find_possible_handlers (self,
+      preferred_handler, request_props, channel_props, NULL);
+
+  if (g_hash_table_size (priv->handlers_cache) >= MAX_HANDLERS_CACHE_SIZE)
+    g_hash_table_remove_all (priv->handlers_cache);
+
+  g_hash_table_insert (priv->handlers_cache, signature,
+      g_list_copy (handlers));
+  return handlers;
+}
+
+/*
+ * _mcd_client_registry_list_observers:
+ * @properties: a channel's immutable properties
+ *
+ * Returns: (transfer container) (element-type McdClientProxy): the
+ *  Observers whose filters match @properties, in no particular order
+ */
+GList *
+_mcd_client_registry_list_observers (McdClientRegistry *self,
+    McdPropertyView *properties)
+{
+  GList *observers = NULL;
+  GHashTableIter client_iter;
+  gpointer client_p;
+
+  g_return_val_if_fail (MCD_IS_CLIENT_REGISTRY (self), NULL);
+  g_return_val_if_fail (properties != NULL, NULL);
+
+  _mcd_client_registry_init_hash_iter (self, &client_iter);
+
+  while (g_hash_table_iter_next (&client_iter, NULL, &client_p))
+    {
+      McdClientProxy *client = MCD_CLIENT_PROXY (client_p);
+
+      if (!tp_proxy_has_interface_by_id (client,
+            TP_IFACE_QUARK_CLIENT_OBSERVER))
+        continue;
+
+      if (_mcd_client_proxy_match_observer_filters (client, properties))
+        observers = g_list_prepend (observers, client);
+    }
+
+  return observers;
+}
+
+static gint
+strcmp_indirect (gconstpointer a,
+    gconstpointer b)
+{
+  return strcmp (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+static void
+add_filter_keys (GHashTable *keys,
+    const GList *filters)
+{
+  const GList *iter;
+
+  for (iter = filters; iter != NULL; iter = iter->next)
+    {
+      GHashTableIter filter_iter;
+      gpointer k;
+
+      g_hash_table_iter_init (&filter_iter, iter->data);
+
+      while (g_hash_table_iter_next (&filter_iter, &k, NULL))
+        g_hash_table_insert (keys, k, k);
+    }
+}
+
+static GPtrArray *
+mcd_client_registry_collect_filter_keys (McdClientRegistry *self,
+    gboolean include_observers)
+{
+  GHashTable *keys;
+  GHashTableIter iter;
+  gpointer k;
+  GPtrArray *ret;
+
+  /* borrowed from the filters, which outlive this function */
+  keys = g_hash_table_new (g_str_hash, g_str_equal);
+
+  _mcd_client_registry_init_hash_iter (self, &iter);
+
+  while (g_hash_table_iter_next (&iter, NULL, &k))
+    {
+      McdClientProxy *client = MCD_CLIENT_PROXY (k);
+
+      add_filter_keys (keys, _mcd_client_proxy_get_handler_filters (client));
+
+      if (include_observers)
+        add_filter_keys (keys,
+            _mcd_client_proxy_get_observer_filters (client));
+    }
+
+  ret = g_ptr_array_new_full (g_hash_table_size (keys), g_free);
+  g_hash_table_iter_init (&iter, keys);
+
+  while (g_hash_table_iter_next (&iter, &k, NULL))
+    g_ptr_array_add (ret, g_strdup (k));
+
+  g_ptr_array_sort (ret, strcmp_indirect);
+  g_hash_table_unref (keys);
+  return ret;
+}
+
+/*
+ * _mcd_client_registry_dup_filter_keys:
+ *
+ * Returns: (transfer full) (element-type utf8): the sorted names of all
+ *  channel properties mentioned by some Handler or Observer filter. Two
+ *  channels whose values agree on all of these properties are matched by
+ *  exactly the same Handlers and Observers.
+ */
+GPtrArray *
+_mcd_client_registry_dup_filter_keys (McdClientRegistry *self)
+{
+  g_return_val_if_fail (MCD_IS_CLIENT_REGISTRY (self), NULL);
+
+  return mcd_client_registry_collect_filter_keys (self, TRUE);
+}
+
 TpDBusDaemon *
 _mcd_client_registry_get_dbus_daemon (McdClientRegistry *self)
 {
@@ -71,20 +71,35 @@ TpDBusDaemon *_mcd_client_registry_get_dbus_daemon (McdClientRegistry *self);
 G_GNUC_INTERNAL McdClientProxy *_mcd_client_registry_lookup (
     McdClientRegistry *self, const gchar *well_known_name);
 
+G_GNUC_INTERNAL gboolean _mcd_client_registry_best_handler_bypasses_approval (
+    McdClientRegistry *self, const gchar * const *possible_handlers);
+
 G_GNUC_INTERNAL GPtrArray *_mcd_client_registry_dup_client_caps (
     McdClientRegistry *self);
 
 G_GNUC_INTERNAL gboolean _mcd_client_registry_is_ready (
     McdClientRegistry *self);
 
+G_GNUC_INTERNAL gboolean _mcd_client_registry_start_deferred_introspection (
+    McdClientRegistry *self);
+
+G_GNUC_INTERNAL gboolean _mcd_client_registry_is_introspecting_deferred (
+    McdClientRegistry *self);
+
 G_GNUC_INTERNAL void _mcd_client_registry_init_hash_iter (
     McdClientRegistry *self, GHashTableIter *iter);
 
 G_GNUC_INTERNAL GList *_mcd_client_registry_list_possible_handlers (
     McdClientRegistry *self, const gchar *preferred_handler,
-    GVariant *request_props, TpChannel *channel,
+    McdPropertyView *request_props, McdPropertyView *channel_props,
     const gchar *must_have_unique_name);
 
+G_GNUC_INTERNAL GList *_mcd_client_registry_list_observers (
+    McdClientRegistry *self, McdPropertyView *properties);
+
+G_GNUC_INTERNAL GPtrArray *_mcd_client_registry_dup_filter_keys (
+    McdClientRegistry *self);
+
 G_END_DECLS
 
 #endif
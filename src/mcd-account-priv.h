@@ -150,5 +150,12 @@ G_GNUC_INTERNAL gboolean _mcd_account_needs_dispatch (McdAccount *account);
 G_GNUC_INTERNAL void _mcd_account_reconnect (McdAccount *self,
     gboolean user_initiated);
 
+G_GNUC_INTERNAL void _mcd_account_block_requests (McdAccount *self);
+G_GNUC_INTERNAL void _mcd_account_unblock_requests (McdAccount *self);
+G_GNUC_INTERNAL gboolean _mcd_account_queue_blocked_request (McdAccount *self,
+    McdRequest *request);
+G_GNUC_INTERNAL void _mcd_account_fail_blocked_requests (McdAccount *self,
+    const GError *error);
+
 
 #endif /* __MCD_ACCOUNT_PRIV_H__ */
@@ -43,6 +43,7 @@
 #include "mcd-master.h"
 #include "mcd-master-priv.h"
 #include "mcd-dbusprop.h"
+#include "mcd-stats.h"
 
 #define MC_OLD_AVATAR_FILENAME	"avatar.bin"
 
@@ -166,6 +167,15 @@ struct _McdAccountPrivate
     guint properties_source;
 
     gboolean password_saved;
+
+    /* Number of internal requests (such as those made by SendMessage) in
+     * flight. While there are any, other channel requests on this account
+     * wait in blocked_requests. */
+    guint internal_requests;
+    /* owned BlockedRequest, oldest first */
+    GQueue blocked_requests;
+    /* TRUE if we are in releasing_accounts */
+    gboolean releasing_requests;
 };
 
 enum
@@ -3303,6 +3313,17 @@ _mcd_account_dispose (GObject *object)
 	priv->online_requests = NULL;
     }
 
+    if (!g_queue_is_empty (&priv->blocked_requests) ||
+        priv->releasing_requests)
+    {
+        GError *error;
+
+        error = g_error_new (TP_ERROR, TP_ERROR_DISCONNECTED,
+                             "Disposing account %s", priv->unique_name);
+        _mcd_account_fail_blocked_requests (self, error);
+        g_error_free (error);
+    }
+
     tp_clear_object (&priv->manager);
     tp_clear_object (&priv->storage_plugin);
     tp_clear_object (&priv->storage);
@@ -5131,3 +5152,231 @@ mcd_account_connection_proceed_with_reason (McdAccount *account,
             _mcd_account_connection_context_free);
     }
 }
+
+/*
+ * Channel requests blocked by internal requests
+ *
+ * While an internal request is in flight on an account, other channel
+ * requests on that account wait for it, in a bounded queue on the
+ * account. When the last internal request finishes, the waiting requests
+ * are not all released at once: accounts with requests to release take
+ * turns, one request at a time and a few requests per main loop
+ * iteration, so that a long queue on one account neither causes a burst
+ * of work nor holds up the others.
+ */
+
+/* beyond this, further requests on a blocked account fail immediately */
+#define MAX_BLOCKED_REQUESTS 64
+/* the number of requests released per main loop iteration, across all
+ * accounts */
+#define REQUESTS_PER_RELEASE 8
+
+typedef struct {
+    /* holds a delay */
+    McdRequest *request;
+    gint64 queued;
+} BlockedRequest;
+
+/* ref'd McdAccount with requests to release, in round-robin order */
+static GQueue releasing_accounts = G_QUEUE_INIT;
+static guint release_requests_id = 0;
+
+/* Let @blocked proceed, or fail if @error is not %NULL, and free it */
+static void
+mcd_account_release_blocked_request (McdAccount *self,
+                                     BlockedRequest *blocked,
+                                     const GError *error)
+{
+    gint64 waited = g_get_monotonic_time () - blocked->queued;
+
+    DEBUG ("releasing request %p on %s after %" G_GINT64_FORMAT "us",
+           blocked->request, self->priv->unique_name, waited);
+    mcd_stats_record_request_delay (self->priv->unique_name,
+                                    MCD_STATS_DELAY_BLOCKED_REQUEST, waited,
+                                    error != NULL);
+
+    if (error != NULL)
+        _mcd_request_set_failure (blocked->request, error->domain,
+                                  error->code, error->message);
+
+    _mcd_request_end_delay (blocked->request);
+    g_slice_free (BlockedRequest, blocked);
+}
+
+static gboolean
+mcd_account_release_requests_cb (gpointer unused G_GNUC_UNUSED)
+{
+    McdAccount *account;
+    guint released = 0;
+
+    while (released < REQUESTS_PER_RELEASE &&
+           (account = g_queue_pop_head (&releasing_accounts)) != NULL)
+    {
+        McdAccountPrivate *priv = account->priv;
+
+        /* another internal request might have started in the meantime,
+         * in which case the rest of the queue waits for that too */
+        if (priv->internal_requests == 0)
+        {
+            BlockedRequest *blocked = g_queue_pop_head (
+                &priv->blocked_requests);
+
+            if (blocked != NULL)
+            {
+                mcd_account_release_blocked_request (account, blocked, NULL);
+                released++;
+            }
+        }
+
+        if (priv->internal_requests == 0 &&
+            !g_queue_is_empty (&priv->blocked_requests))
+        {
+            /* back of the line */
+            g_queue_push_tail (&releasing_accounts, account);
+        }
+        else
+        {
+            priv->releasing_requests = FALSE;
+            g_object_unref (account);
+        }
+    }
+
+    if (g_queue_is_empty (&releasing_accounts))
+    {
+        release_requests_id = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * _mcd_account_block_requests:
+ *
+ * Record that an internal request is in flight on @self, so that other
+ * channel requests on @self must wait until it has finished.
+ */
+void
+_mcd_account_block_requests (McdAccount *self)
+{
+    g_return_if_fail (MCD_IS_ACCOUNT (self));
+
+    self->priv->internal_requests++;
+    DEBUG ("%u internal requests in flight on %s",
+           self->priv->internal_requests, self->priv->unique_name);
+}
+
+/*
+ * _mcd_account_unblock_requests:
+ *
+ * Record that an internal request on @self has finished. If it was the
+ * last, start releasing the requests that were waiting for it.
+ */
+void
+_mcd_account_unblock_requests (McdAccount *self)
+{
+    McdAccountPrivate *priv;
+
+    g_return_if_fail (MCD_IS_ACCOUNT (self));
+    priv = self->priv;
+
+    if (priv->internal_requests == 0)
+    {
+        g_warning ("Unbalanced account-request-unblock for %s",
+                   priv->unique_name);
+        return;
+    }
+
+    if (--priv->internal_requests > 0)
+    {
+        DEBUG ("%u internal requests still in flight on %s",
+               priv->internal_requests, priv->unique_name);
+        return;
+    }
+
+    DEBUG ("%u requests on %s may now proceed",
+           g_queue_get_length (&priv->blocked_requests), priv->unique_name);
+
+    if (g_queue_is_empty (&priv->blocked_requests) ||
+        priv->releasing_requests)
+        return;
+
+    priv->releasing_requests = TRUE;
+    g_queue_push_tail (&releasing_accounts, g_object_ref (self));
+
+    if (release_requests_id == 0)
+        release_requests_id = g_idle_add (mcd_account_release_requests_cb,
+                                          NULL);
+}
+
+/*
+ * _mcd_account_queue_blocked_request:
+ * @request: a channel request that is not internal
+ *
+ * If @request must wait for internal requests on @self (or for requests
+ * that were already waiting), queue it, with a delay that will be ended
+ * when it can proceed. If too many requests are already waiting, fail
+ * @request instead.
+ *
+ * Returns: %TRUE if @request was queued
+ */
+gboolean
+_mcd_account_queue_blocked_request (McdAccount *self,
+                                    McdRequest *request)
+{
+    McdAccountPrivate *priv;
+    BlockedRequest *blocked;
+
+    g_return_val_if_fail (MCD_IS_ACCOUNT (self), FALSE);
+    priv = self->priv;
+
+    /* requests that were waiting keep their place */
+    if (priv->internal_requests == 0 &&
+        g_queue_is_empty (&priv->blocked_requests))
+        return FALSE;
+
+    if (g_queue_get_length (&priv->blocked_requests) >= MAX_BLOCKED_REQUESTS)
+    {
+        gchar *message = g_strdup_printf ("Too many channel requests are "
+                                          "waiting for account %s",
+                                          priv->unique_name);
+
+        mcd_stats_record_request_delay (priv->unique_name,
+                                        MCD_STATS_DELAY_BLOCKED_REQUEST, 0,
+                                        TRUE);
+        _mcd_request_set_failure (request, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+                                  message);
+        g_free (message);
+        return FALSE;
+    }
+
+    blocked = g_slice_new (BlockedRequest);
+    blocked->request = request;
+    blocked->queued = g_get_monotonic_time ();
+    _mcd_request_start_delay (request);
+    g_queue_push_tail (&priv->blocked_requests, blocked);
+    return TRUE;
+}
+
+/*
+ * _mcd_account_fail_blocked_requests:
+ *
+ * Fail all the requests waiting on @self with @error.
+ */
+void
+_mcd_account_fail_blocked_requests (McdAccount *self,
+                                    const GError *error)
+{
+    McdAccountPrivate *priv = self->priv;
+    BlockedRequest *blocked;
+
+    while ((blocked = g_queue_pop_head (&priv->blocked_requests)) != NULL)
+        mcd_account_release_blocked_request (self, blocked, error);
+
+    if (priv->releasing_requests)
+    {
+        priv->releasing_requests = FALSE;
+        g_queue_remove (&releasing_accounts, self);
+        g_object_unref (self);
+    }
+}
@@ -27,6 +27,7 @@
 #ifndef MCD_CHANNEL_PRIV_H
 #define MCD_CHANNEL_PRIV_H
 
+#include "channel-utils.h"
 #include "client-registry.h"
 #include "mcd-channel.h"
 #include "request.h"
@@ -46,6 +47,10 @@ void _mcd_channel_set_status (McdChannel *channel, McdChannelStatus status);
 G_GNUC_INTERNAL void _mcd_channel_undispatchable (McdChannel *self);
 
 G_GNUC_INTERNAL McdRequest *_mcd_channel_get_request (McdChannel *self);
+G_GNUC_INTERNAL gsize _mcd_channel_get_retained_bytes (McdChannel *self);
+
+G_GNUC_INTERNAL McdPropertyView *_mcd_channel_get_property_view (
+    McdChannel *self);
 
 G_GNUC_INTERNAL
 GHashTable *_mcd_channel_get_requested_properties (McdChannel *channel);
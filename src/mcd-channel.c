@@ -57,6 +57,9 @@ typedef struct _McdChannelRequestData McdChannelRequestData;
 struct _McdChannelPrivate
 {
     TpChannel *tp_chan;
+    /* tp_chan's immutable properties, prepared for matching against
+     * channel filters; built when first needed */
+    McdPropertyView *property_view;
     GError *error;
 
     /* boolean properties */
@@ -201,6 +204,8 @@ _mcd_channel_release_tp_channel (McdChannel *channel)
         /* Destroy our proxy */
         tp_clear_object (&priv->tp_chan);
     }
+
+    tp_clear_pointer (&priv->property_view, _mcd_property_view_unref);
 }
 
 static void
@@ -769,6 +774,26 @@ mcd_channel_dup_immutable_properties (McdChannel *channel)
     return ret;
 }
 
+/*
+ * _mcd_channel_get_property_view:
+ *
+ * Returns: (transfer none): the channel's immutable properties, in a form
+ *  suitable for matching against channel filters, or %NULL if the
+ *  channel doesn't have a #TpChannel with immutable properties yet. The
+ *  result is cached, so every match during dispatching shares it.
+ */
+McdPropertyView *
+_mcd_channel_get_property_view (McdChannel *self)
+{
+    g_return_val_if_fail (MCD_IS_CHANNEL (self), NULL);
+
+    if (self->priv->property_view == NULL && self->priv->tp_chan != NULL)
+        self->priv->property_view = _mcd_property_view_new_for_tp_chan (
+            self->priv->tp_chan);
+
+    return self->priv->property_view;
+}
+
 /**
  * mcd_channel_take_error:
  * @channel: the #McdChannel.
@@ -899,6 +924,31 @@ _mcd_channel_get_request (McdChannel *self)
     return self->priv->request;   /* may be NULL */
 }
 
+/*
+ * _mcd_channel_get_retained_bytes:
+ * @self: the #McdChannel.
+ *
+ * Returns: approximately how much memory @self holds on to, including its
+ *  property view but not its McdRequest or TpChannel
+ */
+gsize
+_mcd_channel_get_retained_bytes (McdChannel *self)
+{
+    McdChannelPrivate *priv;
+    gsize size;
+
+    g_return_val_if_fail (MCD_IS_CHANNEL (self), 0);
+    priv = self->priv;
+
+    size = sizeof (McdChannel) + sizeof (McdChannelPrivate) +
+        g_list_length (priv->satisfied_requests) * sizeof (GList);
+
+    if (priv->property_view != NULL)
+        size += _mcd_property_view_get_retained_bytes (priv->property_view);
+
+    return size;
+}
+
 /*
  * _mcd_channel_get_requested_properties:
  * @channel: the #McdChannel.
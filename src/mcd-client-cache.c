@@ -0,0 +1,345 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * Cache of parsed .client files
+ *
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * The cache is a single serialized GVariant in
+ * $XDG_CACHE_HOME/telepathy/mission-control/clients.cache, mapping the
+ * absolute path of each .client file to a SHA-1 checksum of its contents,
+ * and whatever McdClientProxy made of it. It is mapped into memory when
+ * first needed; the parsed forms are not copied out of the mapping, and are
+ * only deserialized when a client with that file is discovered.
+ *
+ * An entry is only used if the file's contents have the same checksum. The
+ * mtime and size would be cheaper to check, but a file can be rewritten
+ * with the same size within the filesystem's timestamp granularity, which
+ * is a whole second on some filesystems. Reading a .client file is cheap
+ * compared with parsing it.
+ *
+ * When a file has to be parsed again, the new entry is stored and the cache
+ * is rewritten a few seconds later, leaving out files that no longer exist.
+ * The cache is ignored entirely if it was written by a different version of
+ * MC, since the parsed form may have changed.
+ */
+
+#include "config.h"
+
+#include "mcd-client-cache.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "mcd-debug.h"
+
+#define CACHE_VERSION "mission-control " PACKAGE_VERSION " clients cache 2"
+#define CACHE_TYPE "(sa{s(sv)})"
+#define SAVE_DELAY_SECONDS 5
+
+typedef struct {
+    /* SHA-1 of the file's contents, in hex */
+    gchar *checksum;
+    /* either borrowed from the mapped file, or newly parsed */
+    GVariant *parsed;
+    /* if TRUE, we have seen that the file is unchanged (or just parsed it)
+     * since we started */
+    gboolean confirmed;
+} CacheEntry;
+
+/* dup'd filename => owned CacheEntry, or NULL if not loaded yet */
+static GHashTable *entries = NULL;
+static guint save_id = 0;
+
+static CacheEntry *
+cache_entry_new (const gchar *checksum,
+                 GVariant *parsed,
+                 gboolean confirmed)
+{
+    CacheEntry *entry = g_slice_new (CacheEntry);
+
+    entry->checksum = g_strdup (checksum);
+    entry->parsed = g_variant_ref_sink (parsed);
+    entry->confirmed = confirmed;
+    return entry;
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+    g_free (entry->checksum);
+    g_variant_unref (entry->parsed);
+    g_slice_free (CacheEntry, entry);
+}
+
+static gchar *
+cache_dup_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "telepathy",
+                             "mission-control", "clients.cache", NULL);
+}
+
+static void
+cache_load (void)
+{
+    gchar *filename = cache_dup_filename ();
+    GError *error = NULL;
+    GMappedFile *mapped;
+    GVariant *root, *dict;
+    GVariantIter iter;
+    const gchar *version, *path, *checksum;
+    GVariant *parsed;
+
+    entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                     (GDestroyNotify) cache_entry_free);
+
+    mapped = g_mapped_file_new (filename, FALSE, &error);
+
+    if (mapped == NULL)
+    {
+        DEBUG ("not using %s: %s", filename, error->message);
+        g_error_free (error);
+        goto finally;
+    }
+
+    if (g_mapped_file_get_length (mapped) == 0)
+    {
+        g_mapped_file_unref (mapped);
+        goto finally;
+    }
+
+    /* the mapping is released when the last entry borrowing from it is
+     * freed; the data is not trusted to be in normal form, so GVariant
+     * checks it as it is accessed */
+    root = g_variant_ref_sink (g_variant_new_from_data (
+        G_VARIANT_TYPE (CACHE_TYPE), g_mapped_file_get_contents (mapped),
+        g_mapped_file_get_length (mapped), FALSE,
+        (GDestroyNotify) g_mapped_file_unref, mapped));
+
+    g_variant_get (root, "(&s@a{s(sv)})", &version, &dict);
+
+    if (tp_strdiff (version, CACHE_VERSION))
+    {
+        DEBUG ("ignoring %s: it is for \"%s\", not \"%s\"", filename,
+               version, CACHE_VERSION);
+    }
+    else
+    {
+        g_variant_iter_init (&iter, dict);
+
+        while (g_variant_iter_next (&iter, "{&s(&sv)}", &path, &checksum,
+                                    &parsed))
+        {
+            g_hash_table_insert (entries, g_strdup (path),
+                                 cache_entry_new (checksum, parsed, FALSE));
+            g_variant_unref (parsed);
+        }
+
+        DEBUG ("%u entries in %s", g_hash_table_size (entries), filename);
+    }
+
+    g_variant_unref (dict);
+    g_variant_unref (root);
+
+finally:
+    g_free (filename);
+}
+
+/* Returns: %TRUE if @entry might still be useful for @path; we don't read
+ * the file to find out whether it has changed, since that happens anyway
+ * if a client with that file appears */
+static gboolean
+cache_entry_is_current (const gchar *path,
+                        CacheEntry *entry)
+{
+    if (entry->confirmed)
+        return TRUE;
+
+    return g_file_test (path, G_FILE_TEST_IS_REGULAR);
+}
+
+static gchar *
+cache_checksum (const gchar *contents,
+                gsize length)
+{
+    return g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+                                        (const guchar *) contents, length);
+}
+
+static gboolean
+cache_save (GError **error)
+{
+    gchar *filename = cache_dup_filename ();
+    gchar *dirname = g_path_get_dirname (filename);
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer k, v;
+    GVariant *root;
+    gboolean ret = FALSE;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(sv)}"));
+    g_hash_table_iter_init (&iter, entries);
+
+    while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+        CacheEntry *entry = v;
+
+        if (!cache_entry_is_current (k, entry))
+        {
+            g_hash_table_iter_remove (&iter);
+            continue;
+        }
+
+        g_variant_builder_add (&builder, "{s(sv)}", k, entry->checksum,
+                               entry->parsed);
+    }
+
+    root = g_variant_ref_sink (g_variant_new ("(s@a{s(sv)})",
+        CACHE_VERSION, g_variant_builder_end (&builder)));
+
+    if (g_mkdir_with_parents (dirname, 0700) != 0)
+    {
+        gint e = errno;
+
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (e),
+                     "Unable to create directory %s: %s", dirname,
+                     g_strerror (e));
+        goto finally;
+    }
+
+    ret = g_file_set_contents (filename, g_variant_get_data (root),
+                               g_variant_get_size (root), error);
+
+    if (ret)
+        DEBUG ("wrote %u entries to %s", g_hash_table_size (entries),
+               filename);
+
+finally:
+    g_variant_unref (root);
+    g_free (dirname);
+    g_free (filename);
+    return ret;
+}
+
+static gboolean
+cache_save_cb (gpointer unused)
+{
+    GError *error = NULL;
+
+    save_id = 0;
+
+    if (!cache_save (&error))
+    {
+        WARNING ("%s", error->message);
+        g_error_free (error);
+    }
+
+    return FALSE;
+}
+
+/*
+ * mcd_client_cache_lookup:
+ * @filename: the absolute path to a .client file
+ * @contents: its contents
+ * @length: the length of @contents
+ * @type: the type of the parsed contents
+ *
+ * Returns: (transfer full): what was stored for @filename by
+ *  mcd_client_cache_store(), or %NULL if it was not stored, was stored
+ *  with different @contents, or is not of type @type
+ */
+GVariant *
+mcd_client_cache_lookup (const gchar *filename,
+                         const gchar *contents,
+                         gsize length,
+                         const GVariantType *type)
+{
+    CacheEntry *entry;
+    gchar *checksum;
+    gboolean current;
+
+    if (G_UNLIKELY (entries == NULL))
+        cache_load ();
+
+    entry = g_hash_table_lookup (entries, filename);
+
+    if (entry == NULL || !g_variant_is_of_type (entry->parsed, type))
+        return NULL;
+
+    checksum = cache_checksum (contents, length);
+    current = !tp_strdiff (checksum, entry->checksum);
+    g_free (checksum);
+
+    if (!current)
+        return NULL;
+
+    entry->confirmed = TRUE;
+    return g_variant_ref (entry->parsed);
+}
+
+/*
+ * mcd_client_cache_store:
+ * @filename: the absolute path to a .client file
+ * @contents: its contents
+ * @length: the length of @contents
+ * @parsed: (transfer none): what @contents were parsed into; if floating,
+ *  the cache takes ownership
+ *
+ * Remember @parsed for @filename, and rewrite the cache soon.
+ */
+void
+mcd_client_cache_store (const gchar *filename,
+                        const gchar *contents,
+                        gsize length,
+                        GVariant *parsed)
+{
+    gchar *checksum = cache_checksum (contents, length);
+
+    if (G_UNLIKELY (entries == NULL))
+        cache_load ();
+
+    g_hash_table_insert (entries, g_strdup (filename),
+                         cache_entry_new (checksum, parsed, TRUE));
+    g_free (checksum);
+
+    if (save_id == 0)
+        save_id = g_timeout_add_seconds (SAVE_DELAY_SECONDS, cache_save_cb,
+                                         NULL);
+}
+
+/*
+ * mcd_client_cache_flush:
+ *
+ * If the cache was going to be rewritten soon, rewrite it now; then forget
+ * everything, so that the next lookup reads it again.
+ */
+void
+mcd_client_cache_flush (void)
+{
+    if (save_id != 0)
+    {
+        g_source_remove (save_id);
+        cache_save_cb (NULL);
+    }
+
+    tp_clear_pointer (&entries, g_hash_table_unref);
+}
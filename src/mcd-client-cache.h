@@ -0,0 +1,40 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * Cache of parsed .client files
+ *
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef MCD_CLIENT_CACHE_H
+#define MCD_CLIENT_CACHE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+GVariant *mcd_client_cache_lookup (const gchar *filename,
+    const gchar *contents, gsize length, const GVariantType *type);
+
+void mcd_client_cache_store (const gchar *filename, const gchar *contents,
+    gsize length, GVariant *parsed);
+
+void mcd_client_cache_flush (void);
+
+G_END_DECLS
+
+#endif /* MCD_CLIENT_CACHE_H */
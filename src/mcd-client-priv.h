@@ -32,6 +32,8 @@
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
+#include "channel-utils.h"
+
 G_BEGIN_DECLS
 
 typedef struct _McdClientProxy McdClientProxy;
@@ -74,6 +76,8 @@ G_GNUC_INTERNAL McdClientProxy *_mcd_client_proxy_new (
     gboolean activatable);
 
 G_GNUC_INTERNAL gboolean _mcd_client_proxy_is_ready (McdClientProxy *self);
+G_GNUC_INTERNAL gboolean _mcd_client_proxy_introspect_deferred (
+    McdClientProxy *self);
 
 G_GNUC_INTERNAL gboolean _mcd_client_check_valid_name (
     const gchar *name_suffix, GError **error);
@@ -100,16 +104,41 @@ G_GNUC_INTERNAL gboolean _mcd_client_proxy_get_bypass_approval
 G_GNUC_INTERNAL gboolean _mcd_client_proxy_get_delay_approvers
     (McdClientProxy *self);
 
-G_GNUC_INTERNAL GValueArray *_mcd_client_proxy_dup_handler_capabilities (
+typedef struct _McdClientCapsSnapshot McdClientCapsSnapshot;
+
+G_GNUC_INTERNAL McdClientCapsSnapshot *_mcd_client_proxy_ref_caps_snapshot (
     McdClientProxy *self);
 
+G_GNUC_INTERNAL McdClientCapsSnapshot *_mcd_client_caps_snapshot_ref (
+    McdClientCapsSnapshot *snapshot);
+G_GNUC_INTERNAL void _mcd_client_caps_snapshot_unref (
+    McdClientCapsSnapshot *snapshot);
+G_GNUC_INTERNAL GValueArray *_mcd_client_caps_snapshot_get_value_array (
+    McdClientCapsSnapshot *snapshot);
+G_GNUC_INTERNAL gboolean _mcd_client_caps_snapshot_equal (
+    McdClientCapsSnapshot *a, McdClientCapsSnapshot *b);
+
 G_GNUC_INTERNAL void _mcd_client_proxy_inc_ready_lock (McdClientProxy *self);
 G_GNUC_INTERNAL void _mcd_client_proxy_dec_ready_lock (McdClientProxy *self);
 
 #define MC_CLIENT_BUS_NAME_BASE_LEN (sizeof (TP_CLIENT_BUS_NAME_BASE) - 1)
 
-G_GNUC_INTERNAL guint _mcd_client_match_filters (
-    GVariant *channel_properties, const GList *filters,
+typedef struct _McdClientFilterIndex McdClientFilterIndex;
+
+G_GNUC_INTERNAL McdClientFilterIndex *_mcd_client_filter_index_new (
+    const GList *filters);
+G_GNUC_INTERNAL void _mcd_client_filter_index_free (
+    McdClientFilterIndex *index);
+G_GNUC_INTERNAL guint _mcd_client_filter_index_match (
+    McdClientFilterIndex *index, McdPropertyView *channel_properties,
+    gboolean assume_requested);
+
+G_GNUC_INTERNAL guint _mcd_client_proxy_match_approver_filters (
+    McdClientProxy *self, McdPropertyView *channel_properties);
+G_GNUC_INTERNAL guint _mcd_client_proxy_match_observer_filters (
+    McdClientProxy *self, McdPropertyView *channel_properties);
+G_GNUC_INTERNAL guint _mcd_client_proxy_match_handler_filters (
+    McdClientProxy *self, McdPropertyView *channel_properties,
     gboolean assume_requested);
 
 G_GNUC_INTERNAL void _mcd_client_proxy_handle_channels (McdClientProxy *self,
@@ -118,6 +147,27 @@ G_GNUC_INTERNAL void _mcd_client_proxy_handle_channels (McdClientProxy *self,
     tp_cli_client_handler_callback_for_handle_channels callback,
     gpointer user_data, GDestroyNotify destroy, GObject *weak_object);
 
+G_GNUC_INTERNAL gboolean _mcd_client_proxy_preactivate (
+    McdClientProxy *self);
+
+G_GNUC_INTERNAL gint _mcd_client_proxy_get_handler_timeout (
+    McdClientProxy *self);
+G_GNUC_INTERNAL gint64 _mcd_client_proxy_get_unresponsive_until (
+    McdClientProxy *self);
+
+G_GNUC_INTERNAL void _mcd_client_proxy_observe_channels (McdClientProxy *self,
+    gint timeout_ms, const gchar *account_path, const gchar *connection_path,
+    const GPtrArray *channels, const gchar *dispatch_operation_path,
+    const GPtrArray *requests_satisfied, GHashTable *observer_info,
+    tp_cli_client_observer_callback_for_observe_channels callback,
+    gpointer user_data, GDestroyNotify destroy, GObject *weak_object);
+
+G_GNUC_INTERNAL void _mcd_client_proxy_add_dispatch_operation (
+    McdClientProxy *self, gint timeout_ms, const GPtrArray *channels,
+    const gchar *dispatch_operation_path, GHashTable *properties,
+    tp_cli_client_approver_callback_for_add_dispatch_operation callback,
+    gpointer user_data, GDestroyNotify destroy, GObject *weak_object);
+
 G_GNUC_INTERNAL void _mcd_client_recover_observer (McdClientProxy *self,
     TpChannel *channel, const gchar *account_path);
 
@@ -27,7 +27,13 @@
 #include "mcd-client-priv.h"
 
 #include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
 
+#include <glib/gstdio.h>
+
+#include <dbus/dbus-glib.h>
+#include <gio/gio.h>
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
@@ -35,7 +41,10 @@
 
 #include "channel-utils.h"
 #include "mcd-channel-priv.h"
+#include "mcd-client-cache.h"
 #include "mcd-debug.h"
+#include "mcd-misc.h"
+#include "mcd-stats.h"
 
 G_DEFINE_TYPE (McdClientProxy, _mcd_client_proxy, TP_TYPE_CLIENT);
 
@@ -54,23 +63,76 @@ enum
     S_HANDLER_CAPABILITIES_CHANGED,
     S_GONE,
     S_NEED_RECOVERY,
+    S_FILTERS_CHANGED,
+    S_RESPONSIVENESS_CHANGED,
+    S_INTROSPECTION_DEFERRED,
     N_SIGNALS
 };
 
 static guint signals[N_SIGNALS] = { 0 };
 
+/* Once we have seen enough HandleChannels calls to a Handler, its
+ * timeout is HANDLER_TIMEOUT_FACTOR times the 99th percentile of its
+ * replies, within limits, so that if it hangs we try the next Handler
+ * quickly. The ceiling is dbus-glib's default timeout. */
+#define HANDLER_TIMEOUT_MIN_SAMPLES 10
+#define HANDLER_TIMEOUT_FACTOR 4
+#define HANDLER_TIMEOUT_FLOOR_MS 5000
+#define HANDLER_TIMEOUT_CEILING_MS 25000
+
+/* A Handler that times out this many times in a row is only tried after
+ * all the others, for UNRESPONSIVE_PENALTY_USEC or until it replies */
+#define MAX_CONSECUTIVE_HANDLER_TIMEOUTS 2
+#define UNRESPONSIVE_PENALTY_USEC (5 * 60 * G_USEC_PER_SEC)
+
+struct _McdClientCapsSnapshot
+{
+    gint ref_count;
+    /* (sa(a{sv})as), as passed to UpdateCapabilities */
+    GValueArray *va;
+    /* a canonical serialization of the filters and tokens, independent of
+     * hash table and .client file ordering */
+    gchar *canonical;
+    guint hash;
+};
+
 struct _McdClientProxyPrivate
 {
     GStrv capability_tokens;
 
+    /* lazily-built snapshot of the current handler capabilities, or NULL if
+     * they have changed since it was last built */
+    McdClientCapsSnapshot *caps;
+    /* the capabilities we last signalled via handler-capabilities-changed */
+    McdClientCapsSnapshot *announced_caps;
+
     gchar *unique_name;
     guint ready_lock;
     gboolean introspect_started;
     gboolean ready;
+    /* TRUE if we are an inactive activatable client without a .client file,
+     * and we are not going to ask for our interfaces until
+     * _mcd_client_proxy_introspect_deferred() is called */
+    gboolean introspection_deferred;
+    /* TRUE once _mcd_client_proxy_introspect_deferred() has been called */
+    gboolean introspection_wanted;
     gboolean bypass_approval;
     gboolean delay_approvers;
     gboolean recover;
 
+    /* if TRUE, the .client file allows us to activate this Handler as
+     * soon as a channel that it might handle arrives */
+    gboolean preactivate;
+    /* TRUE while we are waiting for StartServiceByName */
+    gboolean preactivating;
+
+    /* consecutive HandleChannels calls that timed out */
+    guint handler_timeouts;
+    /* monotonic time until which we avoid this Handler, or 0 */
+    gint64 unresponsive_until;
+    /* ends the penalty at unresponsive_until, or 0 */
+    guint unresponsive_source;
+
     /* If a client was in the ListActivatableNames list, it must not be
      * removed when it disappear from the bus.
      */
@@ -94,6 +156,10 @@ struct _McdClientProxyPrivate
     GList *approver_filters;
     GList *handler_filters;
     GList *observer_filters;
+    /* compiled forms of the filters above, built when first needed */
+    McdClientFilterIndex *approver_index;
+    McdClientFilterIndex *handler_index;
+    McdClientFilterIndex *observer_index;
 
     gboolean disposed;
 };
@@ -105,6 +171,9 @@ typedef enum
     MCD_CLIENT_OBSERVER
 } McdClientInterface;
 
+static void _mcd_client_proxy_handler_capabilities_changed
+    (McdClientProxy *self);
+
 void
 _mcd_client_proxy_inc_ready_lock (McdClientProxy *self)
 {
@@ -147,54 +216,165 @@ static void _mcd_client_proxy_take_observer_filters
 static void _mcd_client_proxy_take_handler_filters
     (McdClientProxy *self, GList *filters);
 
-static gchar *
-_mcd_client_proxy_find_client_file (const gchar *client_name)
+/*
+ * Index of the .client files we can see, so that discovering a client
+ * doesn't have to stat its filename in every data directory. The
+ * directories are scanned once, and rescanned lazily if a file monitor
+ * tells us that any of them changed.
+ */
+
+/* dup'd "name.client" => dup'd absolute path of the file that wins */
+static GHashTable *client_files = NULL;
+/* owned GFileMonitor */
+static GPtrArray *client_file_monitors = NULL;
+static gboolean client_files_stale = TRUE;
+
+/*
+ * The full path is $XDG_DATA_DIRS/telepathy/clients/clientname.client
+ * or $XDG_DATA_HOME/telepathy/clients/clientname.client
+ * For testing purposes, we also look for $MC_CLIENTS_DIR/clientname.client
+ * if $MC_CLIENTS_DIR is set.
+ *
+ * Returns: the directories to look in, earlier ones taking precedence
+ */
+static GPtrArray *
+client_file_dup_dirs (void)
 {
-    const gchar * const *dirs;
+    GPtrArray *dirs = g_ptr_array_new_with_free_func (g_free);
+    const gchar * const *system_dirs;
     const gchar *dirname;
-    const gchar *env_dirname;
-    gchar *filename, *absolute_filepath;
-
-    /*
-     * The full path is $XDG_DATA_DIRS/telepathy/clients/clientname.client
-     * or $XDG_DATA_HOME/telepathy/clients/clientname.client
-     * For testing purposes, we also look for $MC_CLIENTS_DIR/clientname.client
-     * if $MC_CLIENTS_DIR is set.
-     */
-    filename = g_strdup_printf ("%s.client", client_name);
-    env_dirname = g_getenv ("MC_CLIENTS_DIR");
-    if (env_dirname)
-    {
-        absolute_filepath = g_build_filename (env_dirname, filename, NULL);
-        if (g_file_test (absolute_filepath, G_FILE_TEST_IS_REGULAR))
-            goto finish;
-        g_free (absolute_filepath);
-    }
+
+    dirname = g_getenv ("MC_CLIENTS_DIR");
+    if (dirname)
+        g_ptr_array_add (dirs, g_strdup (dirname));
 
     dirname = g_get_user_data_dir ();
     if (G_LIKELY (dirname))
+        g_ptr_array_add (dirs, g_build_filename (dirname, "telepathy/clients",
+                                                 NULL));
+
+    for (system_dirs = g_get_system_data_dirs ();
+         *system_dirs != NULL;
+         system_dirs++)
+        g_ptr_array_add (dirs, g_build_filename (*system_dirs,
+                                                 "telepathy/clients", NULL));
+
+    return dirs;
+}
+
+static void
+client_file_dir_changed_cb (GFileMonitor *monitor,
+                            GFile *file,
+                            GFile *other_file,
+                            GFileMonitorEvent event_type,
+                            gpointer user_data)
+{
+    if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED ||
+        event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT)
+        return;
+
+    if (!client_files_stale)
     {
-        absolute_filepath = g_build_filename (dirname, "telepathy/clients",
-                                              filename, NULL);
-        if (g_file_test (absolute_filepath, G_FILE_TEST_IS_REGULAR))
-            goto finish;
-        g_free (absolute_filepath);
+        DEBUG ("a client directory changed, will rescan it");
+        client_files_stale = TRUE;
     }
+}
+
+static void
+client_file_index_scan (void)
+{
+    GPtrArray *dirs = client_file_dup_dirs ();
+    gboolean monitor = (client_file_monitors == NULL);
+    guint i;
+
+    if (client_files == NULL)
+        client_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+            g_free, g_free);
+    else
+        g_hash_table_remove_all (client_files);
+
+    if (monitor)
+        client_file_monitors = g_ptr_array_new_with_free_func (
+            g_object_unref);
 
-    dirs = g_get_system_data_dirs ();
-    for (dirname = *dirs; dirname != NULL; dirs++, dirname = *dirs)
+    /* mark the index as fresh before we start, so that a change while we
+     * are scanning makes us scan again next time */
+    client_files_stale = FALSE;
+
+    for (i = 0; i < dirs->len; i++)
     {
-        absolute_filepath = g_build_filename (dirname, "telepathy/clients",
-                                              filename, NULL);
-        if (g_file_test (absolute_filepath, G_FILE_TEST_IS_REGULAR))
-            goto finish;
-        g_free (absolute_filepath);
+        const gchar *dirname = g_ptr_array_index (dirs, i);
+        const gchar *name;
+        GDir *dir;
+
+        if (monitor)
+        {
+            GFile *file = g_file_new_for_path (dirname);
+            GFileMonitor *file_monitor = g_file_monitor_directory (file,
+                G_FILE_MONITOR_NONE, NULL, NULL);
+
+            if (file_monitor != NULL)
+            {
+                g_signal_connect (file_monitor, "changed",
+                                  G_CALLBACK (client_file_dir_changed_cb),
+                                  NULL);
+                g_ptr_array_add (client_file_monitors, file_monitor);
+            }
+
+            g_object_unref (file);
+        }
+
+        dir = g_dir_open (dirname, 0, NULL);
+
+        if (dir == NULL)
+            continue;
+
+        while ((name = g_dir_read_name (dir)) != NULL)
+        {
+            gchar *absolute_filepath;
+            GStatBuf buf;
+
+            if (!g_str_has_suffix (name, ".client") ||
+                g_hash_table_lookup (client_files, name) != NULL)
+                continue;
+
+            absolute_filepath = g_build_filename (dirname, name, NULL);
+
+            if (g_stat (absolute_filepath, &buf) == 0 &&
+                S_ISREG (buf.st_mode))
+            {
+                g_hash_table_insert (client_files, g_strdup (name),
+                                     absolute_filepath);
+            }
+            else
+            {
+                g_free (absolute_filepath);
+            }
+        }
+
+        g_dir_close (dir);
     }
 
-    absolute_filepath = NULL;
-finish:
+    DEBUG ("%u .client files in %u directories",
+           g_hash_table_size (client_files), dirs->len);
+    g_ptr_array_unref (dirs);
+}
+
+/* Returns: (transfer none): the path to the .client file for @client_name,
+ * valid until the next call, or %NULL */
+static const gchar *
+_mcd_client_proxy_find_client_file (const gchar *client_name)
+{
+    const gchar *path;
+    gchar *filename;
+
+    if (client_files_stale)
+        client_file_index_scan ();
+
+    filename = g_strdup_printf ("%s.client", client_name);
+    path = g_hash_table_lookup (client_files, filename);
     g_free (filename);
-    return absolute_filepath;
+    return path;
 }
 
 static GHashTable *
@@ -325,94 +505,170 @@ parse_client_filter (GKeyFile *file, const gchar *group)
 
 static void _mcd_client_proxy_set_cap_tokens (McdClientProxy *self,
                                               GStrv cap_tokens);
+static void mcd_client_proxy_filters_changed (McdClientProxy *self);
 static void _mcd_client_proxy_add_interfaces (McdClientProxy *self,
                                               const gchar * const *interfaces);
 
+/* The contents of a .client file, as stored in the cache: Nothing if it
+ * has no Interfaces, or Just (Interfaces, approver filters, handler filters,
+ * observer filters, BypassApproval, DelayApprovers, Recover,
+ * X-MissionControl-Preactivate, capability tokens) */
+#define PARSED_CLIENT_FILE_INNER_TYPE "(asaa{sv}aa{sv}aa{sv}bbbbas)"
+#define PARSED_CLIENT_FILE_TYPE "m" PARSED_CLIENT_FILE_INNER_TYPE
+
 static void
-parse_client_file (McdClientProxy *client,
-                   GKeyFile *file)
+add_client_filter (GVariantBuilder *builder,
+                   GKeyFile *file,
+                   const gchar *group)
 {
+    GHashTable *filter = parse_client_filter (file, group);
+
+    g_variant_builder_add_value (builder, tp_asv_to_vardict (filter));
+    g_hash_table_unref (filter);
+}
+
+/* Returns: a floating GVariant of type PARSED_CLIENT_FILE_TYPE */
+static GVariant *
+parse_client_file (GKeyFile *file)
+{
+    static const gchar * const no_tokens[] = { NULL };
     gchar **iface_names, **groups, **cap_tokens;
-    guint i;
     gsize len = 0;
     gboolean is_approver, is_handler, is_observer;
-    GList *approver_filters = NULL;
-    GList *observer_filters = NULL;
-    GList *handler_filters = NULL;
+    GVariantBuilder approver_filters;
+    GVariantBuilder observer_filters;
+    GVariantBuilder handler_filters;
+    GVariant *parsed;
 
     iface_names = g_key_file_get_string_list (file, TP_IFACE_CLIENT,
                                               "Interfaces", 0, NULL);
     if (!iface_names)
-        return;
-
-    _mcd_client_proxy_add_interfaces (client,
-                                      (const gchar * const *) iface_names);
-    g_strfreev (iface_names);
-
-    is_approver = tp_proxy_has_interface_by_id (client,
-                                                TP_IFACE_QUARK_CLIENT_APPROVER);
-    is_observer = tp_proxy_has_interface_by_id (client,
-                                                TP_IFACE_QUARK_CLIENT_OBSERVER);
-    is_handler = tp_proxy_has_interface_by_id (client,
-                                               TP_IFACE_QUARK_CLIENT_HANDLER);
-
-    /* parse filtering rules */
+        return g_variant_new_maybe (
+            G_VARIANT_TYPE (PARSED_CLIENT_FILE_INNER_TYPE), NULL);
+
+    is_approver = tp_strv_contains ((const gchar * const *) iface_names,
+                                    TP_IFACE_CLIENT_APPROVER);
+    is_observer = tp_strv_contains ((const gchar * const *) iface_names,
+                                    TP_IFACE_CLIENT_OBSERVER);
+    is_handler = tp_strv_contains ((const gchar * const *) iface_names,
+                                   TP_IFACE_CLIENT_HANDLER);
+
+    g_variant_builder_init (&approver_filters, G_VARIANT_TYPE ("aa{sv}"));
+    g_variant_builder_init (&observer_filters, G_VARIANT_TYPE ("aa{sv}"));
+    g_variant_builder_init (&handler_filters, G_VARIANT_TYPE ("aa{sv}"));
+
+    /* parse filtering rules; we used to prepend each filter to a list, so
+     * go backwards to keep them in the same order */
     groups = g_key_file_get_groups (file, &len);
-    for (i = 0; i < len; i++)
+    while (len-- > 0)
     {
         if (is_approver &&
-            g_str_has_prefix (groups[i], TP_IFACE_CLIENT_APPROVER
+            g_str_has_prefix (groups[len], TP_IFACE_CLIENT_APPROVER
                               ".ApproverChannelFilter "))
         {
-            approver_filters =
-                g_list_prepend (approver_filters,
-                                parse_client_filter (file, groups[i]));
+            add_client_filter (&approver_filters, file, groups[len]);
         }
         else if (is_handler &&
-            g_str_has_prefix (groups[i], TP_IFACE_CLIENT_HANDLER
+            g_str_has_prefix (groups[len], TP_IFACE_CLIENT_HANDLER
                               ".HandlerChannelFilter "))
         {
-            handler_filters =
-                g_list_prepend (handler_filters,
-                                parse_client_filter (file, groups[i]));
+            add_client_filter (&handler_filters, file, groups[len]);
         }
         else if (is_observer &&
-            g_str_has_prefix (groups[i], TP_IFACE_CLIENT_OBSERVER
+            g_str_has_prefix (groups[len], TP_IFACE_CLIENT_OBSERVER
                               ".ObserverChannelFilter "))
         {
-            observer_filters =
-                g_list_prepend (observer_filters,
-                                parse_client_filter (file, groups[i]));
+            add_client_filter (&observer_filters, file, groups[len]);
         }
     }
     g_strfreev (groups);
 
-    _mcd_client_proxy_take_approver_filters (client,
-                                             approver_filters);
-    _mcd_client_proxy_take_observer_filters (client,
-                                             observer_filters);
-    _mcd_client_proxy_take_handler_filters (client,
-                                            handler_filters);
-
-    /* Other client options */
-    client->priv->bypass_approval =
-        g_key_file_get_boolean (file, TP_IFACE_CLIENT_HANDLER,
-                                "BypassApproval", NULL);
-
-    client->priv->delay_approvers =
-        g_key_file_get_boolean (file, TP_IFACE_CLIENT_OBSERVER,
-                                "DelayApprovers", NULL);
-
-    client->priv->recover =
-        g_key_file_get_boolean (file, TP_IFACE_CLIENT_OBSERVER,
-                                "Recover", NULL);
-
     cap_tokens = g_key_file_get_keys (file,
                                       TP_IFACE_CLIENT_HANDLER ".Capabilities",
                                       NULL,
                                       NULL);
-    _mcd_client_proxy_set_cap_tokens (client, cap_tokens);
+
+    parsed = g_variant_new_maybe (NULL,
+        g_variant_new ("(^as@aa{sv}@aa{sv}@aa{sv}bbbb^as)",
+            iface_names,
+            g_variant_builder_end (&approver_filters),
+            g_variant_builder_end (&handler_filters),
+            g_variant_builder_end (&observer_filters),
+            /* Other client options */
+            g_key_file_get_boolean (file, TP_IFACE_CLIENT_HANDLER,
+                                    "BypassApproval", NULL),
+            g_key_file_get_boolean (file, TP_IFACE_CLIENT_OBSERVER,
+                                    "DelayApprovers", NULL),
+            g_key_file_get_boolean (file, TP_IFACE_CLIENT_OBSERVER,
+                                    "Recover", NULL),
+            g_key_file_get_boolean (file, TP_IFACE_CLIENT_HANDLER,
+                                    "X-MissionControl-Preactivate", NULL),
+            cap_tokens != NULL ? (const gchar * const *) cap_tokens
+                               : no_tokens));
+
     g_strfreev (cap_tokens);
+    g_strfreev (iface_names);
+    return parsed;
+}
+
+static GList *
+client_filters_from_variant (GVariant *filters)
+{
+    GList *list = NULL;
+    GVariantIter iter;
+    GVariant *filter;
+
+    g_variant_iter_init (&iter, filters);
+
+    while ((filter = g_variant_iter_next_value (&iter)) != NULL)
+    {
+        list = g_list_prepend (list, tp_asv_from_vardict (filter));
+        g_variant_unref (filter);
+    }
+
+    return g_list_reverse (list);
+}
+
+static void
+apply_client_file (McdClientProxy *client,
+                   GVariant *parsed)
+{
+    GVariant *contents = g_variant_get_maybe (parsed);
+    GVariant *approver_filters, *handler_filters, *observer_filters;
+    const gchar **iface_names, **cap_tokens;
+    gboolean bypass_approval, delay_approvers, recover, preactivate;
+
+    if (contents == NULL)
+        return;
+
+    g_variant_get (contents, "(^a&s@aa{sv}@aa{sv}@aa{sv}bbbb^a&s)",
+                   &iface_names, &approver_filters, &handler_filters,
+                   &observer_filters, &bypass_approval, &delay_approvers,
+                   &recover, &preactivate, &cap_tokens);
+
+    _mcd_client_proxy_add_interfaces (client, iface_names);
+
+    _mcd_client_proxy_take_approver_filters (client,
+        client_filters_from_variant (approver_filters));
+    _mcd_client_proxy_take_observer_filters (client,
+        client_filters_from_variant (observer_filters));
+    _mcd_client_proxy_take_handler_filters (client,
+        client_filters_from_variant (handler_filters));
+
+    client->priv->bypass_approval = bypass_approval;
+    client->priv->delay_approvers = delay_approvers;
+    client->priv->recover = recover;
+    client->priv->preactivate = preactivate;
+
+    _mcd_client_proxy_set_cap_tokens (client,
+        cap_tokens[0] != NULL ? (GStrv) cap_tokens : NULL);
+
+    g_free (iface_names);
+    g_free (cap_tokens);
+    g_variant_unref (approver_filters);
+    g_variant_unref (handler_filters);
+    g_variant_unref (observer_filters);
+    g_variant_unref (contents);
 }
 
 static void
@@ -515,6 +771,8 @@ _mcd_client_proxy_set_cap_tokens (McdClientProxy *self,
 {
     g_strfreev (self->priv->capability_tokens);
     self->priv->capability_tokens = g_strdupv (cap_tokens);
+    tp_clear_pointer (&self->priv->caps, _mcd_client_caps_snapshot_unref);
+    mcd_client_proxy_filters_changed (self);
 }
 
 static void
@@ -604,8 +862,7 @@ _mcd_client_recover_observer (McdClientProxy *self, TpChannel *channel,
     DEBUG ("calling ObserveChannels on %s for channel %p",
            tp_proxy_get_bus_name (self), channel);
 
-    tp_cli_client_observer_call_observe_channels (
-        (TpClient *) self, -1, account_path,
+    _mcd_client_proxy_observe_channels (self, -1, account_path,
         connection_path, channels_array,
         "/", satisfied_requests, observer_info,
         NULL, NULL, NULL, NULL);
@@ -666,7 +923,7 @@ _mcd_client_proxy_handler_get_all_cb (TpProxy *proxy,
     {
         _mcd_client_proxy_set_cap_tokens (self,
             tp_asv_get_boxed (properties, "Capabilities", G_TYPE_STRV));
-        g_signal_emit (self, signals[S_HANDLER_CAPABILITIES_CHANGED], 0);
+        _mcd_client_proxy_handler_capabilities_changed (self);
     }
 
     /* If our unique name is "", then we're not *really* handling these
@@ -851,38 +1108,78 @@ finally:
 static gboolean
 _mcd_client_proxy_parse_client_file (McdClientProxy *self)
 {
-    gboolean file_found = FALSE;
-    gchar *filename;
+    const gchar *path;
     const gchar *bus_name = tp_proxy_get_bus_name (self);
+    GKeyFile *file;
+    GError *error = NULL;
+    GVariant *parsed;
+    gchar *contents;
+    gsize length;
+    gboolean file_found = FALSE;
 
-    filename = _mcd_client_proxy_find_client_file (
+    path = _mcd_client_proxy_find_client_file (
         bus_name + MC_CLIENT_BUS_NAME_BASE_LEN);
 
-    if (filename)
+    if (path == NULL)
+        return FALSE;
+
+    if (!g_file_get_contents (path, &contents, &length, &error))
     {
-        GKeyFile *file;
-        GError *error = NULL;
+        g_warning ("Loading file %s failed: %s", path,
+                   error->message);
+        g_error_free (error);
+        return FALSE;
+    }
 
-        file = g_key_file_new ();
-        g_key_file_load_from_file (file, filename, 0, &error);
-        if (G_LIKELY (!error))
-        {
-            DEBUG ("File found for %s: %s", bus_name, filename);
-            parse_client_file (self, file);
-            file_found = TRUE;
-        }
-        else
-        {
-            g_warning ("Loading file %s failed: %s", filename, error->message);
-            g_error_free (error);
-        }
-        g_key_file_free (file);
-        g_free (filename);
+    parsed = mcd_client_cache_lookup (path, contents, length,
+        G_VARIANT_TYPE (PARSED_CLIENT_FILE_TYPE));
+
+    if (parsed != NULL)
+    {
+        DEBUG ("Cached file found for %s: %s", bus_name, path);
+        apply_client_file (self, parsed);
+        g_variant_unref (parsed);
+        g_free (contents);
+        return TRUE;
+    }
+
+    file = g_key_file_new ();
+    g_key_file_load_from_data (file, contents, length, 0, &error);
+    if (G_LIKELY (!error))
+    {
+        DEBUG ("File found for %s: %s", bus_name, path);
+        parsed = g_variant_ref_sink (parse_client_file (file));
+        mcd_client_cache_store (path, contents, length, parsed);
+        apply_client_file (self, parsed);
+        g_variant_unref (parsed);
+        file_found = TRUE;
+    }
+    else
+    {
+        g_warning ("Loading file %s failed: %s", path,
+                   error->message);
+        g_error_free (error);
     }
+    g_key_file_free (file);
+    g_free (contents);
 
     return file_found;
 }
 
+/* If MC_LAZY_INTROSPECTION is set, activatable clients that are not
+ * running and have no .client file are not activated just to ask for their
+ * interfaces until something needs to know them */
+static gboolean
+lazy_introspection_enabled (void)
+{
+    static gint enabled = -1;
+
+    if (G_UNLIKELY (enabled < 0))
+        enabled = mcd_env_flag_enabled ("MC_LAZY_INTROSPECTION");
+
+    return enabled;
+}
+
 static gboolean
 mcd_client_proxy_introspect (gpointer data)
 {
@@ -895,6 +1192,7 @@ mcd_client_proxy_introspect (gpointer data)
     }
 
     self->priv->introspect_started = TRUE;
+    self->priv->introspection_deferred = FALSE;
 
     /* The .client file is not mandatory as per the spec. However if it
      * exists, it is better to read it than activating the service to read the
@@ -902,6 +1200,21 @@ mcd_client_proxy_introspect (gpointer data)
      */
     if (!_mcd_client_proxy_parse_client_file (self))
     {
+        if (self->priv->activatable && !_mcd_client_proxy_is_active (self) &&
+            !self->priv->introspection_wanted &&
+            lazy_introspection_enabled ())
+        {
+            DEBUG ("No .client file for inactive %s. Deferring "
+                   "introspection.", bus_name);
+
+            /* we're still not ready, and we'll start again when asked to
+             * or when the client starts */
+            self->priv->introspect_started = FALSE;
+            self->priv->introspection_deferred = TRUE;
+            g_signal_emit (self, signals[S_INTROSPECTION_DEFERRED], 0);
+            return FALSE;
+        }
+
         DEBUG ("No .client file for %s. Ask on D-Bus.", bus_name);
 
         _mcd_client_proxy_inc_ready_lock (self);
@@ -933,12 +1246,9 @@ mcd_client_proxy_introspect (gpointer data)
                  * activatable */
                 DEBUG ("%s is a Handler but not active", bus_name);
 
-                /* FIXME: we emit this even if the capabilities we got from the
-                 * .client file match those we already had, possibly causing
-                 * redundant UpdateCapabilities calls - however, those are
-                 * harmless */
-                g_signal_emit (self,
-                               signals[S_HANDLER_CAPABILITIES_CHANGED], 0);
+                /* this is suppressed if the capabilities we got from the
+                 * .client file match those we already announced */
+                _mcd_client_proxy_handler_capabilities_changed (self);
             }
         }
     }
@@ -947,6 +1257,30 @@ mcd_client_proxy_introspect (gpointer data)
     return FALSE;
 }
 
+/*
+ * _mcd_client_proxy_introspect_deferred:
+ *
+ * If introspection of this client was deferred (in which case it has
+ * emitted introspection-deferred), start it now, even though that will
+ * activate the client. It will emit ready when finished.
+ *
+ * Returns: %TRUE if introspection was deferred
+ */
+gboolean
+_mcd_client_proxy_introspect_deferred (McdClientProxy *self)
+{
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), FALSE);
+
+    self->priv->introspection_wanted = TRUE;
+
+    if (!self->priv->introspection_deferred)
+        return FALSE;
+
+    DEBUG ("%s", tp_proxy_get_bus_name (self));
+    mcd_client_proxy_introspect (self);
+    return TRUE;
+}
+
 static void
 mcd_client_proxy_unique_name_cb (TpDBusDaemon *dbus_daemon,
                                  const gchar *well_known_name G_GNUC_UNUSED,
@@ -968,7 +1302,24 @@ mcd_client_proxy_unique_name_cb (TpDBusDaemon *dbus_daemon,
     }
     else
     {
+        gboolean was_inactive = (self->priv->unique_name != NULL &&
+                                 self->priv->unique_name[0] == '\0');
+
         _mcd_client_proxy_set_active (self, unique_name);
+
+        /* An activatable Handler that we only knew from its .client file
+         * has started. The file might have been replaced since we read it,
+         * for instance by an upgrade, so read it again; if it has not
+         * changed, the connections are not told anything. */
+        if (was_inactive && self->priv->ready &&
+            tp_proxy_has_interface_by_id (self,
+                                          TP_IFACE_QUARK_CLIENT_HANDLER) &&
+            _mcd_client_proxy_parse_client_file (self))
+        {
+            DEBUG ("%s started, re-read its .client file",
+                   tp_proxy_get_bus_name (self));
+            _mcd_client_proxy_handler_capabilities_changed (self);
+        }
     }
 
     mcd_client_proxy_introspect (self);
@@ -996,7 +1347,16 @@ mcd_client_proxy_dispose (GObject *object)
                                             mcd_client_proxy_unique_name_cb,
                                             self);
 
+    if (self->priv->unresponsive_source != 0)
+    {
+        g_source_remove (self->priv->unresponsive_source);
+        self->priv->unresponsive_source = 0;
+    }
+
     tp_clear_pointer (&self->priv->capability_tokens, g_strfreev);
+    tp_clear_pointer (&self->priv->caps, _mcd_client_caps_snapshot_unref);
+    tp_clear_pointer (&self->priv->announced_caps,
+                      _mcd_client_caps_snapshot_unref);
 
     if (chain_up != NULL)
     {
@@ -1132,6 +1492,37 @@ _mcd_client_proxy_class_init (McdClientProxyClass *klass)
         g_cclosure_marshal_VOID__VOID,
         G_TYPE_NONE, 0);
 
+    /* Emitted whenever any of the channel filters or the capability tokens
+     * are replaced, even if they are unchanged; BypassApproval is always
+     * set just after the HandlerChannelFilter, so this covers that too */
+    signals[S_FILTERS_CHANGED] = g_signal_new ("filters-changed",
+        G_OBJECT_CLASS_TYPE (klass),
+        G_SIGNAL_RUN_LAST,
+        0, NULL, NULL,
+        g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
+
+    /* Emitted when the Handler is deprioritized for not replying, and
+     * when it replies again or the penalty runs out */
+    signals[S_RESPONSIVENESS_CHANGED] = g_signal_new (
+        "responsiveness-changed",
+        G_OBJECT_CLASS_TYPE (klass),
+        G_SIGNAL_RUN_LAST,
+        0, NULL, NULL,
+        g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
+
+    /* Emitted instead of ready if the client is not going to be introspected
+     * until _mcd_client_proxy_introspect_deferred() is called; ready is
+     * emitted later */
+    signals[S_INTROSPECTION_DEFERRED] = g_signal_new (
+        "introspection-deferred",
+        G_OBJECT_CLASS_TYPE (klass),
+        G_SIGNAL_RUN_LAST,
+        0, NULL, NULL,
+        g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE, 0);
+
     g_object_class_install_property (object_class, PROP_ACTIVATABLE,
         g_param_spec_boolean ("activatable", "Activatable?",
             "TRUE if this client can be service-activated", FALSE,
@@ -1321,6 +1712,13 @@ mcd_client_proxy_free_client_filters (GList **client_filters)
     }
 }
 
+static void
+mcd_client_proxy_filters_changed (McdClientProxy *self)
+{
+    if (!self->priv->disposed)
+        g_signal_emit (self, signals[S_FILTERS_CHANGED], 0);
+}
+
 void
 _mcd_client_proxy_take_approver_filters (McdClientProxy *self,
                                          GList *filters)
@@ -1328,7 +1726,10 @@ _mcd_client_proxy_take_approver_filters (McdClientProxy *self,
     g_return_if_fail (MCD_IS_CLIENT_PROXY (self));
 
     mcd_client_proxy_free_client_filters (&(self->priv->approver_filters));
+    tp_clear_pointer (&self->priv->approver_index,
+                      _mcd_client_filter_index_free);
     self->priv->approver_filters = filters;
+    mcd_client_proxy_filters_changed (self);
 }
 
 void
@@ -1338,7 +1739,10 @@ _mcd_client_proxy_take_observer_filters (McdClientProxy *self,
     g_return_if_fail (MCD_IS_CLIENT_PROXY (self));
 
     mcd_client_proxy_free_client_filters (&(self->priv->observer_filters));
+    tp_clear_pointer (&self->priv->observer_index,
+                      _mcd_client_filter_index_free);
     self->priv->observer_filters = filters;
+    mcd_client_proxy_filters_changed (self);
 }
 
 void
@@ -1348,7 +1752,11 @@ _mcd_client_proxy_take_handler_filters (McdClientProxy *self,
     g_return_if_fail (MCD_IS_CLIENT_PROXY (self));
 
     mcd_client_proxy_free_client_filters (&(self->priv->handler_filters));
+    tp_clear_pointer (&self->priv->handler_index,
+                      _mcd_client_filter_index_free);
     self->priv->handler_filters = filters;
+    tp_clear_pointer (&self->priv->caps, _mcd_client_caps_snapshot_unref);
+    mcd_client_proxy_filters_changed (self);
 }
 
 gboolean
@@ -1385,23 +1793,57 @@ _mcd_client_proxy_become_incapable (McdClientProxy *self)
 
     if (handler_was_capable)
     {
-        g_signal_emit (self, signals[S_HANDLER_CAPABILITIES_CHANGED], 0);
+        _mcd_client_proxy_handler_capabilities_changed (self);
     }
 }
 
-GValueArray *
-_mcd_client_proxy_dup_handler_capabilities (McdClientProxy *self)
+static gchar *
+mcd_client_canonicalize_filter (GHashTable *filter)
+{
+    GString *str = g_string_new ("{");
+    GList *keys, *iter;
+
+    keys = g_list_sort (g_hash_table_get_keys (filter),
+                        (GCompareFunc) g_strcmp0);
+
+    for (iter = keys; iter != NULL; iter = iter->next)
+    {
+        const GValue *value = g_hash_table_lookup (filter, iter->data);
+        gchar *repr = g_strdup_value_contents (value);
+
+        g_string_append_printf (str, "%s=%s:%s;", (const gchar *) iter->data,
+                                G_VALUE_TYPE_NAME (value), repr);
+        g_free (repr);
+    }
+
+    g_list_free (keys);
+    g_string_append_c (str, '}');
+    return g_string_free (str, FALSE);
+}
+
+static gint
+mcd_client_strcmp_indirect (gconstpointer a,
+                            gconstpointer b)
+{
+    return g_strcmp0 (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+static McdClientCapsSnapshot *
+mcd_client_caps_snapshot_new (McdClientProxy *self)
 {
+    McdClientCapsSnapshot *snapshot;
     GPtrArray *filters;
+    GPtrArray *canonical_parts;
     GStrv cap_tokens;
     GValueArray *va;
     const GList *list;
     gchar *empty_strv[] = { NULL };
-
-    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), NULL);
+    GString *canonical;
+    guint i;
 
     filters = g_ptr_array_sized_new (
         g_list_length (self->priv->handler_filters));
+    canonical_parts = g_ptr_array_new_with_free_func (g_free);
 
     for (list = self->priv->handler_filters; list != NULL; list = list->next)
     {
@@ -1412,6 +1854,8 @@ _mcd_client_proxy_dup_handler_capabilities (McdClientProxy *self)
                                 (GBoxedCopyFunc) g_strdup,
                                 (GBoxedCopyFunc) tp_g_value_slice_dup);
         g_ptr_array_add (filters, copy);
+        g_ptr_array_add (canonical_parts,
+                         mcd_client_canonicalize_filter (list->data));
     }
 
     cap_tokens = self->priv->capability_tokens;
@@ -1421,8 +1865,6 @@ _mcd_client_proxy_dup_handler_capabilities (McdClientProxy *self)
 
     if (DEBUGGING)
     {
-        guint i;
-
         DEBUG ("%s:", tp_proxy_get_bus_name (self));
 
         DEBUG ("- %u channel filters", filters->len);
@@ -1436,6 +1878,28 @@ _mcd_client_proxy_dup_handler_capabilities (McdClientProxy *self)
         DEBUG ("-end-");
     }
 
+    /* the order of filters and of tokens is not significant */
+    g_ptr_array_sort (canonical_parts, mcd_client_strcmp_indirect);
+    canonical = g_string_new ("");
+
+    for (i = 0; i < canonical_parts->len; i++)
+        g_string_append (canonical, g_ptr_array_index (canonical_parts, i));
+
+    g_ptr_array_set_size (canonical_parts, 0);
+
+    for (i = 0; cap_tokens[i] != NULL; i++)
+        g_ptr_array_add (canonical_parts, g_strdup (cap_tokens[i]));
+
+    g_ptr_array_sort (canonical_parts, mcd_client_strcmp_indirect);
+
+    for (i = 0; i < canonical_parts->len; i++)
+    {
+        g_string_append_c (canonical, '\n');
+        g_string_append (canonical, g_ptr_array_index (canonical_parts, i));
+    }
+
+    g_ptr_array_unref (canonical_parts);
+
     va = g_value_array_new (3);
     g_value_array_append (va, NULL);
     g_value_array_append (va, NULL);
@@ -1449,93 +1913,207 @@ _mcd_client_proxy_dup_handler_capabilities (McdClientProxy *self)
     g_value_take_boxed (va->values + 1, filters);
     g_value_set_boxed (va->values + 2, cap_tokens);
 
-    return va;
+    snapshot = g_slice_new0 (McdClientCapsSnapshot);
+    snapshot->ref_count = 1;
+    snapshot->va = va;
+    snapshot->canonical = g_string_free (canonical, FALSE);
+    snapshot->hash = g_str_hash (snapshot->canonical);
+
+    return snapshot;
+}
+
+McdClientCapsSnapshot *
+_mcd_client_caps_snapshot_ref (McdClientCapsSnapshot *snapshot)
+{
+    g_return_val_if_fail (snapshot != NULL, NULL);
+
+    snapshot->ref_count++;
+    return snapshot;
+}
+
+void
+_mcd_client_caps_snapshot_unref (McdClientCapsSnapshot *snapshot)
+{
+    g_return_if_fail (snapshot != NULL);
+    g_return_if_fail (snapshot->ref_count > 0);
+
+    if (--snapshot->ref_count > 0)
+        return;
+
+    g_value_array_free (snapshot->va);
+    g_free (snapshot->canonical);
+    g_slice_free (McdClientCapsSnapshot, snapshot);
 }
 
-/* returns TRUE if the channel matches one property criteria
+/*
+ * Returns: (transfer none): the (sa(a{sv})as) struct to pass to
+ *  UpdateCapabilities, valid for as long as @snapshot is
  */
-static gboolean
-_mcd_client_match_property (GVariant *channel_properties,
-                            gchar *property_name,
-                            GValue *filter_value)
+GValueArray *
+_mcd_client_caps_snapshot_get_value_array (McdClientCapsSnapshot *snapshot)
 {
-    GType filter_type = G_VALUE_TYPE (filter_value);
+    g_return_val_if_fail (snapshot != NULL, NULL);
 
-    g_return_val_if_fail (g_variant_is_of_type (channel_properties,
-            G_VARIANT_TYPE_VARDICT), FALSE);
+    return snapshot->va;
+}
 
-    g_assert (G_IS_VALUE (filter_value));
+gboolean
+_mcd_client_caps_snapshot_equal (McdClientCapsSnapshot *a,
+                                 McdClientCapsSnapshot *b)
+{
+    g_return_val_if_fail (a != NULL, FALSE);
+    g_return_val_if_fail (b != NULL, FALSE);
 
-    if (filter_type == G_TYPE_STRING)
-    {
-        const gchar *string;
+    return a == b || (a->hash == b->hash &&
+                      strcmp (a->canonical, b->canonical) == 0);
+}
 
-        string = tp_vardict_get_string (channel_properties, property_name);
-        if (!string)
-            return FALSE;
+/*
+ * _mcd_client_proxy_ref_caps_snapshot:
+ *
+ * Returns: (transfer full): an immutable snapshot of @self's current handler
+ *  capabilities. It is only rebuilt when the filters or capability tokens
+ *  change, so repeated calls share the same snapshot.
+ */
+McdClientCapsSnapshot *
+_mcd_client_proxy_ref_caps_snapshot (McdClientProxy *self)
+{
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), NULL);
 
-        return !tp_strdiff (string, g_value_get_string (filter_value));
-    }
+    if (self->priv->caps == NULL)
+        self->priv->caps = mcd_client_caps_snapshot_new (self);
 
-    if (filter_type == DBUS_TYPE_G_OBJECT_PATH)
-    {
-        const gchar *path;
+    return _mcd_client_caps_snapshot_ref (self->priv->caps);
+}
 
-        path = tp_vardict_get_object_path (channel_properties, property_name);
-        if (!path)
-            return FALSE;
+static void
+_mcd_client_proxy_handler_capabilities_changed (McdClientProxy *self)
+{
+    McdClientCapsSnapshot *caps = _mcd_client_proxy_ref_caps_snapshot (self);
+    const gchar *bus_name = tp_proxy_get_bus_name (self);
 
-        return !tp_strdiff (path, g_value_get_boxed (filter_value));
+    if (self->priv->announced_caps != NULL &&
+        _mcd_client_caps_snapshot_equal (caps, self->priv->announced_caps))
+    {
+        DEBUG ("%s: handler capabilities unchanged, not re-announcing",
+               bus_name);
+        mcd_stats_record_caps_change (bus_name, TRUE);
+        _mcd_client_caps_snapshot_unref (caps);
+        return;
     }
 
-    if (filter_type == G_TYPE_BOOLEAN)
-    {
-        gboolean valid;
-        gboolean b;
+    mcd_stats_record_caps_change (bus_name, FALSE);
 
-        b = tp_vardict_get_boolean (channel_properties, property_name, &valid);
-        if (!valid)
-            return FALSE;
+    tp_clear_pointer (&self->priv->announced_caps,
+                      _mcd_client_caps_snapshot_unref);
+    self->priv->announced_caps = caps;
 
-        return !!b == !!g_value_get_boolean (filter_value);
-    }
+    g_signal_emit (self, signals[S_HANDLER_CAPABILITIES_CHANGED], 0);
+}
 
-    if (filter_type == G_TYPE_UCHAR || filter_type == G_TYPE_UINT ||
-        filter_type == G_TYPE_UINT64)
-    {
-        gboolean valid;
-        guint64 i;
+/*
+ * McdClientFilterIndex:
+ *
+ * A list of channel filters, compiled into a discrimination index: for each
+ * property value required by some filter, the filters that require it.
+ * Matching a channel then costs one hash lookup per property mentioned by
+ * the filters, instead of one comparison per (filter, key) pair.
+ *
+ * Property values are represented by the same canonical keys as in
+ * McdPropertyView.
+ */
+struct _McdClientFilterIndex
+{
+    /* owned key => owned GArray of guint (filter numbers) */
+    GHashTable *postings;
+    /* owned property names mentioned by at least one filter */
+    GPtrArray *property_names;
+    /* guint number of keys in each filter, or G_MAXUINT if the filter can
+     * never match */
+    GArray *sizes;
+};
 
-        i = tp_vardict_get_uint64 (channel_properties, property_name, &valid);
-        if (!valid)
-            return FALSE;
+/*
+ * _mcd_client_filter_index_new:
+ * @filters: (element-type GHashTable): channel filters as stored on
+ *  #McdClientProxy
+ *
+ * Returns: (transfer full): an index that can be used to match channels
+ *  against @filters
+ */
+McdClientFilterIndex *
+_mcd_client_filter_index_new (const GList *filters)
+{
+    McdClientFilterIndex *index = g_slice_new (McdClientFilterIndex);
+    GHashTable *names = g_hash_table_new (g_str_hash, g_str_equal);
+    GString *key = g_string_sized_new (128);
+    const GList *list;
+    GHashTableIter iter;
+    gpointer name;
+    guint n;
 
-        if (filter_type == G_TYPE_UCHAR)
-            return i == g_value_get_uchar (filter_value);
-        else if (filter_type == G_TYPE_UINT)
-            return i == g_value_get_uint (filter_value);
-        else
-            return i == g_value_get_uint64 (filter_value);
-    }
+    index->postings = g_hash_table_new_full (g_str_hash, g_str_equal,
+        g_free, (GDestroyNotify) g_array_unref);
+    index->sizes = g_array_new (FALSE, FALSE, sizeof (guint));
 
-    if (filter_type == G_TYPE_INT || filter_type == G_TYPE_INT64)
+    for (list = filters, n = 0; list != NULL; list = list->next, n++)
     {
-        gboolean valid;
-        gint64 i;
+        GHashTable *filter = list->data;
+        GHashTableIter filter_iter;
+        gpointer value;
+        guint size = g_hash_table_size (filter);
 
-        i = tp_vardict_get_int64 (channel_properties, property_name, &valid);
-        if (!valid)
-            return FALSE;
+        g_hash_table_iter_init (&filter_iter, filter);
 
-        if (filter_type == G_TYPE_INT)
-            return i == g_value_get_int (filter_value);
-        else
-            return i == g_value_get_int64 (filter_value);
+        while (g_hash_table_iter_next (&filter_iter, &name, &value))
+        {
+            GArray *posting;
+
+            g_string_truncate (key, 0);
+
+            if (!_mcd_property_key_append_gvalue (key, name, value))
+            {
+                g_warning ("%s: Invalid type: %s", G_STRFUNC,
+                           G_VALUE_TYPE_NAME (value));
+                size = G_MAXUINT;
+                continue;
+            }
+
+            g_hash_table_insert (names, name, name);
+            posting = g_hash_table_lookup (index->postings, key->str);
+
+            if (posting == NULL)
+            {
+                posting = g_array_new (FALSE, FALSE, sizeof (guint));
+                g_hash_table_insert (index->postings, g_strdup (key->str),
+                                     posting);
+            }
+
+            g_array_append_val (posting, n);
+        }
+
+        g_array_append_val (index->sizes, size);
     }
 
-    g_warning ("%s: Invalid type: %s",
-               G_STRFUNC, g_type_name (filter_type));
-    return FALSE;
+    index->property_names = g_ptr_array_new_full (g_hash_table_size (names),
+                                                  g_free);
+    g_hash_table_iter_init (&iter, names);
+
+    while (g_hash_table_iter_next (&iter, &name, NULL))
+        g_ptr_array_add (index->property_names, g_strdup (name));
+
+    g_hash_table_unref (names);
+    g_string_free (key, TRUE);
+    return index;
+}
+
+void
+_mcd_client_filter_index_free (McdClientFilterIndex *index)
+{
+    g_hash_table_unref (index->postings);
+    g_ptr_array_unref (index->property_names);
+    g_array_unref (index->sizes);
+    g_slice_free (McdClientFilterIndex, index);
 }
 
 /* if the channel matches one of the channel filters, returns a positive
@@ -1545,66 +2123,383 @@ _mcd_client_match_property (GVariant *channel_properties,
  * largest filter that matched)
  */
 guint
-_mcd_client_match_filters (GVariant *channel_properties,
-                           const GList *filters,
-                           gboolean assume_requested)
+_mcd_client_filter_index_match (McdClientFilterIndex *index,
+                                McdPropertyView *channel_properties,
+                                gboolean assume_requested)
 {
-    const GList *list;
+    guint stack_counts[16];
+    guint *counts;
+    guint n_filters = index->sizes->len;
     guint best_quality = 0;
+    guint i, j;
 
-    g_return_val_if_fail (g_variant_is_of_type (channel_properties,
-            G_VARIANT_TYPE_VARDICT), 0);
+    g_return_val_if_fail (channel_properties != NULL, 0);
 
-    for (list = filters; list != NULL; list = list->next)
+    if (n_filters == 0)
+        return 0;
+
+    if (n_filters <= G_N_ELEMENTS (stack_counts))
     {
-        GHashTable *filter = list->data;
-        GHashTableIter filter_iter;
-        gboolean filter_matched = TRUE;
-        gchar *property_name;
-        GValue *filter_value;
-        guint quality;
+        counts = stack_counts;
+        memset (counts, 0, n_filters * sizeof (guint));
+    }
+    else
+    {
+        counts = g_new0 (guint, n_filters);
+    }
 
-        /* +1 because the empty hash table matches everything :-) */
-        quality = g_hash_table_size (filter) + 1;
+    for (i = 0; i < index->property_names->len; i++)
+    {
+        const gchar *name = g_ptr_array_index (index->property_names, i);
+        const gchar *key;
+        GArray *posting;
 
-        if (quality <= best_quality)
+        if (assume_requested &&
+            !tp_strdiff (name, TP_IFACE_CHANNEL ".Requested"))
         {
-            /* even if this filter matches, there's no way it can be a
-             * better-quality match than the best one we saw so far */
-            continue;
+            /* We can assume that the request will return a channel
+             * with Requested == TRUE */
+            key = TP_IFACE_CHANNEL ".Requested=b:1";
+        }
+        else
+        {
+            key = _mcd_property_view_get_key (channel_properties, name);
         }
 
-        g_hash_table_iter_init (&filter_iter, filter);
-        while (g_hash_table_iter_next (&filter_iter,
-                                       (gpointer *) &property_name,
-                                       (gpointer *) &filter_value))
+        if (key == NULL)
+            continue;
+
+        posting = g_hash_table_lookup (index->postings, key);
+
+        if (posting == NULL)
+            continue;
+
+        for (j = 0; j < posting->len; j++)
+            counts[g_array_index (posting, guint, j)]++;
+    }
+
+    /* a filter matches if all of its keys were satisfied; the empty filter
+     * matches everything */
+    for (i = 0; i < n_filters; i++)
+    {
+        guint size = g_array_index (index->sizes, guint, i);
+
+        if (counts[i] == size && size + 1 > best_quality)
+            best_quality = size + 1;
+    }
+
+    if (counts != stack_counts)
+        g_free (counts);
+
+    return best_quality;
+}
+
+static guint
+mcd_client_proxy_match (GList *filters,
+                        McdClientFilterIndex **index,
+                        McdPropertyView *channel_properties,
+                        gboolean assume_requested)
+{
+    if (filters == NULL)
+        return 0;
+
+    if (*index == NULL)
+        *index = _mcd_client_filter_index_new (filters);
+
+    return _mcd_client_filter_index_match (*index, channel_properties,
+                                           assume_requested);
+}
+
+guint
+_mcd_client_proxy_match_approver_filters (McdClientProxy *self,
+                                          McdPropertyView *channel_properties)
+{
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), 0);
+
+    return mcd_client_proxy_match (self->priv->approver_filters,
+                                   &self->priv->approver_index,
+                                   channel_properties, FALSE);
+}
+
+guint
+_mcd_client_proxy_match_observer_filters (McdClientProxy *self,
+                                          McdPropertyView *channel_properties)
+{
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), 0);
+
+    return mcd_client_proxy_match (self->priv->observer_filters,
+                                   &self->priv->observer_index,
+                                   channel_properties, FALSE);
+}
+
+/*
+ * @assume_requested: if %TRUE, @channel_properties are those of a request,
+ *  and we assume that the channel that results from it will have
+ *  Requested == TRUE
+ */
+guint
+_mcd_client_proxy_match_handler_filters (McdClientProxy *self,
+                                         McdPropertyView *channel_properties,
+                                         gboolean assume_requested)
+{
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), 0);
+
+    return mcd_client_proxy_match (self->priv->handler_filters,
+                                   &self->priv->handler_index,
+                                   channel_properties, assume_requested);
+}
+
+/* A call to a client, timed for the statistics */
+typedef struct {
+    McdStatsCall stats_call;
+    gint64 started;
+    /* the generated callback types for ObserveChannels,
+     * AddDispatchOperation and HandleChannels are all the same */
+    tp_cli_client_handler_callback_for_handle_channels callback;
+    gpointer user_data;
+    GDestroyNotify destroy;
+} McdClientCall;
+
+static McdClientCall *
+mcd_client_call_new (McdStatsCall stats_call,
+                     tp_cli_client_handler_callback_for_handle_channels callback,
+                     gpointer user_data,
+                     GDestroyNotify destroy)
+{
+    McdClientCall *call = g_slice_new (McdClientCall);
+
+    call->stats_call = stats_call;
+    call->started = g_get_monotonic_time ();
+    call->callback = callback;
+    call->user_data = user_data;
+    call->destroy = destroy;
+    return call;
+}
+
+static gboolean
+mcd_client_proxy_penalty_expired_cb (gpointer data)
+{
+    McdClientProxy *self = data;
+
+    DEBUG ("giving %s another chance", tp_proxy_get_bus_name (self));
+    self->priv->unresponsive_source = 0;
+    self->priv->unresponsive_until = 0;
+    g_signal_emit (self, signals[S_RESPONSIVENESS_CHANGED], 0);
+    return FALSE;
+}
+
+static void
+mcd_client_proxy_handler_replied (McdClientProxy *self,
+                                  const GError *error)
+{
+    if (g_error_matches (error, DBUS_GERROR, DBUS_GERROR_NO_REPLY))
+    {
+        if (++self->priv->handler_timeouts < MAX_CONSECUTIVE_HANDLER_TIMEOUTS)
+            return;
+
+        DEBUG ("%s timed out %u times in a row, deprioritizing it",
+               tp_proxy_get_bus_name (self), self->priv->handler_timeouts);
+
+        if (self->priv->unresponsive_source != 0)
+            g_source_remove (self->priv->unresponsive_source);
+
+        self->priv->unresponsive_until = g_get_monotonic_time () +
+            UNRESPONSIVE_PENALTY_USEC;
+        self->priv->unresponsive_source = g_timeout_add_seconds (
+            UNRESPONSIVE_PENALTY_USEC / G_USEC_PER_SEC,
+            mcd_client_proxy_penalty_expired_cb, self);
+        g_signal_emit (self, signals[S_RESPONSIVENESS_CHANGED], 0);
+    }
+    else
+    {
+        self->priv->handler_timeouts = 0;
+
+        if (self->priv->unresponsive_until != 0)
         {
-            if (assume_requested &&
-                ! tp_strdiff (property_name, TP_IFACE_CHANNEL ".Requested"))
-            {
-                if (! G_VALUE_HOLDS_BOOLEAN (filter_value) ||
-                    ! g_value_get_boolean (filter_value))
-                {
-                    filter_matched = FALSE;
-                    break;
-                }
-            }
-            else if (! _mcd_client_match_property (channel_properties,
-                                                   property_name,
-                                                   filter_value))
+            DEBUG ("%s replied again", tp_proxy_get_bus_name (self));
+
+            if (self->priv->unresponsive_source != 0)
             {
-                filter_matched = FALSE;
-                break;
+                g_source_remove (self->priv->unresponsive_source);
+                self->priv->unresponsive_source = 0;
             }
-        }
 
-        if (filter_matched)
-        {
-            best_quality = quality;
+            self->priv->unresponsive_until = 0;
+            g_signal_emit (self, signals[S_RESPONSIVENESS_CHANGED], 0);
         }
     }
+}
 
-    return best_quality;
+static void
+mcd_client_proxy_start_service_cb (TpDBusDaemon *dbus_daemon,
+                                   guint result,
+                                   const GError *error,
+                                   gpointer user_data,
+                                   GObject *weak_object)
+{
+    McdClientProxy *self = MCD_CLIENT_PROXY (weak_object);
+
+    self->priv->preactivating = FALSE;
+
+    if (error != NULL)
+        DEBUG ("failed to pre-activate %s: %s", tp_proxy_get_bus_name (self),
+               error->message);
+    else
+        DEBUG ("pre-activated %s", tp_proxy_get_bus_name (self));
+}
+
+/*
+ * _mcd_client_proxy_preactivate:
+ *
+ * If pre-activation is enabled by MC_PREACTIVATE_HANDLERS, @self is an
+ * activatable Handler that is not running, and its .client file has
+ * X-MissionControl-Preactivate=true, start activating it now, so that it
+ * is more likely to be ready by the time we call HandleChannels.
+ *
+ * Returns: %TRUE if activation was started
+ */
+gboolean
+_mcd_client_proxy_preactivate (McdClientProxy *self)
+{
+    static gint enabled = -1;
+
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), FALSE);
+
+    if (G_UNLIKELY (enabled < 0))
+        enabled = mcd_env_flag_enabled ("MC_PREACTIVATE_HANDLERS");
+
+    if (!enabled || !self->priv->preactivate || self->priv->preactivating ||
+        !self->priv->activatable || _mcd_client_proxy_is_active (self))
+        return FALSE;
+
+    DEBUG ("pre-activating %s", tp_proxy_get_bus_name (self));
+    self->priv->preactivating = TRUE;
+    tp_cli_dbus_daemon_call_start_service_by_name (
+        tp_proxy_get_dbus_daemon (self), -1, tp_proxy_get_bus_name (self), 0,
+        mcd_client_proxy_start_service_cb, NULL, NULL, (GObject *) self);
+    return TRUE;
+}
+
+/*
+ * _mcd_client_proxy_get_unresponsive_until:
+ *
+ * Returns: the monotonic time until which @self should only be chosen as a
+ *  Handler if nothing else will do, or 0 if it is not being avoided.
+ *  When that time comes, it goes back to 0 and responsiveness-changed is
+ *  emitted.
+ */
+gint64
+_mcd_client_proxy_get_unresponsive_until (McdClientProxy *self)
+{
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), 0);
+
+    return self->priv->unresponsive_until;
+}
+
+/*
+ * _mcd_client_proxy_get_handler_timeout:
+ *
+ * Returns: the timeout in milliseconds for a call to HandleChannels on
+ *  @self, or -1 for the D-Bus default
+ */
+gint
+_mcd_client_proxy_get_handler_timeout (McdClientProxy *self)
+{
+    gint64 p99;
+
+    g_return_val_if_fail (MCD_IS_CLIENT_PROXY (self), -1);
+
+    /* if the call will activate it, give it as long as it needs to start */
+    if (!_mcd_client_proxy_is_active (self))
+        return -1;
+
+    p99 = mcd_stats_get_client_percentile (tp_proxy_get_bus_name (self),
+        MCD_STATS_CALL_HANDLE_CHANNELS, 0.99, HANDLER_TIMEOUT_MIN_SAMPLES);
+
+    if (p99 < 0)
+        return -1;
+
+    return (gint) CLAMP (p99 * HANDLER_TIMEOUT_FACTOR / 1000,
+                         HANDLER_TIMEOUT_FLOOR_MS,
+                         HANDLER_TIMEOUT_CEILING_MS);
+}
+
+static void
+mcd_client_call_cb (TpClient *client,
+                    const GError *error,
+                    gpointer user_data,
+                    GObject *weak_object)
+{
+    McdClientCall *call = user_data;
+
+    mcd_stats_record_client_call (tp_proxy_get_bus_name (client),
+        call->stats_call, g_get_monotonic_time () - call->started,
+        error != NULL);
+
+    if (call->stats_call == MCD_STATS_CALL_HANDLE_CHANNELS)
+        mcd_client_proxy_handler_replied (MCD_CLIENT_PROXY (client), error);
+
+    if (call->callback != NULL)
+        call->callback (client, error, call->user_data, weak_object);
+}
+
+static void
+mcd_client_call_free (gpointer p)
+{
+    McdClientCall *call = p;
+
+    if (call->destroy != NULL)
+        call->destroy (call->user_data);
+
+    g_slice_free (McdClientCall, call);
+}
+
+void
+_mcd_client_proxy_observe_channels (McdClientProxy *self,
+    gint timeout_ms,
+    const gchar *account_path,
+    const gchar *connection_path,
+    const GPtrArray *channels,
+    const gchar *dispatch_operation_path,
+    const GPtrArray *requests_satisfied,
+    GHashTable *observer_info,
+    tp_cli_client_observer_callback_for_observe_channels callback,
+    gpointer user_data,
+    GDestroyNotify destroy,
+    GObject *weak_object)
+{
+    McdClientCall *call;
+
+    g_return_if_fail (MCD_IS_CLIENT_PROXY (self));
+
+    call = mcd_client_call_new (MCD_STATS_CALL_OBSERVE_CHANNELS, callback,
+                                user_data, destroy);
+    tp_cli_client_observer_call_observe_channels ((TpClient *) self,
+        timeout_ms, account_path, connection_path, channels,
+        dispatch_operation_path, requests_satisfied, observer_info,
+        mcd_client_call_cb, call, mcd_client_call_free, weak_object);
+}
+
+void
+_mcd_client_proxy_add_dispatch_operation (McdClientProxy *self,
+    gint timeout_ms,
+    const GPtrArray *channels,
+    const gchar *dispatch_operation_path,
+    GHashTable *properties,
+    tp_cli_client_approver_callback_for_add_dispatch_operation callback,
+    gpointer user_data,
+    GDestroyNotify destroy,
+    GObject *weak_object)
+{
+    McdClientCall *call;
+
+    g_return_if_fail (MCD_IS_CLIENT_PROXY (self));
+
+    call = mcd_client_call_new (MCD_STATS_CALL_ADD_DISPATCH_OPERATION,
+                                callback, user_data, destroy);
+    tp_cli_client_approver_call_add_dispatch_operation ((TpClient *) self,
+        timeout_ms, channels, dispatch_operation_path, properties,
+        mcd_client_call_cb, call, mcd_client_call_free, weak_object);
 }
 
 static const gchar *
@@ -1653,6 +2548,7 @@ _mcd_client_proxy_handle_channels (McdClientProxy *self,
     GPtrArray *channel_details;
     GPtrArray *requests_satisfied;
     const GList *iter;
+    McdClientCall *call;
 
     g_return_if_fail (MCD_IS_CLIENT_PROXY (self));
     g_return_if_fail (channels != NULL);
@@ -1701,11 +2597,13 @@ _mcd_client_proxy_handle_channels (McdClientProxy *self,
                                  MCD_CHANNEL_STATUS_HANDLER_INVOKED);
     }
 
+    call = mcd_client_call_new (MCD_STATS_CALL_HANDLE_CHANNELS, callback,
+                                user_data, destroy);
     tp_cli_client_handler_call_handle_channels ((TpClient *) self,
         timeout_ms, borrow_channel_account_path (channels->data),
         borrow_channel_connection_path (channels->data), channel_details,
         requests_satisfied, user_action_time, handler_info,
-        callback, user_data, destroy, weak_object);
+        mcd_client_call_cb, call, mcd_client_call_free, weak_object);
 
     _mcd_tp_channel_details_free (channel_details);
     g_ptr_array_unref (requests_satisfied);
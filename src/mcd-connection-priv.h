@@ -45,6 +45,9 @@ void _mcd_connection_set_tp_connection (McdConnection *connection,
 G_GNUC_INTERNAL void _mcd_connection_start_dispatching (McdConnection *self,
     GPtrArray *client_caps);
 
+G_GNUC_INTERNAL void _mcd_connection_recover_handled_channels (
+    McdConnection *self);
+
 G_GNUC_INTERNAL gboolean _mcd_connection_is_ready (McdConnection *self);
 
 G_GNUC_INTERNAL void _mcd_connection_set_avatar (McdConnection *self,
@@ -64,6 +67,31 @@ G_GNUC_INTERNAL gboolean _mcd_connection_target_id_is_urgent (McdConnection *con
 G_GNUC_INTERNAL gboolean _mcd_connection_target_handle_is_urgent (McdConnection *self,
     guint handle);
 
+/* Statistics of the CreateChannel/EnsureChannel pipeline; times are in
+ * microseconds */
+typedef struct {
+    guint queued;
+    guint in_flight;
+    guint max_queued;
+    guint64 n_sent;
+    guint64 n_replied;
+    /* EnsureChannel requests that waited for an identical one instead */
+    guint64 n_coalesced;
+    /* requests that left the queue to be sent or coalesced, and how long
+     * they were queued for */
+    guint64 n_waited;
+    gint64 total_wait;
+    gint64 max_wait;
+    gint64 total_round_trip;
+    gint64 max_round_trip;
+} McdConnectionRequestStats;
+
+G_GNUC_INTERNAL void _mcd_connection_get_request_stats (McdConnection *self,
+    McdConnectionRequestStats *stats);
+
+G_GNUC_INTERNAL gsize _mcd_connection_get_retained_bytes (
+    McdConnection *self);
+
 G_END_DECLS
 
 #endif
@@ -46,11 +46,13 @@
 #include <glib/gstdio.h>
 #include <gio/gio.h>
 
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <dlfcn.h>
 
 #include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
@@ -63,12 +65,19 @@
 #include "mcd-channel.h"
 #include "mcd-misc.h"
 #include "mcd-slacker.h"
-#include "sp_timestamp.h"
+#include "mcd-trace.h"
 
 #define INITIAL_RECONNECTION_TIME   3 /* seconds */
 #define RECONNECTION_MULTIPLIER     3
 #define MAXIMUM_RECONNECTION_TIME   30 * 60 /* half an hour */
 
+/* Timeout for CreateChannel and EnsureChannel: some channels can't be
+ * returned until the remote side reacts, so this is 5 hours */
+#define REQUEST_TIMEOUT_MS (5 * 3600 * 1000)
+/* Default limit on concurrent CreateChannel/EnsureChannel calls to the CM;
+ * can be overridden with MC_MAX_CHANNEL_REQUESTS, where 0 means no limit */
+#define DEFAULT_MAX_REQUESTS_IN_FLIGHT 16
+
 #define MCD_CONNECTION_PRIV(mcdconn) (MCD_CONNECTION (mcdconn)->priv)
 
 G_DEFINE_TYPE (McdConnection, mcd_connection, MCD_TYPE_OPERATION);
@@ -134,8 +143,39 @@ struct _McdConnectionPrivate
     /* Emergency service points' identifiers.
      * Set of (transfer full) (type utf8), lazily-allocated. */
     GHashTable *service_point_ids;
+
+    /* Channel requests waiting to be sent to the CM, oldest first; those
+     * with a user action time go before the others.
+     * Owned QueuedRequest */
+    GQueue urgent_requests;
+    GQueue background_requests;
+    /* number of CreateChannel/EnsureChannel calls awaiting a reply */
+    guint requests_in_flight;
+    /* 0 means unlimited */
+    guint max_requests_in_flight;
+    /* EnsureChannel calls awaiting a reply:
+     * borrowed request key => borrowed InFlightRequest */
+    GHashTable *ensures_in_flight;
+    McdConnectionRequestStats request_stats;
 };
 
+typedef struct
+{
+    McdChannel *channel;
+    gint64 queued_at;
+} QueuedRequest;
+
+typedef struct
+{
+    TpWeakRef *connection;
+    gint64 sent_at;
+    /* for EnsureChannel, the key in ensures_in_flight */
+    gchar *key;
+    /* owned McdChannel for identical EnsureChannel requests that will be
+     * satisfied by the reply to this one */
+    GList *followers;
+} InFlightRequest;
+
 typedef struct
 {
     TpConnectionPresenceType presence;
@@ -177,6 +217,8 @@ static void _mcd_connection_release_tp_connection (McdConnection *connection,
                                                    gboolean already_signalled);
 static gboolean request_channel_new_iface (McdConnection *connection,
                                            McdChannel *channel);
+static void mcd_connection_send_queued_requests (McdConnection *self);
+static void mcd_connection_fail_queued_requests (McdConnection *self);
 
 static void
 mcd_presence_info_free (McdPresenceInfo *pi)
@@ -767,26 +809,25 @@ _mcd_connection_request_channel (McdConnection *connection,
                                  McdChannel *channel);
 
 static void
-request_unrequested_channels (McdConnection *connection)
+request_unrequested_channel (McdChannel *channel,
+                             McdConnection *connection)
 {
-    const GList *channels;
-
-    channels = mcd_operation_get_missions ((McdOperation *)connection);
+    if (mcd_channel_get_status (channel) == MCD_CHANNEL_STATUS_REQUEST)
+    {
+        DEBUG ("Requesting channel %p", channel);
+        mcd_connection_request_channel (connection, channel);
+    }
+}
 
+static void
+request_unrequested_channels (McdConnection *connection)
+{
     DEBUG ("called");
     /* go through the channels that were requested while the connection was not
-     * ready, and process them */
-    while (channels)
-    {
-	McdChannel *channel = MCD_CHANNEL (channels->data);
-
-        if (mcd_channel_get_status (channel) == MCD_CHANNEL_STATUS_REQUEST)
-        {
-            DEBUG ("Requesting channel %p", channel);
-            mcd_connection_request_channel (connection, channel);
-        }
-        channels = channels->next;
-    }
+     * ready, and process them; a request can fail immediately and abort its
+     * channel, so this has to use the removal-safe iteration */
+    mcd_operation_foreach ((McdOperation *) connection,
+                           (GFunc) request_unrequested_channel, connection);
 }
 
 McdChannel *
@@ -815,6 +856,31 @@ static gboolean mcd_connection_need_dispatch (McdConnection *connection,
                                               const gchar *object_path,
                                               GHashTable *props);
 
+/* The properties that are enough to tell channels apart in the debug log;
+ * the full set is available from the channel itself */
+static void
+mcd_connection_debug_channel (const gchar *object_path,
+                              GHashTable *props)
+{
+    const gchar *channel_type;
+    const gchar *target_id;
+
+    if (!DEBUGGING)
+        return;
+
+    /* a broken CM might leave these out, and not every printf copes */
+    channel_type = tp_asv_get_string (props, TP_PROP_CHANNEL_CHANNEL_TYPE);
+    target_id = tp_asv_get_string (props, TP_PROP_CHANNEL_TARGET_ID);
+
+    DEBUG ("%s: %s, %s %u (%s), requested=%d", object_path,
+           channel_type != NULL ? channel_type : "(null)",
+           tp_asv_get_uint32 (props, TP_PROP_CHANNEL_TARGET_HANDLE_TYPE,
+                              NULL) == TP_HANDLE_TYPE_ROOM ? "room" : "handle",
+           tp_asv_get_uint32 (props, TP_PROP_CHANNEL_TARGET_HANDLE, NULL),
+           target_id != NULL ? target_id : "(null)",
+           tp_asv_get_boolean (props, TP_PROP_CHANNEL_REQUESTED, NULL));
+}
+
 static void
 on_new_channels (TpConnection *proxy, const GPtrArray *channels,
                  gpointer user_data, GObject *weak_object)
@@ -823,35 +889,20 @@ on_new_channels (TpConnection *proxy, const GPtrArray *channels,
     McdConnectionPrivate *priv = user_data;
     guint i;
 
-    if (DEBUGGING)
+    /* we can completely ignore the channels that arrive while this is
+     * FALSE: they'll also be in Channels in the GetAll(Requests) result */
+    if (!priv->dispatched_initial_channels)
     {
-        for (i = 0; i < channels->len; i++)
-        {
-            GValueArray *va = g_ptr_array_index (channels, i);
-            const gchar *object_path = g_value_get_boxed (va->values);
-            GHashTable *props = g_value_get_boxed (va->values + 1);
-            GHashTableIter iter;
-            gpointer k, v;
-
-            DEBUG ("%s", object_path);
-
-            g_hash_table_iter_init (&iter, props);
-
-            while (g_hash_table_iter_next (&iter, &k, &v))
-            {
-                gchar *repr = g_strdup_value_contents (v);
-
-                DEBUG("  \"%s\" => %s", (const gchar *) k, repr);
-                g_free (repr);
-            }
-        }
+        DEBUG ("ignoring %u channel(s) until initial channels are known",
+               channels->len);
+        return;
     }
 
-    /* we can completely ignore the channels that arrive while this is
-     * FALSE: they'll also be in Channels in the GetAll(Requests) result */
-    if (!priv->dispatched_initial_channels) return;
+    /* a burst of channels (offline messages, joining a conference...) is
+     * likely to contain many channels that match the same clients */
+    if (channels->len > 1)
+        _mcd_dispatcher_begin_batch (priv->dispatcher);
 
-    sp_timestamp ("NewChannels received");
     for (i = 0; i < channels->len; i++)
     {
         GValueArray *va;
@@ -866,6 +917,8 @@ on_new_channels (TpConnection *proxy, const GPtrArray *channels,
         object_path = g_value_get_boxed (va->values);
         props = g_value_get_boxed (va->values + 1);
 
+        mcd_connection_debug_channel (object_path, props);
+
         only_observe = !mcd_connection_need_dispatch (connection, object_path,
                                                       props);
 
@@ -887,6 +940,10 @@ on_new_channels (TpConnection *proxy, const GPtrArray *channels,
                                         MCD_MISSION (channel));
         }
 
+        MCD_TRACE (MCD_TRACE_CHANNEL_ARRIVED, channel,
+                   g_intern_string (tp_asv_get_string (props,
+                       TP_PROP_CHANNEL_CHANNEL_TYPE)));
+
         if (!requested)
         {
             /* we always dispatch unrequested (incoming) channels */
@@ -896,6 +953,9 @@ on_new_channels (TpConnection *proxy, const GPtrArray *channels,
         _mcd_dispatcher_add_channel (priv->dispatcher, channel, requested,
                                      only_observe);
     }
+
+    if (channels->len > 1)
+        _mcd_dispatcher_end_batch (priv->dispatcher);
 }
 
 static void
@@ -927,10 +987,9 @@ mcd_connection_found_channel (McdConnection *self,
     gboolean found = FALSE;
 
     /* find the McdChannel */
-    /* NOTE: we cannot move the mcd_operation_get_missions() call out of
-     * the loop, because mcd_dispatcher_send() can cause the channel to be
-     * destroyed, at which point our list would contain a finalized channel
-     * (and a crash will happen) */
+    /* NOTE: nothing in this loop may cause a channel to be aborted, because
+     * we are walking the live list of children; anything that can do that
+     * must use mcd_operation_foreach(), which tolerates removal */
     list = mcd_operation_get_missions ((McdOperation *) self);
     for (; list != NULL; list = list->next)
     {
@@ -957,6 +1016,62 @@ mcd_connection_found_channel (McdConnection *self,
     }
 }
 
+/*
+ * Returns: (transfer none): the Requests.Channels property in @properties,
+ *  or %NULL if it is missing or malformed
+ */
+static GPtrArray *
+mcd_connection_get_channels_property (TpProxy *proxy,
+                                      GHashTable *properties)
+{
+    GValue *value = g_hash_table_lookup (properties, "Channels");
+
+    if (value == NULL)
+    {
+        g_warning ("%s: no Channels property on %s",
+                   G_STRFUNC, tp_proxy_get_object_path (proxy));
+        return NULL;
+    }
+
+    if (!G_VALUE_HOLDS (value, TP_ARRAY_TYPE_CHANNEL_DETAILS_LIST))
+    {
+        g_warning ("%s: property Channels has type %s, expecting %s",
+                   G_STRFUNC, G_VALUE_TYPE_NAME (value),
+                   g_type_name (TP_ARRAY_TYPE_CHANNEL_DETAILS_LIST));
+        return NULL;
+    }
+
+    return g_value_get_boxed (value);
+}
+
+/* Now that we know which channels the connection has, forget any channels
+ * of this account that the handler map snapshot restored, but which have
+ * closed since */
+static void
+mcd_connection_prune_restored_channels (McdConnection *self,
+                                        GPtrArray *channels)
+{
+    GHashTable *live_paths;
+    guint i;
+
+    /* if we're not connected, Channels doesn't tell us anything */
+    if (!_mcd_connection_is_ready (self))
+        return;
+
+    live_paths = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < channels->len; i++)
+    {
+        GValueArray *va = g_ptr_array_index (channels, i);
+
+        g_hash_table_add (live_paths, g_value_get_boxed (va->values));
+    }
+
+    _mcd_dispatcher_prune_restored_channels (self->priv->dispatcher,
+        mcd_account_get_object_path (self->priv->account), live_paths);
+    g_hash_table_unref (live_paths);
+}
+
 static void get_all_requests_cb (TpProxy *proxy, GHashTable *properties,
                                  const GError *error, gpointer user_data,
                                  GObject *weak_object)
@@ -964,7 +1079,6 @@ static void get_all_requests_cb (TpProxy *proxy, GHashTable *properties,
     McdConnection *connection = MCD_CONNECTION (weak_object);
     McdConnectionPrivate *priv = user_data;
     GPtrArray *channels;
-    GValue *value;
     guint i;
 
     if (error)
@@ -973,24 +1087,13 @@ static void get_all_requests_cb (TpProxy *proxy, GHashTable *properties,
         return;
     }
 
-    value = g_hash_table_lookup (properties, "Channels");
+    channels = mcd_connection_get_channels_property (proxy, properties);
 
-    if (value == NULL)
-    {
-        g_warning ("%s: no Channels property on %s",
-                   G_STRFUNC, tp_proxy_get_object_path (proxy));
+    if (channels == NULL)
         return;
-    }
 
-    if (!G_VALUE_HOLDS (value, TP_ARRAY_TYPE_CHANNEL_DETAILS_LIST))
-    {
-        g_warning ("%s: property Channels has type %s, expecting %s",
-                   G_STRFUNC, G_VALUE_TYPE_NAME (value),
-                   g_type_name (TP_ARRAY_TYPE_CHANNEL_DETAILS_LIST));
-        return;
-    }
+    mcd_connection_prune_restored_channels (connection, channels);
 
-    channels = g_value_get_boxed (value);
     for (i = 0; i < channels->len; i++)
     {
         GValueArray *va;
@@ -1001,28 +1104,69 @@ static void get_all_requests_cb (TpProxy *proxy, GHashTable *properties,
         object_path = g_value_get_boxed (va->values);
         channel_props = g_value_get_boxed (va->values + 1);
 
-        if (DEBUGGING)
-        {
-            GHashTableIter iter;
-            gpointer k, v;
+        mcd_connection_debug_channel (object_path, channel_props);
+
+        mcd_connection_found_channel (connection, object_path, channel_props);
+    }
 
-            DEBUG ("%s", object_path);
+    priv->dispatched_initial_channels = TRUE;
+}
 
-            g_hash_table_iter_init (&iter, channel_props);
+static void
+get_handled_channels_cb (TpProxy *proxy,
+                         GHashTable *properties,
+                         const GError *error,
+                         gpointer user_data G_GNUC_UNUSED,
+                         GObject *weak_object)
+{
+    McdConnection *self = MCD_CONNECTION (weak_object);
+    GPtrArray *channels;
+    guint i;
 
-            while (g_hash_table_iter_next (&iter, &k, &v))
-            {
-                gchar *repr = g_strdup_value_contents (v);
+    if (error)
+    {
+        DEBUG ("not recovering channels early: %s", error->message);
+        return;
+    }
 
-                DEBUG("  \"%s\" => %s", (const gchar *) k, repr);
-                g_free (repr);
-            }
-        }
+    channels = mcd_connection_get_channels_property (proxy, properties);
 
-        mcd_connection_found_channel (connection, object_path, channel_props);
+    if (channels == NULL)
+        return;
+
+    mcd_connection_prune_restored_channels (self, channels);
+
+    for (i = 0; i < channels->len; i++)
+    {
+        GValueArray *va = g_ptr_array_index (channels, i);
+        const gchar *object_path = g_value_get_boxed (va->values);
+
+        /* the rest will be recovered when dispatching starts */
+        if (_mcd_dispatcher_channel_has_handler (self->priv->dispatcher,
+                                                 object_path))
+            mcd_connection_found_channel (self, object_path,
+                                          g_value_get_boxed (va->values + 1));
     }
+}
 
-    priv->dispatched_initial_channels = TRUE;
+/*
+ * _mcd_connection_recover_handled_channels:
+ *
+ * Before dispatching has started, recover the channels that the dispatcher
+ * already knows to be handled, from the snapshot of the handler map left
+ * by a previous instance of MC.
+ */
+void
+_mcd_connection_recover_handled_channels (McdConnection *self)
+{
+    g_return_if_fail (MCD_IS_CONNECTION (self));
+    g_return_if_fail (self->priv->tp_conn != NULL);
+
+    DEBUG ("%p", self);
+
+    tp_cli_dbus_properties_call_get_all (self->priv->tp_conn, -1,
+        TP_IFACE_CONNECTION_INTERFACE_REQUESTS,
+        get_handled_channels_cb, NULL, NULL, (GObject *) self);
 }
 
 static void
@@ -1290,8 +1434,6 @@ mcd_connection_early_get_interfaces_cb (TpProxy *proxy,
                 if (client_caps != NULL)
                 {
                     _mcd_connection_update_client_caps (self, client_caps);
-                    g_ptr_array_foreach (client_caps,
-                                         (GFunc) g_value_array_free, NULL);
                     g_ptr_array_unref (client_caps);
                 }
                 /* else the McdDispatcher hasn't sorted itself out yet, so
@@ -1490,6 +1632,7 @@ _mcd_connection_finalize (GObject * object)
 
     tp_clear_pointer (&priv->service_point_handles, tp_intset_destroy);
     tp_clear_pointer (&priv->service_point_ids, g_hash_table_unref);
+    tp_clear_pointer (&priv->ensures_in_flight, g_hash_table_unref);
 
     G_OBJECT_CLASS (mcd_connection_parent_class)->finalize (object);
 }
@@ -1551,6 +1694,8 @@ _mcd_connection_release_tp_connection (McdConnection *connection,
         tp_clear_object (&priv->tp_conn);
     }
 
+    mcd_connection_fail_queued_requests (connection);
+
     if (priv->recognized_presences)
         g_hash_table_remove_all (priv->recognized_presences);
 
@@ -1605,6 +1750,23 @@ _mcd_connection_dispose (GObject * object)
 
     priv->is_disposed = TRUE;
 
+    if (priv->request_stats.n_sent > 0)
+    {
+        McdConnectionRequestStats *stats = &priv->request_stats;
+
+        DEBUG ("%" G_GUINT64_FORMAT " channel requests; max queue %u, "
+               "mean wait %" G_GINT64_FORMAT "us, max wait %" G_GINT64_FORMAT
+               "us; mean round trip %" G_GINT64_FORMAT "us, max round trip %"
+               G_GINT64_FORMAT "us; %" G_GUINT64_FORMAT " coalesced",
+               stats->n_sent, stats->max_queued,
+               stats->n_waited > 0 ?
+                   stats->total_wait / (gint64) stats->n_waited : 0,
+               stats->max_wait,
+               stats->n_replied > 0 ?
+                   stats->total_round_trip / (gint64) stats->n_replied : 0,
+               stats->max_round_trip, stats->n_coalesced);
+    }
+
     if (priv->probation_timer)
     {
         g_source_remove (priv->probation_timer);
@@ -1821,7 +1983,11 @@ _mcd_connection_request_channel (McdConnection *connection,
     }
 
     if (ret)
+    {
         _mcd_channel_set_status (channel, MCD_CHANNEL_STATUS_REQUESTED);
+        mcd_connection_send_queued_requests (connection);
+    }
+
     return ret;
 }
 
@@ -1903,6 +2069,50 @@ mcd_connection_class_init (McdConnectionClass * klass)
         G_TYPE_NONE, 0);
 }
 
+/* Merging identical EnsureChannel calls changes what the CM sees (one
+ * call, with Yours set at most once), so it's opt-in */
+static gboolean
+coalesce_ensure_channel (void)
+{
+    static gint enabled = -1;
+
+    if (G_UNLIKELY (enabled < 0))
+        enabled = mcd_env_flag_enabled ("MC_COALESCE_ENSURE_CHANNEL");
+
+    return enabled;
+}
+
+static guint
+get_max_requests_in_flight (void)
+{
+    static gsize once = 0;
+    static guint max = DEFAULT_MAX_REQUESTS_IN_FLIGHT;
+
+    if (g_once_init_enter (&once))
+    {
+        const gchar *env = g_getenv ("MC_MAX_CHANNEL_REQUESTS");
+
+        if (env != NULL)
+        {
+            guint64 u;
+            gchar *endptr;
+
+            errno = 0;
+            u = g_ascii_strtoull (env, &endptr, 10);
+
+            if (errno != 0 || endptr == env || *endptr != '\0' ||
+                u > G_MAXUINT)
+                WARNING ("ignoring invalid MC_MAX_CHANNEL_REQUESTS=%s", env);
+            else
+                max = (guint) u;
+        }
+
+        g_once_init_leave (&once, 1);
+    }
+
+    return max;
+}
+
 static void
 mcd_connection_init (McdConnection * connection)
 {
@@ -1915,6 +2125,11 @@ mcd_connection_init (McdConnection * connection)
     priv->abort_reason = TP_CONNECTION_STATUS_REASON_NONE_SPECIFIED;
 
     priv->reconnect_interval = INITIAL_RECONNECTION_TIME;
+
+    g_queue_init (&priv->urgent_requests);
+    g_queue_init (&priv->background_requests);
+    priv->max_requests_in_flight = get_max_requests_in_flight ();
+    priv->ensures_in_flight = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
 /* Public methods */
@@ -1928,13 +2143,187 @@ mcd_connection_get_account (McdConnection * id)
     return priv->account;
 }
 
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+    return strcmp (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+/*
+ * Returns: a string that is the same for any two requests with the same
+ *  properties, whatever order they are stored in
+ */
+static gchar *
+dup_request_key (GHashTable *properties)
+{
+    GPtrArray *entries = g_ptr_array_new_with_free_func (g_free);
+    GHashTableIter iter;
+    gpointer k, v;
+    gchar *key;
+
+    g_hash_table_iter_init (&iter, properties);
+
+    while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+        GVariant *variant = g_variant_ref_sink (
+            dbus_g_value_build_g_variant (v));
+        gchar *printed = g_variant_print (variant, TRUE);
+
+        g_ptr_array_add (entries, g_strdup_printf ("%s=%s", (gchar *) k,
+                                                   printed));
+        g_free (printed);
+        g_variant_unref (variant);
+    }
+
+    g_ptr_array_sort (entries, compare_strings);
+    g_ptr_array_add (entries, NULL);
+    key = g_strjoinv ("\n", (gchar **) entries->pdata);
+    g_ptr_array_unref (entries);
+    return key;
+}
+
+/* @req's EnsureChannel call has been answered, or will never be: other
+ * identical requests should make their own call from now on */
+static void
+in_flight_request_forget (McdConnection *self,
+                          InFlightRequest *req)
+{
+    if (req->key != NULL && self->priv->ensures_in_flight != NULL &&
+        g_hash_table_lookup (self->priv->ensures_in_flight, req->key) == req)
+        g_hash_table_remove (self->priv->ensures_in_flight, req->key);
+}
+
+static void
+in_flight_request_free (gpointer p)
+{
+    InFlightRequest *req = p;
+    McdConnection *connection = tp_weak_ref_dup_object (req->connection);
+    GList *followers = req->followers;
+    GList *l;
+
+    req->followers = NULL;
+
+    /* this is called exactly once per call, whether it was answered,
+     * cancelled because the McdChannel died, or invalidated along with
+     * the TpConnection */
+    if (connection != NULL)
+    {
+        in_flight_request_forget (connection, req);
+
+        /* if any requests were waiting for this one but were not satisfied
+         * by it, because its McdChannel died or was cancelled, they go back
+         * in the queue to make their own call */
+        for (l = followers; l != NULL; l = l->next)
+            request_channel_new_iface (connection, l->data);
+
+        connection->priv->requests_in_flight--;
+        mcd_connection_send_queued_requests (connection);
+        g_object_unref (connection);
+    }
+    else
+    {
+        for (l = followers; l != NULL; l = l->next)
+        {
+            if (mcd_channel_get_status (l->data) ==
+                MCD_CHANNEL_STATUS_REQUESTED)
+            {
+                mcd_channel_take_error (l->data,
+                    g_error_new (TP_ERROR, TP_ERROR_DISCONNECTED,
+                                 "Connection went away before the request "
+                                 "could be made"));
+                mcd_mission_abort (l->data);
+            }
+        }
+    }
+
+    g_list_free_full (followers, g_object_unref);
+    g_free (req->key);
+    tp_weak_ref_destroy (req->connection);
+    g_slice_free (InFlightRequest, req);
+}
+
+/* Complete the requests that were waiting for @req's EnsureChannel call
+ * from its result */
+static void
+mcd_connection_complete_followers (McdConnection *self,
+                                   InFlightRequest *req,
+                                   const gchar *channel_path,
+                                   const GError *error)
+{
+    McdChannel *existing = NULL;
+    GList *followers = req->followers;
+    GList *l;
+
+    req->followers = NULL;
+
+    if (error == NULL)
+        existing = mcd_connection_find_channel_by_path (self, channel_path);
+
+    for (l = followers; l != NULL; l = l->next)
+    {
+        McdChannel *follower = l->data;
+
+        if (mcd_channel_get_status (follower) == MCD_CHANNEL_STATUS_FAILED)
+        {
+            DEBUG ("Channel %p was cancelled while waiting, never mind",
+                   follower);
+            _mcd_channel_close (follower);
+            mcd_mission_abort (MCD_MISSION (follower));
+        }
+        else if (mcd_channel_get_status (follower) !=
+                 MCD_CHANNEL_STATUS_REQUESTED)
+        {
+            DEBUG ("Channel %p is no longer waiting", follower);
+        }
+        else if (existing != NULL)
+        {
+            DEBUG ("Channel %p is satisfied by %p", follower, existing);
+            _mcd_dispatcher_add_channel_request (self->priv->dispatcher,
+                                                 existing, follower);
+        }
+        else
+        {
+            mcd_channel_take_error (follower, error != NULL ?
+                g_error_copy (error) :
+                g_error_new_literal (TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+                                     "Channel request failed"));
+            mcd_mission_abort (MCD_MISSION (follower));
+        }
+    }
+
+    g_list_free_full (followers, g_object_unref);
+}
+
 static void
 common_request_channel_cb (TpConnection *proxy, gboolean yours,
                            const gchar *channel_path, GHashTable *properties,
                            const GError *error,
-                           McdConnection *connection, McdChannel *channel)
+                           InFlightRequest *req, McdChannel *channel)
 {
-    McdConnectionPrivate *priv = connection->priv;
+    McdConnection *connection;
+    McdConnectionPrivate *priv;
+    McdConnectionRequestStats *stats;
+    gint64 round_trip;
+    gboolean cancelled;
+
+    connection = tp_weak_ref_dup_object (req->connection);
+
+    if (connection == NULL)
+        return;
+
+    /* if the request was cancelled while we were waiting, the requests
+     * waiting for it are put back in the queue by in_flight_request_free() */
+    cancelled = (mcd_channel_get_status (channel) ==
+                 MCD_CHANNEL_STATUS_FAILED);
+    in_flight_request_forget (connection, req);
+
+    priv = connection->priv;
+    stats = &priv->request_stats;
+    round_trip = g_get_monotonic_time () - req->sent_at;
+    stats->n_replied++;
+    stats->total_round_trip += round_trip;
+    stats->max_round_trip = MAX (stats->max_round_trip, round_trip);
 
     if (error != NULL)
     {
@@ -1947,7 +2336,7 @@ common_request_channel_cb (TpConnection *proxy, gboolean yours,
         mc_error = g_error_copy (error);
         mcd_channel_take_error (channel, mc_error);
         mcd_mission_abort ((McdMission *)channel);
-        return;
+        goto finally;
     }
     DEBUG ("%p, object %s", channel, channel_path);
 
@@ -1964,7 +2353,7 @@ common_request_channel_cb (TpConnection *proxy, gboolean yours,
         {
             _mcd_dispatcher_add_channel_request (priv->dispatcher, existing,
                                                  channel);
-            return;
+            goto finally;
         }
     }
 
@@ -1973,7 +2362,7 @@ common_request_channel_cb (TpConnection *proxy, gboolean yours,
                                     channel_path, properties))
     {
         mcd_mission_abort ((McdMission *)channel);
-        return;
+        goto finally;
     }
 
     /* if the channel request was cancelled, abort the channel now */
@@ -1986,6 +2375,12 @@ common_request_channel_cb (TpConnection *proxy, gboolean yours,
 
     /* No dispatching here: the channel will be dispatched upon receiving the
      * NewChannels signal */
+finally:
+    if (!cancelled)
+        mcd_connection_complete_followers (connection, req, channel_path,
+                                           error);
+
+    g_object_unref (connection);
 }
 
 static void
@@ -1995,8 +2390,7 @@ ensure_channel_cb (TpConnection *proxy, gboolean yours,
                    gpointer user_data, GObject *weak_object)
 {
     common_request_channel_cb (proxy, yours, channel_path, properties, error,
-                               MCD_CONNECTION (user_data),
-                               MCD_CHANNEL (weak_object));
+                               user_data, MCD_CHANNEL (weak_object));
 }
 
 static void
@@ -2005,34 +2399,205 @@ create_channel_cb (TpConnection *proxy, const gchar *channel_path,
                    gpointer user_data, GObject *weak_object)
 {
     common_request_channel_cb (proxy, TRUE, channel_path, properties, error,
-                               MCD_CONNECTION (user_data),
-                               MCD_CHANNEL (weak_object));
+                               user_data, MCD_CHANNEL (weak_object));
 }
 
-static gboolean
-request_channel_new_iface (McdConnection *connection, McdChannel *channel)
+static void
+mcd_connection_send_request (McdConnection *self,
+                             McdChannel *channel)
 {
-    McdConnectionPrivate *priv = MCD_CONNECTION_PRIV (connection);
+    McdConnectionPrivate *priv = self->priv;
+    InFlightRequest *req;
     GHashTable *properties;
+    gchar *key = NULL;
 
     properties = _mcd_channel_get_requested_properties (channel);
+
+    /* if an identical EnsureChannel call is already in flight, its reply
+     * will do for this request too */
+    if (_mcd_channel_get_request_use_existing (channel) &&
+        coalesce_ensure_channel ())
+    {
+        key = dup_request_key (properties);
+        req = g_hash_table_lookup (priv->ensures_in_flight, key);
+
+        if (req != NULL)
+        {
+            DEBUG ("Channel %p waits for an identical EnsureChannel call",
+                   channel);
+            req->followers = g_list_append (req->followers,
+                                            g_object_ref (channel));
+            priv->request_stats.n_coalesced++;
+            g_free (key);
+            return;
+        }
+    }
+
+    req = g_slice_new0 (InFlightRequest);
+    req->connection = tp_weak_ref_new (self, NULL, NULL);
+    req->sent_at = g_get_monotonic_time ();
+
+    priv->requests_in_flight++;
+    priv->request_stats.n_sent++;
+
     if (_mcd_channel_get_request_use_existing (channel))
     {
-        /* Timeout of 5 hours: 5 * 3600 * 1000 */
+        if (key != NULL)
+        {
+            req->key = key;
+            g_hash_table_insert (priv->ensures_in_flight, req->key, req);
+        }
+
         tp_cli_connection_interface_requests_call_ensure_channel
-            (priv->tp_conn, 18000000, properties, ensure_channel_cb,
-             connection, NULL, (GObject *)channel);
+            (priv->tp_conn, REQUEST_TIMEOUT_MS, properties, ensure_channel_cb,
+             req, in_flight_request_free, (GObject *)channel);
     }
     else
     {
-        /* Timeout of 5 hours: 5 * 3600 * 1000 */
         tp_cli_connection_interface_requests_call_create_channel
-            (priv->tp_conn, 18000000, properties, create_channel_cb,
-             connection, NULL, (GObject *)channel);
+            (priv->tp_conn, REQUEST_TIMEOUT_MS, properties, create_channel_cb,
+             req, in_flight_request_free, (GObject *)channel);
+    }
+}
+
+static void
+mcd_connection_send_queued_requests (McdConnection *self)
+{
+    McdConnectionPrivate *priv = self->priv;
+    McdConnectionRequestStats *stats = &priv->request_stats;
+
+    while (priv->tp_conn != NULL &&
+           (priv->max_requests_in_flight == 0 ||
+            priv->requests_in_flight < priv->max_requests_in_flight))
+    {
+        QueuedRequest *queued;
+        gint64 wait;
+
+        queued = g_queue_pop_head (&priv->urgent_requests);
+
+        if (queued == NULL)
+            queued = g_queue_pop_head (&priv->background_requests);
+
+        if (queued == NULL)
+            break;
+
+        /* the request might have been cancelled, or the channel aborted
+         * along with its account, while it was waiting */
+        if (mcd_channel_get_status (queued->channel) ==
+            MCD_CHANNEL_STATUS_REQUESTED)
+        {
+            /* only requests that get sent (or coalesced) count towards the
+             * wait: the others weren't waiting for anything */
+            wait = g_get_monotonic_time () - queued->queued_at;
+            stats->n_waited++;
+            stats->total_wait += wait;
+            stats->max_wait = MAX (stats->max_wait, wait);
+
+            mcd_connection_send_request (self, queued->channel);
+        }
+        else if (mcd_channel_get_status (queued->channel) ==
+                 MCD_CHANNEL_STATUS_FAILED)
+        {
+            DEBUG ("Channel %p failed while queued, never mind",
+                   queued->channel);
+            _mcd_channel_close (queued->channel);
+            mcd_mission_abort (MCD_MISSION (queued->channel));
+        }
+
+        g_object_unref (queued->channel);
+        g_slice_free (QueuedRequest, queued);
     }
+}
+
+static void
+mcd_connection_fail_queued_requests (McdConnection *self)
+{
+    McdConnectionPrivate *priv = self->priv;
+    QueuedRequest *queued;
+
+    while ((queued = g_queue_pop_head (&priv->urgent_requests)) != NULL ||
+           (queued = g_queue_pop_head (&priv->background_requests)) != NULL)
+    {
+        if (mcd_channel_get_status (queued->channel) ==
+            MCD_CHANNEL_STATUS_REQUESTED)
+        {
+            mcd_channel_take_error (queued->channel,
+                g_error_new (TP_ERROR, TP_ERROR_DISCONNECTED,
+                             "Connection went away before the request could "
+                             "be made"));
+            mcd_mission_abort (MCD_MISSION (queued->channel));
+        }
+
+        g_object_unref (queued->channel);
+        g_slice_free (QueuedRequest, queued);
+    }
+}
+
+static gboolean
+request_channel_new_iface (McdConnection *connection, McdChannel *channel)
+{
+    McdConnectionPrivate *priv = MCD_CONNECTION_PRIV (connection);
+    McdRequest *request = _mcd_channel_get_request (channel);
+    QueuedRequest *queued;
+    guint depth;
+
+    queued = g_slice_new (QueuedRequest);
+    queued->channel = g_object_ref (channel);
+    queued->queued_at = g_get_monotonic_time ();
+
+    /* requests the user is waiting for overtake the others */
+    if (request != NULL &&
+        _mcd_request_get_user_action_time (request) !=
+            TP_USER_ACTION_TIME_NOT_USER_ACTION)
+        g_queue_push_tail (&priv->urgent_requests, queued);
+    else
+        g_queue_push_tail (&priv->background_requests, queued);
+
+    depth = priv->urgent_requests.length + priv->background_requests.length;
+    priv->request_stats.max_queued = MAX (priv->request_stats.max_queued,
+                                          depth);
+
+    /* the status becomes REQUESTED as soon as we return, which is what the
+     * queue expects; send the request after that */
     return TRUE;
 }
 
+void
+_mcd_connection_get_request_stats (McdConnection *self,
+                                   McdConnectionRequestStats *stats)
+{
+    McdConnectionPrivate *priv;
+
+    g_return_if_fail (MCD_IS_CONNECTION (self));
+    g_return_if_fail (stats != NULL);
+
+    priv = self->priv;
+    *stats = priv->request_stats;
+    stats->queued = priv->urgent_requests.length +
+        priv->background_requests.length;
+    stats->in_flight = priv->requests_in_flight;
+}
+
+/*
+ * _mcd_connection_get_retained_bytes:
+ * @self: the connection
+ *
+ * Returns: approximately how much memory @self holds on to itself, not
+ *  including its channels or its TpConnection
+ */
+gsize
+_mcd_connection_get_retained_bytes (McdConnection *self)
+{
+    McdConnectionPrivate *priv;
+
+    g_return_val_if_fail (MCD_IS_CONNECTION (self), 0);
+
+    priv = self->priv;
+    return sizeof (McdConnection) + sizeof (McdConnectionPrivate) +
+        (priv->urgent_requests.length + priv->background_requests.length) *
+        sizeof (GList);
+}
+
 gboolean
 mcd_connection_request_channel (McdConnection *connection,
                                 McdChannel *channel)
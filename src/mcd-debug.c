@@ -38,14 +38,23 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
 
+#include <dbus/dbus-glib.h>
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/telepathy-glib-dbus.h>
 
 #include <mission-control-plugins/mission-control-plugins.h>
 
 #include "mcd-debug.h"
+#include "mcd-channel-priv.h"
+#include "mcd-connection-priv.h"
+#include "mcd-dispatch-operation-priv.h"
+#include "mcd-dispatcher-priv.h"
+#include "mcd-master.h"
 #include "mcd-operation.h"
+#include "mcd-trace.h"
+#include "request.h"
 
 gint mcd_debug_level = 0;
 
@@ -83,12 +92,14 @@ mcd_debug_print_tree_real (gpointer object, gint level)
 
 typedef enum {
     MCD_DEBUG_MISC = 1 << 0,
-    MCD_DEBUG_TREES = 1 << 1
+    MCD_DEBUG_TREES = 1 << 1,
+    MCD_DEBUG_TRACE = 1 << 2
 } McdDebugCategory;
 
 static GDebugKey const keys[] = {
     { "misc", MCD_DEBUG_MISC },
     { "trees", MCD_DEBUG_TREES },
+    { "trace", MCD_DEBUG_TRACE },
     { NULL, 0 }
 };
 
@@ -108,6 +119,247 @@ mcd_debug_print_tree (gpointer object)
     }
 }
 
+gsize
+mcd_debug_estimate_string_size (const gchar *s)
+{
+    return (s != NULL ? strlen (s) + 1 : 0);
+}
+
+/*
+ * mcd_debug_estimate_value_size:
+ * @value: a GValue as found in a D-Bus property map
+ *
+ * Returns: approximately how much memory @value and its contents use. Only
+ *  the types commonly found in channel requests and hints are looked into.
+ */
+gsize
+mcd_debug_estimate_value_size (const GValue *value)
+{
+    gsize size = sizeof (GValue);
+    guint i;
+
+    if (G_VALUE_HOLDS_STRING (value))
+    {
+        size += mcd_debug_estimate_string_size (g_value_get_string (value));
+    }
+    else if (G_VALUE_HOLDS (value, DBUS_TYPE_G_OBJECT_PATH))
+    {
+        size += mcd_debug_estimate_string_size (g_value_get_boxed (value));
+    }
+    else if (G_VALUE_HOLDS (value, G_TYPE_STRV))
+    {
+        gchar **strv = g_value_get_boxed (value);
+
+        for (i = 0; strv != NULL && strv[i] != NULL; i++)
+            size += sizeof (gchar *) +
+                mcd_debug_estimate_string_size (strv[i]);
+    }
+    else if (G_VALUE_HOLDS (value, TP_HASH_TYPE_STRING_VARIANT_MAP))
+    {
+        size += mcd_debug_estimate_asv_size (g_value_get_boxed (value));
+    }
+    else if (G_VALUE_HOLDS (value, G_TYPE_VARIANT))
+    {
+        GVariant *variant = g_value_get_variant (value);
+
+        if (variant != NULL)
+            size += g_variant_get_size (variant);
+    }
+    else if (G_VALUE_HOLDS (value, TP_ARRAY_TYPE_OBJECT_PATH_LIST))
+    {
+        GPtrArray *paths = g_value_get_boxed (value);
+
+        for (i = 0; paths != NULL && i < paths->len; i++)
+            size += sizeof (gchar *) +
+                mcd_debug_estimate_string_size (g_ptr_array_index (paths, i));
+    }
+
+    return size;
+}
+
+/*
+ * mcd_debug_estimate_asv_size:
+ * @asv: (allow-none): a map from strings to GValues
+ *
+ * Returns: approximately how much memory @asv and its contents use
+ */
+gsize
+mcd_debug_estimate_asv_size (GHashTable *asv)
+{
+    GHashTableIter iter;
+    gpointer k, v;
+    gsize size;
+
+    if (asv == NULL)
+        return 0;
+
+    size = g_hash_table_size (asv) * MCD_DEBUG_HASH_ENTRY_SIZE;
+    g_hash_table_iter_init (&iter, asv);
+
+    while (g_hash_table_iter_next (&iter, &k, &v))
+        size += mcd_debug_estimate_string_size (k) +
+            mcd_debug_estimate_value_size (v);
+
+    return size;
+}
+
+typedef struct {
+    /* borrowed from the account, or "" */
+    const gchar *account_path;
+    GType type;
+    guint count;
+    guint64 bytes;
+} TreeStats;
+
+static void
+tree_stats_add (GArray *rows,
+                const gchar *account_path,
+                gpointer object,
+                gsize bytes)
+{
+    TreeStats row;
+    GType type = G_OBJECT_TYPE (object);
+    guint i;
+
+    /* dispatch operations without an account say "/" */
+    if (account_path == NULL || !tp_strdiff (account_path, "/"))
+        account_path = "";
+
+    /* there are only a few types per account, so a linear search will do */
+    for (i = 0; i < rows->len; i++)
+    {
+        TreeStats *existing = &g_array_index (rows, TreeStats, i);
+
+        if (existing->type == type &&
+            !tp_strdiff (existing->account_path, account_path))
+        {
+            existing->count++;
+            existing->bytes += bytes;
+            return;
+        }
+    }
+
+    row.account_path = account_path;
+    row.type = type;
+    row.count = 1;
+    row.bytes = bytes;
+    g_array_append_val (rows, row);
+}
+
+static void
+collect_tree_stats (GArray *rows,
+                    gpointer object,
+                    const gchar *account_path)
+{
+    gsize bytes;
+
+    if (MCD_IS_CONNECTION (object))
+    {
+        McdAccount *account = mcd_connection_get_account (object);
+
+        if (account != NULL)
+            account_path = mcd_account_get_object_path (account);
+
+        bytes = _mcd_connection_get_retained_bytes (object);
+    }
+    else if (MCD_IS_CHANNEL (object))
+    {
+        bytes = _mcd_channel_get_retained_bytes (object);
+    }
+    else
+    {
+        GTypeQuery query;
+
+        g_type_query (G_OBJECT_TYPE (object), &query);
+        bytes = query.instance_size;
+    }
+
+    tree_stats_add (rows, account_path, object, bytes);
+
+    if (MCD_IS_OPERATION (object))
+    {
+        const GList *node;
+
+        for (node = mcd_operation_get_missions (MCD_OPERATION (object));
+             node != NULL;
+             node = node->next)
+            collect_tree_stats (rows, node->data, account_path);
+    }
+}
+
+static void
+collect_request_stats (gpointer request,
+                       gpointer rows)
+{
+    McdAccount *account = _mcd_request_get_account (request);
+    const gchar *account_path = NULL;
+
+    if (account != NULL)
+        account_path = mcd_account_get_object_path (account);
+
+    tree_stats_add (rows, account_path, request,
+                    _mcd_request_get_retained_bytes (request));
+}
+
+/*
+ * mcd_debug_foreach_tree_stats:
+ * @master: the #McdMaster
+ * @func: called once per account and type of object
+ * @user_data: passed to @func
+ *
+ * Walk the tree of missions below @master, the dispatch operations that
+ * have not finished and all the channel requests, and call @func with the
+ * number of objects of each type per account and approximately how much
+ * memory they use. Channel requests are counted whether or not they are
+ * in the tree yet, so requests waiting for an internal request or for a
+ * request policy are included.
+ * Objects that don't belong to an account are reported with an empty
+ * account path.
+ *
+ * Unlike mcd_debug_print_tree(), this works regardless of MC_DEBUG, so
+ * that it can be used on D-Bus at runtime.
+ */
+void
+mcd_debug_foreach_tree_stats (gpointer master,
+                              McdDebugTreeStatsFunc func,
+                              gpointer user_data)
+{
+    GArray *rows;
+    McdDispatcher *dispatcher = NULL;
+    const GList *node;
+    guint i;
+
+    g_return_if_fail (MCD_IS_MASTER (master));
+
+    rows = g_array_new (FALSE, FALSE, sizeof (TreeStats));
+    collect_tree_stats (rows, master, NULL);
+    _mcd_request_foreach (collect_request_stats, rows);
+
+    g_object_get (master, "dispatcher", &dispatcher, NULL);
+
+    for (node = _mcd_dispatcher_get_operations (dispatcher);
+         node != NULL;
+         node = node->next)
+    {
+        McdDispatchOperation *operation = node->data;
+
+        tree_stats_add (rows,
+            _mcd_dispatch_operation_get_account_path (operation), operation,
+            _mcd_dispatch_operation_get_retained_bytes (operation));
+    }
+
+    for (i = 0; i < rows->len; i++)
+    {
+        TreeStats *row = &g_array_index (rows, TreeStats, i);
+
+        func (row->account_path, g_type_name (row->type), row->count,
+              row->bytes, user_data);
+    }
+
+    g_object_unref (dispatcher);
+    g_array_unref (rows);
+}
+
 void mcd_debug_init ()
 {
     gchar *mc_debug_str;
@@ -146,6 +398,10 @@ void mcd_debug_init ()
     mcp_set_debug ((mcd_debug_level >= 1));
     mcp_debug_init ();
 
+    if ((categories & MCD_DEBUG_TRACE) != 0 ||
+        g_getenv ("MC_TRACE_FILE") != NULL)
+        mcd_trace_set_enabled (TRUE);
+
     tp_debug_divert_messages (g_getenv ("MC_LOGFILE"));
 
     if (mcd_debug_level >= 1)
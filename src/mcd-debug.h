@@ -70,6 +70,24 @@ static inline gint _mcd_debug_get_level (void)
 
 void mcd_debug_print_tree (gpointer obj);
 
+/* Approximate overhead of one GHashTable entry (its key, value and hash),
+ * for estimating how much memory objects retain */
+#define MCD_DEBUG_HASH_ENTRY_SIZE (2 * sizeof (gpointer) + sizeof (guint))
+
+gsize mcd_debug_estimate_string_size (const gchar *s);
+gsize mcd_debug_estimate_value_size (const GValue *value);
+gsize mcd_debug_estimate_asv_size (GHashTable *asv);
+
+typedef void (*McdDebugTreeStatsFunc) (const gchar *account_path,
+                                       const gchar *type_name,
+                                       guint count,
+                                       guint64 bytes,
+                                       gpointer user_data);
+
+void mcd_debug_foreach_tree_stats (gpointer master,
+                                   McdDebugTreeStatsFunc func,
+                                   gpointer user_data);
+
 void mcd_debug (const gchar *format, ...) G_GNUC_PRINTF (1, 2);
 
 G_END_DECLS
@@ -73,6 +73,7 @@ G_GNUC_INTERNAL McdDispatchOperation *_mcd_dispatch_operation_new (
     McdHandlerMap *handler_map,
     gboolean needs_approval,
     gboolean observe_only,
+    gboolean bypass_only,
     McdChannel *channel,
     const gchar * const *possible_handlers);
 
@@ -93,9 +94,13 @@ G_GNUC_INTERNAL gboolean _mcd_dispatch_operation_get_cancelled (
 
 G_GNUC_INTERNAL void _mcd_dispatch_operation_run_clients (
     McdDispatchOperation *self);
+G_GNUC_INTERNAL void _mcd_dispatch_operation_set_observers (
+    McdDispatchOperation *self, const GList *observers);
 
 G_GNUC_INTERNAL const gchar *_mcd_dispatch_operation_get_account_path (
     McdDispatchOperation *self);
+G_GNUC_INTERNAL gsize _mcd_dispatch_operation_get_retained_bytes (
+    McdDispatchOperation *self);
 G_GNUC_INTERNAL const gchar *_mcd_dispatch_operation_get_protocol (
     McdDispatchOperation *self);
 G_GNUC_INTERNAL const gchar *_mcd_dispatch_operation_get_cm_name (
@@ -41,6 +41,8 @@
 #include "mcd-dbusprop.h"
 #include "mcd-master-priv.h"
 #include "mcd-misc.h"
+#include "mcd-stats.h"
+#include "mcd-trace.h"
 #include "plugin-dispatch-operation.h"
 #include "plugin-loader.h"
 
@@ -154,13 +156,15 @@ approval_free (Approval *approval)
 
 struct _McdDispatchOperationPrivate
 {
-    const gchar *unique_name;   /* borrowed from object_path */
+    /* borrowed from object_path, or a string literal while bypass_only */
+    const gchar *unique_name;
+    /* NULL while bypass_only */
     gchar *object_path;
     GStrv possible_handlers;
     GHashTable *properties;
 
-    /* If FALSE, we're not actually on D-Bus; an object path is reserved,
-     * but we're inaccessible. */
+    /* If FALSE, we're not actually on D-Bus; an object path is reserved
+     * (unless we're bypass_only), but we're inaccessible. */
     guint needs_approval : 1;
 
     /* set of handlers we already tried
@@ -182,10 +186,14 @@ struct _McdDispatchOperationPrivate
      * expect *something* to happen at the time of the second call. */
     gint64 handle_with_time;
 
-    /* queue of Approval */
-    GQueue *approvals;
+    /* queue of Approval; embedded, since most operations never have any */
+    GQueue approvals;
     /* if not NULL, the handler that accepted it */
     TpClient *successful_handler;
+    /* if not NULL, the bus name of a handler we started activating before
+     * running the observers, in the hope that it will be ready by the
+     * time we call HandleChannels */
+    gchar *preactivated_handler;
 
     /* Reference to a global handler map */
     McdHandlerMap *handler_map;
@@ -198,6 +206,11 @@ struct _McdDispatchOperationPrivate
 
     /* Owned McdChannel we're dispatching */
     McdChannel *channel;
+    /* If have_observers is TRUE, the Observers matching channel, already
+     * worked out by the McdDispatcher; otherwise NULL.
+     * Owned McdClientProxy */
+    GList *observers;
+    gboolean have_observers;
     /* If non-NULL, we have lost the McdChannel but can't emit
      * ChannelLost yet */
     McdChannel *lost_channel;
@@ -250,6 +263,12 @@ struct _McdDispatchOperationPrivate
      * after observers */
     gboolean observe_only;
 
+    /* If TRUE, we were created without needs_approval because the best
+     * handler bypasses approval: only BypassApproval handlers may be tried,
+     * and if they all fail, we start needing approval and appear on D-Bus
+     * after all. */
+    gboolean bypass_only;
+
     /* If non-NULL, we're in the middle of asking plugins whether we may call
      * HandleChannels, or doing so. This is a client lock. */
     McdClientProxy *trying_handler;
@@ -258,6 +277,8 @@ struct _McdDispatchOperationPrivate
      * before we run approvers. */
     gboolean tried_handlers_before_approval;
 
+    /* created the first time a plugin is given this operation, which never
+     * happens if there are no dispatch operation policy plugins */
     McdPluginDispatchOperation *plugin_api;
     gsize plugins_pending;
     gboolean did_post_observer_actions;
@@ -347,7 +368,7 @@ _mcd_dispatch_operation_dec_ado_pending (McdDispatchOperation *self)
     {
         DEBUG ("No approver accepted the channel; considering it to be "
                "approved");
-        g_queue_push_tail (self->priv->approvals,
+        g_queue_push_tail (&self->priv->approvals,
                            approval_new (APPROVAL_TYPE_NO_APPROVERS));
     }
 
@@ -374,8 +395,20 @@ _mcd_dispatch_operation_is_internal (McdDispatchOperation *self)
 static inline gboolean
 _mcd_dispatch_operation_is_approved (McdDispatchOperation *self)
 {
+    if (self->priv->bypass_only)
+        return FALSE;
+
     return (!self->priv->needs_approval ||
-            !g_queue_is_empty (self->priv->approvals));
+            !g_queue_is_empty (&self->priv->approvals));
+}
+
+static McpDispatchOperation *
+mcd_dispatch_operation_get_plugin_api (McdDispatchOperation *self)
+{
+    if (self->priv->plugin_api == NULL)
+        self->priv->plugin_api = _mcd_plugin_dispatch_operation_new (self);
+
+    return MCP_DISPATCH_OPERATION (self->priv->plugin_api);
 }
 
 static gboolean _mcd_dispatch_operation_try_next_handler (
@@ -412,8 +445,11 @@ _mcd_dispatch_operation_check_client_locks (McdDispatchOperation *self)
     if (self->priv->observers_pending == 0 &&
         !self->priv->did_post_observer_actions)
     {
-        _mcd_plugin_dispatch_operation_observers_finished (
-            self->priv->plugin_api);
+        /* if no plugin has seen us, none can have asked for that */
+        if (self->priv->plugin_api != NULL)
+            _mcd_plugin_dispatch_operation_observers_finished (
+                self->priv->plugin_api);
+
         self->priv->did_post_observer_actions = TRUE;
     }
 
@@ -428,8 +464,9 @@ _mcd_dispatch_operation_check_client_locks (McdDispatchOperation *self)
         !_mcd_dispatch_operation_handlers_can_bypass_approval (self)
         && self->priv->delay_approver_observers_pending == 0
         && self->priv->channel != NULL &&
-        ! _mcd_plugin_dispatch_operation_will_terminate (
-            self->priv->plugin_api))
+        (self->priv->plugin_api == NULL ||
+         !_mcd_plugin_dispatch_operation_will_terminate (
+            self->priv->plugin_api)))
     {
         self->priv->tried_handlers_before_approval = TRUE;
 
@@ -514,7 +551,7 @@ _mcd_dispatch_operation_check_client_locks (McdDispatchOperation *self)
         return;
     }
 
-    approval = g_queue_peek_head (self->priv->approvals);
+    approval = g_queue_peek_head (&self->priv->approvals);
 
     /* if we've been claimed, respond, then do not call HandleChannels */
     if (approval != NULL && approval->type == APPROVAL_TYPE_CLAIM)
@@ -526,7 +563,7 @@ _mcd_dispatch_operation_check_client_locks (McdDispatchOperation *self)
 
         /* remove this approval from the list, so it won't be treated as a
          * failure */
-        g_queue_pop_head (self->priv->approvals);
+        g_queue_pop_head (&self->priv->approvals);
 
         if (self->priv->channel != NULL)
         {
@@ -615,6 +652,7 @@ enum
     PROP_POSSIBLE_HANDLERS,
     PROP_NEEDS_APPROVAL,
     PROP_OBSERVE_ONLY,
+    PROP_BYPASS_ONLY,
 };
 
 /*
@@ -701,6 +739,53 @@ _mcd_dispatch_operation_get_account_path (McdDispatchOperation *self)
     return path;
 }
 
+/*
+ * _mcd_dispatch_operation_get_retained_bytes:
+ * @self: the #McdDispatchOperation
+ *
+ * Returns: approximately how much memory @self holds on to, not including
+ *  its channel
+ */
+gsize
+_mcd_dispatch_operation_get_retained_bytes (McdDispatchOperation *self)
+{
+    McdDispatchOperationPrivate *priv;
+    GHashTableIter iter;
+    gpointer k;
+    gsize size;
+    guint i;
+
+    g_return_val_if_fail (MCD_IS_DISPATCH_OPERATION (self), 0);
+    priv = self->priv;
+
+    size = sizeof (McdDispatchOperation) +
+        sizeof (McdDispatchOperationPrivate) +
+        mcd_debug_estimate_string_size (priv->object_path) +
+        mcd_debug_estimate_string_size (priv->preactivated_handler) +
+        mcd_debug_estimate_asv_size (priv->properties) +
+        g_list_length (priv->observers) * sizeof (GList);
+
+    if (priv->possible_handlers != NULL)
+    {
+        for (i = 0; priv->possible_handlers[i] != NULL; i++)
+            size += sizeof (gchar *) +
+                mcd_debug_estimate_string_size (priv->possible_handlers[i]);
+    }
+
+    if (priv->failed_handlers != NULL)
+    {
+        g_hash_table_iter_init (&iter, priv->failed_handlers);
+
+        while (g_hash_table_iter_next (&iter, &k, NULL))
+            size += MCD_DEBUG_HASH_ENTRY_SIZE +
+                mcd_debug_estimate_string_size (k);
+    }
+
+    size += priv->approvals.length * sizeof (GList);
+
+    return size;
+}
+
 static void
 get_account (TpSvcDBusProperties *self, const gchar *name, GValue *value)
 {
@@ -821,9 +906,16 @@ _mcd_dispatch_operation_finish (McdDispatchOperation *operation,
     va_end (ap);
     DEBUG ("Result: %s", priv->result->message);
 
-    for (approval = g_queue_pop_head (priv->approvals);
+    if (priv->preactivated_handler != NULL)
+    {
+        mcd_stats_record_preactivation (priv->preactivated_handler,
+            !tp_strdiff (priv->preactivated_handler, successful_handler));
+        tp_clear_pointer (&priv->preactivated_handler, g_free);
+    }
+
+    for (approval = g_queue_pop_head (&priv->approvals);
          approval != NULL;
-         approval = g_queue_pop_head (priv->approvals))
+         approval = g_queue_pop_head (&priv->approvals))
     {
         switch (approval->type)
         {
@@ -929,7 +1021,7 @@ dispatch_operation_handle_with_time (TpSvcChannelDispatchOperation *cdo,
 
     self->priv->handle_with_time = user_action_timestamp;
 
-    g_queue_push_tail (self->priv->approvals,
+    g_queue_push_tail (&self->priv->approvals,
                        approval_new_handle_with (handler_name, context));
     _mcd_dispatch_operation_check_client_locks (self);
 }
@@ -955,7 +1047,7 @@ claim_attempt_resolve (ClaimAttempt *claim_attempt)
 {
     if (claim_attempt->context != NULL)
     {
-        g_queue_push_tail (claim_attempt->self->priv->approvals,
+        g_queue_push_tail (&claim_attempt->self->priv->approvals,
                            approval_new_claim (claim_attempt->context));
         _mcd_dispatch_operation_check_client_locks (claim_attempt->self);
     }
@@ -996,8 +1088,6 @@ dispatch_operation_claim (TpSvcChannelDispatchOperation *cdo,
     McdDispatchOperation *self = MCD_DISPATCH_OPERATION (cdo);
     ClaimAttempt *claim_attempt;
     gchar *sender = dbus_g_method_get_sender (context);
-    McpDispatchOperation *plugin_api = MCP_DISPATCH_OPERATION (
-        self->priv->plugin_api);
     const GList *p;
 
     if (self->priv->result != NULL)
@@ -1013,7 +1103,10 @@ dispatch_operation_claim (TpSvcChannelDispatchOperation *cdo,
     claim_attempt->context = context;
     claim_attempt->handler_suitable_pending = 0;
 
-    for (p = mcp_list_objects (); p != NULL; p = g_list_next (p))
+    for (p = mcp_list_objects_implementing (
+            MCP_TYPE_DISPATCH_OPERATION_POLICY);
+         p != NULL;
+         p = g_list_next (p))
     {
         if (MCP_IS_DISPATCH_OPERATION_POLICY (p->data))
         {
@@ -1024,7 +1117,7 @@ dispatch_operation_claim (TpSvcChannelDispatchOperation *cdo,
 
             claim_attempt->handler_suitable_pending++;
             mcp_dispatch_operation_policy_handler_is_suitable_async (plugin,
-                    NULL, sender, plugin_api,
+                    NULL, sender, mcd_dispatch_operation_get_plugin_api (self),
                     claim_attempt_suitability_cb,
                     claim_attempt);
         }
@@ -1060,6 +1153,29 @@ create_object_path (McdDispatchOperationPrivate *priv)
         (sizeof (MC_DISPATCH_OPERATION_DBUS_OBJECT_BASE) - 1);
 }
 
+static void
+mcd_dispatch_operation_export (McdDispatchOperation *self)
+{
+    TpDBusDaemon *dbus_daemon;
+    DBusGConnection *dbus_connection;
+
+    g_object_get (self->priv->client_registry,
+                  "dbus-daemon", &dbus_daemon,
+                  NULL);
+
+    /* can be NULL if we have fallen off the bus (in the real MC libdbus
+     * would exit in this situation, but in the debug build, we stay
+     * active briefly) */
+    dbus_connection = tp_proxy_get_dbus_connection (dbus_daemon);
+
+    if (G_LIKELY (dbus_connection != NULL))
+        dbus_g_connection_register_g_object (dbus_connection,
+                                             self->priv->object_path,
+                                             (GObject *) self);
+
+    g_object_unref (dbus_daemon);
+}
+
 static GObject *
 mcd_dispatch_operation_constructor (GType type, guint n_params,
                                     GObjectConstructParam *params)
@@ -1085,10 +1201,23 @@ mcd_dispatch_operation_constructor (GType type, guint n_params,
         goto error;
     }
 
-    create_object_path (priv);
+    if (priv->bypass_only && (priv->needs_approval || priv->observe_only))
+    {
+        g_critical ("bypass_only => needs_approval and observe_only must "
+                    "not be TRUE");
+        goto error;
+    }
+
+    /* Bypass-only operations don't get an object path unless they fall
+     * back to approvers */
+    if (priv->bypass_only)
+        priv->unique_name = "(bypass)";
+    else
+        create_object_path (priv);
 
-    DEBUG ("%s/%p: needs_approval=%c", priv->unique_name, object,
-           priv->needs_approval ? 'T' : 'F');
+    DEBUG ("%s/%p: needs_approval=%c bypass_only=%c", priv->unique_name,
+           object, priv->needs_approval ? 'T' : 'F',
+           priv->bypass_only ? 'T' : 'F');
 
     if (priv->channel != NULL)
     {
@@ -1101,27 +1230,7 @@ mcd_dispatch_operation_constructor (GType type, guint n_params,
     /* If approval is not needed, we don't appear on D-Bus (and approvers
      * don't run) */
     if (priv->needs_approval)
-    {
-        TpDBusDaemon *dbus_daemon;
-        DBusGConnection *dbus_connection;
-
-        g_object_get (priv->client_registry,
-                      "dbus-daemon", &dbus_daemon,
-                      NULL);
-
-        /* can be NULL if we have fallen off the bus (in the real MC libdbus
-         * would exit in this situation, but in the debug build, we stay
-         * active briefly) */
-        dbus_connection = tp_proxy_get_dbus_connection (dbus_daemon);
-
-        if (G_LIKELY (dbus_connection != NULL))
-            dbus_g_connection_register_g_object (dbus_connection,
-                                                 priv->object_path, object);
-
-        g_object_unref (dbus_daemon);
-    }
-
-    priv->plugin_api = _mcd_plugin_dispatch_operation_new (operation);
+        mcd_dispatch_operation_export (operation);
 
     return object;
 error:
@@ -1180,7 +1289,7 @@ mcd_dispatch_operation_set_property (GObject *obj, guint prop_id,
     case PROP_CHANNEL:
         /* because this is construct-only, we can assert that: */
         g_assert (priv->channel == NULL);
-        g_assert (g_queue_is_empty (priv->approvals));
+        g_assert (g_queue_is_empty (&priv->approvals));
 
         priv->channel = g_value_dup_object (val);
 
@@ -1214,7 +1323,7 @@ mcd_dispatch_operation_set_property (GObject *obj, guint prop_id,
             {
                 DEBUG ("Extracted preferred handler: %s",
                        preferred_handler);
-                g_queue_push_tail (priv->approvals,
+                g_queue_push_tail (&priv->approvals,
                                    approval_new_requested (preferred_handler));
             }
 
@@ -1251,6 +1360,10 @@ mcd_dispatch_operation_set_property (GObject *obj, guint prop_id,
         priv->observe_only = g_value_get_boolean (val);
         break;
 
+    case PROP_BYPASS_ONLY:
+        priv->bypass_only = g_value_get_boolean (val);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
         break;
@@ -1285,6 +1398,10 @@ mcd_dispatch_operation_get_property (GObject *obj, guint prop_id,
         g_value_set_boolean (val, priv->observe_only);
         break;
 
+    case PROP_BYPASS_ONLY:
+        g_value_set_boolean (val, priv->bypass_only);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (obj, prop_id, pspec);
         break;
@@ -1300,6 +1417,7 @@ mcd_dispatch_operation_finalize (GObject *object)
     tp_clear_pointer (&priv->properties, g_hash_table_unref);
     tp_clear_pointer (&priv->failed_handlers, g_hash_table_unref);
     g_clear_error (&priv->result);
+    g_free (priv->preactivated_handler);
     g_free (priv->object_path);
 
     G_OBJECT_CLASS (_mcd_dispatch_operation_parent_class)->finalize (object);
@@ -1321,15 +1439,14 @@ mcd_dispatch_operation_dispose (GObject *object)
 
     tp_clear_object (&priv->channel);
     tp_clear_object (&priv->lost_channel);
+    g_list_free_full (priv->observers, g_object_unref);
+    priv->observers = NULL;
     tp_clear_object (&priv->account);
     tp_clear_object (&priv->handler_map);
     tp_clear_object (&priv->client_registry);
 
-    if (priv->approvals != NULL)
-    {
-        g_queue_foreach (priv->approvals, (GFunc) approval_free, NULL);
-        tp_clear_pointer (&priv->approvals, g_queue_free);
-    }
+    g_queue_foreach (&priv->approvals, (GFunc) approval_free, NULL);
+    g_queue_clear (&priv->approvals);
 
     G_OBJECT_CLASS (_mcd_dispatch_operation_parent_class)->dispose (object);
 }
@@ -1388,6 +1505,15 @@ _mcd_dispatch_operation_class_init (McdDispatchOperationClass * klass)
                               FALSE,
                               G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
                               G_PARAM_STATIC_STRINGS));
+
+    g_object_class_install_property (object_class, PROP_BYPASS_ONLY,
+        g_param_spec_boolean ("bypass-only", "Bypass only?",
+                              "TRUE if this CDO should only try "
+                              "BypassApproval handlers before it needs "
+                              "approval and appears on D-Bus",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+                              G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -1399,7 +1525,7 @@ _mcd_dispatch_operation_init (McdDispatchOperation *operation)
                                         MCD_TYPE_DISPATCH_OPERATION,
                                         McdDispatchOperationPrivate);
     operation->priv = priv;
-    operation->priv->approvals = g_queue_new ();
+    g_queue_init (&operation->priv->approvals);
 
     /* initializes the interfaces */
     mcd_dbus_init_interfaces_instances (operation);
@@ -1409,6 +1535,11 @@ _mcd_dispatch_operation_init (McdDispatchOperation *operation)
  * _mcd_dispatch_operation_new:
  * @client_registry: the client registry.
  * @handler_map: the handler map
+ * @needs_approval: if %TRUE, run Approvers and appear on D-Bus
+ * @observe_only: if %TRUE, stop after running Observers
+ * @bypass_only: if %TRUE, @needs_approval must be %FALSE, and the
+ *  operation only tries BypassApproval handlers; if they all fail, it
+ *  starts needing approval and emits notify::needs-approval
  * @channel: the channel to dispatch
  * @possible_handlers: the bus names of possible handlers for this channel
  *
@@ -1419,6 +1550,7 @@ _mcd_dispatch_operation_new (McdClientRegistry *client_registry,
                              McdHandlerMap *handler_map,
                              gboolean needs_approval,
                              gboolean observe_only,
+                             gboolean bypass_only,
                              McdChannel *channel,
                              const gchar * const *possible_handlers)
 {
@@ -1428,6 +1560,8 @@ _mcd_dispatch_operation_new (McdClientRegistry *client_registry,
      * back", so they can't need approval (i.e. observe_only implies
      * !needs_approval) */
     g_return_val_if_fail (!observe_only || !needs_approval, NULL);
+    g_return_val_if_fail (!bypass_only || (!needs_approval && !observe_only),
+                          NULL);
     g_return_val_if_fail (MCD_IS_CHANNEL (channel), NULL);
 
     obj = g_object_new (MCD_TYPE_DISPATCH_OPERATION,
@@ -1437,6 +1571,7 @@ _mcd_dispatch_operation_new (McdClientRegistry *client_registry,
                         "possible-handlers", possible_handlers,
                         "needs-approval", needs_approval,
                         "observe-only", observe_only,
+                        "bypass-only", bypass_only,
                         NULL);
 
     return MCD_DISPATCH_OPERATION (obj);
@@ -1446,7 +1581,8 @@ _mcd_dispatch_operation_new (McdClientRegistry *client_registry,
  * _mcd_dispatch_operation_get_path:
  * @operation: the #McdDispatchOperation.
  *
- * Returns: the D-Bus object path of @operation.
+ * Returns: the D-Bus object path of @operation, or %NULL if it is
+ *  bypass-only and has not fallen back to approvers.
  */
 const gchar *
 _mcd_dispatch_operation_get_path (McdDispatchOperation *operation)
@@ -1541,7 +1677,7 @@ mcd_dispatch_operation_check_handle_with (McdDispatchOperation *self,
         return FALSE;
     }
 
-    if (!g_queue_is_empty (self->priv->approvals))
+    if (!g_queue_is_empty (&self->priv->approvals))
     {
         DEBUG ("NotYours: already finished or approved");
         g_set_error (error, TP_ERROR, TP_ERROR_NOT_YOURS,
@@ -1590,7 +1726,7 @@ _mcd_dispatch_operation_approve (McdDispatchOperation *self,
         preferred_handler = "";
     }
 
-    g_queue_push_tail (self->priv->approvals,
+    g_queue_push_tail (&self->priv->approvals,
                        approval_new_requested (preferred_handler));
 
     _mcd_dispatch_operation_check_client_locks (self);
@@ -1730,7 +1866,7 @@ _mcd_dispatch_operation_set_handler_failed (McdDispatchOperation *self,
     g_hash_table_insert (self->priv->failed_handlers, g_strdup (bus_name),
                          self->priv->failed_handlers);
 
-    for (iter = g_queue_peek_head_link (self->priv->approvals);
+    for (iter = g_queue_peek_head_link (&self->priv->approvals);
          iter != NULL;
          iter = next)
     {
@@ -1747,7 +1883,7 @@ _mcd_dispatch_operation_set_handler_failed (McdDispatchOperation *self,
             dbus_g_method_return_error (approval->context, (GError *) error);
             approval->context = NULL;
             approval_free (approval);
-            g_queue_delete_link (self->priv->approvals, iter);
+            g_queue_delete_link (&self->priv->approvals, iter);
         }
     }
 
@@ -1796,34 +1932,11 @@ _mcd_dispatch_operation_handlers_can_bypass_approval (
     if (self->priv->possible_handlers == NULL)
         return TRUE;
 
-    for (iter = self->priv->possible_handlers;
-         *iter != NULL;
-         iter++)
-    {
-        McdClientProxy *handler = _mcd_client_registry_lookup (
-            self->priv->client_registry, *iter);
-
-        /* If the best handler that still exists bypasses approval, then
-         * we're going to bypass approval.
-         *
-         * Also, because handlers are sorted with the best ones first, and
-         * handlers with BypassApproval are "better", we can be sure that if
-         * we've found a handler that still exists and does not bypass
-         * approval, no handler bypasses approval. */
-        if (handler != NULL)
-        {
-            gboolean bypass = _mcd_client_proxy_get_bypass_approval (
-                handler);
-
-            DEBUG ("%s has BypassApproval=%c", *iter, bypass ? 'T' : 'F');
-            return bypass;
-        }
-    }
-
-    /* If no handler still exists, we don't bypass approval, although if that
-     * happens we're basically doomed anyway. (unless this is an internal
-     * request, in which case we should be ok) */
-    return FALSE;
+    /* If the best handler that still exists bypasses approval, then
+     * we're going to bypass approval. */
+    return _mcd_client_registry_best_handler_bypasses_approval (
+        self->priv->client_registry,
+        (const gchar * const *) self->priv->possible_handlers);
 }
 
 gboolean
@@ -1866,12 +1979,17 @@ _mcd_dispatch_operation_handle_channels_cb (TpClient *client,
     if (error)
     {
         DEBUG ("error: %s", error->message);
+        MCD_TRACE (MCD_TRACE_HANDLER_FAILED, self,
+                   g_intern_string (tp_proxy_get_bus_name (client)));
 
         _mcd_dispatch_operation_set_handler_failed (self,
             tp_proxy_get_bus_name (client), error);
     }
     else
     {
+        MCD_TRACE (MCD_TRACE_HANDLER_ACCEPTED, self,
+                   g_intern_string (tp_proxy_get_bus_name (client)));
+
         /* FIXME: can channel ever be NULL here? */
         if (self->priv->channel != NULL)
         {
@@ -1938,6 +2056,9 @@ observe_channels_cb (TpClient *proxy, const GError *error,
     else
         DEBUG ("success from %s", tp_proxy_get_object_path (proxy));
 
+    MCD_TRACE (MCD_TRACE_OBSERVER_REPLIED, self,
+               g_intern_string (tp_proxy_get_bus_name (proxy)));
+
     _mcd_dispatch_operation_dec_observers_pending (self, MCD_CLIENT_PROXY (proxy));
 }
 
@@ -1995,88 +2116,108 @@ static void
 _mcd_dispatch_operation_run_observers (McdDispatchOperation *self)
 {
     const gchar *dispatch_operation_path = "/";
+    const gchar *account_path, *connection_path;
+    GPtrArray *channels_array, *satisfied_requests;
+    GHashTable *request_properties;
     GHashTable *observer_info;
-    GHashTableIter iter;
-    gpointer client_p;
+    GList *observers, *iter;
 
-    observer_info = tp_asv_new (NULL, NULL);
-
-    _mcd_client_registry_init_hash_iter (self->priv->client_registry, &iter);
+    /* in particular this happens if there is no channel at all */
+    if (self->priv->channel == NULL)
+        return;
 
-    while (g_hash_table_iter_next (&iter, NULL, &client_p))
+    if (self->priv->have_observers)
     {
-        McdClientProxy *client = MCD_CLIENT_PROXY (client_p);
-        gboolean observed = FALSE;
-        const gchar *account_path, *connection_path;
-        GPtrArray *channels_array, *satisfied_requests;
-        GHashTable *request_properties;
-
-        if (!tp_proxy_has_interface_by_id (client,
-                                           TP_IFACE_QUARK_CLIENT_OBSERVER))
-            continue;
-
-        if (self->priv->channel != NULL)
-        {
-            McdChannel *channel = MCD_CHANNEL (self->priv->channel);
-            GVariant *properties;
-
-            properties = mcd_channel_dup_immutable_properties (channel);
-            g_assert (properties != NULL);
-
-            if (_mcd_client_match_filters (properties,
-                _mcd_client_proxy_get_observer_filters (client),
-                FALSE))
-                observed = TRUE;
+        observers = g_list_copy (self->priv->observers);
+    }
+    else
+    {
+        McdPropertyView *properties;
 
-            g_variant_unref (properties);
-        }
+        properties = _mcd_channel_get_property_view (self->priv->channel);
+        g_assert (properties != NULL);
+        observers = _mcd_client_registry_list_observers (
+            self->priv->client_registry, properties);
+    }
 
-        /* in particular this happens if there is no channel at all */
-        if (!observed) continue;
+    if (observers == NULL)
+        return;
 
-        /* build up the parameters and invoke the observer */
+    /* The arguments are the same for every Observer, and are marshalled
+     * when each call is made, so build them once and share them */
+    connection_path = _mcd_dispatch_operation_get_connection_path (self);
+    account_path = _mcd_dispatch_operation_get_account_path (self);
 
-        connection_path = _mcd_dispatch_operation_get_connection_path (self);
-        account_path = _mcd_dispatch_operation_get_account_path (self);
+    channels_array = _mcd_tp_channel_details_build_from_tp_chan (
+        mcd_channel_get_tp_channel (self->priv->channel));
 
-        /* TODO: there's room for optimization here: reuse the channels_array,
-         * if the observed list is the same */
-        channels_array = _mcd_tp_channel_details_build_from_tp_chan (
-            mcd_channel_get_tp_channel (self->priv->channel));
+    collect_satisfied_requests (self->priv->channel, &satisfied_requests,
+                                &request_properties);
 
-        collect_satisfied_requests (self->priv->channel, &satisfied_requests,
-                                    &request_properties);
+    observer_info = tp_asv_new (NULL, NULL);
+    /* transfer ownership into observer_info */
+    tp_asv_take_boxed (observer_info, "request-properties",
+        TP_HASH_TYPE_OBJECT_IMMUTABLE_PROPERTIES_MAP,
+        request_properties);
+    request_properties = NULL;
 
-        /* transfer ownership into observer_info */
-        tp_asv_take_boxed (observer_info, "request-properties",
-            TP_HASH_TYPE_OBJECT_IMMUTABLE_PROPERTIES_MAP,
-            request_properties);
-        request_properties = NULL;
+    if (_mcd_dispatch_operation_needs_approval (self))
+    {
+        dispatch_operation_path = _mcd_dispatch_operation_get_path (self);
+    }
 
-        if (_mcd_dispatch_operation_needs_approval (self))
-        {
-            dispatch_operation_path = _mcd_dispatch_operation_get_path (self);
-        }
+    for (iter = observers; iter != NULL; iter = iter->next)
+    {
+        McdClientProxy *client = MCD_CLIENT_PROXY (iter->data);
 
         _mcd_dispatch_operation_inc_observers_pending (self, client);
 
         DEBUG ("calling ObserveChannels on %s for CDO %p",
                tp_proxy_get_bus_name (client), self);
-        tp_cli_client_observer_call_observe_channels (
-            (TpClient *) client, -1,
+        MCD_TRACE (MCD_TRACE_OBSERVER_CALLED, self,
+                   g_intern_string (tp_proxy_get_bus_name (client)));
+        _mcd_client_proxy_observe_channels (client, -1,
             account_path, connection_path, channels_array,
             dispatch_operation_path, satisfied_requests, observer_info,
             observe_channels_cb,
             g_object_ref (self), g_object_unref, NULL);
-
-        g_ptr_array_unref (satisfied_requests);
-
-        _mcd_tp_channel_details_free (channels_array);
     }
 
+    g_list_free (observers);
+    g_ptr_array_unref (satisfied_requests);
+    _mcd_tp_channel_details_free (channels_array);
     g_hash_table_unref (observer_info);
 }
 
+/*
+ * _mcd_dispatch_operation_set_observers:
+ * @observers: (element-type McdClientProxy): the Observers whose filters
+ *  match this operation's channel
+ *
+ * Use @observers instead of matching every Observer's filters against the
+ * channel when the clients are run. This lets the McdDispatcher match
+ * a burst of similar channels once. Must be called before
+ * _mcd_dispatch_operation_run_clients().
+ */
+void
+_mcd_dispatch_operation_set_observers (McdDispatchOperation *self,
+                                       const GList *observers)
+{
+    const GList *iter;
+
+    g_return_if_fail (MCD_IS_DISPATCH_OPERATION (self));
+    g_return_if_fail (!self->priv->invoked_observers_if_needed);
+
+    g_list_free_full (self->priv->observers, g_object_unref);
+    self->priv->observers = NULL;
+
+    for (iter = observers; iter != NULL; iter = iter->next)
+        self->priv->observers = g_list_prepend (self->priv->observers,
+                                                g_object_ref (iter->data));
+
+    self->priv->have_observers = TRUE;
+}
+
 static void
 add_dispatch_operation_cb (TpClient *proxy,
                            const GError *error,
@@ -2104,6 +2245,9 @@ add_dispatch_operation_cb (TpClient *proxy,
         }
     }
 
+    MCD_TRACE (MCD_TRACE_APPROVER_REPLIED, self,
+               g_intern_string (tp_proxy_get_bus_name (proxy)));
+
     /* If all approvers fail to add the DO, then we behave as if no
      * approver was registered: i.e., we continue dispatching. If at least
      * one approver accepted it, then we can still continue dispatching,
@@ -2138,19 +2282,16 @@ _mcd_dispatch_operation_run_approvers (McdDispatchOperation *self)
         if (self->priv->channel != NULL)
         {
             McdChannel *channel = MCD_CHANNEL (self->priv->channel);
-            GVariant *channel_properties;
+            McdPropertyView *channel_properties;
 
-            channel_properties = mcd_channel_dup_immutable_properties (channel);
+            channel_properties = _mcd_channel_get_property_view (channel);
             g_assert (channel_properties != NULL);
 
-            if (_mcd_client_match_filters (channel_properties,
-                _mcd_client_proxy_get_approver_filters (client),
-                FALSE))
+            if (_mcd_client_proxy_match_approver_filters (client,
+                    channel_properties))
             {
                 matched = TRUE;
             }
-
-            g_variant_unref (channel_properties);
         }
 
         /* in particular, after this point, self->priv->channel can't
@@ -2166,9 +2307,10 @@ _mcd_dispatch_operation_run_approvers (McdDispatchOperation *self)
                tp_proxy_get_bus_name (client), dispatch_operation, self);
 
         _mcd_dispatch_operation_inc_ado_pending (self);
+        MCD_TRACE (MCD_TRACE_APPROVER_CALLED, self,
+                   g_intern_string (tp_proxy_get_bus_name (client)));
 
-        tp_cli_client_approver_call_add_dispatch_operation (
-            (TpClient *) client, -1,
+        _mcd_client_proxy_add_dispatch_operation (client, -1,
             channel_details, dispatch_operation, properties,
             add_dispatch_operation_cb,
             g_object_ref (self), g_object_unref, NULL);
@@ -2186,6 +2328,19 @@ mcd_dispatch_operation_idle_run_approvers (gpointer p)
 {
     McdDispatchOperation *self = p;
 
+    /* No BypassApproval handler took the channel, so we need approval
+     * after all: appear on D-Bus and let the dispatcher announce us. */
+    if (self->priv->bypass_only)
+    {
+        DEBUG ("%s: no BypassApproval handler accepted the channel, "
+               "falling back to approvers", self->priv->unique_name);
+        self->priv->bypass_only = FALSE;
+        self->priv->needs_approval = TRUE;
+        create_object_path (self->priv);
+        mcd_dispatch_operation_export (self);
+        g_object_notify ((GObject *) self, "needs-approval");
+    }
+
     if (_mcd_dispatch_operation_needs_approval (self))
     {
         if (!_mcd_dispatch_operation_is_approved (self))
@@ -2198,6 +2353,32 @@ mcd_dispatch_operation_idle_run_approvers (gpointer p)
     return FALSE;
 }
 
+/* If the best Handler that still exists is activatable but not running,
+ * and allows it, start activating it now, so that it can start up while
+ * the observers and approvers run. */
+static void
+_mcd_dispatch_operation_preactivate_handler (McdDispatchOperation *self)
+{
+    gchar **iter;
+
+    if (self->priv->possible_handlers == NULL)
+        return;
+
+    for (iter = self->priv->possible_handlers; *iter != NULL; iter++)
+    {
+        McdClientProxy *handler = _mcd_client_registry_lookup (
+            self->priv->client_registry, *iter);
+
+        if (handler == NULL)
+            continue;
+
+        if (_mcd_client_proxy_preactivate (handler))
+            self->priv->preactivated_handler = g_strdup (*iter);
+
+        return;
+    }
+}
+
 /* After this function is called, the McdDispatchOperation takes over its
  * own life-cycle, and the caller needn't hold an explicit reference to it. */
 void
@@ -2210,17 +2391,20 @@ _mcd_dispatch_operation_run_clients (McdDispatchOperation *self)
     {
         const GList *mini_plugins;
 
+        _mcd_dispatch_operation_preactivate_handler (self);
+
         DEBUG ("Running observers");
         _mcd_dispatch_operation_run_observers (self);
 
-        for (mini_plugins = mcp_list_objects ();
+        for (mini_plugins = mcp_list_objects_implementing (
+                MCP_TYPE_DISPATCH_OPERATION_POLICY);
              mini_plugins != NULL;
              mini_plugins = mini_plugins->next)
         {
             if (MCP_IS_DISPATCH_OPERATION_POLICY (mini_plugins->data))
             {
                 mcp_dispatch_operation_policy_check (mini_plugins->data,
-                    MCP_DISPATCH_OPERATION (self->priv->plugin_api));
+                    mcd_dispatch_operation_get_plugin_api (self));
             }
         }
     }
@@ -2286,8 +2470,13 @@ mcd_dispatch_operation_handle_channels (McdDispatchOperation *self)
         TP_HASH_TYPE_OBJECT_IMMUTABLE_PROPERTIES_MAP, request_properties);
     request_properties = NULL;
 
+    MCD_TRACE (MCD_TRACE_HANDLER_CALLED, self,
+               g_intern_string (tp_proxy_get_bus_name (
+                   self->priv->trying_handler)));
+
     _mcd_client_proxy_handle_channels (self->priv->trying_handler,
-        -1, channels, self->priv->handle_with_time,
+        _mcd_client_proxy_get_handler_timeout (self->priv->trying_handler),
+        channels, self->priv->handle_with_time,
         handler_info, _mcd_dispatch_operation_handle_channels_cb,
         g_object_ref (self), g_object_unref, NULL);
 
@@ -2327,8 +2516,6 @@ mcd_dispatch_operation_try_handler (McdDispatchOperation *self,
 {
     TpClient *handler_client = (TpClient *) handler;
     const GList *p;
-    McpDispatchOperation *plugin_api = MCP_DISPATCH_OPERATION (
-        self->priv->plugin_api);
 
     g_assert (self->priv->trying_handler == NULL);
     self->priv->trying_handler = g_object_ref (handler);
@@ -2337,7 +2524,10 @@ mcd_dispatch_operation_try_handler (McdDispatchOperation *self,
 
     DEBUG ("%s: channel ACL verification", self->priv->unique_name);
 
-    for (p = mcp_list_objects (); p != NULL; p = g_list_next (p))
+    for (p = mcp_list_objects_implementing (
+            MCP_TYPE_DISPATCH_OPERATION_POLICY);
+         p != NULL;
+         p = g_list_next (p))
     {
         if (MCP_IS_DISPATCH_OPERATION_POLICY (p->data))
         {
@@ -2351,7 +2541,7 @@ mcd_dispatch_operation_try_handler (McdDispatchOperation *self,
             mcp_dispatch_operation_policy_handler_is_suitable_async (plugin,
                     handler_client,
                     _mcd_client_proxy_get_unique_name (handler),
-                    plugin_api,
+                    mcd_dispatch_operation_get_plugin_api (self),
                     mcd_dispatch_operation_handler_decision_cb,
                     g_object_ref (self));
         }
@@ -2368,7 +2558,7 @@ _mcd_dispatch_operation_try_next_handler (McdDispatchOperation *self)
 {
     gchar **iter;
     gboolean is_approved = _mcd_dispatch_operation_is_approved (self);
-    Approval *approval = g_queue_peek_head (self->priv->approvals);
+    Approval *approval = g_queue_peek_head (&self->priv->approvals);
 
     /* If there is a preferred Handler chosen by the first Approver or
      * request, it's the first one we'll consider. We'll even consider
@@ -2406,7 +2596,7 @@ _mcd_dispatch_operation_try_next_handler (McdDispatchOperation *self)
                 TP_ERROR_NOT_IMPLEMENTED,
                 "The requested Handler does not exist" };
 
-            g_queue_pop_head (self->priv->approvals);
+            g_queue_pop_head (&self->priv->approvals);
 
             dbus_g_method_return_error (approval->context, &gone);
 
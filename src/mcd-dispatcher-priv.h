@@ -39,6 +39,8 @@ G_GNUC_INTERNAL void _mcd_dispatcher_add_channel (
     McdChannel *channel,
     gboolean requested,
     gboolean only_observe);
+G_GNUC_INTERNAL void _mcd_dispatcher_begin_batch (McdDispatcher *self);
+G_GNUC_INTERNAL void _mcd_dispatcher_end_batch (McdDispatcher *self);
 G_GNUC_INTERNAL
 void _mcd_dispatcher_add_channel_request (McdDispatcher *dispatcher,
                                           McdChannel *channel,
@@ -47,6 +49,13 @@ G_GNUC_INTERNAL
 void _mcd_dispatcher_recover_channel (McdDispatcher *dispatcher,
                                       McdChannel *channel,
                                       const gchar *account_path);
+G_GNUC_INTERNAL gboolean _mcd_dispatcher_channel_has_handler (
+    McdDispatcher *self,
+    const gchar *channel_path);
+G_GNUC_INTERNAL void _mcd_dispatcher_prune_restored_channels (
+    McdDispatcher *self,
+    const gchar *account_path,
+    GHashTable *live_paths);
 
 G_GNUC_INTERNAL void _mcd_dispatcher_add_connection (McdDispatcher *self,
     McdConnection *connection);
@@ -54,6 +63,9 @@ G_GNUC_INTERNAL void _mcd_dispatcher_add_connection (McdDispatcher *self,
 G_GNUC_INTERNAL GPtrArray *_mcd_dispatcher_dup_client_caps (
     McdDispatcher *self);
 
+G_GNUC_INTERNAL const GList *_mcd_dispatcher_get_operations (
+    McdDispatcher *self);
+
 G_END_DECLS
 
 #endif /* MCD_DISPATCHER_H */
@@ -66,7 +66,6 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include "sp_timestamp.h"
 
 #define MCD_DISPATCHER_PRIV(dispatcher) (MCD_DISPATCHER (dispatcher)->priv)
 
@@ -104,6 +103,29 @@ typedef struct
     gboolean ensure;
 } McdChannelRequestACL;
 
+/* What a burst of channels with the same filter-relevant properties
+ * would be dispatched to */
+typedef struct
+{
+    /* only valid if have_handlers, since channels that are only observed
+     * don't need them */
+    GStrv possible_handlers;
+    gboolean have_handlers;
+    /* McdClientProxy, borrowed from the client registry */
+    GList *observers;
+} McdDispatchMatch;
+
+/* Matches shared between the channels of one NewChannels signal */
+typedef struct
+{
+    /* Sorted names of the properties mentioned by any filter; two channels
+     * with the same values for these get the same McdDispatchMatch */
+    GPtrArray *filter_keys;
+    /* owned signature string => owned McdDispatchMatch */
+    GHashTable *matches;
+    guint n_channels;
+} McdDispatchBatch;
+
 struct _McdDispatcherPrivate
 {
     /* Dispatching contexts */
@@ -131,9 +153,41 @@ struct _McdDispatcherPrivate
      * property. */
     gboolean operation_list_active;
 
+    /* Non-NULL between _mcd_dispatcher_begin_batch() and the matching
+     * _mcd_dispatcher_end_batch() */
+    McdDispatchBatch *batch;
+    guint batch_depth;
+
+    /* text channels used by Messages.SendMessage:
+     * borrowed "account-path target-id" => owned MessageTarget */
+    GHashTable *message_targets;
+
+    /* owned PendingChannel, which no known client could handle, waiting for
+     * clients whose introspection was deferred until now, for at most
+     * DEFERRED_CLIENTS_TIMEOUT_MS */
+    GQueue waiting_for_clients;
+    guint waiting_for_clients_id;
+
     gboolean is_disposed;
 };
 
+/* how long a channel may wait for clients that were only introspected
+ * because it arrived, before we dispatch it without them */
+#define DEFERRED_CLIENTS_TIMEOUT_MS 1000
+
+typedef struct {
+    McdChannel *channel;
+    gboolean requested;
+    gboolean only_observe;
+} PendingChannel;
+
+static void
+pending_channel_free (PendingChannel *pending)
+{
+    g_object_unref (pending->channel);
+    g_slice_free (PendingChannel, pending);
+}
+
 struct cancel_call_data
 {
     DBusGProxy *handler_proxy;
@@ -153,6 +207,7 @@ enum
 
 static void on_operation_finished (McdDispatchOperation *operation,
                                    McdDispatcher *self);
+static void message_target_forget (gpointer p);
 
 static void
 on_master_abort (McdMaster *master, McdDispatcherPrivate *priv)
@@ -171,7 +226,7 @@ mcd_dispatcher_dup_internal_handlers (void)
 static GStrv
 mcd_dispatcher_dup_possible_handlers (McdDispatcher *self,
                                       McdRequest *request,
-                                      TpChannel *channel,
+                                      McdPropertyView *channel_props,
                                       const gchar *must_have_unique_name)
 {
     GList *handlers;
@@ -179,19 +234,26 @@ mcd_dispatcher_dup_possible_handlers (McdDispatcher *self,
     guint i;
     GStrv ret;
     const GList *iter;
-    GVariant *request_properties = NULL;
+    McdPropertyView *request_props = NULL;
+
+    /* the request's properties are only needed if we don't have the
+     * channel's */
+    if (request != NULL && channel_props == NULL)
+    {
+        GVariant *properties = mcd_request_dup_properties (request);
 
-    if (request != NULL)
-        request_properties = mcd_request_dup_properties (request);
+        request_props = _mcd_property_view_new (properties);
+        g_variant_unref (properties);
+    }
 
     handlers = _mcd_client_registry_list_possible_handlers (
         self->priv->clients,
         request != NULL ? _mcd_request_get_preferred_handler (request) : NULL,
-        request_properties,
-        channel, must_have_unique_name);
+        request_props,
+        channel_props, must_have_unique_name);
     n_handlers = g_list_length (handlers);
 
-    tp_clear_pointer (&request_properties, g_variant_unref);
+    tp_clear_pointer (&request_props, _mcd_property_view_unref);
 
     if (handlers == NULL)
         return NULL;
@@ -210,6 +272,168 @@ mcd_dispatcher_dup_possible_handlers (McdDispatcher *self,
     return ret;
 }
 
+static void
+mcd_dispatch_match_free (gpointer p)
+{
+    McdDispatchMatch *match = p;
+
+    g_strfreev (match->possible_handlers);
+    g_list_free (match->observers);
+    g_slice_free (McdDispatchMatch, match);
+}
+
+static gchar *
+mcd_dispatch_batch_dup_signature (McdDispatchBatch *batch,
+                                  McdPropertyView *properties)
+{
+    GString *signature = g_string_new ("");
+    guint i;
+
+    for (i = 0; i < batch->filter_keys->len; i++)
+    {
+        const gchar *key = _mcd_property_view_get_key (properties,
+            g_ptr_array_index (batch->filter_keys, i));
+
+        /* the view's keys are exactly what the filters are matched
+         * against, so equal keys mean equal results */
+        if (key != NULL)
+            g_string_append (signature, key);
+
+        g_string_append_c (signature, '\n');
+    }
+
+    return g_string_free (signature, FALSE);
+}
+
+/*
+ * _mcd_dispatcher_begin_batch:
+ *
+ * Start a burst of calls to _mcd_dispatcher_add_channel(). Until the
+ * matching _mcd_dispatcher_end_batch(), unrequested channels whose
+ * filter-relevant properties are identical share a single evaluation
+ * of the Handler and Observer filters.
+ */
+void
+_mcd_dispatcher_begin_batch (McdDispatcher *self)
+{
+    McdDispatcherPrivate *priv;
+
+    g_return_if_fail (MCD_IS_DISPATCHER (self));
+    priv = self->priv;
+
+    if (priv->batch_depth++ > 0)
+        return;
+
+    priv->batch = g_slice_new0 (McdDispatchBatch);
+    priv->batch->matches = g_hash_table_new_full (g_str_hash, g_str_equal,
+        g_free, mcd_dispatch_match_free);
+}
+
+void
+_mcd_dispatcher_end_batch (McdDispatcher *self)
+{
+    McdDispatcherPrivate *priv;
+    McdDispatchBatch *batch;
+
+    g_return_if_fail (MCD_IS_DISPATCHER (self));
+    priv = self->priv;
+    g_return_if_fail (priv->batch_depth > 0);
+
+    if (--priv->batch_depth > 0)
+        return;
+
+    batch = priv->batch;
+    priv->batch = NULL;
+
+    DEBUG ("dispatched %u channel(s) in batch, %u distinct match(es)",
+           batch->n_channels, g_hash_table_size (batch->matches));
+
+    g_hash_table_unref (batch->matches);
+    tp_clear_pointer (&batch->filter_keys, g_ptr_array_unref);
+    g_slice_free (McdDispatchBatch, batch);
+}
+
+/* Returns: (transfer none): the cached or newly computed match for
+ * @channel in the current batch */
+static McdDispatchMatch *
+mcd_dispatcher_batch_lookup (McdDispatcher *self,
+                             McdChannel *channel)
+{
+    McdDispatchBatch *batch = self->priv->batch;
+    McdDispatchMatch *match;
+    McdPropertyView *properties;
+    gchar *signature;
+
+    properties = _mcd_channel_get_property_view (channel);
+    g_return_val_if_fail (properties != NULL, NULL);
+
+    /* the clients can't change while we are dispatching synchronously, so
+     * the keys only need to be collected once per batch */
+    if (batch->filter_keys == NULL)
+        batch->filter_keys = _mcd_client_registry_dup_filter_keys (
+            self->priv->clients);
+
+    batch->n_channels++;
+    signature = mcd_dispatch_batch_dup_signature (batch, properties);
+    match = g_hash_table_lookup (batch->matches, signature);
+
+    if (match != NULL)
+    {
+        DEBUG ("reusing handlers and observers matched for an earlier "
+               "channel in this batch");
+        g_free (signature);
+    }
+    else
+    {
+        match = g_slice_new0 (McdDispatchMatch);
+        match->observers = _mcd_client_registry_list_observers (
+            self->priv->clients, properties);
+        g_hash_table_insert (batch->matches, signature, match);
+    }
+
+    return match;
+}
+
+/* A lightweight bypass-only operation fell back to approvers, so it is on
+ * D-Bus now */
+static void
+on_operation_needs_approval (McdDispatchOperation *operation,
+                             GParamSpec *pspec G_GNUC_UNUSED,
+                             McdDispatcher *self)
+{
+    if (self->priv->operation_list_active &&
+        _mcd_dispatch_operation_needs_approval (operation))
+    {
+        tp_svc_channel_dispatcher_interface_operation_list_emit_new_dispatch_operation (
+            self,
+            _mcd_dispatch_operation_get_path (operation),
+            _mcd_dispatch_operation_get_properties (operation));
+    }
+}
+
+/*
+ * If MC_LIGHTWEIGHT_BYPASS is set, unrequested channels whose best handler
+ * bypasses approval are dispatched without putting a ChannelDispatchOperation
+ * on D-Bus: Observers are given "/" as the dispatch operation, and nothing
+ * is announced on the OperationList interface, unless all the BypassApproval
+ * handlers fail and we fall back to Approvers.
+ */
+static gboolean
+_mcd_dispatcher_lightweight_bypass (McdDispatcher *self,
+                                    const gchar * const *possible_handlers)
+{
+    static gint enabled = -1;
+
+    if (G_UNLIKELY (enabled < 0))
+        enabled = mcd_env_flag_enabled ("MC_LIGHTWEIGHT_BYPASS");
+
+    if (!enabled || possible_handlers == NULL)
+        return FALSE;
+
+    return _mcd_client_registry_best_handler_bypasses_approval (
+        self->priv->clients, possible_handlers);
+}
+
 static void
 on_operation_finished (McdDispatchOperation *operation,
                        McdDispatcher *self)
@@ -219,6 +443,9 @@ on_operation_finished (McdDispatchOperation *operation,
     g_signal_handlers_disconnect_by_func (operation,
                                           on_operation_finished,
                                           self);
+    g_signal_handlers_disconnect_by_func (operation,
+                                          on_operation_needs_approval,
+                                          self);
 
     /* don't emit the signal if the CDO never appeared on D-Bus */
     if (self->priv->operation_list_active &&
@@ -242,12 +469,14 @@ static void
 _mcd_dispatcher_enter_state_machine (McdDispatcher *dispatcher,
                                      McdChannel *channel,
                                      const gchar * const *possible_handlers,
+                                     const McdDispatchMatch *match,
                                      gboolean requested,
                                      gboolean only_observe)
 {
     McdDispatchOperation *operation;
     McdDispatcherPrivate *priv;
     McdAccount *account;
+    gboolean bypass_only;
 
     g_return_if_fail (MCD_IS_DISPATCHER (dispatcher));
     g_return_if_fail (MCD_IS_CHANNEL (channel));
@@ -267,13 +496,19 @@ _mcd_dispatcher_enter_state_machine (McdDispatcher *dispatcher,
            channel,
            mcd_channel_get_object_path (channel));
 
+    bypass_only = (!requested &&
+        _mcd_dispatcher_lightweight_bypass (dispatcher, possible_handlers));
+
     operation = _mcd_dispatch_operation_new (priv->clients,
-        priv->handler_map, !requested, only_observe, channel,
-        (const gchar * const *) possible_handlers);
+        priv->handler_map, !requested && !bypass_only, only_observe,
+        bypass_only, channel, (const gchar * const *) possible_handlers);
+
+    if (match != NULL)
+        _mcd_dispatch_operation_set_observers (operation, match->observers);
 
     if (!requested)
     {
-        if (priv->operation_list_active)
+        if (priv->operation_list_active && !bypass_only)
         {
             tp_svc_channel_dispatcher_interface_operation_list_emit_new_dispatch_operation (
                 dispatcher,
@@ -286,6 +521,11 @@ _mcd_dispatcher_enter_state_machine (McdDispatcher *dispatcher,
 
         g_signal_connect (operation, "finished",
                           G_CALLBACK (on_operation_finished), dispatcher);
+
+        if (bypass_only)
+            g_signal_connect (operation, "notify::needs-approval",
+                              G_CALLBACK (on_operation_needs_approval),
+                              dispatcher);
     }
 
     if (_mcd_dispatch_operation_get_cancelled (operation))
@@ -535,7 +775,7 @@ _mcd_dispatcher_lookup_handler (McdDispatcher *self,
     if (handler == NULL)
     {
         GList *possible_handlers;
-        GVariant *request_properties = NULL;
+        McdPropertyView *properties;
 
         /* Failing that, maybe the Handler it was dispatched to was temporary;
          * try to pick another Handler that can deal with it, on the same
@@ -543,14 +783,14 @@ _mcd_dispatcher_lookup_handler (McdDispatcher *self,
          * It can also happen in the case an Observer/Approver Claimed the
          * channel; in that case we did not get its handler well known name.
          */
-        if (request != NULL)
-            request_properties = mcd_request_dup_properties (request);
+        properties = _mcd_property_view_new_for_tp_chan (channel);
+        g_return_val_if_fail (properties != NULL, NULL);
 
         possible_handlers = _mcd_client_registry_list_possible_handlers (
                 self->priv->clients,
                 request != NULL ? _mcd_request_get_preferred_handler (request) : NULL,
-                request_properties, channel, unique_name);
-        tp_clear_pointer (&request_properties, g_variant_unref);
+                NULL, properties, unique_name);
+        _mcd_property_view_unref (properties);
 
         if (possible_handlers != NULL)
         {
@@ -579,22 +819,21 @@ mcd_dispatcher_client_needs_recovery_cb (McdClientProxy *client,
 {
     const GList *channels =
         _mcd_handler_map_get_handled_channels (self->priv->handler_map);
-    const GList *observer_filters;
     const GList *list;
 
     DEBUG ("called");
 
-    observer_filters = _mcd_client_proxy_get_observer_filters (client);
-
     for (list = channels; list; list = list->next)
     {
         TpChannel *channel = list->data;
-        GVariant *properties;
+        McdPropertyView *properties;
+
+        properties = _mcd_property_view_new_for_tp_chan (channel);
 
-        properties = tp_channel_dup_immutable_properties (channel);
+        if (properties == NULL)
+            continue;
 
-        if (_mcd_client_match_filters (properties, observer_filters,
-            FALSE))
+        if (_mcd_client_proxy_match_observer_filters (client, properties))
         {
             const gchar *account_path =
                 _mcd_handler_map_get_channel_account (self->priv->handler_map,
@@ -603,7 +842,7 @@ mcd_dispatcher_client_needs_recovery_cb (McdClientProxy *client,
             _mcd_client_recover_observer (client, channel, account_path);
         }
 
-        g_variant_unref (properties);
+        _mcd_property_view_unref (properties);
     }
 
     /* we also need to think about channels that are still being dispatched,
@@ -619,18 +858,17 @@ mcd_dispatcher_client_needs_recovery_cb (McdClientProxy *client,
 
             if (mcd_channel != NULL)
             {
-                GVariant *properties =
-                    mcd_channel_dup_immutable_properties (mcd_channel);
+                McdPropertyView *properties =
+                    _mcd_channel_get_property_view (mcd_channel);
 
-                if (_mcd_client_match_filters (properties, observer_filters,
-                        FALSE))
+                if (properties != NULL &&
+                    _mcd_client_proxy_match_observer_filters (client,
+                        properties))
                 {
                     _mcd_client_recover_observer (client,
                         mcd_channel_get_tp_channel (mcd_channel),
                         _mcd_dispatch_operation_get_account_path (op));
                 }
-
-                g_variant_unref (properties);
             }
         }
     }
@@ -659,6 +897,62 @@ mcd_dispatcher_client_added_cb (McdClientRegistry *clients,
 
 }
 
+static void mcd_dispatcher_add_channel_full (McdDispatcher *dispatcher,
+    McdChannel *channel, gboolean requested, gboolean only_observe,
+    gboolean may_wait);
+
+/* Dispatch the channels that were waiting for deferred clients, now that
+ * they are ready or we have given up on them */
+static void
+mcd_dispatcher_add_waiting_channels (McdDispatcher *self)
+{
+    GQueue pending = self->priv->waiting_for_clients;
+    PendingChannel *p;
+
+    if (self->priv->waiting_for_clients_id != 0)
+    {
+        g_source_remove (self->priv->waiting_for_clients_id);
+        self->priv->waiting_for_clients_id = 0;
+    }
+
+    /* take the whole queue, so that the channels don't just wait again */
+    g_queue_init (&self->priv->waiting_for_clients);
+
+    while ((p = g_queue_pop_head (&pending)) != NULL)
+    {
+        McdChannelStatus status = mcd_channel_get_status (p->channel);
+
+        if (status == MCD_CHANNEL_STATUS_ABORTED ||
+            status == MCD_CHANNEL_STATUS_FAILED)
+            DEBUG ("channel %p went away while waiting", p->channel);
+        else
+            mcd_dispatcher_add_channel_full (self, p->channel, p->requested,
+                                             p->only_observe, FALSE);
+
+        pending_channel_free (p);
+    }
+}
+
+static void
+mcd_dispatcher_deferred_clients_ready_cb (McdClientRegistry *clients,
+                                          McdDispatcher *self)
+{
+    DEBUG ("clients whose introspection was deferred are ready");
+    mcd_dispatcher_add_waiting_channels (self);
+}
+
+static gboolean
+mcd_dispatcher_waiting_for_clients_timeout_cb (gpointer data)
+{
+    McdDispatcher *self = data;
+
+    DEBUG ("not waiting any longer for clients whose introspection was "
+           "deferred");
+    self->priv->waiting_for_clients_id = 0;
+    mcd_dispatcher_add_waiting_channels (self);
+    return FALSE;
+}
+
 static void
 mcd_dispatcher_client_registry_ready_cb (McdClientRegistry *clients,
                                          McdDispatcher *self)
@@ -678,7 +972,6 @@ mcd_dispatcher_client_registry_ready_cb (McdClientRegistry *clients,
         _mcd_connection_start_dispatching (p, vas);
     }
 
-    g_ptr_array_foreach (vas, (GFunc) g_value_array_free, NULL);
     g_ptr_array_unref (vas);
 }
 
@@ -730,10 +1023,24 @@ _mcd_dispatcher_dispose (GObject * object)
         g_signal_handlers_disconnect_by_func (priv->clients,
             mcd_dispatcher_client_registry_ready_cb, object);
 
+        g_signal_handlers_disconnect_by_func (priv->clients,
+            mcd_dispatcher_deferred_clients_ready_cb, object);
+
         tp_clear_object (&priv->clients);
     }
 
+    if (priv->waiting_for_clients_id != 0)
+    {
+        g_source_remove (priv->waiting_for_clients_id);
+        priv->waiting_for_clients_id = 0;
+    }
+
+    g_queue_foreach (&priv->waiting_for_clients, (GFunc) pending_channel_free,
+                     NULL);
+    g_queue_clear (&priv->waiting_for_clients);
+
     tp_clear_pointer (&priv->connections, g_hash_table_unref);
+    tp_clear_pointer (&priv->message_targets, g_hash_table_unref);
     tp_clear_object (&priv->master);
     tp_clear_object (&priv->dbus_daemon);
 
@@ -744,6 +1051,7 @@ static void
 mcd_dispatcher_update_client_caps (McdDispatcher *self,
                                    McdClientProxy *client)
 {
+    McdClientCapsSnapshot *snapshot;
     GPtrArray *vas;
     GHashTableIter iter;
     gpointer k;
@@ -759,8 +1067,12 @@ mcd_dispatcher_update_client_caps (McdDispatcher *self,
         return;
     }
 
+    /* McdClientProxy only signals a change if the capabilities really did
+     * change, so this is never redundant; the same snapshot is sent to every
+     * connection */
+    snapshot = _mcd_client_proxy_ref_caps_snapshot (client);
     vas = g_ptr_array_sized_new (1);
-    g_ptr_array_add (vas, _mcd_client_proxy_dup_handler_capabilities (client));
+    g_ptr_array_add (vas, _mcd_client_caps_snapshot_get_value_array (snapshot));
 
     g_hash_table_iter_init (&iter, self->priv->connections);
 
@@ -769,8 +1081,8 @@ mcd_dispatcher_update_client_caps (McdDispatcher *self,
         _mcd_connection_update_client_caps (k, vas);
     }
 
-    g_ptr_array_foreach (vas, (GFunc) g_value_array_free, NULL);
     g_ptr_array_unref (vas);
+    _mcd_client_caps_snapshot_unref (snapshot);
 }
 
 static void
@@ -788,6 +1100,9 @@ mcd_dispatcher_constructed (GObject *object)
     g_signal_connect (priv->clients, "ready",
                       G_CALLBACK (mcd_dispatcher_client_registry_ready_cb),
                       object);
+    g_signal_connect (priv->clients, "deferred-clients-ready",
+                      G_CALLBACK (mcd_dispatcher_deferred_clients_ready_cb),
+                      object);
 
     dgc = tp_proxy_get_dbus_connection (TP_PROXY (priv->dbus_daemon));
 
@@ -891,6 +1206,8 @@ mcd_dispatcher_init (McdDispatcher * dispatcher)
     priv->operation_list_active = FALSE;
 
     priv->connections = g_hash_table_new (NULL, NULL);
+    priv->message_targets = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   NULL, message_target_forget);
 
     /* idempotent, not guaranteed to have been called yet */
     _mcd_plugin_loader_init ();
@@ -907,24 +1224,18 @@ mcd_dispatcher_new (TpDBusDaemon *dbus_daemon, McdMaster *master)
     return obj;
 }
 
-/*
- * _mcd_dispatcher_add_channel:
- * @dispatcher: the #McdDispatcher.
- * @channel: (transfer none): a #McdChannel which must own a #TpChannel
- * @requested: whether the channels were requested by MC.
- *
- * Add @channel to the dispatching state machine.
- */
-void
-_mcd_dispatcher_add_channel (McdDispatcher *dispatcher,
-                             McdChannel *channel,
-                             gboolean requested,
-                             gboolean only_observe)
+static void
+mcd_dispatcher_add_channel_full (McdDispatcher *dispatcher,
+                                 McdChannel *channel,
+                                 gboolean requested,
+                                 gboolean only_observe,
+                                 gboolean may_wait)
 {
     TpChannel *tp_channel = NULL;
     GStrv possible_handlers;
     McdRequest *request = NULL;
     gboolean internal_request = FALSE;
+    McdDispatchMatch *match = NULL;
 
     g_return_if_fail (MCD_IS_DISPATCHER (dispatcher));
     g_return_if_fail (MCD_IS_CHANNEL (channel));
@@ -934,14 +1245,22 @@ _mcd_dispatcher_add_channel (McdDispatcher *dispatcher,
            channel,
            mcd_channel_get_object_path (channel));
 
+    /* If some clients have not been introspected yet because they were not
+     * running, we'll want their filters from now on */
+    _mcd_client_registry_start_deferred_introspection (
+        dispatcher->priv->clients);
+
     if (only_observe)
     {
         g_return_if_fail (requested);
 
         /* these channels were requested "behind our back", so only call
          * ObserveChannels on them */
+        if (dispatcher->priv->batch != NULL)
+            match = mcd_dispatcher_batch_lookup (dispatcher, channel);
+
         _mcd_dispatcher_enter_state_machine (dispatcher, channel, NULL,
-                                             TRUE, TRUE);
+                                             match, TRUE, TRUE);
         return;
     }
 
@@ -955,12 +1274,54 @@ _mcd_dispatcher_add_channel (McdDispatcher *dispatcher,
 
     /* See if there are any handlers that can take all these channels */
     if (internal_request)
+    {
         possible_handlers = mcd_dispatcher_dup_internal_handlers ();
+    }
+    else if (request == NULL && dispatcher->priv->batch != NULL)
+    {
+        /* Without a request there is no preferred handler, so the result
+         * only depends on the channel's properties */
+        match = mcd_dispatcher_batch_lookup (dispatcher, channel);
+
+        if (!match->have_handlers)
+        {
+            match->possible_handlers = mcd_dispatcher_dup_possible_handlers (
+                dispatcher, NULL, _mcd_channel_get_property_view (channel),
+                NULL);
+            match->have_handlers = TRUE;
+        }
+
+        possible_handlers = g_strdupv (match->possible_handlers);
+    }
     else
         possible_handlers = mcd_dispatcher_dup_possible_handlers (dispatcher,
-                                                                  request,
-                                                                  tp_channel,
-                                                                  NULL);
+            request, _mcd_channel_get_property_view (channel), NULL);
+
+    /* If none of the clients we know about can handle it, one of those
+     * still being introspected might: wait for them, but not for long.
+     * Channels that some client can handle are dispatched straight away;
+     * Observers among the deferred clients will recover them if they ask
+     * to. */
+    if (possible_handlers == NULL && may_wait &&
+        _mcd_client_registry_is_introspecting_deferred (
+            dispatcher->priv->clients))
+    {
+        PendingChannel *pending = g_slice_new (PendingChannel);
+
+        DEBUG ("no handler yet, waiting for clients to be introspected");
+        pending->channel = g_object_ref (channel);
+        pending->requested = requested;
+        pending->only_observe = only_observe;
+        g_queue_push_tail (&dispatcher->priv->waiting_for_clients, pending);
+
+        if (dispatcher->priv->waiting_for_clients_id == 0)
+            dispatcher->priv->waiting_for_clients_id = g_timeout_add (
+                DEFERRED_CLIENTS_TIMEOUT_MS,
+                mcd_dispatcher_waiting_for_clients_timeout_cb, dispatcher);
+
+        g_strfreev (possible_handlers);
+        return;
+    }
 
     if (possible_handlers == NULL)
     {
@@ -976,11 +1337,29 @@ _mcd_dispatcher_add_channel (McdDispatcher *dispatcher,
     _mcd_channel_set_status (channel, MCD_CHANNEL_STATUS_DISPATCHING);
 
     _mcd_dispatcher_enter_state_machine (dispatcher, channel,
-        (const gchar * const *) possible_handlers, requested, FALSE);
+        (const gchar * const *) possible_handlers, match, requested, FALSE);
 
     g_strfreev (possible_handlers);
 }
 
+/*
+ * _mcd_dispatcher_add_channel:
+ * @dispatcher: the #McdDispatcher.
+ * @channel: (transfer none): a #McdChannel which must own a #TpChannel
+ * @requested: whether the channels were requested by MC.
+ *
+ * Add @channel to the dispatching state machine.
+ */
+void
+_mcd_dispatcher_add_channel (McdDispatcher *dispatcher,
+                             McdChannel *channel,
+                             gboolean requested,
+                             gboolean only_observe)
+{
+    mcd_dispatcher_add_channel_full (dispatcher, channel, requested,
+                                     only_observe, TRUE);
+}
+
 static void
 mcd_dispatcher_finish_reinvocation (McdChannel *request)
 {
@@ -1157,13 +1536,12 @@ _mcd_dispatcher_recover_channel (McdDispatcher *dispatcher,
     TpChannel *tp_channel;
 
     /* we must check if the channel is already being handled by some client; to
-     * do this, we can examine the active handlers' "HandledChannel" property.
-     * By now, we should already have done this, because startup has completed.
+     * do this, we can examine the active handlers' "HandledChannel" property,
+     * which we have done if startup has completed, or the snapshot of the
+     * handler map left by a previous instance of MC.
      */
     g_return_if_fail (MCD_IS_DISPATCHER (dispatcher));
     priv = dispatcher->priv;
-    g_return_if_fail (_mcd_client_registry_is_ready (
-        dispatcher->priv->clients));
 
     path = mcd_channel_get_object_path (channel);
     tp_channel = mcd_channel_get_tp_channel (channel);
@@ -1184,6 +1562,10 @@ _mcd_dispatcher_recover_channel (McdDispatcher *dispatcher,
     }
     else
     {
+        /* only channels that the snapshot says are handled are recovered
+         * before startup has completed */
+        g_return_if_fail (_mcd_client_registry_is_ready (priv->clients));
+
         DEBUG ("%s is unhandled, redispatching", path);
 
         requested = mcd_channel_is_requested (channel);
@@ -1191,6 +1573,41 @@ _mcd_dispatcher_recover_channel (McdDispatcher *dispatcher,
     }
 }
 
+/*
+ * _mcd_dispatcher_channel_has_handler:
+ *
+ * Returns: %TRUE if we know which process is handling @channel_path, even
+ *  if only from the snapshot of the handler map
+ */
+gboolean
+_mcd_dispatcher_channel_has_handler (McdDispatcher *self,
+                                     const gchar *channel_path)
+{
+    g_return_val_if_fail (MCD_IS_DISPATCHER (self), FALSE);
+
+    return (_mcd_handler_map_get_handler (self->priv->handler_map,
+                                          channel_path, NULL) != NULL);
+}
+
+/*
+ * _mcd_dispatcher_prune_restored_channels:
+ * @account_path: an account whose connection is connected
+ * @live_paths: the set of channels that its connection has
+ *
+ * Forget any channels of @account_path that were restored from the handler
+ * map snapshot, but are not in @live_paths.
+ */
+void
+_mcd_dispatcher_prune_restored_channels (McdDispatcher *self,
+                                         const gchar *account_path,
+                                         GHashTable *live_paths)
+{
+    g_return_if_fail (MCD_IS_DISPATCHER (self));
+
+    _mcd_handler_map_prune_restored_channels (self->priv->handler_map,
+                                              account_path, live_paths);
+}
+
 static gboolean
 check_preferred_handler (const gchar *preferred_handler,
     GError **error)
@@ -1389,6 +1806,15 @@ mcd_dispatcher_lost_connection (gpointer data,
     g_object_unref (self);
 }
 
+/* Returns: (transfer none) (element-type McdDispatchOperation): the
+ * dispatch operations that have not finished yet */
+const GList *
+_mcd_dispatcher_get_operations (McdDispatcher *self)
+{
+    g_return_val_if_fail (MCD_IS_DISPATCHER (self), NULL);
+    return self->priv->operations;
+}
+
 /* FIXME: this only needs to exist because McdConnection calls it in order
  * to preload caps before Connect */
 GPtrArray *
@@ -1425,15 +1851,66 @@ _mcd_dispatcher_add_connection (McdDispatcher *self,
 
         _mcd_connection_start_dispatching (connection, vas);
 
-        g_ptr_array_foreach (vas, (GFunc) g_value_array_free, NULL);
         g_ptr_array_unref (vas);
     }
+    else if (_mcd_handler_map_has_restored_channels (self->priv->handler_map)
+             && _mcd_connection_is_ready (connection))
+    {
+        /* the channels that the handler map snapshot says are still
+         * handled needn't wait for us to be ready */
+        _mcd_connection_recover_handled_channels (connection);
+    }
     /* else _mcd_connection_start_dispatching will be called when we're ready
      * for it */
 }
 
-/* org.freedesktop.Telepathy.ChannelDispatcher.Messages */
+/* org.freedesktop.Telepathy.ChannelDispatcher.Messages
+ *
+ * Getting a channel to send a message on means creating an internal
+ * request, waiting for EnsureChannel and dispatching the result. Only
+ * channels that a Handler already has are reused: if the result is a
+ * channel that some Handler is handling, we remember it for that
+ * (account, target) pair and send any further messages straight to it,
+ * until it has been idle for MESSAGE_CHANNEL_IDLE_SECONDS or is
+ * invalidated. Messages that arrive while the channel is still being
+ * ensured wait for it in a queue, up to MAX_QUEUED_MESSAGES of them.
+ *
+ * If nothing was handling the channel, MC handles it internally and
+ * closes it as soon as the message has been sent, as it always has:
+ * holding on to it would stop a client that requests the same channel
+ * from being given it. Any messages that queued up behind that one make
+ * their own requests.
+ *
+ * If sending on a remembered channel fails, we forget it and try once
+ * more with a new request, like we do if the request itself fails. */
+
+#define MESSAGE_CHANNEL_IDLE_SECONDS 5
+#define MAX_QUEUED_MESSAGES 64
+
+typedef struct _MessageContext MessageContext;
+
 typedef struct
+{
+    gint ref_count;
+    /* borrowed; the dispatcher owns us while we are in message_targets */
+    McdDispatcher *dispatcher;
+    /* owned "account-path target-id" */
+    gchar *key;
+    /* the message whose internal request is ensuring the channel, or
+     * NULL once we have the channel; borrowed */
+    MessageContext *ensuring;
+    /* owned MessageContext waiting for @channel */
+    GQueue pending;
+    /* owned, or NULL while the channel is being ensured */
+    McdChannel *channel;
+    TpChannel *tp_channel;
+    gulong invalidated_id;
+    /* number of SendMessage calls to @tp_channel awaiting a reply */
+    guint in_flight;
+    guint expiry_id;
+} MessageTarget;
+
+struct _MessageContext
 {
     McdDispatcher *dispatcher;
     gchar *account_path;
@@ -1443,7 +1920,14 @@ typedef struct
     guint tries;
     gboolean close_after;
     DBusGMethodInvocation *dbus_context;
-} MessageContext;
+    /* if not NULL, we are ensuring this target's channel */
+    MessageTarget *target;
+    /* if not NULL, a ref to the target on whose channel we are being sent */
+    MessageTarget *sending_on;
+};
+
+static void message_target_unref (MessageTarget *target);
+static void message_target_remove (MessageTarget *target);
 
 static MessageContext *
 message_context_new (McdDispatcher *dispatcher,
@@ -1498,6 +1982,18 @@ message_context_free (gpointer ctx)
 {
     MessageContext *context = ctx;
 
+    /* we were ensuring a channel for the messages queued behind us, and
+     * failed: they fail too */
+    if (context->target != NULL)
+    {
+        MessageTarget *target = context->target;
+
+        context->target = NULL;
+        target->ensuring = NULL;
+        message_target_remove (target);
+    }
+
+    tp_clear_pointer (&context->sending_on, message_target_unref);
     tp_clear_pointer (&context->payload, g_ptr_array_unref);
     tp_clear_pointer (&context->account_path, g_free);
     tp_clear_pointer (&context->target_id, g_free);
@@ -1517,6 +2013,211 @@ message_context_free (gpointer ctx)
     g_slice_free (MessageContext, context);
 }
 
+static MessageTarget *
+message_target_ref (MessageTarget *target)
+{
+    target->ref_count++;
+    return target;
+}
+
+static void
+message_target_unref (MessageTarget *target)
+{
+    if (--target->ref_count > 0)
+        return;
+
+    tp_clear_object (&target->tp_channel);
+    tp_clear_object (&target->channel);
+    g_free (target->key);
+    g_slice_free (MessageTarget, target);
+}
+
+/* called when @p is removed from message_targets */
+static void
+message_target_forget (gpointer p)
+{
+    MessageTarget *target = p;
+    MessageContext *message;
+
+    if (target->ensuring != NULL)
+    {
+        target->ensuring->target = NULL;
+        target->ensuring = NULL;
+    }
+
+    /* this fails them with TP_ERROR_TERMINATED */
+    while ((message = g_queue_pop_head (&target->pending)) != NULL)
+        message_context_free (message);
+
+    if (target->expiry_id != 0)
+    {
+        g_source_remove (target->expiry_id);
+        target->expiry_id = 0;
+    }
+
+    if (target->invalidated_id != 0)
+    {
+        g_signal_handler_disconnect (target->tp_channel,
+                                     target->invalidated_id);
+        target->invalidated_id = 0;
+    }
+
+    message_target_unref (target);
+}
+
+static gchar *
+message_target_dup_key (const gchar *account_path,
+                        const gchar *target_id)
+{
+    return g_strdup_printf ("%s %s", account_path, target_id);
+}
+
+static void
+message_target_remove (MessageTarget *target)
+{
+    GHashTable *targets = target->dispatcher->priv->message_targets;
+
+    /* it might already have been replaced, or the dispatcher disposed */
+    if (targets != NULL && g_hash_table_lookup (targets, target->key) == target)
+        g_hash_table_remove (targets, target->key);
+}
+
+static gboolean
+message_target_expire_cb (gpointer data)
+{
+    MessageTarget *target = data;
+
+    /* try again when the replies are in */
+    if (target->in_flight > 0)
+        return TRUE;
+
+    target->expiry_id = 0;
+    DEBUG ("channel for %s idle, forgetting it", target->key);
+    message_target_remove (target);
+    return FALSE;
+}
+
+static void
+message_target_touch (MessageTarget *target)
+{
+    if (target->expiry_id != 0)
+        g_source_remove (target->expiry_id);
+
+    target->expiry_id = g_timeout_add_seconds (MESSAGE_CHANNEL_IDLE_SECONDS,
+                                               message_target_expire_cb,
+                                               target);
+}
+
+static void
+message_target_invalidated_cb (TpProxy *proxy,
+                               guint domain,
+                               gint code,
+                               gchar *message,
+                               gpointer data)
+{
+    MessageTarget *target = data;
+
+    DEBUG ("channel for %s invalidated: %s", target->key, message);
+    message_target_remove (target);
+}
+
+static void messages_send_message_start (DBusGMethodInvocation *context,
+                                         MessageContext *message);
+
+static void
+message_target_sent_cb (TpChannel *proxy,
+                        const gchar *token,
+                        const GError *error,
+                        gpointer data,
+                        GObject *weak)
+{
+    MessageContext *message = data;
+    MessageTarget *target = message->sending_on;
+
+    target->in_flight--;
+
+    if (error == NULL)
+    {
+        tp_svc_channel_dispatcher_interface_messages1_return_from_send_message (
+            message->dbus_context, token);
+        message_context_set_return_context (message, NULL);
+    }
+    else if (message->tries++ == 0)
+    {
+        DEBUG ("error sending on cached channel for %s, retrying with a "
+               "new request: %s", target->key, error->message);
+        message_target_remove (target);
+        tp_clear_pointer (&message->sending_on, message_target_unref);
+        messages_send_message_start (message->dbus_context, message);
+        return;
+    }
+    else
+    {
+        DEBUG ("error: %s", error->message);
+        message_context_return_error (message, error);
+    }
+
+    message_context_free (message);
+}
+
+static void
+message_target_send (MessageTarget *target,
+                     MessageContext *message)
+{
+    DEBUG ("sending on cached channel for %s", target->key);
+    target->in_flight++;
+    message_target_touch (target);
+    message->sending_on = message_target_ref (target);
+
+    /* the callback is always called, and either frees @message or sends
+     * it again */
+    tp_cli_channel_interface_messages_call_send_message (target->tp_channel,
+        -1, message->payload, message->flags, message_target_sent_cb,
+        message, NULL, NULL);
+}
+
+static void
+message_target_set_channel (MessageTarget *target,
+                            McdChannel *channel)
+{
+    g_assert (target->channel == NULL);
+
+    target->ensuring = NULL;
+    target->channel = g_object_ref (channel);
+    target->tp_channel = g_object_ref (mcd_channel_get_tp_channel (channel));
+    target->invalidated_id = g_signal_connect (target->tp_channel,
+        "invalidated", G_CALLBACK (message_target_invalidated_cb), target);
+}
+
+static void
+message_target_flush (MessageTarget *target)
+{
+    MessageContext *message;
+
+    while ((message = g_queue_pop_head (&target->pending)) != NULL)
+        message_target_send (target, message);
+
+    message_target_touch (target);
+}
+
+/* we are handling the channel internally and will close it, so the
+ * messages waiting for it have to make their own requests */
+static void
+message_target_abandon (MessageTarget *target)
+{
+    GQueue pending;
+    MessageContext *message;
+
+    /* steal them, so that forgetting the target doesn't fail them */
+    pending = target->pending;
+    g_queue_init (&target->pending);
+    target->ensuring = NULL;
+    message_target_remove (target);
+
+    while ((message = g_queue_pop_head (&pending)) != NULL)
+        messages_send_message_start (message->dbus_context, message);
+}
+
 static void
 send_message_submitted (TpChannel *proxy,
                         const gchar *token,
@@ -1542,16 +2243,13 @@ send_message_submitted (TpChannel *proxy,
         message_context_return_error (message, error);
     }
 
-    _mcd_request_unblock_account (message->account_path);
+    _mcd_account_unblock_requests (_mcd_request_get_account (request));
     _mcd_request_clear_internal_handler (request);
 
     if (close_after)
         _mcd_channel_close (channel);
 }
 
-static void messages_send_message_start (DBusGMethodInvocation *context,
-                                         MessageContext *message);
-
 static void
 send_message_got_channel (McdRequest *request,
                           McdChannel *channel,
@@ -1565,7 +2263,21 @@ send_message_got_channel (McdRequest *request,
     /* successful channel creation */
     if (channel != NULL)
     {
+        MessageTarget *target = message->target;
+
         message->close_after = close_after;
+        message->target = NULL;
+
+        /* if another Handler has the channel, keep it for the next
+         * messages to this target; if it's ours, it is closed after this
+         * message, and the next ones will have to get their own */
+        if (target != NULL)
+        {
+            if (close_after)
+                message_target_abandon (target);
+            else
+                message_target_set_channel (target, channel);
+        }
 
         DEBUG ("calling send on channel interface");
         tp_cli_channel_interface_messages_call_send_message
@@ -1577,6 +2289,10 @@ send_message_got_channel (McdRequest *request,
            message,
            NULL,
            G_OBJECT (channel));
+
+        /* the messages that were queued behind this one go after it */
+        if (target != NULL && !close_after)
+            message_target_flush (target);
     }
     else /* doom and despair: no channel */
     {
@@ -1584,14 +2300,16 @@ send_message_got_channel (McdRequest *request,
         {
             messages_send_message_start (message->dbus_context, message);
             /* we created a new lock above, we can now release the old one: */
-            _mcd_request_unblock_account (message->account_path);
+            _mcd_account_unblock_requests (
+                _mcd_request_get_account (request));
         }
         else
         {
             GError *error = g_error_new_literal (TP_ERROR, TP_ERROR_CANCELLED,
                                                  "Channel closed by owner");
 
-            _mcd_request_unblock_account (message->account_path);
+            _mcd_account_unblock_requests (
+                _mcd_request_get_account (request));
             message_context_return_error (message, error);
             _mcd_request_clear_internal_handler (request);
             g_error_free (error);
@@ -1703,6 +2421,56 @@ messages_send_message (TpSvcChannelDispatcherInterfaceMessages1 *iface,
     McdDispatcher *self= MCD_DISPATCHER (iface);
     MessageContext *message =
       message_context_new (self, account_path, target_id, payload, flags);
+    MessageTarget *target;
+    gchar *key;
+
+    if (tp_str_empty (account_path) || tp_str_empty (target_id))
+    {
+        /* messages_send_message_start() will fail it */
+        messages_send_message_start (context, message);
+        return;
+    }
+
+    key = message_target_dup_key (account_path, target_id);
+    target = g_hash_table_lookup (self->priv->message_targets, key);
+
+    if (target != NULL)
+    {
+        g_free (key);
+        message_context_set_return_context (message, context);
+
+        if (target->channel != NULL)
+        {
+            message_target_send (target, message);
+        }
+        else if (target->pending.length < MAX_QUEUED_MESSAGES)
+        {
+            DEBUG ("queueing message until the channel for %s is ready",
+                   target->key);
+            g_queue_push_tail (&target->pending, message);
+        }
+        else
+        {
+            GError *error = g_error_new (TP_ERROR, TP_ERROR_NOT_AVAILABLE,
+                "Too many messages are waiting for a channel to %s",
+                target_id);
+
+            message_context_return_error (message, error);
+            message_context_free (message);
+            g_error_free (error);
+        }
+
+        return;
+    }
+
+    target = g_slice_new0 (MessageTarget);
+    target->ref_count = 1;
+    target->dispatcher = self;
+    target->key = key;
+    target->ensuring = message;
+    g_queue_init (&target->pending);
+    g_hash_table_insert (self->priv->message_targets, target->key, target);
+    message->target = target;
 
     messages_send_message_start (context, message);
 }
@@ -1928,10 +2696,14 @@ add_possible_handlers (McdDispatcher *self,
     const gchar *preferred_handler)
 {
     GStrv possible_handlers;
+    McdPropertyView *properties;
     guint i;
 
+    properties = _mcd_property_view_new_for_tp_chan (tp_channel);
+    g_return_if_fail (properties != NULL);
     possible_handlers = mcd_dispatcher_dup_possible_handlers (self,
-        NULL, tp_channel, NULL);
+        NULL, properties, NULL);
+    _mcd_property_view_unref (properties);
 
     for (i = 0; possible_handlers[i] != NULL; i++)
       {
@@ -82,6 +82,12 @@ void _mcd_handler_map_set_channel_handled (McdHandlerMap *self,
 
 GList *_mcd_handler_map_get_handled_channels (McdHandlerMap *self);
 
+gboolean _mcd_handler_map_has_restored_channels (McdHandlerMap *self);
+
+void _mcd_handler_map_prune_restored_channels (McdHandlerMap *self,
+                                               const gchar *account_path,
+                                               GHashTable *live_paths);
+
 const gchar *_mcd_handler_map_get_channel_account (McdHandlerMap *self,
                                                    const gchar *channel_path);
 
@@ -23,13 +23,46 @@
  *
  */
 
+/*
+ * If MC_HANDLER_MAP_SNAPSHOT is set, the map is also written to a snapshot
+ * in the user's runtime directory, so that a restarted MC knows straight
+ * away which process handles each channel it is about to recover.
+ *
+ * The snapshot is an append-only log of lines:
+ *
+ *  + <channel path> <unique name> <well-known name> <account path>
+ *  - <channel path>
+ *
+ * separated by tabs (which cannot appear in object paths or bus names),
+ * with empty fields for unknown names. Records are batched and appended
+ * from an idle callback; when most of the log is obsolete, it is rewritten
+ * with one "+" line per channel. There is one log per bus, named after the
+ * bus's server ID.
+ *
+ * Nothing in the snapshot is trusted blindly: each restored handler's
+ * unique name is watched as usual, and if it no longer exists, its channels
+ * are forgotten, exactly as if it had crashed. Restored channels that are
+ * missing from their connection's Channels when it connects are forgotten
+ * too. The rest are recovered as soon as their connection is ready, without
+ * waiting for every Client to be introspected.
+ */
+
 #include "config.h"
 #include "mcd-handler-map-priv.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
+#include <glib/gstdio.h>
 #include <telepathy-glib/telepathy-glib.h>
 
 #include "channel-utils.h"
 #include "mcd-channel-priv.h"
+#include "mcd-misc.h"
 
 G_DEFINE_TYPE (McdHandlerMap, _mcd_handler_map, G_TYPE_OBJECT);
 
@@ -42,25 +75,39 @@ struct _McdHandlerMapPrivate
     /* The well-known bus name we invoked in channel_processes[path]
      * owned gchar *object_path => owned gchar *well_known_name */
     GHashTable *channel_clients;
-    /* owned gchar *unique_name => malloc'd gsize, number of channels */
+    /* The reverse of channel_processes, so that we can find a handler's
+     * channels without looking at everyone else's
+     * owned gchar *unique_name => owned set of owned gchar *object_path */
     GHashTable *handler_processes;
     /* owned gchar *object_path => ref'd TpChannel */
     GHashTable *handled_channels;
     /* owned gchar *object_path =>  owned gchar *account_path */
     GHashTable *channel_accounts;
+    /* Channels restored from the snapshot that no McdChannel has claimed
+     * yet, which might have closed while MC was not running
+     * set of owned gchar *object_path */
+    GHashTable *restored_channels;
+
+    /* NULL if we are not keeping a snapshot */
+    gchar *snapshot_path;
+    /* open for appending, or NULL if not opened yet */
+    FILE *snapshot;
+    /* records not yet appended to the snapshot */
+    GString *snapshot_pending;
+    /* number of records in the snapshot, including pending ones */
+    guint snapshot_records;
+    guint snapshot_flush_id;
 };
 
+#define SNAPSHOT_HEADER "# mission-control handler map 1\n"
+/* don't bother compacting the snapshot until it has this many records */
+#define SNAPSHOT_MIN_COMPACT 256
+
 enum {
     PROP_0,
     PROP_DBUS_DAEMON
 };
 
-static void
-slice_free_gsize (gpointer p)
-{
-    g_slice_free (gsize, p);
-}
-
 static void
 _mcd_handler_map_init (McdHandlerMap *self)
 {
@@ -76,9 +123,7 @@ _mcd_handler_map_init (McdHandlerMap *self)
                                                          g_free, g_free);
 
     self->priv->handler_processes = g_hash_table_new_full (g_str_hash,
-                                                           g_str_equal,
-                                                           g_free,
-                                                           slice_free_gsize);
+        g_str_equal, g_free, (GDestroyNotify) g_hash_table_unref);
 
     self->priv->handled_channels = g_hash_table_new_full (g_str_hash,
                                                           g_str_equal,
@@ -89,6 +134,10 @@ _mcd_handler_map_init (McdHandlerMap *self)
                                                           g_str_equal,
                                                           g_free,
                                                           g_free);
+
+    self->priv->restored_channels = g_hash_table_new_full (g_str_hash,
+                                                           g_str_equal,
+                                                           g_free, NULL);
 }
 
 static void
@@ -136,11 +185,21 @@ static void mcd_handler_map_name_owner_cb (TpDBusDaemon *dbus_daemon,
                                            const gchar *new_owner,
                                            gpointer user_data);
 
+static gboolean mcd_handler_map_snapshot_flush (McdHandlerMap *self,
+                                                gboolean compact);
+
 static void
 _mcd_handler_map_dispose (GObject *object)
 {
     McdHandlerMap *self = MCD_HANDLER_MAP (object);
 
+    if (self->priv->snapshot_flush_id != 0)
+    {
+        g_source_remove (self->priv->snapshot_flush_id);
+        self->priv->snapshot_flush_id = 0;
+        mcd_handler_map_snapshot_flush (self, FALSE);
+    }
+
     tp_clear_pointer (&self->priv->handled_channels, g_hash_table_unref);
 
     if (self->priv->handler_processes != NULL)
@@ -174,16 +233,331 @@ _mcd_handler_map_finalize (GObject *object)
     tp_clear_pointer (&self->priv->channel_processes, g_hash_table_unref);
     tp_clear_pointer (&self->priv->channel_clients, g_hash_table_unref);
     tp_clear_pointer (&self->priv->channel_accounts, g_hash_table_unref);
+    tp_clear_pointer (&self->priv->restored_channels, g_hash_table_unref);
+    tp_clear_pointer (&self->priv->snapshot, fclose);
+
+    if (self->priv->snapshot_pending != NULL)
+        g_string_free (self->priv->snapshot_pending, TRUE);
+
+    g_free (self->priv->snapshot_path);
 
     G_OBJECT_CLASS (_mcd_handler_map_parent_class)->finalize (object);
 }
 
+static gboolean
+snapshot_enabled (void)
+{
+    static gint enabled = -1;
+
+    if (G_UNLIKELY (enabled < 0))
+        enabled = mcd_env_flag_enabled ("MC_HANDLER_MAP_SNAPSHOT");
+
+    return enabled;
+}
+
+static gchar *
+mcd_handler_map_dup_snapshot_path (McdHandlerMap *self)
+{
+    DBusConnection *dconn = dbus_g_connection_get_connection (
+        tp_proxy_get_dbus_connection (self->priv->dbus_daemon));
+    gchar *server_id = dbus_connection_get_server_id (dconn);
+    gchar *basename;
+    gchar *path;
+
+    if (server_id == NULL)
+        return NULL;
+
+    basename = g_strdup_printf ("handlers-%s.log", server_id);
+    dbus_free (server_id);
+    path = g_build_filename (g_get_user_runtime_dir (), "telepathy",
+                             "mission-control", basename, NULL);
+    g_free (basename);
+    return path;
+}
+
+static void
+append_snapshot_record (GString *str,
+                        const gchar *channel_path,
+                        const gchar *unique_name,
+                        const gchar *well_known_name,
+                        const gchar *account_path)
+{
+    if (unique_name == NULL)
+    {
+        g_string_append_printf (str, "-\t%s\n", channel_path);
+    }
+    else
+    {
+        g_string_append_printf (str, "+\t%s\t%s\t%s\t%s\n", channel_path,
+                                unique_name,
+                                well_known_name != NULL ? well_known_name : "",
+                                account_path != NULL ? account_path : "");
+    }
+}
+
+/*
+ * Write out the pending records. If @compact, or if most of the snapshot
+ * would be obsolete records, rewrite it from scratch instead.
+ *
+ * Returns: %FALSE, to be usable as an idle callback
+ */
+static gboolean
+mcd_handler_map_snapshot_flush (McdHandlerMap *self,
+                                gboolean compact)
+{
+    guint live = g_hash_table_size (self->priv->channel_processes);
+    GError *error = NULL;
+
+    self->priv->snapshot_flush_id = 0;
+
+    if (self->priv->snapshot_records > SNAPSHOT_MIN_COMPACT &&
+        self->priv->snapshot_records > 2 * live)
+        compact = TRUE;
+
+    if (compact)
+    {
+        GString *str = g_string_new (SNAPSHOT_HEADER);
+        gchar *dirname = g_path_get_dirname (self->priv->snapshot_path);
+        GHashTableIter iter;
+        gpointer k, v;
+
+        g_hash_table_iter_init (&iter, self->priv->channel_processes);
+
+        while (g_hash_table_iter_next (&iter, &k, &v))
+            append_snapshot_record (str, k, v,
+                g_hash_table_lookup (self->priv->channel_clients, k),
+                g_hash_table_lookup (self->priv->channel_accounts, k));
+
+        tp_clear_pointer (&self->priv->snapshot, fclose);
+        g_string_truncate (self->priv->snapshot_pending, 0);
+        self->priv->snapshot_records = live;
+
+        if (g_mkdir_with_parents (dirname, 0700) != 0)
+        {
+            gint e = errno;
+
+            g_set_error (&error, G_FILE_ERROR, g_file_error_from_errno (e),
+                         "Unable to create directory %s: %s", dirname,
+                         g_strerror (e));
+        }
+        else if (g_file_set_contents (self->priv->snapshot_path, str->str,
+                                      str->len, &error))
+        {
+            DEBUG ("wrote %u channels to %s", live,
+                   self->priv->snapshot_path);
+        }
+
+        g_free (dirname);
+        g_string_free (str, TRUE);
+    }
+    else if (self->priv->snapshot_pending->len > 0)
+    {
+        if (self->priv->snapshot == NULL)
+            self->priv->snapshot = g_fopen (self->priv->snapshot_path, "a");
+
+        if (self->priv->snapshot == NULL ||
+            fputs (self->priv->snapshot_pending->str,
+                   self->priv->snapshot) < 0 ||
+            fflush (self->priv->snapshot) != 0)
+        {
+            gint e = errno;
+
+            g_set_error (&error, G_FILE_ERROR, g_file_error_from_errno (e),
+                         "Unable to append to %s: %s",
+                         self->priv->snapshot_path, g_strerror (e));
+            tp_clear_pointer (&self->priv->snapshot, fclose);
+        }
+
+        g_string_truncate (self->priv->snapshot_pending, 0);
+    }
+
+    if (error != NULL)
+    {
+        /* it's only an optimization; carry on without it */
+        WARNING ("%s", error->message);
+        g_clear_error (&error);
+        tp_clear_pointer (&self->priv->snapshot_path, g_free);
+    }
+
+    return FALSE;
+}
+
+static gboolean
+mcd_handler_map_snapshot_flush_cb (gpointer user_data)
+{
+    return mcd_handler_map_snapshot_flush (user_data, FALSE);
+}
+
+/* Queue a record of what we currently know about @channel_path */
+static void
+mcd_handler_map_snapshot_record (McdHandlerMap *self,
+                                 const gchar *channel_path)
+{
+    if (self->priv->snapshot_path == NULL)
+        return;
+
+    append_snapshot_record (self->priv->snapshot_pending, channel_path,
+        g_hash_table_lookup (self->priv->channel_processes, channel_path),
+        g_hash_table_lookup (self->priv->channel_clients, channel_path),
+        g_hash_table_lookup (self->priv->channel_accounts, channel_path));
+    self->priv->snapshot_records++;
+
+    if (self->priv->snapshot_flush_id == 0)
+        self->priv->snapshot_flush_id = g_idle_add_full (G_PRIORITY_LOW,
+            mcd_handler_map_snapshot_flush_cb, self, NULL);
+}
+
+static void mcd_handler_map_add_handler_path (McdHandlerMap *self,
+                                              const gchar *unique_name,
+                                              const gchar *channel_path);
+
+/* Replay the snapshot left by a previous instance of MC on this bus */
+static void
+mcd_handler_map_snapshot_load (McdHandlerMap *self)
+{
+    gchar *contents = NULL;
+    GError *error = NULL;
+    GHashTable *records;
+    GHashTableIter iter;
+    gpointer k, v;
+    gchar *line, *next;
+
+    if (!g_file_get_contents (self->priv->snapshot_path, &contents, NULL,
+                              &error))
+    {
+        DEBUG ("not using %s: %s", self->priv->snapshot_path,
+               error->message);
+        g_error_free (error);
+        return;
+    }
+
+    if (!g_str_has_prefix (contents, SNAPSHOT_HEADER))
+    {
+        DEBUG ("ignoring %s: not a handler map snapshot",
+               self->priv->snapshot_path);
+        g_free (contents);
+        return;
+    }
+
+    /* borrowed gchar *channel_path => borrowed gchar **fields, the latest
+     * "+" record for that channel */
+    records = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                     g_free);
+
+    for (line = contents + strlen (SNAPSHOT_HEADER);
+         line != NULL && *line != '\0';
+         line = next)
+    {
+        gchar **fields;
+        guint i;
+
+        next = strchr (line, '\n');
+
+        /* ignore a partly-written last line */
+        if (next == NULL)
+            break;
+
+        *next++ = '\0';
+        fields = g_new0 (gchar *, 6);
+
+        /* split in place; g_strsplit would copy every field */
+        fields[0] = line;
+
+        for (i = 1; i < 5; i++)
+        {
+            gchar *tab = strchr (fields[i - 1], '\t');
+
+            if (tab == NULL)
+                break;
+
+            *tab = '\0';
+            fields[i] = tab + 1;
+        }
+
+        if (!tp_strdiff (fields[0], "-") && fields[1] != NULL)
+        {
+            g_hash_table_remove (records, fields[1]);
+            g_free (fields);
+        }
+        else if (!tp_strdiff (fields[0], "+") && fields[4] != NULL &&
+                 tp_dbus_check_valid_object_path (fields[1], NULL) &&
+                 tp_dbus_check_valid_bus_name (fields[2],
+                     TP_DBUS_NAME_TYPE_UNIQUE, NULL))
+        {
+            g_hash_table_insert (records, fields[1], fields);
+        }
+        else
+        {
+            DEBUG ("ignoring malformed line in %s",
+                   self->priv->snapshot_path);
+            g_free (fields);
+        }
+    }
+
+    g_hash_table_iter_init (&iter, records);
+
+    while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+        gchar **fields = v;
+
+        DEBUG ("%s was handled by %s (%s) before we restarted", fields[1],
+               fields[2], fields[3]);
+
+        g_hash_table_insert (self->priv->channel_processes,
+                             g_strdup (fields[1]), g_strdup (fields[2]));
+
+        if (fields[3][0] != '\0')
+            g_hash_table_insert (self->priv->channel_clients,
+                                 g_strdup (fields[1]), g_strdup (fields[3]));
+
+        if (fields[4][0] != '\0')
+            g_hash_table_insert (self->priv->channel_accounts,
+                                 g_strdup (fields[1]), g_strdup (fields[4]));
+
+        g_hash_table_add (self->priv->restored_channels,
+                          g_strdup (fields[1]));
+
+        /* if the handler has gone away since, this will tell us so */
+        mcd_handler_map_add_handler_path (self, fields[2], fields[1]);
+    }
+
+    g_hash_table_unref (records);
+    g_free (contents);
+}
+
+static void
+_mcd_handler_map_constructed (GObject *object)
+{
+    McdHandlerMap *self = MCD_HANDLER_MAP (object);
+    void (*chain_up) (GObject *) =
+        G_OBJECT_CLASS (_mcd_handler_map_parent_class)->constructed;
+
+    if (chain_up != NULL)
+        chain_up (object);
+
+    g_return_if_fail (self->priv->dbus_daemon != NULL);
+
+    if (!snapshot_enabled ())
+        return;
+
+    self->priv->snapshot_path = mcd_handler_map_dup_snapshot_path (self);
+
+    if (self->priv->snapshot_path == NULL)
+        return;
+
+    self->priv->snapshot_pending = g_string_new ("");
+    mcd_handler_map_snapshot_load (self);
+    /* start afresh with only what we just restored */
+    mcd_handler_map_snapshot_flush (self, TRUE);
+}
+
 static void
 _mcd_handler_map_class_init (McdHandlerMapClass *klass)
 {
     GObjectClass *object_class = (GObjectClass *) klass;
 
     g_type_class_add_private (object_class, sizeof (McdHandlerMapPrivate));
+    object_class->constructed = _mcd_handler_map_constructed;
     object_class->dispose = _mcd_handler_map_dispose;
     object_class->get_property = _mcd_handler_map_get_property;
     object_class->set_property = _mcd_handler_map_set_property;
@@ -222,6 +596,52 @@ _mcd_handler_map_get_handler (McdHandlerMap *self,
     return g_hash_table_lookup (self->priv->channel_processes, channel_path);
 }
 
+/* Record that @unique_name handles @channel_path in handler_processes,
+ * watching @unique_name if it wasn't handling anything before */
+static void
+mcd_handler_map_add_handler_path (McdHandlerMap *self,
+                                  const gchar *unique_name,
+                                  const gchar *channel_path)
+{
+    GHashTable *paths = g_hash_table_lookup (self->priv->handler_processes,
+                                             unique_name);
+
+    if (paths == NULL)
+    {
+        paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                       NULL);
+        g_hash_table_insert (self->priv->handler_processes,
+                             g_strdup (unique_name), paths);
+        tp_dbus_daemon_watch_name_owner (self->priv->dbus_daemon, unique_name,
+                                         mcd_handler_map_name_owner_cb, self,
+                                         NULL);
+    }
+
+    g_hash_table_add (paths, g_strdup (channel_path));
+}
+
+/* Forget that @unique_name handles @channel_path, and stop watching it if
+ * that was its last channel */
+static void
+mcd_handler_map_remove_handler_path (McdHandlerMap *self,
+                                     const gchar *unique_name,
+                                     const gchar *channel_path)
+{
+    GHashTable *paths = g_hash_table_lookup (self->priv->handler_processes,
+                                             unique_name);
+
+    g_return_if_fail (paths != NULL);
+
+    g_hash_table_remove (paths, channel_path);
+
+    if (g_hash_table_size (paths) == 0)
+    {
+        tp_dbus_daemon_cancel_name_owner_watch (self->priv->dbus_daemon,
+            unique_name, mcd_handler_map_name_owner_cb, self);
+        g_hash_table_remove (self->priv->handler_processes, unique_name);
+    }
+}
+
 /*
  * @channel_path: a channel
  * @unique_name: the unique name of the handler
@@ -240,7 +660,6 @@ _mcd_handler_map_set_path_handled (McdHandlerMap *self,
                                    const gchar *well_known_name)
 {
     const gchar *old;
-    gsize *counter;
 
     /* In case we want to re-invoke the same client later, remember its
      * well-known name, if we know it. (In edge cases where we're recovering
@@ -254,45 +673,20 @@ _mcd_handler_map_set_path_handled (McdHandlerMap *self,
 
     old = g_hash_table_lookup (self->priv->channel_processes, channel_path);
 
-    if (!tp_strdiff (old, unique_name))
+    /* if the new handler is the same as the old, there's nothing to do
+     * except update the snapshot */
+    if (tp_strdiff (old, unique_name))
     {
-        /* no-op - the new handler is the same as the old */
-        return;
-    }
+        if (old != NULL)
+            mcd_handler_map_remove_handler_path (self, old, channel_path);
 
-    if (old != NULL)
-    {
-        counter = g_hash_table_lookup (self->priv->handler_processes,
-                                       old);
+        g_hash_table_insert (self->priv->channel_processes,
+                             g_strdup (channel_path), g_strdup (unique_name));
 
-        if (--*counter == 0)
-        {
-            tp_dbus_daemon_cancel_name_owner_watch (self->priv->dbus_daemon,
-                old, mcd_handler_map_name_owner_cb, self);
-            g_hash_table_remove (self->priv->handler_processes, old);
-        }
+        mcd_handler_map_add_handler_path (self, unique_name, channel_path);
     }
 
-    g_hash_table_insert (self->priv->channel_processes,
-                         g_strdup (channel_path), g_strdup (unique_name));
-
-    counter = g_hash_table_lookup (self->priv->handler_processes,
-                                   unique_name);
-
-    if (counter == NULL)
-    {
-        counter = g_slice_new (gsize);
-        *counter = 1;
-        g_hash_table_insert (self->priv->handler_processes,
-                             g_strdup (unique_name), counter);
-        tp_dbus_daemon_watch_name_owner (self->priv->dbus_daemon, unique_name,
-                                         mcd_handler_map_name_owner_cb, self,
-                                         NULL);
-    }
-    else
-    {
-        ++*counter;
-    }
+    mcd_handler_map_snapshot_record (self, channel_path);
 }
 
 static void
@@ -312,24 +706,16 @@ handled_channel_invalidated_cb (TpChannel *channel,
 
     handler = g_hash_table_lookup (self->priv->channel_processes, path);
 
+    g_hash_table_remove (self->priv->handled_channels, path);
+    g_hash_table_remove (self->priv->channel_accounts, path);
+
     if (handler != NULL)
     {
-        gsize *counter = g_hash_table_lookup (self->priv->handler_processes,
-                                              handler);
-
-        g_assert (counter != NULL);
-
-        if (--*counter == 0)
-        {
-            g_hash_table_remove (self->priv->handler_processes, handler);
-        }
-
+        mcd_handler_map_remove_handler_path (self, handler, path);
         g_hash_table_remove (self->priv->channel_processes, path);
+        mcd_handler_map_snapshot_record (self, path);
     }
 
-    g_hash_table_remove (self->priv->handled_channels, path);
-    g_hash_table_remove (self->priv->channel_accounts, path);
-
     g_object_unref (self);
 }
 
@@ -355,6 +741,7 @@ _mcd_handler_map_set_channel_handled (McdHandlerMap *self,
 {
     const gchar *path = tp_proxy_get_object_path (channel);
 
+    g_hash_table_remove (self->priv->restored_channels, path);
     g_hash_table_insert (self->priv->handled_channels,
                          g_strdup (path),
                          g_object_ref (channel));
@@ -375,56 +762,50 @@ static void
 _mcd_handler_map_set_handler_crashed (McdHandlerMap *self,
                                       const gchar *unique_name)
 {
-    gsize *counter = g_hash_table_lookup (self->priv->handler_processes,
-                                          unique_name);
+    GHashTable *paths = g_hash_table_lookup (self->priv->handler_processes,
+                                             unique_name);
+    GHashTableIter iter;
+    gpointer path_p;
 
-    if (counter != NULL)
-    {
-        GHashTableIter iter;
-        gpointer path_p, name_p;
-        GList *paths = NULL;
+    if (paths == NULL)
+        return;
 
-        tp_dbus_daemon_cancel_name_owner_watch (self->priv->dbus_daemon,
-                                                unique_name,
-                                                mcd_handler_map_name_owner_cb,
-                                                self);
-        g_hash_table_remove (self->priv->handler_processes, unique_name);
+    tp_dbus_daemon_cancel_name_owner_watch (self->priv->dbus_daemon,
+                                            unique_name,
+                                            mcd_handler_map_name_owner_cb,
+                                            self);
 
-        /* This is O(number of channels being handled) but then again
-         * it only happens if a handler crashes */
-        g_hash_table_iter_init (&iter, self->priv->channel_processes);
+    /* keep the set of paths while we close them; this only looks at the
+     * crashed handler's own channels */
+    g_hash_table_ref (paths);
+    g_hash_table_remove (self->priv->handler_processes, unique_name);
 
-        while (g_hash_table_iter_next (&iter, &path_p, &name_p))
-        {
-            if (!tp_strdiff (name_p, unique_name))
-            {
-                DEBUG ("%s lost its handler %s", (const gchar *) path_p,
-                       (const gchar *) name_p);
-                paths = g_list_prepend (paths, g_strdup (path_p));
-                g_hash_table_iter_remove (&iter);
-            }
-        }
+    g_hash_table_iter_init (&iter, paths);
+
+    while (g_hash_table_iter_next (&iter, &path_p, NULL))
+    {
+        const gchar *path = path_p;
+        TpChannel *channel;
 
-        while (paths != NULL)
+        DEBUG ("%s lost its handler %s", path, unique_name);
+        g_hash_table_remove (self->priv->channel_processes, path);
+        g_hash_table_remove (self->priv->restored_channels, path);
+        mcd_handler_map_snapshot_record (self, path);
+
+        channel = g_hash_table_lookup (self->priv->handled_channels, path);
+
+        /* this is NULL-safe */
+        if (_mcd_tp_channel_should_close (channel, "closing"))
         {
-            gchar *path = paths->data;
-            TpChannel *channel = g_hash_table_lookup (
-                self->priv->handled_channels, path);
-
-            /* this is NULL-safe */
-            if (_mcd_tp_channel_should_close (channel, "closing"))
-            {
-                DEBUG ("Closing channel %s", path);
-                /* the corresponding McdChannel will get aborted when the
-                 * Channel actually closes */
-                tp_cli_channel_call_close (channel, -1,
-                                           NULL, NULL, NULL, NULL);
-            }
-
-            paths = g_list_delete_link (paths, paths);
-            g_free (path);
+            DEBUG ("Closing channel %s", path);
+            /* the corresponding McdChannel will get aborted when the
+             * Channel actually closes */
+            tp_cli_channel_call_close (channel, -1,
+                                       NULL, NULL, NULL, NULL);
         }
     }
+
+    g_hash_table_unref (paths);
 }
 
 static void
@@ -439,6 +820,57 @@ mcd_handler_map_name_owner_cb (TpDBusDaemon *dbus_daemon,
     }
 }
 
+/*
+ * Returns: %TRUE if some channels were restored from the snapshot and have
+ *  not been recovered or pruned yet
+ */
+gboolean
+_mcd_handler_map_has_restored_channels (McdHandlerMap *self)
+{
+    return (g_hash_table_size (self->priv->restored_channels) > 0);
+}
+
+/*
+ * @account_path: an account whose connection is connected
+ * @live_paths: the set of channels that its connection has
+ *
+ * Forget channels of @account_path that were restored from the snapshot,
+ * but have closed since.
+ */
+void
+_mcd_handler_map_prune_restored_channels (McdHandlerMap *self,
+                                          const gchar *account_path,
+                                          GHashTable *live_paths)
+{
+    GHashTableIter iter;
+    gpointer path_p;
+
+    g_hash_table_iter_init (&iter, self->priv->restored_channels);
+
+    while (g_hash_table_iter_next (&iter, &path_p, NULL))
+    {
+        const gchar *path = path_p;
+        const gchar *handler;
+
+        if (tp_strdiff (g_hash_table_lookup (self->priv->channel_accounts,
+                                             path), account_path) ||
+            g_hash_table_contains (live_paths, path))
+            continue;
+
+        DEBUG ("%s has closed since we restarted", path);
+        handler = g_hash_table_lookup (self->priv->channel_processes, path);
+
+        if (handler != NULL)
+            mcd_handler_map_remove_handler_path (self, handler, path);
+
+        g_hash_table_remove (self->priv->channel_processes, path);
+        g_hash_table_remove (self->priv->channel_clients, path);
+        g_hash_table_remove (self->priv->channel_accounts, path);
+        mcd_handler_map_snapshot_record (self, path);
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
 /*
  * Returns: (transfer container): all channels that are being handled
  */
@@ -230,3 +230,17 @@ mcd_nullable_variant_equal (GVariant *a,
 
     return g_variant_equal (a, b);
 }
+
+/*
+ * mcd_env_flag_enabled:
+ * @name: an environment variable
+ *
+ * Returns: %TRUE if @name is set to anything other than "" or "0"
+ */
+gboolean
+mcd_env_flag_enabled (const gchar *name)
+{
+    const gchar *env = g_getenv (name);
+
+    return !tp_str_empty (env) && tp_strdiff (env, "0");
+}
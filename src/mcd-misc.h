@@ -57,5 +57,7 @@ G_GNUC_INTERNAL int _mcd_chmod_private (const gchar *filename);
 
 gboolean mcd_nullable_variant_equal (GVariant *a, GVariant *b);
 
+gboolean mcd_env_flag_enabled (const gchar *name);
+
 G_END_DECLS
 #endif /* MCD_MISC_H */
@@ -53,7 +53,12 @@ G_DEFINE_TYPE (McdOperation, mcd_operation, MCD_TYPE_MISSION);
 
 typedef struct _McdOperationPrivate
 {
-    GList *missions;
+    /* owned McdMission, most recently taken first; the GList head is what
+     * mcd_operation_get_missions() returns */
+    GQueue missions;
+    /* borrowed McdMission => borrowed GList link in missions, so that
+     * removal does not need to walk the list */
+    GHashTable *links;
     gboolean is_disposed;
 } McdOperationPrivate;
 
@@ -94,16 +99,52 @@ _mcd_operation_child_unref (McdMission *child)
     g_object_unref (child);
 }
 
+/*
+ * Returns: a copy of the list of children, each with a new reference, in
+ * the same order as mcd_operation_get_missions(). Children can be added to
+ * or removed from @operation while the copy is being walked.
+ * Free with _mcd_operation_free_missions_copy().
+ */
+static GList *
+_mcd_operation_copy_missions (McdOperation *operation)
+{
+    McdOperationPrivate *priv = MCD_OPERATION_PRIV (operation);
+    GList *copy = NULL;
+    GList *node;
+
+    for (node = priv->missions.tail; node != NULL; node = node->prev)
+        copy = g_list_prepend (copy, g_object_ref (node->data));
+
+    return copy;
+}
+
+static void
+_mcd_operation_free_missions_copy (GList *copy)
+{
+    g_list_foreach (copy, (GFunc) _mcd_operation_child_unref, NULL);
+    g_list_free (copy);
+}
+
 static void
 _mcd_operation_abort (McdOperation * operation)
 {
-    const GList *node;
+    McdOperationPrivate *priv = MCD_OPERATION_PRIV (operation);
+    GList *missions, *node;
     
     DEBUG ("Operation abort received, aborting all children");
-    node = MCD_OPERATION_PRIV (operation)->missions;
-    while (node)
+
+    /* Aborting a child can cause other children to be removed (or new
+     * ones to be taken), so walk a private copy rather than the live list */
+    missions = _mcd_operation_copy_missions (operation);
+
+    for (node = missions; node != NULL; node = node->next)
     {
 	McdMission *mission = MCD_MISSION (node->data);
+
+        /* already removed by a previous child's abort */
+        if (!g_hash_table_contains (priv->links, mission))
+            continue;
+
 	/* We don't want to hear it ourself so that we still hold the
 	 * final reference to our children.
 	 */
@@ -117,8 +158,9 @@ _mcd_operation_abort (McdOperation * operation)
 	 */
 	g_signal_connect (mission, "abort",
 			  G_CALLBACK (on_mission_abort), operation);
-	node = g_list_next (node);
     }
+
+    _mcd_operation_free_missions_copy (missions);
 }
 
 static void
@@ -137,15 +179,20 @@ _mcd_operation_dispose (GObject * object)
     g_signal_handlers_disconnect_by_func (object,
 					  G_CALLBACK (_mcd_operation_abort),
 					  NULL);
-    if (priv->missions)
+    if (priv->links != NULL)
     {
-	g_list_foreach (priv->missions,
+        g_hash_table_unref (priv->links);
+        priv->links = NULL;
+    }
+
+    if (priv->missions.head)
+    {
+	g_list_foreach (priv->missions.head,
 			(GFunc) _mcd_operation_disconnect_mission,
 			object);
-	g_list_foreach (priv->missions, (GFunc) _mcd_operation_child_unref,
-			NULL);
-	g_list_free (priv->missions);
-	priv->missions = NULL;
+	g_list_foreach (priv->missions.head,
+                        (GFunc) _mcd_operation_child_unref, NULL);
+	g_queue_clear (&priv->missions);
     }
     G_OBJECT_CLASS (mcd_operation_parent_class)->dispose (object);
 }
@@ -153,16 +200,20 @@ _mcd_operation_dispose (GObject * object)
 static void
 _mcd_operation_connect (McdMission * mission)
 {
-    McdOperationPrivate *priv = MCD_OPERATION_PRIV (mission);
-    g_list_foreach (priv->missions, (GFunc) mcd_mission_connect, NULL);
+    GList *missions = _mcd_operation_copy_missions (MCD_OPERATION (mission));
+
+    g_list_foreach (missions, (GFunc) mcd_mission_connect, NULL);
+    _mcd_operation_free_missions_copy (missions);
     MCD_MISSION_CLASS (mcd_operation_parent_class)->connect (mission);
 }
 
 static void
 _mcd_operation_disconnect (McdMission * mission)
 {
-    McdOperationPrivate *priv = MCD_OPERATION_PRIV (mission);
-    g_list_foreach (priv->missions, (GFunc) mcd_mission_disconnect, NULL);
+    GList *missions = _mcd_operation_copy_missions (MCD_OPERATION (mission));
+
+    g_list_foreach (missions, (GFunc) mcd_mission_disconnect, NULL);
+    _mcd_operation_free_missions_copy (missions);
     MCD_MISSION_CLASS (mcd_operation_parent_class)->disconnect (mission);
 }
 
@@ -175,7 +226,10 @@ mcd_operation_take_mission (McdOperation * operation, McdMission * mission)
     g_return_if_fail (MCD_IS_MISSION (mission));
     priv = MCD_OPERATION_PRIV (operation);
 
-    priv->missions = g_list_prepend (priv->missions, mission);
+    g_return_if_fail (!g_hash_table_contains (priv->links, mission));
+
+    g_queue_push_head (&priv->missions, mission);
+    g_hash_table_insert (priv->links, mission, priv->missions.head);
     _mcd_mission_set_parent (mission, MCD_MISSION (operation));
 
     if (mcd_mission_is_connected (MCD_MISSION (operation)))
@@ -190,16 +244,19 @@ void
 mcd_operation_remove_mission (McdOperation * operation, McdMission * mission)
 {
     McdOperationPrivate *priv;
+    GList *link;
 
     g_return_if_fail (MCD_IS_OPERATION (operation));
     g_return_if_fail (MCD_IS_MISSION (mission));
     priv = MCD_OPERATION_PRIV (operation);
 
-    g_return_if_fail (g_list_find (priv->missions, mission) != NULL);
+    link = g_hash_table_lookup (priv->links, mission);
+    g_return_if_fail (link != NULL);
     
     _mcd_operation_disconnect_mission (mission, operation);
     
-    priv->missions = g_list_remove (priv->missions, mission);
+    g_hash_table_remove (priv->links, mission);
+    g_queue_delete_link (&priv->missions, link);
     _mcd_mission_set_parent (mission, NULL);
     
     g_signal_emit_by_name (G_OBJECT (operation), "mission-removed", mission);
@@ -247,7 +304,9 @@ static void
 mcd_operation_init (McdOperation * obj)
 {
     McdOperationPrivate *priv = MCD_OPERATION_PRIV (obj);
-    priv->missions = NULL;
+
+    g_queue_init (&priv->missions);
+    priv->links = g_hash_table_new (NULL, NULL);
     
     /* Listen to self abort so that we can propagate it to our
      * children
@@ -273,16 +332,33 @@ mcd_operation_get_missions (McdOperation * operation)
     g_return_val_if_fail (MCD_IS_OPERATION (operation), NULL);
     priv = MCD_OPERATION_PRIV (operation);
 
-    return priv->missions;
+    return priv->missions.head;
 }
 
+guint
+mcd_operation_get_n_missions (McdOperation *operation)
+{
+    g_return_val_if_fail (MCD_IS_OPERATION (operation), 0);
+
+    return MCD_OPERATION_PRIV (operation)->missions.length;
+}
+
+/*
+ * mcd_operation_foreach:
+ *
+ * Call @func on each child of @operation. It is safe for @func to take or
+ * remove children (including the one it was called for): each child that
+ * was present when the iteration started is visited exactly once, and is
+ * kept alive until the iteration has finished.
+ */
 void
 mcd_operation_foreach (McdOperation * operation, GFunc func, gpointer user_data)
 {
-    McdOperationPrivate *priv;
+    GList *missions;
 
     g_return_if_fail (MCD_IS_OPERATION (operation));
-    priv = MCD_OPERATION_PRIV (operation);
 
-    g_list_foreach (priv->missions, (GFunc) func, user_data);
+    missions = _mcd_operation_copy_missions (operation);
+    g_list_foreach (missions, func, user_data);
+    _mcd_operation_free_missions_copy (missions);
 }
@@ -72,6 +72,7 @@ void mcd_operation_remove_mission (McdOperation * operation,
 void mcd_operation_foreach (McdOperation * operation,
 			    GFunc func, gpointer user_data);
 const GList * mcd_operation_get_missions (McdOperation * operation);
+guint mcd_operation_get_n_missions (McdOperation *operation);
 
 G_END_DECLS
 #endif /* MCD_OPERATION_H */
@@ -55,6 +55,7 @@
 #include "mcd-connection.h"
 #include "mcd-misc.h"
 #include "mcd-service.h"
+#include "mcd-stats.h"
 
 /* DBus service specifics */
 #define MISSION_CONTROL_DBUS_SERVICE "org.freedesktop.Telepathy.MissionControl5"
@@ -138,6 +139,7 @@ mcd_service_constructed (GObject *obj)
      * all of which we want to have finished before we open up our main
      * D-Bus API for business. (See also fd.o #24000) */
     mcd_service_obtain_bus_name (MCD_OBJECT (obj));
+    mcd_stats_export (mcd_master_get_dbus_daemon (MCD_MASTER (obj)));
     mcd_debug_print_tree (obj);
 
     if (G_OBJECT_CLASS (parent_class)->constructed)
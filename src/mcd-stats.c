@@ -0,0 +1,933 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * Latency statistics for calls to Telepathy clients
+ *
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * For each client bus name and each kind of call MC makes to clients
+ * (ObserveChannels, AddDispatchOperation, HandleChannels), we keep the
+ * number of calls and failures and a histogram of how long the client
+ * took to reply successfully. Failures, most of which are timeouts, are
+ * only counted: their duration says more about the timeout than about the
+ * client, and feeding it back into the timeout (see
+ * _mcd_client_proxy_get_handler_timeout()) would only make it grow.
+ * Statistics are kept by bus name rather than on the McdClientProxy, so
+ * they survive the client exiting and being reactivated.
+ *
+ * The histograms are log-linear, like HdrHistogram: each power of two
+ * microseconds is split into 4 buckets, so any latency from 1us to over an
+ * hour is recorded with a relative error below 25%, in a fixed 128
+ * counters.
+ *
+ * Things that delay channel requests inside MC are kept separately, in
+ * the same form. Each RequestPolicy delay is one request policy plugin,
+ * named by its type name, checking one request, from being asked until it
+ * ends its last delay; it counts as a failure if MC_REQUEST_POLICY_TIMEOUT
+ * ran out first. Each BlockedRequest delay is one channel request waiting
+ * for an internal request on its account, named by the account's unique
+ * name; requests that could not wait because the account's queue was full
+ * count as failures.
+ *
+ * If Handlers are pre-activated (see _mcd_client_proxy_preactivate()), we
+ * also count how often the Handler we activated was the one that ended up
+ * handling the channels (a hit) or not (a miss).
+ *
+ * For each Handler, we also count how often its capabilities were
+ * announced to connections, and how often an announcement was suppressed
+ * because they had not really changed (see
+ * _mcd_client_proxy_handler_capabilities_changed()).
+ *
+ * The statistics can be read with the GetClientStats,
+ * GetPreactivationStats, GetCapabilitiesStats and GetRequestDelayStats
+ * methods of the read-only MCD_STATS_IFACE on MC's well-known name, which
+ * "mc-tool client-stats" displays.
+ *
+ * The same interface has a GetObjectStats method, which walks the tree of
+ * missions when it is called and returns, per account and per type, how
+ * many connections, channels, requests and dispatch operations exist and
+ * roughly how much memory they hold, for spotting leaks in a running MC.
+ * "mc-tool object-stats" displays it.
+ *
+ * GetRequestStats returns, for each connection, how many channel requests
+ * are queued and in flight (see MC_MAX_CHANNEL_REQUESTS), and how long
+ * requests waited in the queue and for the CM to reply; "mc-tool
+ * object-stats" displays that too.
+ *
+ * GetTrace returns the dispatching events in the in-memory trace (see
+ * mcd-trace.c), oldest first, so the trace can be inspected without
+ * stopping MC. It is empty unless tracing was enabled.
+ *
+ * GetPluginCallStats returns what mcp_debug_foreach_call_stats() reports:
+ * for each plugin and virtual method, how many calls have finished, their
+ * total and longest time, and how many delays are still in progress; this
+ * is what MC logs with mcp_debug_dump_call_stats() when it exits.
+ * "mc-tool plugin-stats" displays it.
+ */
+
+#include "config.h"
+
+#include "mcd-stats.h"
+
+#include <string.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include "mission-control-plugins/mission-control-plugins.h"
+
+#include "mcd-account.h"
+#include "mcd-connection-priv.h"
+#include "mcd-debug.h"
+#include "mcd-master.h"
+#include "mcd-trace.h"
+
+#define SUB_BUCKET_BITS 2
+#define N_SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define N_BUCKETS 128
+
+/* Keep in sync with McdStatsCall */
+static const gchar * const call_names[MCD_STATS_N_CALLS] = {
+    "ObserveChannels",
+    "AddDispatchOperation",
+    "HandleChannels",
+};
+
+/* Keep in sync with McdStatsDelay */
+static const gchar * const delay_names[MCD_STATS_N_DELAYS] = {
+    "RequestPolicy",
+    "BlockedRequest",
+};
+
+typedef struct {
+    guint32 count;
+    guint32 failures;
+    guint64 total_usec;
+    guint64 max_usec;
+    guint32 buckets[N_BUCKETS];
+} CallStats;
+
+typedef struct {
+    /* interned */
+    const gchar *bus_name;
+    CallStats calls[MCD_STATS_N_CALLS];
+    guint32 preactivation_hits;
+    guint32 preactivation_misses;
+    guint32 caps_changes_announced;
+    guint32 caps_changes_suppressed;
+} ClientStats;
+
+typedef struct {
+    /* interned */
+    const gchar *name;
+    CallStats delays[MCD_STATS_N_DELAYS];
+} DelayStats;
+
+/* interned bus name => owned ClientStats */
+static GHashTable *client_stats = NULL;
+/* interned plugin type or account name => owned DelayStats */
+static GHashTable *delay_stats = NULL;
+
+static guint
+bucket_for_usec (guint64 usec)
+{
+    guint exponent;
+
+    if (usec < N_SUB_BUCKETS)
+        return (guint) usec;
+
+    /* anything over 2**32 us (about 71 minutes) is lumped together */
+    if (usec > G_MAXUINT32)
+        usec = G_MAXUINT32;
+
+    exponent = g_bit_storage (usec) - 1;
+
+    /* the top SUB_BUCKET_BITS + 1 bits select the bucket */
+    return (exponent - SUB_BUCKET_BITS + 1) * N_SUB_BUCKETS +
+        ((usec >> (exponent - SUB_BUCKET_BITS)) & (N_SUB_BUCKETS - 1));
+}
+
+/* the smallest latency that does not fall in @bucket or below */
+static guint64
+bucket_limit_usec (guint bucket)
+{
+    guint exponent;
+    guint64 width;
+
+    if (bucket < N_SUB_BUCKETS)
+        return bucket + 1;
+
+    exponent = bucket / N_SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    width = G_GUINT64_CONSTANT (1) << (exponent - SUB_BUCKET_BITS);
+
+    return (N_SUB_BUCKETS + bucket % N_SUB_BUCKETS + 1) * width;
+}
+
+static ClientStats *
+client_stats_get (const gchar *bus_name)
+{
+    ClientStats *stats;
+
+    if (G_UNLIKELY (client_stats == NULL))
+        client_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              NULL, g_free);
+
+    bus_name = g_intern_string (bus_name);
+    stats = g_hash_table_lookup (client_stats, bus_name);
+
+    if (stats == NULL)
+    {
+        stats = g_new0 (ClientStats, 1);
+        stats->bus_name = bus_name;
+        g_hash_table_insert (client_stats, (gchar *) bus_name, stats);
+    }
+
+    return stats;
+}
+
+static void
+call_stats_record (CallStats *call_stats,
+                   gint64 elapsed_usec,
+                   gboolean failed)
+{
+    if (elapsed_usec < 0)
+        elapsed_usec = 0;
+
+    call_stats->count++;
+
+    if (failed)
+    {
+        call_stats->failures++;
+        return;
+    }
+
+    call_stats->total_usec += elapsed_usec;
+    call_stats->max_usec = MAX (call_stats->max_usec,
+                                (guint64) elapsed_usec);
+    call_stats->buckets[bucket_for_usec (elapsed_usec)]++;
+}
+
+/*
+ * mcd_stats_record_client_call:
+ * @bus_name: the client's well-known name
+ * @call: the method that was called
+ * @elapsed_usec: the time between calling the method and the reply
+ * @failed: %TRUE if the reply was an error, including a timeout, in which
+ *  case @elapsed_usec is not recorded
+ */
+void
+mcd_stats_record_client_call (const gchar *bus_name,
+                              McdStatsCall call,
+                              gint64 elapsed_usec,
+                              gboolean failed)
+{
+    g_return_if_fail (bus_name != NULL);
+    g_return_if_fail (call < MCD_STATS_N_CALLS);
+
+    call_stats_record (&client_stats_get (bus_name)->calls[call],
+                       elapsed_usec, failed);
+}
+
+/*
+ * mcd_stats_record_request_delay:
+ * @name: the request policy's type name, or the account's unique name
+ * @delay: what delayed the request
+ * @elapsed_usec: how long the request was delayed
+ * @failed: %TRUE if MC gave up waiting, in which case @elapsed_usec is not
+ *  recorded
+ */
+void
+mcd_stats_record_request_delay (const gchar *name,
+                                McdStatsDelay delay,
+                                gint64 elapsed_usec,
+                                gboolean failed)
+{
+    DelayStats *stats;
+
+    g_return_if_fail (name != NULL);
+    g_return_if_fail (delay < MCD_STATS_N_DELAYS);
+
+    if (G_UNLIKELY (delay_stats == NULL))
+        delay_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             NULL, g_free);
+
+    name = g_intern_string (name);
+    stats = g_hash_table_lookup (delay_stats, name);
+
+    if (stats == NULL)
+    {
+        stats = g_new0 (DelayStats, 1);
+        stats->name = name;
+        g_hash_table_insert (delay_stats, (gchar *) name, stats);
+    }
+
+    call_stats_record (&stats->delays[delay], elapsed_usec, failed);
+}
+
+/*
+ * mcd_stats_record_preactivation:
+ * @bus_name: the well-known name of a Handler that was pre-activated
+ * @hit: %TRUE if that Handler went on to handle the channels
+ */
+void
+mcd_stats_record_preactivation (const gchar *bus_name,
+                                gboolean hit)
+{
+    ClientStats *stats;
+
+    g_return_if_fail (bus_name != NULL);
+
+    stats = client_stats_get (bus_name);
+
+    if (hit)
+        stats->preactivation_hits++;
+    else
+        stats->preactivation_misses++;
+}
+
+/*
+ * mcd_stats_record_caps_change:
+ * @bus_name: the well-known name of a Handler whose capabilities might
+ *  have changed
+ * @suppressed: %TRUE if they had not, so connections were not told
+ */
+void
+mcd_stats_record_caps_change (const gchar *bus_name,
+                              gboolean suppressed)
+{
+    ClientStats *stats;
+
+    g_return_if_fail (bus_name != NULL);
+
+    stats = client_stats_get (bus_name);
+
+    if (suppressed)
+        stats->caps_changes_suppressed++;
+    else
+        stats->caps_changes_announced++;
+}
+
+/*
+ * mcd_stats_get_client_percentile:
+ * @bus_name: the client's well-known name
+ * @call: a method
+ * @fraction: a number between 0 and 1, such as 0.99 for the 99th percentile
+ * @min_samples: the number of calls below which the result would be
+ *  meaningless
+ *
+ * Returns: an upper bound for the time, in microseconds, within which
+ *  @bus_name replied to at least @fraction of its successful calls to
+ *  @call, or -1 if fewer than @min_samples calls have succeeded
+ */
+gint64
+mcd_stats_get_client_percentile (const gchar *bus_name,
+                                 McdStatsCall call,
+                                 gdouble fraction,
+                                 guint min_samples)
+{
+    const ClientStats *stats;
+    const CallStats *call_stats;
+    guint32 succeeded;
+    guint32 wanted;
+    guint32 seen = 0;
+    guint i;
+
+    g_return_val_if_fail (bus_name != NULL, -1);
+    g_return_val_if_fail (call < MCD_STATS_N_CALLS, -1);
+
+    if (client_stats == NULL)
+        return -1;
+
+    stats = g_hash_table_lookup (client_stats, bus_name);
+
+    if (stats == NULL)
+        return -1;
+
+    call_stats = &stats->calls[call];
+
+    succeeded = call_stats->count - call_stats->failures;
+
+    if (succeeded == 0 || succeeded < min_samples)
+        return -1;
+
+    wanted = (guint32) (CLAMP (fraction, 0.0, 1.0) * succeeded + 0.5);
+
+    for (i = 0; i < N_BUCKETS; i++)
+    {
+        seen += call_stats->buckets[i];
+
+        if (seen >= wanted && seen > 0)
+            return bucket_limit_usec (i);
+    }
+
+    return call_stats->max_usec + 1;
+}
+
+static gint
+client_stats_cmp (gconstpointer a,
+                  gconstpointer b)
+{
+    const ClientStats *x = *(ClientStats * const *) a;
+    const ClientStats *y = *(ClientStats * const *) b;
+
+    return strcmp (x->bus_name, y->bus_name);
+}
+
+static void
+append_call_stats (DBusMessageIter *array,
+                   const gchar *name,
+                   const gchar *call_name,
+                   const CallStats *call_stats)
+{
+    DBusMessageIter st, histogram;
+    dbus_uint32_t u;
+    dbus_uint64_t t;
+    guint i;
+
+    dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL, &st);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &name);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &call_name);
+    u = call_stats->count;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+    u = call_stats->failures;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+    t = call_stats->total_usec;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = call_stats->max_usec;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+
+    /* only the buckets that have something in them, as (limit, count) */
+    dbus_message_iter_open_container (&st, DBUS_TYPE_ARRAY, "(tu)",
+                                      &histogram);
+
+    for (i = 0; i < N_BUCKETS; i++)
+    {
+        DBusMessageIter bucket;
+
+        if (call_stats->buckets[i] == 0)
+            continue;
+
+        dbus_message_iter_open_container (&histogram, DBUS_TYPE_STRUCT, NULL,
+                                          &bucket);
+        t = bucket_limit_usec (i);
+        dbus_message_iter_append_basic (&bucket, DBUS_TYPE_UINT64, &t);
+        u = call_stats->buckets[i];
+        dbus_message_iter_append_basic (&bucket, DBUS_TYPE_UINT32, &u);
+        dbus_message_iter_close_container (&histogram, &bucket);
+    }
+
+    dbus_message_iter_close_container (&st, &histogram);
+    dbus_message_iter_close_container (array, &st);
+}
+
+/* returns a borrowed ClientStats for each client, sorted by name */
+static GPtrArray *
+dup_sorted_client_stats (void)
+{
+    GPtrArray *sorted = g_ptr_array_new ();
+
+    if (client_stats != NULL)
+    {
+        GHashTableIter hash_iter;
+        gpointer v;
+
+        g_hash_table_iter_init (&hash_iter, client_stats);
+
+        while (g_hash_table_iter_next (&hash_iter, NULL, &v))
+            g_ptr_array_add (sorted, v);
+
+        g_ptr_array_sort (sorted, client_stats_cmp);
+    }
+
+    return sorted;
+}
+
+static void
+append_client_stats (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+    GPtrArray *sorted = dup_sorted_client_stats ();
+    guint i;
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                      "(ssuutta(tu))", &array);
+
+    for (i = 0; i < sorted->len; i++)
+    {
+        const ClientStats *stats = g_ptr_array_index (sorted, i);
+        McdStatsCall call;
+
+        for (call = 0; call < MCD_STATS_N_CALLS; call++)
+        {
+            if (stats->calls[call].count > 0)
+                append_call_stats (&array, stats->bus_name, call_names[call],
+                                   &stats->calls[call]);
+        }
+    }
+
+    dbus_message_iter_close_container (&iter, &array);
+    g_ptr_array_unref (sorted);
+}
+
+static gint
+delay_stats_cmp (gconstpointer a,
+                 gconstpointer b)
+{
+    const DelayStats *x = *(DelayStats * const *) a;
+    const DelayStats *y = *(DelayStats * const *) b;
+
+    return strcmp (x->name, y->name);
+}
+
+static void
+append_request_delay_stats (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+    GPtrArray *sorted = g_ptr_array_new ();
+    guint i;
+
+    if (delay_stats != NULL)
+    {
+        GHashTableIter hash_iter;
+        gpointer v;
+
+        g_hash_table_iter_init (&hash_iter, delay_stats);
+
+        while (g_hash_table_iter_next (&hash_iter, NULL, &v))
+            g_ptr_array_add (sorted, v);
+
+        g_ptr_array_sort (sorted, delay_stats_cmp);
+    }
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                      "(ssuutta(tu))", &array);
+
+    for (i = 0; i < sorted->len; i++)
+    {
+        const DelayStats *stats = g_ptr_array_index (sorted, i);
+        McdStatsDelay delay;
+
+        for (delay = 0; delay < MCD_STATS_N_DELAYS; delay++)
+        {
+            if (stats->delays[delay].count > 0)
+                append_call_stats (&array, stats->name, delay_names[delay],
+                                   &stats->delays[delay]);
+        }
+    }
+
+    dbus_message_iter_close_container (&iter, &array);
+    g_ptr_array_unref (sorted);
+}
+
+static void
+append_preactivation_stats (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+    GPtrArray *sorted = dup_sorted_client_stats ();
+    guint i;
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(suu)",
+                                      &array);
+
+    for (i = 0; i < sorted->len; i++)
+    {
+        const ClientStats *stats = g_ptr_array_index (sorted, i);
+        DBusMessageIter st;
+        dbus_uint32_t u;
+
+        if (stats->preactivation_hits == 0 &&
+            stats->preactivation_misses == 0)
+            continue;
+
+        dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT, NULL,
+                                          &st);
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING,
+                                        &stats->bus_name);
+        u = stats->preactivation_hits;
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+        u = stats->preactivation_misses;
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+        dbus_message_iter_close_container (&array, &st);
+    }
+
+    dbus_message_iter_close_container (&iter, &array);
+    g_ptr_array_unref (sorted);
+}
+
+static void
+append_capabilities_stats (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+    GPtrArray *sorted = dup_sorted_client_stats ();
+    guint i;
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(suu)",
+                                      &array);
+
+    for (i = 0; i < sorted->len; i++)
+    {
+        const ClientStats *stats = g_ptr_array_index (sorted, i);
+        DBusMessageIter st;
+        dbus_uint32_t u;
+
+        if (stats->caps_changes_announced == 0 &&
+            stats->caps_changes_suppressed == 0)
+            continue;
+
+        dbus_message_iter_open_container (&array, DBUS_TYPE_STRUCT, NULL,
+                                          &st);
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING,
+                                        &stats->bus_name);
+        u = stats->caps_changes_announced;
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+        u = stats->caps_changes_suppressed;
+        dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+        dbus_message_iter_close_container (&array, &st);
+    }
+
+    dbus_message_iter_close_container (&iter, &array);
+    g_ptr_array_unref (sorted);
+}
+
+static void
+append_one_object_stats (const gchar *account_path,
+                         const gchar *type_name,
+                         guint count,
+                         guint64 bytes,
+                         gpointer user_data)
+{
+    DBusMessageIter *array = user_data;
+    DBusMessageIter st;
+    dbus_uint32_t u = count;
+    dbus_uint64_t t = bytes;
+
+    dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL, &st);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &account_path);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &type_name);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    dbus_message_iter_close_container (array, &st);
+}
+
+static void
+append_object_stats (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(ssut)",
+                                      &array);
+    mcd_debug_foreach_tree_stats (mcd_master_get_default (),
+                                  append_one_object_stats, &array);
+    dbus_message_iter_close_container (&iter, &array);
+}
+
+static void
+append_one_request_stats (DBusMessageIter *array,
+                          McdConnection *connection)
+{
+    McdConnectionRequestStats stats;
+    McdAccount *account = mcd_connection_get_account (connection);
+    const gchar *account_path = "";
+    DBusMessageIter st;
+    dbus_uint32_t u;
+    dbus_uint64_t t;
+
+    if (account != NULL)
+        account_path = mcd_account_get_object_path (account);
+
+    _mcd_connection_get_request_stats (connection, &stats);
+
+    dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL, &st);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &account_path);
+    u = stats.queued;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+    u = stats.in_flight;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+    u = stats.max_queued;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+    t = stats.n_sent;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = stats.n_coalesced;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = stats.n_waited;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = MAX (stats.total_wait, 0);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = MAX (stats.max_wait, 0);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = stats.n_replied;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = MAX (stats.total_round_trip, 0);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = MAX (stats.max_round_trip, 0);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    dbus_message_iter_close_container (array, &st);
+}
+
+static void
+collect_request_stats (DBusMessageIter *array,
+                       gpointer object)
+{
+    const GList *node;
+
+    if (MCD_IS_CONNECTION (object))
+    {
+        append_one_request_stats (array, object);
+        return;
+    }
+
+    if (!MCD_IS_OPERATION (object))
+        return;
+
+    for (node = mcd_operation_get_missions (MCD_OPERATION (object));
+         node != NULL;
+         node = node->next)
+        collect_request_stats (array, node->data);
+}
+
+static void
+append_request_stats (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                      "(suuutttttttt)", &array);
+    collect_request_stats (&array, mcd_master_get_default ());
+    dbus_message_iter_close_container (&iter, &array);
+}
+
+static void
+append_one_trace_event (gint64 time,
+                        const gchar *event,
+                        gconstpointer subject,
+                        const gchar *detail,
+                        gpointer user_data)
+{
+    DBusMessageIter *array = user_data;
+    DBusMessageIter st;
+    dbus_int64_t x = time;
+    dbus_uint64_t t = (guintptr) subject;
+
+    if (detail == NULL)
+        detail = "";
+
+    dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL, &st);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_INT64, &x);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &event);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &detail);
+    dbus_message_iter_close_container (array, &st);
+}
+
+static void
+append_trace (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(xsts)",
+                                      &array);
+    mcd_trace_foreach (append_one_trace_event, &array);
+    dbus_message_iter_close_container (&iter, &array);
+}
+
+static void
+append_one_plugin_call_stats (const gchar *plugin,
+                              const gchar *vfunc,
+                              guint64 calls,
+                              gint64 total_usec,
+                              gint64 max_usec,
+                              guint in_progress,
+                              gpointer user_data)
+{
+    DBusMessageIter *array = user_data;
+    DBusMessageIter st;
+    dbus_uint64_t t;
+    dbus_uint32_t u = in_progress;
+
+    dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL, &st);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &plugin);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_STRING, &vfunc);
+    t = calls;
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = MAX (total_usec, 0);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    t = MAX (max_usec, 0);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT64, &t);
+    dbus_message_iter_append_basic (&st, DBUS_TYPE_UINT32, &u);
+    dbus_message_iter_close_container (array, &st);
+}
+
+static void
+append_plugin_call_stats (DBusMessage *reply)
+{
+    DBusMessageIter iter, array;
+
+    dbus_message_iter_init_append (reply, &iter);
+    dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(sstttu)",
+                                      &array);
+    mcp_debug_foreach_call_stats (append_one_plugin_call_stats, &array);
+    dbus_message_iter_close_container (&iter, &array);
+}
+
+static const gchar introspection_xml[] =
+    DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+    "<node>\n"
+    "  <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+    "    <method name=\"Introspect\">\n"
+    "      <arg name=\"xml\" type=\"s\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "  </interface>\n"
+    "  <interface name=\"" MCD_STATS_IFACE "\">\n"
+    "    <method name=\"GetClientStats\">\n"
+    "      <arg name=\"Stats\" type=\"a(ssuutta(tu))\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetPreactivationStats\">\n"
+    "      <arg name=\"Stats\" type=\"a(suu)\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetCapabilitiesStats\">\n"
+    "      <arg name=\"Stats\" type=\"a(suu)\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetRequestDelayStats\">\n"
+    "      <arg name=\"Stats\" type=\"a(ssuutta(tu))\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetObjectStats\">\n"
+    "      <arg name=\"Stats\" type=\"a(ssut)\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetRequestStats\">\n"
+    "      <arg name=\"Stats\" type=\"a(suuutttttttt)\" "
+    "direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetTrace\">\n"
+    "      <arg name=\"Events\" type=\"a(xsts)\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "    <method name=\"GetPluginCallStats\">\n"
+    "      <arg name=\"Stats\" type=\"a(sstttu)\" direction=\"out\"/>\n"
+    "    </method>\n"
+    "  </interface>\n"
+    "</node>\n";
+
+static DBusHandlerResult
+stats_message_cb (DBusConnection *dconn,
+                  DBusMessage *message,
+                  void *user_data)
+{
+    DBusMessage *reply;
+
+    if (dbus_message_is_method_call (message, DBUS_INTERFACE_INTROSPECTABLE,
+                                     "Introspect"))
+    {
+        const gchar *xml = introspection_xml;
+
+        reply = dbus_message_new_method_return (message);
+        dbus_message_append_args (reply, DBUS_TYPE_STRING, &xml,
+                                  DBUS_TYPE_INVALID);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetClientStats"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_client_stats (reply);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetPreactivationStats"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_preactivation_stats (reply);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetCapabilitiesStats"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_capabilities_stats (reply);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetRequestDelayStats"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_request_delay_stats (reply);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetObjectStats"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_object_stats (reply);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetRequestStats"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_request_stats (reply);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetTrace"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_trace (reply);
+    }
+    else if (dbus_message_is_method_call (message, MCD_STATS_IFACE,
+                                          "GetPluginCallStats"))
+    {
+        reply = dbus_message_new_method_return (message);
+        append_plugin_call_stats (reply);
+    }
+    else
+    {
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+    dbus_connection_send (dconn, reply, NULL);
+    dbus_message_unref (reply);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable stats_vtable = {
+    NULL,
+    stats_message_cb,
+};
+
+/*
+ * mcd_stats_export:
+ *
+ * Make the statistics available on D-Bus at MCD_STATS_OBJECT_PATH.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+mcd_stats_export (TpDBusDaemon *dbus_daemon)
+{
+    DBusGConnection *gconn = tp_proxy_get_dbus_connection (dbus_daemon);
+    DBusConnection *dconn = dbus_g_connection_get_connection (gconn);
+
+    if (!dbus_connection_register_object_path (dconn, MCD_STATS_OBJECT_PATH,
+                                               &stats_vtable, NULL))
+    {
+        WARNING ("unable to register %s", MCD_STATS_OBJECT_PATH);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,67 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * Latency statistics for calls to Telepathy clients
+ *
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef MCD_STATS_H
+#define MCD_STATS_H
+
+#include <glib.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+G_BEGIN_DECLS
+
+/* Keep in sync with call_names in mcd-stats.c */
+typedef enum {
+    MCD_STATS_CALL_OBSERVE_CHANNELS = 0,
+    MCD_STATS_CALL_ADD_DISPATCH_OPERATION,
+    MCD_STATS_CALL_HANDLE_CHANNELS,
+    MCD_STATS_N_CALLS
+} McdStatsCall;
+
+/* Keep in sync with delay_names in mcd-stats.c */
+typedef enum {
+    MCD_STATS_DELAY_REQUEST_POLICY = 0,
+    MCD_STATS_DELAY_BLOCKED_REQUEST,
+    MCD_STATS_N_DELAYS
+} McdStatsDelay;
+
+#define MCD_STATS_OBJECT_PATH "/org/freedesktop/Telepathy/MissionControl5"
+#define MCD_STATS_IFACE "org.freedesktop.Telepathy.MissionControl5.Stats"
+
+void mcd_stats_record_client_call (const gchar *bus_name, McdStatsCall call,
+    gint64 elapsed_usec, gboolean failed);
+
+void mcd_stats_record_request_delay (const gchar *name, McdStatsDelay delay,
+    gint64 elapsed_usec, gboolean failed);
+
+void mcd_stats_record_preactivation (const gchar *bus_name, gboolean hit);
+
+void mcd_stats_record_caps_change (const gchar *bus_name,
+    gboolean suppressed);
+
+gint64 mcd_stats_get_client_percentile (const gchar *bus_name,
+    McdStatsCall call, gdouble fraction, guint min_samples);
+
+gboolean mcd_stats_export (TpDBusDaemon *dbus_daemon);
+
+G_END_DECLS
+
+#endif /* MCD_STATS_H */
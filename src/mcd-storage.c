@@ -475,7 +475,9 @@ sort_and_cache_plugins ()
   /* Add compiled-in plugins */
   add_storage_plugin (MCP_ACCOUNT_STORAGE (mcd_account_manager_default_new ()));
 
-  for (p = mcp_list_objects(); p != NULL; p = g_list_next (p))
+  for (p = mcp_list_objects_implementing (MCP_TYPE_ACCOUNT_STORAGE);
+       p != NULL;
+       p = g_list_next (p))
     {
       if (MCP_IS_ACCOUNT_STORAGE (p->data))
         {
@@ -0,0 +1,248 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * In-memory trace of dispatching events
+ *
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * The trace is a fixed-size ring of the most recent events. Recording an
+ * event takes a timestamp and claims a slot with one atomic increment, so
+ * it is cheap enough to leave in the dispatching code permanently; it
+ * does nothing at all unless enabled with MC_DEBUG=trace or by setting
+ * MC_TRACE_FILE.
+ *
+ * The trace can be read while MC is running with mcd_trace_foreach(), which
+ * the GetTrace method of MCD_STATS_IFACE does. It can also be sent to the
+ * Telepathy Debug interface with mcd_trace_dump(), which MC does when it
+ * exits, and written in the Chrome/Catapult trace event format with
+ * mcd_trace_write_chrome_json(), which MC does on exit if MC_TRACE_FILE is
+ * set.
+ */
+
+#include "config.h"
+
+#include "mcd-trace.h"
+
+#include <unistd.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+/* must be a power of 2 */
+#define RING_SIZE 4096
+
+#define TRACE_DOMAIN "mcd/trace"
+
+typedef struct {
+    gint64 time;
+    gconstpointer subject;
+    const gchar *detail;
+    McdTraceEvent event;
+} TraceEntry;
+
+static const gchar * const event_names[MCD_TRACE_N_EVENTS] = {
+    "channel-arrived",
+    "observer-called",
+    "observer-replied",
+    "approver-called",
+    "approver-replied",
+    "handler-called",
+    "handler-accepted",
+    "handler-failed",
+};
+
+gint mcd_trace_enabled = 0;
+
+static TraceEntry ring[RING_SIZE];
+/* total number of events recorded; the next slot is n_recorded % RING_SIZE */
+static volatile gint n_recorded = 0;
+
+void
+mcd_trace_record (McdTraceEvent event,
+                  gconstpointer subject,
+                  const gchar *detail)
+{
+    TraceEntry *entry;
+
+    g_return_if_fail (event < MCD_TRACE_N_EVENTS);
+
+    entry = &ring[((guint) g_atomic_int_add (&n_recorded, 1)) &
+                  (RING_SIZE - 1)];
+    entry->time = g_get_monotonic_time ();
+    entry->subject = subject;
+    entry->detail = detail;
+    entry->event = event;
+}
+
+void
+mcd_trace_set_enabled (gboolean enabled)
+{
+    g_atomic_int_set (&mcd_trace_enabled, enabled ? 1 : 0);
+}
+
+void
+mcd_trace_clear (void)
+{
+    g_atomic_int_set (&n_recorded, 0);
+}
+
+/* Call @func on each recorded event, oldest first */
+static void
+trace_foreach (void (*func) (const TraceEntry *, gpointer),
+               gpointer user_data)
+{
+    guint n = (guint) g_atomic_int_get (&n_recorded);
+    guint first = (n > RING_SIZE ? n - RING_SIZE : 0);
+    guint i;
+
+    for (i = first; i < n; i++)
+        func (&ring[i & (RING_SIZE - 1)], user_data);
+}
+
+typedef struct {
+    McdTraceForeachFunc func;
+    gpointer user_data;
+} ForeachData;
+
+static void
+foreach_one (const TraceEntry *entry,
+             gpointer user_data)
+{
+    ForeachData *data = user_data;
+
+    data->func (entry->time, event_names[entry->event], entry->subject,
+                entry->detail, data->user_data);
+}
+
+/*
+ * mcd_trace_foreach:
+ * @func: called with the monotonic time in microseconds, the name of the
+ *  event, its subject and its detail (possibly %NULL) for each recorded
+ *  event
+ *
+ * Call @func on each recorded event, oldest first.
+ */
+void
+mcd_trace_foreach (McdTraceForeachFunc func,
+                   gpointer user_data)
+{
+    ForeachData data = { func, user_data };
+
+    trace_foreach (foreach_one, &data);
+}
+
+static void
+dump_one (const TraceEntry *entry,
+          gpointer user_data)
+{
+    TpDebugSender *dbg = user_data;
+
+    tp_debug_sender_add_message_printf (dbg, NULL, NULL, TRACE_DOMAIN,
+        G_LOG_LEVEL_DEBUG, "%" G_GINT64_FORMAT " %s %p %s", entry->time,
+        event_names[entry->event], entry->subject,
+        entry->detail != NULL ? entry->detail : "");
+}
+
+/*
+ * mcd_trace_dump:
+ *
+ * Send the recorded events to the Telepathy Debug interface, in the
+ * "mcd/trace" domain, oldest first.
+ */
+void
+mcd_trace_dump (void)
+{
+    TpDebugSender *dbg;
+
+    if (g_atomic_int_get (&n_recorded) == 0)
+        return;
+
+    dbg = tp_debug_sender_dup ();
+    trace_foreach (dump_one, dbg);
+    g_object_unref (dbg);
+}
+
+static void
+append_json_string (GString *str,
+                    const gchar *s)
+{
+    g_string_append_c (str, '"');
+
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            g_string_append_printf (str, "\\%c", *s);
+        else if ((guchar) *s < 0x20)
+            g_string_append_printf (str, "\\u%04x", (guchar) *s);
+        else
+            g_string_append_c (str, *s);
+    }
+
+    g_string_append_c (str, '"');
+}
+
+static void
+append_chrome_event (const TraceEntry *entry,
+                     gpointer user_data)
+{
+    GString *json = user_data;
+
+    if (json->str[json->len - 1] != '[')
+        g_string_append (json, ",\n");
+
+    /* instant events, with the subject as the "thread" so that the events
+     * for each channel or dispatch operation line up */
+    g_string_append_printf (json,
+        "{\"name\":\"%s\",\"cat\":\"mc\",\"ph\":\"i\",\"s\":\"t\","
+        "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%" G_GUINTPTR_FORMAT
+        ",\"args\":{",
+        event_names[entry->event], entry->time, (gint) getpid (),
+        (guintptr) entry->subject);
+
+    if (entry->detail != NULL)
+    {
+        g_string_append (json, "\"detail\":");
+        append_json_string (json, entry->detail);
+    }
+
+    g_string_append (json, "}}");
+}
+
+/*
+ * mcd_trace_write_chrome_json:
+ * @filename: where to write the trace
+ *
+ * Write the recorded events to @filename as a JSON Object Format file that
+ * can be loaded by chrome://tracing.
+ *
+ * Returns: %TRUE on success
+ */
+gboolean
+mcd_trace_write_chrome_json (const gchar *filename,
+                             GError **error)
+{
+    GString *json = g_string_new ("{\"traceEvents\":[");
+    gboolean ret;
+
+    trace_foreach (append_chrome_event, json);
+    g_string_append (json, "],\n\"displayTimeUnit\":\"ms\"}\n");
+
+    ret = g_file_set_contents (filename, json->str, json->len, error);
+    g_string_free (json, TRUE);
+    return ret;
+}
@@ -0,0 +1,76 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * In-memory trace of dispatching events
+ *
+ * Copyright (C) 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef MCD_TRACE_H
+#define MCD_TRACE_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Keep in sync with event_names in mcd-trace.c */
+typedef enum {
+    MCD_TRACE_CHANNEL_ARRIVED = 0,
+    MCD_TRACE_OBSERVER_CALLED,
+    MCD_TRACE_OBSERVER_REPLIED,
+    MCD_TRACE_APPROVER_CALLED,
+    MCD_TRACE_APPROVER_REPLIED,
+    MCD_TRACE_HANDLER_CALLED,
+    MCD_TRACE_HANDLER_ACCEPTED,
+    MCD_TRACE_HANDLER_FAILED,
+    MCD_TRACE_N_EVENTS
+} McdTraceEvent;
+
+extern gint mcd_trace_enabled;
+
+void mcd_trace_record (McdTraceEvent event, gconstpointer subject,
+    const gchar *detail);
+
+/*
+ * MCD_TRACE:
+ * @event: a #McdTraceEvent
+ * @subject: the object the event happened to, only used as an identifier
+ * @detail: a string that will outlive the trace, such as a static or
+ *  interned string, or %NULL; only evaluated if tracing is enabled
+ *
+ * Record @event in the trace buffer. If tracing is disabled this is a
+ * single predictable branch.
+ */
+#define MCD_TRACE(event, subject, detail) \
+    G_STMT_START { \
+        if (G_UNLIKELY (mcd_trace_enabled)) \
+            mcd_trace_record ((event), (subject), (detail)); \
+    } G_STMT_END
+
+void mcd_trace_set_enabled (gboolean enabled);
+void mcd_trace_clear (void);
+
+typedef void (*McdTraceForeachFunc) (gint64 time, const gchar *event,
+    gconstpointer subject, const gchar *detail, gpointer user_data);
+void mcd_trace_foreach (McdTraceForeachFunc func, gpointer user_data);
+
+void mcd_trace_dump (void);
+gboolean mcd_trace_write_chrome_json (const gchar *filename, GError **error);
+
+G_END_DECLS
+
+#endif /* MCD_TRACE_H */
@@ -31,17 +31,38 @@
 
 #include "mcd-channel-priv.h"
 #include "mcd-debug.h"
+#include "mcd-misc.h"
+#include "mcd-stats.h"
 
 enum {
     PROP_0,
     PROP_ACCOUNT,
-    PROP_REAL_REQUEST
+    PROP_REAL_REQUEST,
+    PROP_POLICY
 };
 
 struct _McdPluginRequest {
     GObject parent;
     McdAccount *account;
     McdRequest *real_request;
+    /* the policy that this object was given to, or NULL */
+    McpRequestPolicy *policy;
+
+    /* when the policy was asked to check the request */
+    gint64 check_started;
+    /* number of delays started by the policy and not yet ended */
+    guint n_delays;
+    /* borrowed RealDelay, those of the n_delays that we are waiting for */
+    GList *delays;
+    /* signal handlers that abandon the request while it's delayed */
+    gulong cancelling_id;
+    gulong removed_id;
+    /* TRUE if the policy ran out of time */
+    gboolean timed_out;
+    /* TRUE if we have stopped waiting for the policy, because all its
+     * delays timed out or the request was cancelled or its account removed,
+     * after which account and real_request are NULL */
+    gboolean abandoned;
 };
 
 struct _McdPluginRequestClass {
@@ -80,6 +101,11 @@ plugin_req_set_property (GObject *object,
       self->account = g_value_dup_object (value);
       break;
 
+    case PROP_POLICY:
+      g_assert (self->policy == NULL); /* construct-only */
+      self->policy = g_value_dup_object (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -95,8 +121,18 @@ plugin_req_dispose (GObject *object)
 
   DEBUG ("%p", object);
 
+  if (self->cancelling_id != 0)
+    g_signal_handler_disconnect (self->real_request, self->cancelling_id);
+
+  if (self->removed_id != 0)
+    g_signal_handler_disconnect (self->account, self->removed_id);
+
+  self->cancelling_id = 0;
+  self->removed_id = 0;
+
   tp_clear_object (&self->account);
   tp_clear_object (&self->real_request);
+  tp_clear_object (&self->policy);
 
   if (dispose != NULL)
     dispose (object);
@@ -122,23 +158,97 @@ _mcd_plugin_request_class_init (
           "The underlying McdAccount",
           MCD_TYPE_ACCOUNT,
           G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_POLICY,
+      g_param_spec_object ("policy", "Request policy",
+          "The McpRequestPolicy that will check the request, or NULL",
+          MCP_TYPE_REQUEST_POLICY,
+          G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 }
 
 McdPluginRequest *
 _mcd_plugin_request_new (McdAccount *account,
-    McdRequest *real_request)
+    McdRequest *real_request,
+    McpRequestPolicy *policy)
 {
   McdPluginRequest *self;
 
   self = g_object_new (MCD_TYPE_PLUGIN_REQUEST,
       "account", account,
       "real-request", real_request,
+      "policy", policy,
       NULL);
   DEBUG ("%p (for %p, %p)", self, account, real_request);
 
   return self;
 }
 
+/* How long a request policy may delay a request, in seconds; 0 means
+ * forever. Set by MC_REQUEST_POLICY_TIMEOUT. */
+static guint
+policy_timeout (void)
+{
+  static gsize once = 0;
+  static guint timeout = 0;
+
+  if (g_once_init_enter (&once))
+    {
+      const gchar *env = g_getenv ("MC_REQUEST_POLICY_TIMEOUT");
+
+      if (env != NULL)
+        timeout = (guint) g_ascii_strtoull (env, NULL, 10);
+
+      g_once_init_leave (&once, 1);
+    }
+
+  return timeout;
+}
+
+/* TRUE if a request policy that runs out of time should be taken to have
+ * denied the request, rather than allowed it. Set by
+ * MC_REQUEST_POLICY_FAIL_CLOSED. */
+static gboolean
+policy_fails_closed (void)
+{
+  static gint fail_closed = -1;
+
+  if (G_UNLIKELY (fail_closed < 0))
+    fail_closed = mcd_env_flag_enabled ("MC_REQUEST_POLICY_FAIL_CLOSED");
+
+  return fail_closed;
+}
+
+/* Record how long the policy took, once it has finished with the request */
+static void
+plugin_req_check_finished (McdPluginRequest *self)
+{
+  if (self->policy == NULL || self->n_delays > 0 || self->abandoned)
+    return;
+
+  mcd_stats_record_request_delay (G_OBJECT_TYPE_NAME (self->policy),
+      MCD_STATS_DELAY_REQUEST_POLICY,
+      g_get_monotonic_time () - self->check_started, self->timed_out);
+}
+
+/*
+ * Ask our policy to check the request. The policy may delay the request
+ * with mcp_request_start_delay(), but if MC_REQUEST_POLICY_TIMEOUT is set,
+ * only for that long; the policies are all asked in turn without waiting
+ * for each other, so their delays overlap.
+ */
+void
+_mcd_plugin_request_check (McdPluginRequest *self)
+{
+  g_return_if_fail (MCD_IS_PLUGIN_REQUEST (self));
+  g_return_if_fail (self->policy != NULL);
+
+  DEBUG ("Checking request with policy %s", G_OBJECT_TYPE_NAME (self->policy));
+
+  self->check_started = g_get_monotonic_time ();
+  mcp_request_policy_check (self->policy, MCP_REQUEST (self));
+  plugin_req_check_finished (self);
+}
+
 static const gchar *
 plugin_req_get_account_path (McpRequest *obj)
 {
@@ -146,6 +256,9 @@ plugin_req_get_account_path (McpRequest *obj)
 
   g_return_val_if_fail (self != NULL, NULL);
 
+  if (self->account == NULL)
+    return NULL;
+
   return mcd_account_get_object_path (self->account);
 }
 
@@ -156,6 +269,9 @@ plugin_req_get_protocol (McpRequest *obj)
 
   g_return_val_if_fail (self != NULL, NULL);
 
+  if (self->account == NULL)
+    return NULL;
+
   return mcd_account_get_protocol_name (self->account);
 }
 
@@ -166,6 +282,9 @@ plugin_req_get_cm_name (McpRequest *obj)
 
   g_return_val_if_fail (self != NULL, NULL);
 
+  if (self->account == NULL)
+    return NULL;
+
   return mcd_account_get_manager_name (self->account);
 }
 
@@ -176,6 +295,9 @@ plugin_req_get_user_action_time (McpRequest *obj)
 
   g_return_val_if_fail (self != NULL, 0);
 
+  if (self->real_request == NULL)
+    return 0;
+
   return _mcd_request_get_user_action_time (self->real_request);
 }
 
@@ -199,7 +321,7 @@ plugin_req_ref_nth_request (McpRequest *obj,
 
   g_return_val_if_fail (self != NULL, NULL);
 
-  if (n > 0)
+  if (n > 0 || self->real_request == NULL)
     {
       /* not an error, for easy iteration */
       return NULL;
@@ -221,6 +343,14 @@ plugin_req_deny (McpRequest *obj,
 
   g_return_if_fail (self != NULL);
 
+  if (self->timed_out || self->abandoned)
+    {
+      /* too late: we've already made up our mind */
+      DEBUG ("ignoring late denial from %s: %s",
+          G_OBJECT_TYPE_NAME (self->policy), message);
+      return;
+    }
+
   _mcd_request_set_failure (self->real_request, domain, code, message);
 }
 
@@ -230,8 +360,128 @@ plugin_req_deny (McpRequest *obj,
 typedef struct {
     gsize magic;
     McdPluginRequest *self;
+    guint timeout_id;
+    /* TRUE if we stopped waiting for this delay */
+    gboolean expired;
 } RealDelay;
 
+static void
+plugin_req_delay_finished (McdPluginRequest *self)
+{
+  g_return_if_fail (self->n_delays > 0);
+
+  self->n_delays--;
+  plugin_req_check_finished (self);
+  _mcd_request_end_delay (self->real_request);
+}
+
+/*
+ * We are no longer waiting for any of the policy's delays: let go of the
+ * request and the account, which would otherwise be kept alive until the
+ * policy ended its delays, or forever if it never does. We have to stay
+ * alive ourselves until then, since the policy may still call us.
+ */
+static void
+plugin_req_release (McdPluginRequest *self)
+{
+  DEBUG ("%p: no longer waiting for %s", self,
+      G_OBJECT_TYPE_NAME (self->policy));
+
+  if (self->cancelling_id != 0)
+    g_signal_handler_disconnect (self->real_request, self->cancelling_id);
+
+  if (self->removed_id != 0)
+    g_signal_handler_disconnect (self->account, self->removed_id);
+
+  self->cancelling_id = 0;
+  self->removed_id = 0;
+  self->abandoned = TRUE;
+  tp_clear_object (&self->real_request);
+  tp_clear_object (&self->account);
+}
+
+static gboolean
+plugin_req_delay_timeout_cb (gpointer data)
+{
+  RealDelay *delay = data;
+  McdPluginRequest *self = delay->self;
+
+  g_return_val_if_fail (delay->magic == DELAY_MAGIC, FALSE);
+
+  delay->timeout_id = 0;
+  delay->expired = TRUE;
+  self->delays = g_list_remove (self->delays, delay);
+  self->timed_out = TRUE;
+
+  if (policy_fails_closed ())
+    {
+      WARNING ("request policy %s did not finish with request %p in %us: "
+          "denying it", G_OBJECT_TYPE_NAME (self->policy), self->real_request,
+          policy_timeout ());
+      _mcd_request_set_failure (self->real_request, TP_ERROR,
+          TP_ERROR_PERMISSION_DENIED,
+          "Request policy did not make a decision in time");
+    }
+  else
+    {
+      WARNING ("request policy %s did not finish with request %p in %us: "
+          "allowing it", G_OBJECT_TYPE_NAME (self->policy), self->real_request,
+          policy_timeout ());
+    }
+
+  plugin_req_delay_finished (self);
+
+  if (self->delays == NULL)
+    plugin_req_release (self);
+
+  return FALSE;
+}
+
+/* The request was cancelled, or its account removed, while the policy was
+ * delaying it: stop waiting for the policy */
+static void
+plugin_req_abandon (McdPluginRequest *self)
+{
+  GList *delays = self->delays;
+  GList *l;
+
+  if (self->abandoned)
+    return;
+
+  /* don't record how long the policy took */
+  self->abandoned = TRUE;
+  self->delays = NULL;
+
+  for (l = delays; l != NULL; l = l->next)
+    {
+      RealDelay *delay = l->data;
+
+      if (delay->timeout_id != 0)
+        {
+          g_source_remove (delay->timeout_id);
+          delay->timeout_id = 0;
+        }
+
+      delay->expired = TRUE;
+      plugin_req_delay_finished (self);
+    }
+
+  g_list_free (delays);
+  plugin_req_release (self);
+}
+
+static void
+plugin_req_account_removed_cb (McdAccount *account,
+    McdPluginRequest *self)
+{
+  /* don't let the request carry on with an account that no longer exists */
+  if (self->delays != NULL)
+    _mcd_request_set_failure (self->real_request, TP_ERROR,
+        TP_ERROR_CANCELLED, "Account was removed");
+
+  plugin_req_abandon (self);
+}
+
 static McpRequestDelay *
 plugin_req_start_delay (McpRequest *obj)
 {
@@ -241,10 +491,34 @@ plugin_req_start_delay (McpRequest *obj)
   DEBUG ("%p", self);
 
   g_return_val_if_fail (self != NULL, NULL);
-  delay = g_slice_new (RealDelay);
+  delay = g_slice_new0 (RealDelay);
   delay->magic = DELAY_MAGIC;
   delay->self = g_object_ref (obj);
+
+  if (self->abandoned)
+    {
+      /* there's nothing left to delay */
+      delay->expired = TRUE;
+      return (McpRequestDelay *) delay;
+    }
+
+  if (self->cancelling_id == 0)
+    {
+      /* we hold a ref to both, and disconnect in dispose */
+      self->cancelling_id = g_signal_connect_swapped (self->real_request,
+          "cancelling", G_CALLBACK (plugin_req_abandon), self);
+      self->removed_id = g_signal_connect (self->account, "removed",
+          G_CALLBACK (plugin_req_account_removed_cb), self);
+    }
+
   _mcd_request_start_delay (self->real_request);
+  self->n_delays++;
+  self->delays = g_list_prepend (self->delays, delay);
+
+  if (self->policy != NULL && policy_timeout () > 0)
+    delay->timeout_id = g_timeout_add_seconds (policy_timeout (),
+        plugin_req_delay_timeout_cb, delay);
+
   return (McpRequestDelay *) delay;
 }
 
@@ -261,9 +535,24 @@ plugin_req_end_delay (McpRequest *obj,
   g_return_if_fail (real_delay->self == self);
   g_return_if_fail (real_delay->magic == DELAY_MAGIC);
 
+  if (real_delay->timeout_id != 0)
+    g_source_remove (real_delay->timeout_id);
+
   real_delay->magic = ~(DELAY_MAGIC);
   real_delay->self = NULL;
-  _mcd_request_end_delay (self->real_request);
+
+  /* if it expired, we already stopped waiting for it */
+  if (real_delay->expired)
+    {
+      DEBUG ("%s ended a delay after it had expired",
+          G_OBJECT_TYPE_NAME (self->policy));
+    }
+  else
+    {
+      self->delays = g_list_remove (self->delays, real_delay);
+      plugin_req_delay_finished (self);
+    }
+
   g_object_unref (self);
 }
 
@@ -54,7 +54,10 @@ G_GNUC_INTERNAL GType _mcd_plugin_request_get_type (void);
                               McdPluginRequestClass))
 
 G_GNUC_INTERNAL McdPluginRequest *_mcd_plugin_request_new (McdAccount *account,
-    McdRequest *real_request);
+    McdRequest *real_request,
+    McpRequestPolicy *policy);
+
+G_GNUC_INTERNAL void _mcd_plugin_request_check (McdPluginRequest *self);
 
 G_END_DECLS
 
@@ -106,6 +106,10 @@ G_DEFINE_TYPE_WITH_CODE (McdRequest, _mcd_request, G_TYPE_OBJECT,
 
 static guint last_req_id = 1;
 
+/* every McdRequest that has not been finalized, so that they can be
+ * counted wherever they are: borrowed McdRequest => itself */
+static GHashTable *live_requests = NULL;
+
 static void
 _mcd_request_init (McdRequest *self)
 {
@@ -114,6 +118,11 @@ _mcd_request_init (McdRequest *self)
   self->delay = 1;
   self->cancellable = TRUE;
   self->object_path = g_strdup_printf (REQUEST_OBJ_BASE "%u", last_req_id++);
+
+  if (G_UNLIKELY (live_requests == NULL))
+    live_requests = g_hash_table_new (NULL, NULL);
+
+  g_hash_table_add (live_requests, self);
 }
 
 static void
@@ -277,8 +286,7 @@ _mcd_request_dispose (GObject *object)
    * but we have to clear the lock if we do or we'll deadlock     */
   if (_mcd_request_is_internal (self) && self->account != NULL)
     {
-      const gchar *path = mcd_account_get_object_path (self->account);
-      _mcd_request_unblock_account (path);
+      _mcd_account_unblock_requests (self->account);
       g_warning ("internal request disposed without being handled or failed");
     }
 
@@ -300,6 +308,7 @@ _mcd_request_finalize (GObject *object)
 
   DEBUG ("%p", object);
 
+  g_hash_table_remove (live_requests, self);
   _mcd_request_clear_internal_handler (self);
 
   g_free (self->preferred_handler);
@@ -526,6 +535,42 @@ _mcd_request_get_hints (McdRequest *self)
   return self->hints;
 }
 
+/* Returns: approximately how much memory @self holds on to, including its
+ * requested properties and hints */
+gsize
+_mcd_request_get_retained_bytes (McdRequest *self)
+{
+  return sizeof (McdRequest) +
+    mcd_debug_estimate_asv_size (self->properties) +
+    mcd_debug_estimate_asv_size (self->hints) +
+    mcd_debug_estimate_string_size (self->preferred_handler) +
+    mcd_debug_estimate_string_size (self->object_path) +
+    mcd_debug_estimate_string_size (self->failure_message);
+}
+
+/*
+ * _mcd_request_foreach:
+ * @func: called with each McdRequest that exists, including those that
+ *  are only kept alive by delays or by their account's queue of blocked
+ *  requests, and those that have been disposed but not finalized
+ * @user_data: passed to @func
+ */
+void
+_mcd_request_foreach (GFunc func,
+    gpointer user_data)
+{
+  GHashTableIter iter;
+  gpointer k;
+
+  if (live_requests == NULL)
+    return;
+
+  g_hash_table_iter_init (&iter, live_requests);
+
+  while (g_hash_table_iter_next (&iter, &k, NULL))
+    func (k, user_data);
+}
+
 static GList *
 _mcd_request_policy_plugins (void)
 {
@@ -536,7 +581,9 @@ _mcd_request_policy_plugins (void)
     {
       const GList *p = NULL;
 
-      for (p = mcp_list_objects (); p != NULL; p = g_list_next (p))
+      for (p = mcp_list_objects_implementing (MCP_TYPE_REQUEST_POLICY);
+           p != NULL;
+           p = g_list_next (p))
         {
           if (MCP_IS_REQUEST_POLICY (p->data))
             policies = g_list_prepend (policies, g_object_ref (p->data));
@@ -548,131 +595,21 @@ _mcd_request_policy_plugins (void)
   return policies;
 }
 
-/* hash keys on account paths: value is the lock-count */
-static GHashTable *account_locks = NULL;
-static GHashTable *blocked_reqs = NULL;
-
-static void
-_init_blocked_account_request_queue (void)
-{
-  account_locks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  blocked_reqs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-}
-
-guint
-_mcd_request_block_account (const gchar *account)
-{
-  guint count;
-  gchar *key = g_strdup (account);
-
-  if (G_UNLIKELY (account_locks == NULL))
-    _init_blocked_account_request_queue ();
-
-  count = GPOINTER_TO_UINT (g_hash_table_lookup (account_locks, account));
-  g_hash_table_replace (account_locks, key, GUINT_TO_POINTER (++count));
-  DEBUG ("lock count for account %s is now: %u", account, count);
-
-  return count;
-}
-
-static void
-_unblock_request (gpointer object, gpointer data)
-{
-  DEBUG ("ending delay for internally locked request %p on account %s",
-      object, (const gchar *) data);
-  _mcd_request_end_delay (MCD_REQUEST (object));
-}
-
-guint
-_mcd_request_unblock_account (const gchar *account)
-{
-  guint count = 0;
-  gchar *key = NULL;
-
-  if (G_UNLIKELY (account_locks == NULL))
-    {
-      g_warning ("Unbalanced account-request-unblock for %s", account);
-      return 0;
-    }
-
-  count = GPOINTER_TO_UINT (g_hash_table_lookup (account_locks, account));
-
-  switch (count)
-    {
-      GQueue *queue;
-
-      case 0:
-        g_warning ("Unbalanced account-request-unblock for %s", account);
-        return 0;
-
-      case 1:
-        DEBUG ("removing lock from account %s", account);
-        g_hash_table_remove (account_locks, account);
-        queue = g_hash_table_lookup (blocked_reqs, account);
-
-        if (queue == NULL)
-          return 0;
-
-        g_queue_foreach (queue, _unblock_request, NULL);
-        g_queue_clear (queue);
-
-        return 0;
-
-      default:
-        DEBUG ("reducing lock count for %s", account);
-        key = g_strdup (account);
-        g_hash_table_replace (account_locks, key, GUINT_TO_POINTER (--count));
-        return count;
-    }
-}
-
 static gboolean
 _queue_blocked_requests (McdRequest *self)
 {
-  const gchar *path = NULL;
-  guint locks = 0;
-
   /* this is an internal request and therefore not subject to blocking *
      BUT the fact that this internal request is in-flight means other  *
-     requests on the same account/handle type should be blocked        */
+     requests on the same account should be blocked                    */
   if (self->internal_handler != NULL)
     {
-      path = mcd_account_get_object_path (_mcd_request_get_account (self));
-      _mcd_request_block_account (path);
-
+      _mcd_account_block_requests (self->account);
       return FALSE;
     }
 
-  /* no internal requests in flight, nothing to queue, nothing to do */
-  if (account_locks == NULL)
-    return FALSE;
-
-  if (path == NULL)
-    path = mcd_account_get_object_path (_mcd_request_get_account (self));
-
-  /* account_locks tracks the # of in-flight internal requests per account */
-  locks = GPOINTER_TO_UINT (g_hash_table_lookup (account_locks, path));
-
-  /* internal reqeusts in flight => other requests on that account must wait */
-  if (locks > 0)
-    {
-      GQueue *queue;
-
-      queue = g_hash_table_lookup (blocked_reqs, path);
-
-      if (queue == NULL)
-        {
-          queue = g_queue_new ();
-          g_hash_table_insert (blocked_reqs, g_strdup (path), queue);
-        }
-
-      _mcd_request_start_delay (self);
-      g_queue_push_tail (queue, self);
-
-      return TRUE;
-    }
-
-  return FALSE;
+  /* internal requests in flight => other requests on that account must
+   * wait, behind any that are already waiting */
+  return _mcd_account_queue_blocked_request (self->account, self);
 }
 
 void
@@ -732,27 +669,27 @@ _mcd_request_proceed (McdRequest *self,
     DEBUG ("Request delayed in favour of internal request on %s",
         mcd_account_get_object_path (self->account));
 
+  /* if too many requests were already waiting, it has failed, and there's
+   * nothing for the policies to check */
+  if (self->failure_domain != 0)
+    goto proceed;
+
   /* now regular request policy plugins get their shot at denying/delaying */
   for (mini_plugins = _mcd_request_policy_plugins ();
        mini_plugins != NULL;
        mini_plugins = mini_plugins->next)
     {
-      DEBUG ("Checking request with policy");
-
-      /* Lazily create a plugin-API object if anything cares */
-      if (plugin_api == NULL)
-        {
-          plugin_api = _mcd_plugin_request_new (self->account, self);
-        }
-
-      mcp_request_policy_check (mini_plugins->data, MCP_REQUEST (plugin_api));
+      /* each policy gets its own plugin-API object, so that its delays
+       * can be timed and, if necessary, timed out separately */
+      plugin_api = _mcd_plugin_request_new (self->account, self,
+          mini_plugins->data);
+      _mcd_plugin_request_check (plugin_api);
+      tp_clear_object (&plugin_api);
     }
 
   /* this is paired with the delay set when the request was created */
  proceed:
   _mcd_request_end_delay (self);
-
-  tp_clear_object (&plugin_api);
 }
 
 GHashTable *
@@ -985,6 +922,7 @@ guess_request_handler (McdRequest *self)
 {
   GList *sorted_handlers;
   GVariant *properties;
+  McdPropertyView *view;
 
   if (!tp_str_empty (self->preferred_handler))
     {
@@ -996,10 +934,11 @@ guess_request_handler (McdRequest *self)
     }
 
   properties = mcd_request_dup_properties (self);
-  sorted_handlers = _mcd_client_registry_list_possible_handlers (
-      self->clients, self->preferred_handler, properties,
-      NULL, NULL);
+  view = _mcd_property_view_new (properties);
   g_variant_unref (properties);
+  sorted_handlers = _mcd_client_registry_list_possible_handlers (
+      self->clients, self->preferred_handler, view, NULL, NULL);
+  _mcd_property_view_unref (view);
 
   if (sorted_handlers != NULL)
     {
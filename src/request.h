@@ -70,6 +70,8 @@ G_GNUC_INTERNAL const gchar *_mcd_request_get_preferred_handler (
 G_GNUC_INTERNAL const gchar *_mcd_request_get_object_path (McdRequest *self);
 G_GNUC_INTERNAL GHashTable *_mcd_request_get_hints (
     McdRequest *self);
+G_GNUC_INTERNAL gsize _mcd_request_get_retained_bytes (McdRequest *self);
+G_GNUC_INTERNAL void _mcd_request_foreach (GFunc func, gpointer user_data);
 
 G_GNUC_INTERNAL GHashTable *_mcd_request_dup_immutable_properties (
     McdRequest *self);
@@ -103,9 +105,6 @@ G_GNUC_INTERNAL gboolean _mcd_request_handle_internally (McdRequest *self,
 G_GNUC_INTERNAL void _mcd_request_clear_internal_handler (McdRequest *self);
 G_GNUC_INTERNAL gboolean _mcd_request_is_internal (McdRequest *self);
 
-G_GNUC_INTERNAL guint _mcd_request_block_account (const gchar *account);
-G_GNUC_INTERNAL guint _mcd_request_unblock_account (const gchar *account);
-
 G_END_DECLS
 
 #endif
@@ -0,0 +1,248 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * Regression test for the cache of parsed .client files
+ *
+ * Copyright © 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "mcd-client-cache.h"
+
+static gchar *tmpdir = NULL;
+static gchar *cache_file = NULL;
+
+typedef struct {
+    gchar *path;
+    const gchar *contents;
+} Fixture;
+
+static void
+write_client_file (Fixture *f,
+                   const gchar *contents)
+{
+    GError *error = NULL;
+
+    g_file_set_contents (f->path, contents, -1, &error);
+    g_assert_no_error (error);
+    f->contents = contents;
+}
+
+static GVariant *
+lookup (Fixture *f,
+        const GVariantType *type)
+{
+    return mcd_client_cache_lookup (f->path, f->contents,
+                                    strlen (f->contents), type);
+}
+
+static void
+store (Fixture *f,
+       const gchar *parsed)
+{
+    mcd_client_cache_store (f->path, f->contents, strlen (f->contents),
+                            g_variant_new_string (parsed));
+}
+
+static void
+assert_cached (Fixture *f,
+               const gchar *expected)
+{
+    GVariant *parsed = lookup (f, G_VARIANT_TYPE_STRING);
+
+    g_assert (parsed != NULL);
+    g_assert_cmpstr (g_variant_get_string (parsed, NULL), ==, expected);
+    g_variant_unref (parsed);
+}
+
+static void
+assert_not_cached (Fixture *f)
+{
+    g_assert (lookup (f, G_VARIANT_TYPE_STRING) == NULL);
+}
+
+static void
+setup (Fixture *f,
+       gconstpointer unused G_GNUC_UNUSED)
+{
+    /* start each test with nothing in memory or on disk */
+    mcd_client_cache_flush ();
+    g_unlink (cache_file);
+
+    f->path = g_build_filename (tmpdir, "Test.client", NULL);
+    write_client_file (f,
+        "[org.freedesktop.Telepathy.Client]\n"
+        "Interfaces=org.freedesktop.Telepathy.Client.Handler;\n");
+}
+
+static void
+teardown (Fixture *f,
+          gconstpointer unused G_GNUC_UNUSED)
+{
+    mcd_client_cache_flush ();
+    g_unlink (cache_file);
+    g_unlink (f->path);
+    g_free (f->path);
+}
+
+static void
+test_round_trip (Fixture *f,
+                 gconstpointer unused G_GNUC_UNUSED)
+{
+    assert_not_cached (f);
+
+    store (f, "handler");
+    assert_cached (f, "handler");
+
+    /* it survives being written out and read back */
+    mcd_client_cache_flush ();
+    g_assert (g_file_test (cache_file, G_FILE_TEST_IS_REGULAR));
+    assert_cached (f, "handler");
+
+    /* but only as the type it was stored as */
+    g_assert (lookup (f, G_VARIANT_TYPE_BOOLEAN) == NULL);
+}
+
+static void
+test_stale (Fixture *f,
+            gconstpointer unused G_GNUC_UNUSED)
+{
+    store (f, "handler");
+    mcd_client_cache_flush ();
+
+    /* The file is rewritten with the same size, almost certainly within
+     * the same second; the cached entry must not be used */
+    write_client_file (f,
+        "[org.freedesktop.Telepathy.Client]\n"
+        "Interfaces=org.freedesktop.Telepathy.Client.Observer;\n");
+    assert_not_cached (f);
+
+    store (f, "observer");
+    mcd_client_cache_flush ();
+    assert_cached (f, "observer");
+}
+
+static void
+test_corrupt (Fixture *f,
+              gconstpointer unused G_GNUC_UNUSED)
+{
+    GError *error = NULL;
+    gchar *dirname = g_path_get_dirname (cache_file);
+    guint8 garbage[256];
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (garbage); i++)
+        garbage[i] = g_random_int_range (0, 256);
+
+    g_assert_cmpint (g_mkdir_with_parents (dirname, 0700), ==, 0);
+    g_file_set_contents (cache_file, (const gchar *) garbage,
+                         sizeof (garbage), &error);
+    g_assert_no_error (error);
+
+    assert_not_cached (f);
+
+    /* a truncated cache is no better */
+    mcd_client_cache_flush ();
+    g_file_set_contents (cache_file, "(", 1, &error);
+    g_assert_no_error (error);
+
+    assert_not_cached (f);
+
+    /* the cache is rewritten with good data */
+    store (f, "handler");
+    mcd_client_cache_flush ();
+    assert_cached (f, "handler");
+
+    g_free (dirname);
+}
+
+static void
+test_version (Fixture *f,
+              gconstpointer unused G_GNUC_UNUSED)
+{
+    GError *error = NULL;
+    gchar *dirname = g_path_get_dirname (cache_file);
+    gchar *checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1,
+                                                     f->contents, -1);
+    GVariant *root;
+
+    /* an entry that would be used, if it had been written by this
+     * version of MC */
+    root = g_variant_ref_sink (g_variant_new_parsed (
+        "('mission-control 0.0.0 clients cache 2', {%s: (%s, <'handler'>)})",
+        f->path, checksum));
+
+    g_assert_cmpint (g_mkdir_with_parents (dirname, 0700), ==, 0);
+    g_file_set_contents (cache_file, g_variant_get_data (root),
+                         g_variant_get_size (root), &error);
+    g_assert_no_error (error);
+
+    assert_not_cached (f);
+
+    g_variant_unref (root);
+    g_free (checksum);
+    g_free (dirname);
+}
+
+int
+main (int argc, char **argv)
+{
+    gchar *dirname;
+    int ret;
+
+    g_type_init ();
+    g_test_init (&argc, &argv, NULL);
+
+    tmpdir = g_dir_make_tmp ("mc-test-client-cache.XXXXXX", NULL);
+    g_assert (tmpdir != NULL);
+    /* this must happen before anything calls g_get_user_cache_dir() */
+    g_setenv ("XDG_CACHE_HOME", tmpdir, TRUE);
+    cache_file = g_build_filename (tmpdir, "telepathy", "mission-control",
+                                   "clients.cache", NULL);
+
+    g_test_add ("/client-cache/round-trip", Fixture, NULL, setup,
+                test_round_trip, teardown);
+    g_test_add ("/client-cache/stale", Fixture, NULL, setup, test_stale,
+                teardown);
+    g_test_add ("/client-cache/corrupt", Fixture, NULL, setup, test_corrupt,
+                teardown);
+    g_test_add ("/client-cache/version", Fixture, NULL, setup, test_version,
+                teardown);
+
+    ret = g_test_run ();
+
+    /* teardown() removed the files, so only the directories are left */
+    dirname = g_path_get_dirname (cache_file);
+    g_rmdir (dirname);
+    g_free (dirname);
+    dirname = g_build_filename (tmpdir, "telepathy", NULL);
+    g_rmdir (dirname);
+    g_free (dirname);
+    g_rmdir (tmpdir);
+
+    g_free (cache_file);
+    g_free (tmpdir);
+    return ret;
+}
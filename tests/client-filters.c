@@ -0,0 +1,351 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * Regression test for compiled client channel filters
+ *
+ * Copyright © 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#include "mcd-client-priv.h"
+
+static GVariant *
+text_channel (guint handle_type,
+              gboolean requested)
+{
+    return g_variant_ref_sink (g_variant_new_parsed (
+        "{%s: <%s>, %s: <%u>, %s: <%b>, %s: <'alice@example.com'>}",
+        TP_PROP_CHANNEL_CHANNEL_TYPE, TP_IFACE_CHANNEL_TYPE_TEXT,
+        TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, handle_type,
+        TP_PROP_CHANNEL_REQUESTED, requested,
+        TP_PROP_CHANNEL_TARGET_ID));
+}
+
+static guint
+match (const GList *filters,
+       GVariant *channel,
+       gboolean assume_requested)
+{
+    McdClientFilterIndex *index = _mcd_client_filter_index_new (filters);
+    McdPropertyView *view = _mcd_property_view_new (channel);
+    guint quality;
+
+    quality = _mcd_client_filter_index_match (index, view, assume_requested);
+    _mcd_property_view_unref (view);
+    _mcd_client_filter_index_free (index);
+    return quality;
+}
+
+static void
+free_filters (GList *filters)
+{
+    g_list_free_full (filters, (GDestroyNotify) g_hash_table_unref);
+}
+
+static void
+test_quality (void)
+{
+    GVariant *channel = text_channel (TP_HANDLE_TYPE_CONTACT, FALSE);
+    GList *filters = NULL;
+
+    /* no filters: never matches */
+    g_assert_cmpuint (match (NULL, channel, FALSE), ==, 0);
+
+    /* the empty filter matches everything */
+    filters = g_list_prepend (filters, tp_asv_new (NULL, NULL));
+    g_assert_cmpuint (match (filters, channel, FALSE), ==, 1);
+
+    /* the most specific matching filter wins */
+    filters = g_list_prepend (filters, tp_asv_new (
+        TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+            TP_IFACE_CHANNEL_TYPE_TEXT,
+        TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_UINT,
+            TP_HANDLE_TYPE_CONTACT,
+        NULL));
+    filters = g_list_prepend (filters, tp_asv_new (
+        TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+            TP_IFACE_CHANNEL_TYPE_TEXT,
+        NULL));
+    g_assert_cmpuint (match (filters, channel, FALSE), ==, 3);
+
+    /* a filter that fails on one key doesn't match at all */
+    free_filters (filters);
+    filters = g_list_prepend (NULL, tp_asv_new (
+        TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+            TP_IFACE_CHANNEL_TYPE_TEXT,
+        TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_UINT,
+            TP_HANDLE_TYPE_ROOM,
+        NULL));
+    g_assert_cmpuint (match (filters, channel, FALSE), ==, 0);
+
+    free_filters (filters);
+    g_variant_unref (channel);
+}
+
+static void
+test_integer_types (void)
+{
+    GVariant *channel = text_channel (TP_HANDLE_TYPE_ROOM, FALSE);
+    GList *filters;
+
+    /* the channel has TargetHandleType as a uint32, but filters with any
+     * integer type and the same value match it */
+    filters = g_list_prepend (NULL, tp_asv_new (
+        TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_INT64,
+            (gint64) TP_HANDLE_TYPE_ROOM,
+        NULL));
+    g_assert_cmpuint (match (filters, channel, FALSE), ==, 2);
+    free_filters (filters);
+
+    filters = g_list_prepend (NULL, tp_asv_new (
+        TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_UCHAR,
+            (guchar) TP_HANDLE_TYPE_ROOM,
+        NULL));
+    g_assert_cmpuint (match (filters, channel, FALSE), ==, 2);
+    free_filters (filters);
+
+    /* but a string is not an integer */
+    filters = g_list_prepend (NULL, tp_asv_new (
+        TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_STRING, "2",
+        NULL));
+    g_assert_cmpuint (match (filters, channel, FALSE), ==, 0);
+    free_filters (filters);
+
+    g_variant_unref (channel);
+}
+
+static void
+test_assume_requested (void)
+{
+    GVariant *request = g_variant_ref_sink (g_variant_new_parsed (
+        "{%s: <%s>}",
+        TP_PROP_CHANNEL_CHANNEL_TYPE, TP_IFACE_CHANNEL_TYPE_TEXT));
+    GList *filters;
+
+    filters = g_list_prepend (NULL, tp_asv_new (
+        TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+            TP_IFACE_CHANNEL_TYPE_TEXT,
+        TP_PROP_CHANNEL_REQUESTED, G_TYPE_BOOLEAN, TRUE,
+        NULL));
+    g_assert_cmpuint (match (filters, request, FALSE), ==, 0);
+    g_assert_cmpuint (match (filters, request, TRUE), ==, 3);
+    free_filters (filters);
+
+    filters = g_list_prepend (NULL, tp_asv_new (
+        TP_PROP_CHANNEL_REQUESTED, G_TYPE_BOOLEAN, FALSE,
+        NULL));
+    g_assert_cmpuint (match (filters, request, TRUE), ==, 0);
+    free_filters (filters);
+
+    g_variant_unref (request);
+}
+
+#define N_CLIENTS 50
+#define N_MATCHES 2000
+
+/* How MC matched a channel against a client's filters before they were
+ * compiled into an index: every key of every filter was looked up in the
+ * channel's GVariant and compared, for every client. Only the types that
+ * the benchmark uses are handled. */
+static guint
+reference_match (GVariant *channel,
+                 const GList *filters)
+{
+    const GList *list;
+    guint best_quality = 0;
+
+    for (list = filters; list != NULL; list = list->next)
+    {
+        GHashTable *filter = list->data;
+        GHashTableIter iter;
+        gboolean filter_matched = TRUE;
+        gpointer k, v;
+        guint quality = g_hash_table_size (filter) + 1;
+
+        if (quality <= best_quality)
+            continue;
+
+        g_hash_table_iter_init (&iter, filter);
+
+        while (filter_matched && g_hash_table_iter_next (&iter, &k, &v))
+        {
+            GValue *filter_value = v;
+            gboolean valid;
+
+            if (G_VALUE_HOLDS_STRING (filter_value))
+            {
+                filter_matched = !tp_strdiff (
+                    tp_vardict_get_string (channel, k),
+                    g_value_get_string (filter_value));
+            }
+            else if (G_VALUE_HOLDS_BOOLEAN (filter_value))
+            {
+                gboolean b = tp_vardict_get_boolean (channel, k, &valid);
+
+                filter_matched = valid &&
+                    !!b == !!g_value_get_boolean (filter_value);
+            }
+            else if (G_VALUE_HOLDS_UINT (filter_value))
+            {
+                guint64 u = tp_vardict_get_uint64 (channel, k, &valid);
+
+                filter_matched = valid &&
+                    u == g_value_get_uint (filter_value);
+            }
+            else
+            {
+                g_assert_not_reached ();
+            }
+        }
+
+        if (filter_matched)
+            best_quality = quality;
+    }
+
+    return best_quality;
+}
+
+typedef enum {
+    /* the channel's GVariant, with each client's filters as a GList */
+    MATCH_REFERENCE,
+    /* a view of the channel built once, as McdChannel does, with each
+     * client's compiled index */
+    MATCH_CACHED_VIEW,
+    /* the view rebuilt for every client */
+    MATCH_VIEW_PER_CLIENT
+} MatchMode;
+
+/* Match a channel against N_CLIENTS clients with a few filters each, as
+ * dispatching does, N_MATCHES times, and return matches per second */
+static gdouble
+benchmark_matches (GList **filters,
+                   McdClientFilterIndex **indices,
+                   GVariant *channel,
+                   MatchMode mode)
+{
+    McdPropertyView *view = _mcd_property_view_new (channel);
+    guint matched = 0;
+    guint i, j;
+
+    g_test_timer_start ();
+
+    for (i = 0; i < N_MATCHES; i++)
+    {
+        for (j = 0; j < N_CLIENTS; j++)
+        {
+            guint quality;
+
+            switch (mode)
+            {
+                case MATCH_REFERENCE:
+                    quality = reference_match (channel, filters[j]);
+                    break;
+
+                case MATCH_VIEW_PER_CLIENT:
+                    _mcd_property_view_unref (view);
+                    view = _mcd_property_view_new (channel);
+                    /* fall through */
+
+                default:
+                    quality = _mcd_client_filter_index_match (indices[j],
+                                                              view, FALSE);
+            }
+
+            if (quality > 0)
+                matched++;
+        }
+    }
+
+    /* every third client has a filter for contact text channels */
+    g_assert_cmpuint (matched, ==, N_MATCHES * ((N_CLIENTS + 2) / 3));
+    _mcd_property_view_unref (view);
+    return (N_MATCHES * N_CLIENTS) / g_test_timer_elapsed ();
+}
+
+static void
+test_benchmark (void)
+{
+    GVariant *channel = text_channel (TP_HANDLE_TYPE_CONTACT, FALSE);
+    GList *filters[N_CLIENTS];
+    McdClientFilterIndex *indices[N_CLIENTS];
+    gdouble reference, cached, per_client;
+    guint i;
+
+    for (i = 0; i < N_CLIENTS; i++)
+    {
+        filters[i] = NULL;
+        filters[i] = g_list_prepend (filters[i], tp_asv_new (
+            TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+                TP_IFACE_CHANNEL_TYPE_STREAMED_MEDIA,
+            NULL));
+        filters[i] = g_list_prepend (filters[i], tp_asv_new (
+            TP_PROP_CHANNEL_CHANNEL_TYPE, G_TYPE_STRING,
+                TP_IFACE_CHANNEL_TYPE_TEXT,
+            TP_PROP_CHANNEL_TARGET_HANDLE_TYPE, G_TYPE_UINT,
+                (i % 3 == 0) ? TP_HANDLE_TYPE_CONTACT : TP_HANDLE_TYPE_ROOM,
+            TP_PROP_CHANNEL_REQUESTED, G_TYPE_BOOLEAN, FALSE,
+            NULL));
+        indices[i] = _mcd_client_filter_index_new (filters[i]);
+
+        /* both ways of matching agree */
+        g_assert_cmpuint (reference_match (channel, filters[i]), ==,
+                          match (filters[i], channel, FALSE));
+    }
+
+    reference = benchmark_matches (filters, indices, channel,
+                                   MATCH_REFERENCE);
+    cached = benchmark_matches (filters, indices, channel,
+                                MATCH_CACHED_VIEW);
+    per_client = benchmark_matches (filters, indices, channel,
+                                    MATCH_VIEW_PER_CLIENT);
+
+    g_test_minimized_result (1.0 / cached, "%.0f matches/s with a cached "
+                             "view, %.0f matches/s matching the GVariant "
+                             "against each filter, %.0f matches/s "
+                             "rebuilding the view per client",
+                             cached, reference, per_client);
+
+    for (i = 0; i < N_CLIENTS; i++)
+    {
+        _mcd_client_filter_index_free (indices[i]);
+        free_filters (filters[i]);
+    }
+
+    g_variant_unref (channel);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_type_init ();
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/client-filters/quality", test_quality);
+    g_test_add_func ("/client-filters/integer-types", test_integer_types);
+    g_test_add_func ("/client-filters/assume-requested",
+                     test_assume_requested);
+
+    if (g_test_perf ())
+        g_test_add_func ("/client-filters/benchmark", test_benchmark);
+
+    return g_test_run ();
+}
@@ -0,0 +1,139 @@
+/* vi: set et sw=4 ts=8 cino=t0,(0: */
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 8 -*- */
+/*
+ * Regression test and benchmark for McdOperation's child container
+ *
+ * Copyright © 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "config.h"
+
+#include "mcd-operation.h"
+
+/* roughly the number of channels a busy connection might churn through */
+#define N_CHURN 10000
+#define N_ABORT 100
+
+static void
+test_churn (void)
+{
+    McdOperation *operation = mcd_operation_new ();
+    McdMission **missions = g_new0 (McdMission *, N_CHURN);
+    gdouble elapsed;
+    guint i;
+
+    g_test_timer_start ();
+
+    for (i = 0; i < N_CHURN; i++)
+    {
+        missions[i] = g_object_new (MCD_TYPE_MISSION, NULL);
+        mcd_operation_take_mission (operation, missions[i]);
+    }
+
+    g_assert_cmpuint (mcd_operation_get_n_missions (operation), ==, N_CHURN);
+
+    /* remove the oldest children first, which is the worst case for a
+     * list that is searched from the head */
+    for (i = 0; i < N_CHURN; i++)
+        mcd_operation_remove_mission (operation, missions[i]);
+
+    elapsed = g_test_timer_elapsed ();
+
+    g_assert_cmpuint (mcd_operation_get_n_missions (operation), ==, 0);
+    g_assert (mcd_operation_get_missions (operation) == NULL);
+
+    g_test_message ("%u take+remove pairs in %.3f ms", N_CHURN,
+                    elapsed * 1000.0);
+    g_test_minimized_result (elapsed, "take+remove of %u children", N_CHURN);
+
+    g_free (missions);
+    g_object_unref (operation);
+}
+
+static void
+abort_sibling_cb (McdMission *mission,
+                  McdMission *sibling)
+{
+    mcd_mission_abort (sibling);
+}
+
+static void
+test_abort_removes_siblings (void)
+{
+    McdOperation *operation = mcd_operation_new ();
+    McdMission *missions[N_ABORT];
+    guint i;
+
+    for (i = 0; i < N_ABORT; i++)
+    {
+        missions[i] = g_object_new (MCD_TYPE_MISSION, NULL);
+        mcd_operation_take_mission (operation, missions[i]);
+    }
+
+    /* the most recently taken child is visited first, so each odd child
+     * removes its even sibling before the iteration gets to it */
+    for (i = 1; i < N_ABORT; i += 2)
+        g_signal_connect (missions[i], "abort",
+                          G_CALLBACK (abort_sibling_cb), missions[i - 1]);
+
+    mcd_mission_abort (MCD_MISSION (operation));
+
+    g_assert_cmpuint (mcd_operation_get_n_missions (operation), ==,
+                      N_ABORT / 2);
+
+    g_object_unref (operation);
+}
+
+static void
+remove_cb (McdMission *mission,
+           McdOperation *operation)
+{
+    mcd_operation_remove_mission (operation, mission);
+}
+
+static void
+test_foreach_remove (void)
+{
+    McdOperation *operation = mcd_operation_new ();
+    guint i;
+
+    for (i = 0; i < N_ABORT; i++)
+        mcd_operation_take_mission (operation,
+                                    g_object_new (MCD_TYPE_MISSION, NULL));
+
+    mcd_operation_foreach (operation, (GFunc) remove_cb, operation);
+
+    g_assert_cmpuint (mcd_operation_get_n_missions (operation), ==, 0);
+
+    g_object_unref (operation);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/operation/churn", test_churn);
+    g_test_add_func ("/operation/abort-removes-siblings",
+                     test_abort_removes_siblings);
+    g_test_add_func ("/operation/foreach-remove", test_foreach_remove);
+
+    return g_test_run ();
+}
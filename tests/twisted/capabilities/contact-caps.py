@@ -26,7 +26,7 @@ import dbus
 import dbus.service
 
 from servicetest import EventPattern, tp_name_prefix, tp_path_prefix, \
-        call_async
+        call_async, sync_dbus
 from mctest import exec_test, SimulatedConnection, SimulatedClient, \
         create_fakecm_account, enable_fakecm_account, SimulatedChannel, \
         expect_client_setup
@@ -149,5 +149,25 @@ def test(q, bus, mc):
     assert struct[1] == []
     assert struct[2] == []
 
+    # When AbiWord starts, MC reads its .client file again; its
+    # capabilities have not changed, so the CM is not told about them
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+    assert (cs.CLIENT + '.AbiWord', 1, 0) in stats.GetCapabilitiesStats()
+
+    forbidden = [EventPattern('dbus-method-call',
+        interface=cs.CONN_IFACE_CONTACT_CAPS, method='UpdateCapabilities')]
+    q.forbid_events(forbidden)
+
+    abiword = SimulatedClient(q, bus, 'AbiWord',
+            observe=[], approve=[],
+            handle=[abi_contact_fixed_properties, abi_room_fixed_properties],
+            cap_tokens=['com.example.Foo', 'com.example.Bar'],
+            bypass_approval=False)
+    sync_dbus(bus, q, mc)
+
+    assert (cs.CLIENT + '.AbiWord', 1, 1) in stats.GetCapabilitiesStats()
+    q.unforbid_events(forbidden)
+
 if __name__ == '__main__':
     exec_test(test, {})
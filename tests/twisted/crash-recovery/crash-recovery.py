@@ -17,10 +17,14 @@
 # 02110-1301 USA
 
 import dbus
-"""Regression test for recovering from an MC crash.
+"""Regression test for recovering from an MC crash, with a snapshot of
+the handler map left by the crashed MC (see MC_HANDLER_MAP_SNAPSHOT).
 """
 
 import os
+import shutil
+import tempfile
+import time
 
 import dbus
 import dbus.service
@@ -60,9 +64,57 @@ def preseed(q, bus, fake_accounts_service):
                 cs.tp_name_prefix + '.Connection.fakecm.fakeprotocol.jc',
                 'fakecm/fakeprotocol/jc_2edenton_40unatco_2eint'))
 
+def snapshot_path(bus, runtime_dir):
+    bus_daemon = bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+    server_id = bus_daemon.GetId(dbus_interface=dbus.BUS_DAEMON_IFACE)
+    return os.path.join(runtime_dir, 'telepathy', 'mission-control',
+            'handlers-%s.log' % server_id)
+
+def write_snapshot(path, records):
+    os.makedirs(os.path.dirname(path))
+    f = open(path, 'w')
+    f.write('# mission-control handler map 1\n')
+
+    for record in records:
+        f.write('+\t%s\n' % '\t'.join(record))
+
+    f.close()
+
+def read_snapshot(path):
+    channels = {}
+
+    for line in open(path).readlines()[1:]:
+        fields = line.rstrip('\n').split('\t')
+
+        if fields[0] == '+':
+            channels[fields[1]] = fields[2:]
+        else:
+            channels.pop(fields[1], None)
+
+    return channels
+
+def object_stats(bus, account_path):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+    counts = {}
+
+    for path, type_name, count, size in stats.GetObjectStats():
+        if path == account_path:
+            counts[type_name] = count
+
+    return counts
+
 def test(q, bus, unused, **kwargs):
     fake_accounts_service = kwargs['fake_accounts_service']
     preseed(q, bus, fake_accounts_service)
+    account_path = cs.ACCOUNT_PATH_PREFIX + account_id
+
+    # MC is service-activated, so it gets its environment from the bus
+    runtime_dir = tempfile.mkdtemp(prefix='mc-test-runtime.')
+    bus_daemon = bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+    bus_daemon.UpdateActivationEnvironment(
+            {'MC_HANDLER_MAP_SNAPSHOT': '1', 'XDG_RUNTIME_DIR': runtime_dir},
+            dbus_interface=dbus.BUS_DAEMON_IFACE)
 
     text_fixed_properties = dbus.Dictionary({
         cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
@@ -97,19 +149,49 @@ def test(q, bus, unused, **kwargs):
 
     client = SimulatedClient(q, bus, 'Empathy',
             observe=[text_fixed_properties], approve=[text_fixed_properties],
-            handle=[text_fixed_properties], bypass_approval=False)
+            handle=[text_fixed_properties], bypass_approval=False,
+            implement_get_interfaces=False)
     client.handled_channels.append(handled_chan.object_path)
 
-    # Service-activate MC.
-    # We're told about the other channel as an observer...
+    # The crashed MC knew that Empathy was handling one of the channels,
+    # and another that has closed since
+    snapshot = snapshot_path(bus, runtime_dir)
+    closed_path = conn.object_path + '/closed'
+    write_snapshot(snapshot, [
+        (handled_chan.object_path, bus.get_unique_name(), client.bus_name,
+            account_path),
+        (closed_path, bus.get_unique_name(), client.bus_name, account_path),
+        ])
+
+    # Service-activate MC. It starts to introspect Empathy, but we don't
+    # answer yet; meanwhile, it looks at the connection's channels
     mc = MC(q, bus, wait_for_names=False)
-    e, = mc.wait_for_names(
+    get_interfaces, _ = mc.wait_for_names(
             EventPattern('dbus-method-call',
                 path=client.object_path,
-                interface=cs.OBSERVER, method='ObserveChannels',
+                interface=cs.PROPERTIES_IFACE, method='Get',
+                args=[cs.CLIENT, 'Interfaces'],
                 handled=False),
+            EventPattern('dbus-method-call',
+                path=conn.object_path,
+                interface=cs.PROPERTIES_IFACE, method='GetAll',
+                args=[cs.CONN_IFACE_REQUESTS]),
             )
 
+    # The snapshot says that the handled channel is still handled, so MC
+    # recovers it without waiting for Empathy; the other one must wait
+    counts = object_stats(bus, account_path)
+    assert counts.get('McdChannel') == 1, counts
+
+    q.dbus_return(get_interfaces.message, client.get_interfaces(),
+            signature='v')
+
+    # We're told about the other channel as an observer...
+    e = q.expect('dbus-method-call',
+            path=client.object_path,
+            interface=cs.OBSERVER, method='ObserveChannels',
+            handled=False)
+
     assert e.args[1] == conn.object_path, e.args
     channels = e.args[2]
     assert channels[0][0] == unhandled_chan.object_path, channels
@@ -125,6 +207,25 @@ def test(q, bus, unused, **kwargs):
     assert channels[0][0] == unhandled_chan.object_path, channels
     q.dbus_return(e.message, signature='')
 
+    # MC forgot the channel that had closed, and remembers who is handling
+    # the others; the snapshot is written when MC is idle
+    for i in range(50):
+        channels = read_snapshot(snapshot)
+
+        if closed_path not in channels and \
+                unhandled_chan.object_path in channels:
+            break
+
+        time.sleep(0.1)
+
+    assert closed_path not in channels, channels
+    assert channels[handled_chan.object_path][0] == bus.get_unique_name(), \
+            channels
+    assert channels[unhandled_chan.object_path][0] == bus.get_unique_name(), \
+            channels
+
+    shutil.rmtree(runtime_dir)
+
 if __name__ == '__main__':
     exec_test(test, {}, preload_mc=False, use_fake_accounts_service=True,
             pass_kwargs=True)
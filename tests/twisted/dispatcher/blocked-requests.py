@@ -0,0 +1,166 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for channel requests that wait for an internal request
+on their account: each account's queue is bounded, the time spent waiting
+is recorded, and when the internal requests finish, accounts take turns to
+release their requests.
+"""
+
+import dbus
+
+from servicetest import EventPattern, call_async
+from mctest import exec_test, SimulatedClient, create_fakecm_account, \
+        enable_fakecm_account, expect_client_setup
+import constants as cs
+
+# Keep in sync with mcd-account.c
+MAX_BLOCKED_REQUESTS = 64
+
+text_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_TEXT,
+    }, signature='sv')
+
+def start_internal_request(q, cd, account, conn):
+    # MC makes an internal request to send a message
+    call_async(q, cd, 'SendMessage', account.object_path, 'romeo',
+            dbus.Array([
+                dbus.Dictionary({'message-type': dbus.UInt32(0)},
+                    signature='sv'),
+                dbus.Dictionary({'content-type': 'text/plain',
+                    'content': 'hello'}, signature='sv'),
+                ], signature='a{sv}'),
+            0, dbus_interface=cs.CD + '.Interface.Messages1')
+    return q.expect('dbus-method-call', path=conn.object_path,
+            interface=cs.CONN_IFACE_REQUESTS, method='EnsureChannel',
+            handled=False)
+
+def create_and_proceed(q, bus, cd, account, client, target_id):
+    request = dbus.Dictionary(text_fixed_properties, signature='sv')
+    request[cs.CHANNEL + '.TargetID'] = target_id
+    call_async(q, cd, 'CreateChannel', account.object_path, request,
+            dbus.Int64(0), client.bus_name, dbus_interface=cs.CD)
+    ret = q.expect('dbus-return', method='CreateChannel')
+
+    cr = bus.get_object(cs.AM, ret.value[0])
+    call_async(q, cr, 'Proceed', dbus_interface=cs.CR)
+    q.expect('dbus-return', method='Proceed')
+    return ret.value[0]
+
+def blocked_request_stats(bus, account):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+    unique_name = account.object_path[len(cs.ACCOUNT_PATH_PREFIX):]
+
+    for row in stats.GetRequestDelayStats():
+        if row[0] == unique_name and row[1] == 'BlockedRequest':
+            return row
+
+    return None
+
+def test(q, bus, mc):
+    simulated_cm, busy = create_fakecm_account(q, bus, mc,
+            dbus.Dictionary({"account": "busy@example.com",
+                "password": "secrecy"}, signature='sv'))
+    busy_conn = enable_fakecm_account(q, bus, mc, busy,
+            dbus.Dictionary({"account": "busy@example.com",
+                "password": "secrecy"}, signature='sv'))
+
+    simulated_cm, quiet = create_fakecm_account(q, bus, mc,
+            dbus.Dictionary({"account": "quiet@example.com",
+                "password": "secrecy"}, signature='sv'),
+            simulated_cm=simulated_cm)
+    quiet_conn = enable_fakecm_account(q, bus, mc, quiet,
+            dbus.Dictionary({"account": "quiet@example.com",
+                "password": "secrecy"}, signature='sv'))
+
+    client = SimulatedClient(q, bus, 'Empathy',
+            observe=[], approve=[], handle=[text_fixed_properties],
+            bypass_approval=True)
+    expect_client_setup(q, [client])
+
+    cd = bus.get_object(cs.CD, cs.CD_PATH)
+
+    busy_ensure = start_internal_request(q, cd, busy, busy_conn)
+    quiet_ensure = start_internal_request(q, cd, quiet, quiet_conn)
+
+    # Requests on both accounts have to wait; the busy account's queue
+    # fills up
+    for i in range(MAX_BLOCKED_REQUESTS):
+        create_and_proceed(q, bus, cd, busy, client, 'busy%d' % i)
+
+    for i in range(3):
+        create_and_proceed(q, bus, cd, quiet, client, 'quiet%d' % i)
+
+    # so the next request on it fails straight away
+    cr_path = create_and_proceed(q, bus, cd, busy, client, 'one-too-many')
+    e = q.expect('dbus-signal', path=cr_path, interface=cs.CR,
+            signal='Failed')
+    assert e.args[0] == cs.NOT_AVAILABLE, e.args
+
+    # Nothing has been released yet, but the refusal has been counted
+    row = blocked_request_stats(bus, busy)
+    assert row is not None
+    assert (row[2], row[3]) == (1, 1), row
+    assert blocked_request_stats(bus, quiet) is None
+
+    # When the internal requests finish, the waiting requests go ahead
+    # (MC tries once more to get a channel for each message, then gives
+    # up)
+    q.dbus_raise(busy_ensure.message, cs.NOT_AVAILABLE, 'No')
+    q.dbus_raise(quiet_ensure.message, cs.NOT_AVAILABLE, 'No')
+    busy_ensure, quiet_ensure = q.expect_many(
+            EventPattern('dbus-method-call', path=busy_conn.object_path,
+                interface=cs.CONN_IFACE_REQUESTS, method='EnsureChannel',
+                handled=False),
+            EventPattern('dbus-method-call', path=quiet_conn.object_path,
+                interface=cs.CONN_IFACE_REQUESTS, method='EnsureChannel',
+                handled=False),
+            )
+    q.dbus_raise(busy_ensure.message, cs.NOT_AVAILABLE, 'Still no')
+    q.dbus_raise(quiet_ensure.message, cs.NOT_AVAILABLE, 'Still no')
+
+    targets = []
+
+    for i in range(MAX_BLOCKED_REQUESTS + 3):
+        e = q.expect('dbus-method-call',
+                interface=cs.CONN_IFACE_REQUESTS, method='CreateChannel',
+                handled=False)
+        targets.append(e.args[0][cs.CHANNEL + '.TargetID'])
+        q.dbus_raise(e.message, cs.NOT_AVAILABLE, 'No')
+
+    # Each account's requests are released in order...
+    assert [t for t in targets if t.startswith('busy')] == \
+            ['busy%d' % i for i in range(MAX_BLOCKED_REQUESTS)], targets
+    assert [t for t in targets if t.startswith('quiet')] == \
+            ['quiet%d' % i for i in range(3)], targets
+
+    # ... but the accounts take turns, so the quiet account's requests
+    # don't have to wait for the whole of the busy account's queue
+    assert max(targets.index('quiet%d' % i) for i in range(3)) < 20, targets
+
+    # Every request's wait was recorded against its account
+    row = blocked_request_stats(bus, busy)
+    assert (row[2], row[3]) == (MAX_BLOCKED_REQUESTS + 1, 1), row
+    row = blocked_request_stats(bus, quiet)
+    assert (row[2], row[3]) == (3, 0), row
+    assert row[5] > 0 and row[5] <= row[4], row
+    assert sum(count for limit, count in row[6]) == 3, row
+
+if __name__ == '__main__':
+    exec_test(test, {})
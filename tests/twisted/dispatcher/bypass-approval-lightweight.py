@@ -0,0 +1,217 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for dispatching incoming channels with bypassed
+approval, with MC_LIGHTWEIGHT_BYPASS set so that no channel dispatch
+operation appears on D-Bus unless MC has to fall back to approvers.
+
+If MC_TEST_BENCHMARK is set, this also times a burst of lightweight
+dispatches, and writes the rate to the test's log.
+"""
+
+import os
+import time
+
+import dbus
+
+from servicetest import EventPattern, call_async
+from mctest import exec_test, SimulatedClient, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, expect_client_setup, \
+        MC
+import constants as cs
+
+N_CHANNELS = 3
+N_BENCHMARK_CHANNELS = 500
+
+text_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_TEXT,
+    }, signature='sv')
+
+def announce(q, conn, jid):
+    channel_properties = dbus.Dictionary(text_fixed_properties,
+            signature='sv')
+    channel_properties[cs.CHANNEL + '.TargetID'] = jid
+    channel_properties[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, jid)
+    channel_properties[cs.CHANNEL + '.InitiatorID'] = jid
+    channel_properties[cs.CHANNEL + '.InitiatorHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, jid)
+    channel_properties[cs.CHANNEL + '.Requested'] = False
+    channel_properties[cs.CHANNEL + '.Interfaces'] = dbus.Array(signature='s')
+
+    chan = SimulatedChannel(conn, channel_properties)
+    chan.announce()
+    return chan
+
+def object_stats(bus, account):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+    counts = {}
+
+    for path, type_name, count, size in stats.GetObjectStats():
+        if path == account.object_path:
+            counts[type_name] = count
+
+    return counts
+
+def dispatch(q, archiver, sms, account, conn, jid):
+    chan = announce(q, conn, jid)
+
+    # The Observer is told about the new channel, but there is no channel
+    # dispatch operation for it to look at
+    e = q.expect('dbus-method-call',
+            path=archiver.object_path,
+            interface=cs.OBSERVER, method='ObserveChannels',
+            handled=False)
+    assert e.args[0] == account.object_path, e.args
+    assert e.args[1] == conn.object_path, e.args
+    assert e.args[2][0][0] == chan.object_path, e.args
+    assert e.args[3] == '/', e.args
+    q.dbus_return(e.message, signature='')
+
+    return chan, q.expect('dbus-method-call',
+            path=sms.object_path,
+            interface=cs.HANDLER, method='HandleChannels',
+            handled=False)
+
+def benchmark(q, archiver, sms, account, conn):
+    start = time.time()
+
+    for i in range(N_BENCHMARK_CHANNELS):
+        chan, e = dispatch(q, archiver, sms, account, conn,
+                'bench%d@example.com' % i)
+        q.dbus_return(e.message, signature='')
+
+    elapsed = time.time() - start
+    print "%d lightweight bypass dispatches in %.3fs (%.1f/s)" % (
+            N_BENCHMARK_CHANNELS, elapsed, N_BENCHMARK_CHANNELS / elapsed)
+
+def test(q, bus, unused, **kwargs):
+    # MC is service-activated, so it gets its environment from the bus
+    bus_daemon = bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+    bus_daemon.UpdateActivationEnvironment({'MC_LIGHTWEIGHT_BYPASS': '1'},
+            dbus_interface=dbus.BUS_DAEMON_IFACE)
+
+    mc = MC(q, bus, wait_for_names=False)
+    mc.wait_for_names(
+        EventPattern('dbus-signal',
+            path=cs.TEST_DBUS_ACCOUNT_PLUGIN_PATH,
+            interface=cs.TEST_DBUS_ACCOUNT_PLUGIN_IFACE,
+            signal='Active'))
+
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    simulated_cm, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    # An archiver observes everything; an SMS client handles text channels
+    # without approval; a chat UI could approve and handle them too.
+    archiver = SimulatedClient(q, bus, 'Archiver',
+            observe=[text_fixed_properties], approve=[],
+            handle=[])
+    sms = SimulatedClient(q, bus, 'SMS',
+            observe=[], approve=[],
+            handle=[text_fixed_properties], bypass_approval=True)
+    empathy = SimulatedClient(q, bus, 'Empathy',
+            observe=[], approve=[text_fixed_properties],
+            handle=[text_fixed_properties], bypass_approval=False)
+
+    expect_client_setup(q, [archiver, sms, empathy])
+
+    # subscribe to the OperationList interface (MC assumes that until this
+    # property has been retrieved once, nobody cares)
+    cd = bus.get_object(cs.CD, cs.CD_PATH)
+    cd_props = dbus.Interface(cd, cs.PROPERTIES_IFACE)
+    assert cd_props.Get(cs.CD_IFACE_OP_LIST, 'DispatchOperations') == []
+
+    # While the bypassing handler accepts the channels, nothing is approved
+    # and no channel dispatch operation is announced
+    forbidden = [
+            EventPattern('dbus-method-call', method='AddDispatchOperation'),
+            EventPattern('dbus-signal', interface=cs.CD_IFACE_OP_LIST),
+            ]
+    q.forbid_events(forbidden)
+
+    for i in range(N_CHANNELS):
+        chan, e = dispatch(q, archiver, sms, account, conn,
+                'sender%d@example.com' % i)
+
+        # MC is still dispatching the channel internally, but there is
+        # nothing for anyone else to see
+        counts = object_stats(bus, account)
+        assert counts.get('McdDispatchOperation') == 1, counts
+        assert cd_props.Get(cs.CD_IFACE_OP_LIST, 'DispatchOperations') == []
+
+        q.dbus_return(e.message, signature='')
+
+    if os.environ.get('MC_TEST_BENCHMARK', '') != '':
+        benchmark(q, archiver, sms, account, conn)
+
+    q.unforbid_events(forbidden)
+
+    # If the bypassing handler fails, MC falls back to approvers, and the
+    # channel dispatch operation appears on D-Bus after all
+    chan, e = dispatch(q, archiver, sms, account, conn, 'broken@example.com')
+    q.dbus_raise(e.message, 'com.example.Broken', 'No way')
+
+    e, a = q.expect_many(
+            EventPattern('dbus-signal',
+                path=cs.CD_PATH,
+                interface=cs.CD_IFACE_OP_LIST,
+                signal='NewDispatchOperation'),
+            EventPattern('dbus-method-call',
+                path=empathy.object_path,
+                interface=cs.APPROVER, method='AddDispatchOperation',
+                handled=False),
+            )
+    cdo_path = e.args[0]
+    assert a.args[1] == cdo_path, a.args
+
+    # None of the channels that were handled without approval used up an
+    # object path, so this is the first one MC has handed out
+    assert cdo_path.endswith('/do0'), cdo_path
+    assert cd_props.Get(cs.CD_IFACE_OP_LIST, 'DispatchOperations') == \
+            [(cdo_path, e.args[1])]
+    q.dbus_return(a.message, signature='')
+
+    cdo_iface = dbus.Interface(bus.get_object(cs.CD, cdo_path), cs.CDO)
+    call_async(q, cdo_iface, 'HandleWith',
+            cs.tp_name_prefix + '.Client.Empathy')
+
+    e = q.expect('dbus-method-call',
+            path=empathy.object_path,
+            interface=cs.HANDLER, method='HandleChannels',
+            handled=False)
+    q.dbus_return(e.message, signature='')
+
+    q.expect_many(
+            EventPattern('dbus-return', method='HandleWith'),
+            EventPattern('dbus-signal', interface=cs.CDO, signal='Finished'),
+            EventPattern('dbus-signal', interface=cs.CD_IFACE_OP_LIST,
+                signal='DispatchOperationFinished'),
+            )
+
+    assert cd_props.Get(cs.CD_IFACE_OP_LIST, 'DispatchOperations') == []
+
+    # Every dispatch has finished, including the lightweight ones
+    counts = object_stats(bus, account)
+    assert 'McdDispatchOperation' not in counts, counts
+
+if __name__ == '__main__':
+    exec_test(test, {}, preload_mc=False, use_fake_accounts_service=True,
+            pass_kwargs=True)
@@ -0,0 +1,129 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for a .client file that is installed while MC is
+running: the index of .client files is rescanned when the directory changes,
+so MC reads the new file instead of asking the client on D-Bus.
+"""
+
+import os
+import time
+
+import dbus
+
+from servicetest import EventPattern, sync_dbus
+from mctest import exec_test, SimulatedClient, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, expect_client_setup, MC
+import constants as cs
+
+text_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_TEXT,
+    }, signature='sv')
+
+KATE_CLIENT_FILE = """\
+[org.freedesktop.Telepathy.Client]
+Interfaces=org.freedesktop.Telepathy.Client.Handler
+
+[org.freedesktop.Telepathy.Client.Handler.HandlerChannelFilter 0]
+org.freedesktop.Telepathy.Channel.ChannelType s=org.freedesktop.Telepathy.Channel.Type.Text
+org.freedesktop.Telepathy.Channel.TargetHandleType u=1
+
+[org.freedesktop.Telepathy.Client.Handler]
+BypassApproval=true
+"""
+
+def test(q, bus, unused, **kwargs):
+    # The user's clients directory exists, but is empty, when MC starts,
+    # so MC indexes it and watches it for changes
+    clients_dir = os.path.join(os.environ['XDG_DATA_HOME'], 'telepathy',
+            'clients')
+    os.makedirs(clients_dir)
+
+    mc = MC(q, bus, wait_for_names=False)
+    mc.wait_for_names(
+        EventPattern('dbus-signal',
+            path=cs.TEST_DBUS_ACCOUNT_PLUGIN_PATH,
+            interface=cs.TEST_DBUS_ACCOUNT_PLUGIN_IFACE,
+            signal='Active'))
+
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    simulated_cm, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    # Empathy has no .client file, so looking for one makes sure that the
+    # index has been built before Kate's file appears
+    empathy = SimulatedClient(q, bus, 'Empathy',
+            observe=[], approve=[text_fixed_properties], handle=[])
+    expect_client_setup(q, [empathy])
+
+    # Kate's .client file is installed while MC is running
+    f = open(os.path.join(clients_dir, 'Kate.client'), 'w')
+    f.write(KATE_CLIENT_FILE)
+    f.close()
+
+    # give the file monitor a chance to tell MC about it
+    time.sleep(1)
+    sync_dbus(bus, q, mc)
+
+    # When Kate starts, MC learns that it is a Handler from the new
+    # .client file, and doesn't need to ask for its interfaces
+    forbidden = [
+        EventPattern('dbus-method-call', path=cs.tp_path_prefix +
+            '/Client/Kate', interface=cs.PROPERTIES_IFACE,
+            predicate=lambda e: e.args[0] == cs.CLIENT),
+        EventPattern('dbus-method-call', path=empathy.object_path,
+            interface=cs.APPROVER, method='AddDispatchOperation'),
+        ]
+    q.forbid_events(forbidden)
+
+    kate = SimulatedClient(q, bus, 'Kate',
+            handle=[text_fixed_properties], bypass_approval=True,
+            implement_get_interfaces=False)
+    q.expect('dbus-method-call', path=kate.object_path,
+            interface=cs.PROPERTIES_IFACE, method='GetAll',
+            args=[cs.HANDLER])
+
+    # An incoming channel goes straight to Kate, without being approved
+    channel_properties = dbus.Dictionary(text_fixed_properties,
+            signature='sv')
+    channel_properties[cs.CHANNEL + '.TargetID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.InitiatorID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.InitiatorHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.Requested'] = False
+    channel_properties[cs.CHANNEL + '.Interfaces'] = dbus.Array(signature='s')
+
+    chan = SimulatedChannel(conn, channel_properties)
+    chan.announce()
+
+    e = q.expect('dbus-method-call', path=kate.object_path,
+            interface=cs.HANDLER, method='HandleChannels', handled=False)
+    assert e.args[0] == account.object_path, e.args
+    assert e.args[1] == conn.object_path, e.args
+    assert [c[0] for c in e.args[2]] == [chan.object_path], e.args
+    q.dbus_return(e.message, signature='')
+
+    sync_dbus(bus, q, mc)
+    q.unforbid_events(forbidden)
+
+if __name__ == '__main__':
+    exec_test(test, {}, preload_mc=False, use_fake_accounts_service=True,
+            pass_kwargs=True)
@@ -36,6 +36,18 @@ import constants as cs
 # Rejected by the plugin
 DELAYED_CTYPE = 'com.example.QuestionableChannel'
 
+def plugin_call_stats(bus, plugin, vfunc):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+
+    for row in stats.GetPluginCallStats():
+        if row[0] == plugin and row[1] == vfunc:
+            calls, total_usec, max_usec, in_progress = row[2:]
+            assert max_usec <= total_usec, row
+            return (calls, in_progress)
+
+    return None
+
 def test(q, bus, mc):
     policy_bus_name_ref = dbus.service.BusName('com.example.Policy', bus)
 
@@ -168,5 +180,49 @@ def test(q, bus, mc):
                     path=conn.object_path, args=[request], handled=False)
             q.dbus_raise(cm_request_call.message, cs.INVALID_ARGUMENT, 'No')
 
+    # If the request is cancelled while the policy is thinking about it,
+    # MC stops waiting for the policy, which can be as slow as it likes
+    request = dbus.Dictionary({
+            cs.CHANNEL + '.ChannelType': DELAYED_CTYPE,
+            cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+            cs.CHANNEL + '.TargetID': 'romeo',
+            }, signature='sv')
+    call_async(q, cd, 'CreateChannel',
+            account.object_path, request, user_action_time, client.bus_name,
+            dbus_interface=cs.CD)
+    ret = q.expect('dbus-return', method='CreateChannel')
+
+    cr = bus.get_object(cs.AM, ret.value[0])
+    call_async(q, cr, 'Proceed', dbus_interface=cs.CR)
+    q.expect('dbus-return', method='Proceed')
+
+    permission = q.expect('dbus-method-call', path='/com/example/Policy',
+            interface='com.example.Policy', method='RequestRequest')
+
+    forbidden = [EventPattern('dbus-method-call', method='CreateChannel')]
+    q.forbid_events(forbidden)
+
+    call_async(q, cr, 'Cancel', dbus_interface=cs.CR)
+    q.expect_many(
+            EventPattern('dbus-return', method='Cancel'),
+            EventPattern('dbus-signal', path=ret.value[0],
+                interface=cs.CR, signal='Failed',
+                predicate=lambda e: e.args[0] == cs.CANCELLED),
+            )
+
+    # The plugin's delay is still charged to it: Juliet's request was
+    # delayed once, and Romeo's still is
+    assert plugin_call_stats(bus, 'TestPermissionPlugin',
+            'request-delay') == (1, 1)
+    assert plugin_call_stats(bus, 'TestPermissionPlugin', 'check')[0] >= 2
+
+    # A late answer from the policy doesn't bring the request back
+    q.dbus_return(permission.message, signature='')
+    sync_dbus(bus, q, account)
+    q.unforbid_events(forbidden)
+
+    assert plugin_call_stats(bus, 'TestPermissionPlugin',
+            'request-delay') == (2, 0)
+
 if __name__ == '__main__':
     exec_test(test, {})
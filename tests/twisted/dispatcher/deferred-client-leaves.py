@@ -0,0 +1,112 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for MC_LAZY_INTROSPECTION: if a client whose
+introspection was deferred leaves while MC is introspecting it, the channel
+that was waiting for it is dispatched anyway, and MC survives.
+"""
+
+import shutil
+import tempfile
+
+import dbus
+import dbus.service
+
+from servicetest import EventPattern
+from mctest import exec_test, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, MC
+import constants as cs
+
+abiword_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL_TYPE_STREAM_TUBE + '.Service': 'x-abiword',
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_STREAM_TUBE,
+    }, signature='sv')
+
+def test(q, bus, unused, **kwargs):
+    # With no .client files, the activatable AbiWord and Logger clients
+    # can only be introspected by activating them
+    clients_dir = tempfile.mkdtemp(prefix='mc-test-clients.')
+
+    # MC is service-activated, so it gets its environment from the bus
+    bus_daemon = bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+    bus_daemon.UpdateActivationEnvironment(
+            {'MC_LAZY_INTROSPECTION': '1', 'MC_CLIENTS_DIR': clients_dir},
+            dbus_interface=dbus.BUS_DAEMON_IFACE)
+
+    mc = MC(q, bus, wait_for_names=False)
+    mc.wait_for_names(
+        EventPattern('dbus-signal',
+            path=cs.TEST_DBUS_ACCOUNT_PLUGIN_PATH,
+            interface=cs.TEST_DBUS_ACCOUNT_PLUGIN_IFACE,
+            signal='Active'))
+
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    cm_name_ref, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    cd = bus.get_object(cs.CD, cs.CD_PATH)
+    cd_props = dbus.Interface(cd, cs.PROPERTIES_IFACE)
+    assert cd_props.Get(cs.CD_IFACE_OP_LIST, 'DispatchOperations') == []
+
+    channel_properties = dbus.Dictionary(abiword_fixed_properties,
+            signature='sv')
+    channel_properties[cs.CHANNEL + '.TargetHandleType'] = cs.HT_CONTACT
+    channel_properties[cs.CHANNEL + '.TargetID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.InitiatorID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.InitiatorHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.Requested'] = False
+    channel_properties[cs.CHANNEL + '.Interfaces'] = dbus.Array(signature='s')
+
+    chan = SimulatedChannel(conn, channel_properties)
+    chan.announce()
+
+    # MC activates AbiWord to find out whether it can handle the tube
+    q.expect('dbus-signal',
+            path=cs.tp_path_prefix + '/RegressionTests',
+            interface=cs.tp_name_prefix + '.RegressionTests',
+            signal='FakeStartup',
+            args=[cs.tp_name_prefix + '.Client.AbiWord'])
+
+    abiword_name_ref = dbus.service.BusName(
+            cs.tp_name_prefix + '.Client.AbiWord', bus)
+    e = q.expect('dbus-method-call',
+            path=cs.tp_path_prefix + '/Client/AbiWord',
+            interface=cs.PROPERTIES_IFACE, method='Get',
+            args=[cs.CLIENT, 'Interfaces'], handled=False)
+
+    # AbiWord exits before answering
+    del abiword_name_ref
+    q.dbus_raise(e.message, 'org.freedesktop.DBus.Error.ServiceUnknown',
+            'AbiWord has gone away')
+
+    # MC stops waiting for it: nobody can handle the channel, so it is
+    # closed
+    q.expect('dbus-method-call', path=chan.object_path,
+            interface=cs.CHANNEL, method='Close')
+
+    # MC is still alive
+    assert cd_props.Get(cs.CD_IFACE_OP_LIST, 'DispatchOperations') == []
+
+    shutil.rmtree(clients_dir)
+
+if __name__ == '__main__':
+    exec_test(test, {}, preload_mc=False, use_fake_accounts_service=True,
+        pass_kwargs=True)
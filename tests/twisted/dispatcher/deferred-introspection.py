@@ -0,0 +1,139 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Feature test for MC_LAZY_INTROSPECTION: activatable clients with no
+.client file are only introspected when the first channel arrives. A channel
+that no known client can handle waits for them; a channel that a running
+client can handle does not.
+"""
+
+import shutil
+import tempfile
+
+import dbus
+import dbus.service
+
+from servicetest import EventPattern
+from mctest import exec_test, SimulatedClient, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, expect_client_setup, MC
+import constants as cs
+
+text_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_TEXT,
+    }, signature='sv')
+
+abiword_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL_TYPE_STREAM_TUBE + '.Service': 'x-abiword',
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_STREAM_TUBE,
+    }, signature='sv')
+
+def make_channel(conn, fixed_properties, target_id):
+    props = dbus.Dictionary(fixed_properties, signature='sv')
+    props[cs.CHANNEL + '.TargetHandleType'] = cs.HT_CONTACT
+    props[cs.CHANNEL + '.TargetID'] = target_id
+    props[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, target_id)
+    props[cs.CHANNEL + '.InitiatorID'] = target_id
+    props[cs.CHANNEL + '.InitiatorHandle'] = props[cs.CHANNEL +
+            '.TargetHandle']
+    props[cs.CHANNEL + '.Requested'] = False
+    props[cs.CHANNEL + '.Interfaces'] = dbus.Array(signature='s')
+    return SimulatedChannel(conn, props)
+
+def test(q, bus, unused, **kwargs):
+    # With no .client files, the activatable AbiWord and Logger clients
+    # can only be introspected by activating them
+    clients_dir = tempfile.mkdtemp(prefix='mc-test-clients.')
+
+    # MC is service-activated, so it gets its environment from the bus
+    bus_daemon = bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+    bus_daemon.UpdateActivationEnvironment(
+            {'MC_LAZY_INTROSPECTION': '1', 'MC_CLIENTS_DIR': clients_dir},
+            dbus_interface=dbus.BUS_DAEMON_IFACE)
+
+    # nothing is activated until a channel needs dispatching
+    no_startup = [EventPattern('dbus-signal',
+        path=cs.tp_path_prefix + '/RegressionTests',
+        interface=cs.tp_name_prefix + '.RegressionTests',
+        signal='FakeStartup')]
+    q.forbid_events(no_startup)
+
+    mc = MC(q, bus, wait_for_names=False)
+    mc.wait_for_names(
+        EventPattern('dbus-signal',
+            path=cs.TEST_DBUS_ACCOUNT_PLUGIN_PATH,
+            interface=cs.TEST_DBUS_ACCOUNT_PLUGIN_IFACE,
+            signal='Active'))
+
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    cm_name_ref, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    empathy = SimulatedClient(q, bus, 'Empathy',
+            observe=[], approve=[], handle=[text_fixed_properties],
+            bypass_approval=True)
+    expect_client_setup(q, [empathy])
+
+    q.unforbid_events(no_startup)
+
+    # Nobody we know about can handle a tube, so MC activates AbiWord to
+    # find out whether it can
+    tube = make_channel(conn, abiword_fixed_properties, 'juliet')
+    tube.announce()
+
+    q.expect('dbus-signal',
+            path=cs.tp_path_prefix + '/RegressionTests',
+            interface=cs.tp_name_prefix + '.RegressionTests',
+            signal='FakeStartup',
+            args=[cs.tp_name_prefix + '.Client.AbiWord'])
+
+    # We take on its identity, but don't answer yet
+    abiword_name_ref = dbus.service.BusName(
+            cs.tp_name_prefix + '.Client.AbiWord', bus)
+    get_interfaces = q.expect('dbus-method-call',
+            path=cs.tp_path_prefix + '/Client/AbiWord',
+            interface=cs.PROPERTIES_IFACE, method='Get',
+            args=[cs.CLIENT, 'Interfaces'], handled=False)
+
+    # While AbiWord is being introspected, a channel that Empathy can handle
+    # is not held back
+    text = make_channel(conn, text_fixed_properties, 'romeo')
+    text.announce()
+
+    e = q.expect('dbus-method-call', path=empathy.object_path,
+            interface=cs.HANDLER, method='HandleChannels', handled=False)
+    assert e.args[2][0][0] == text.object_path, e.args
+    q.dbus_return(e.message, signature='')
+
+    # Now AbiWord answers, and the tube is dispatched to it
+    abiword = SimulatedClient(q, bus, 'AbiWord',
+            handle=[abiword_fixed_properties], bypass_approval=True)
+    abiword.Get_Interfaces(get_interfaces)
+
+    e = q.expect('dbus-method-call', path=abiword.object_path,
+            interface=cs.HANDLER, method='HandleChannels', handled=False)
+    assert e.args[2][0][0] == tube.object_path, e.args
+    q.dbus_return(e.message, signature='')
+
+    del abiword_name_ref
+    shutil.rmtree(clients_dir)
+
+if __name__ == '__main__':
+    exec_test(test, {}, preload_mc=False, use_fake_accounts_service=True,
+        pass_kwargs=True)
@@ -0,0 +1,92 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for plugins with a manifest: mcp-lazy-plugin only
+implements McpDispatchOperationPolicy, so it is not loaded until a channel
+is dispatched.
+"""
+
+import dbus
+
+from servicetest import EventPattern, sync_dbus
+from mctest import exec_test, SimulatedClient, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, expect_client_setup
+import constants as cs
+
+text_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_TEXT,
+    }, signature='sv')
+
+def test(q, bus, mc):
+    loaded = [EventPattern('dbus-signal', path='/com/example/LazyPlugin',
+        interface='com.example.LazyPlugin', signal='Loaded')]
+    q.forbid_events(loaded)
+
+    # Loading accounts and connecting them only needs McpAccountStorage...
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    simulated_cm, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    client = SimulatedClient(q, bus, 'Empathy',
+            observe=[], approve=[], handle=[text_fixed_properties],
+            bypass_approval=True)
+    expect_client_setup(q, [client])
+    sync_dbus(bus, q, mc)
+    q.unforbid_events(loaded)
+
+    # ... but dispatching a channel needs the dispatch operation policies
+    channel_properties = dbus.Dictionary(text_fixed_properties,
+            signature='sv')
+    channel_properties[cs.CHANNEL + '.TargetID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.InitiatorID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.InitiatorHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.Requested'] = False
+    channel_properties[cs.CHANNEL + '.Interfaces'] = dbus.Array(signature='s')
+
+    chan = SimulatedChannel(conn, channel_properties)
+    chan.announce()
+
+    _, e = q.expect_many(
+            loaded[0],
+            EventPattern('dbus-method-call',
+                path=client.object_path,
+                interface=cs.HANDLER, method='HandleChannels',
+                handled=False),
+            )
+    q.dbus_return(e.message, signature='')
+
+    # It is only loaded once
+    q.forbid_events(loaded)
+
+    chan.close()
+    chan = SimulatedChannel(conn, channel_properties)
+    chan.announce()
+
+    e = q.expect('dbus-method-call',
+            path=client.object_path,
+            interface=cs.HANDLER, method='HandleChannels',
+            handled=False)
+    q.dbus_return(e.message, signature='')
+    sync_dbus(bus, q, mc)
+
+if __name__ == '__main__':
+    exec_test(test, {})
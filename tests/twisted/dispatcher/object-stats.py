@@ -0,0 +1,198 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for counting MC's objects per account at runtime.
+"""
+
+import dbus
+
+from servicetest import EventPattern, call_async, sync_dbus
+from mctest import exec_test, SimulatedClient, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, expect_client_setup
+import constants as cs
+
+text_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_TEXT,
+    }, signature='sv')
+
+def object_stats(bus, account):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+    counts = {}
+
+    for path, type_name, count, size in stats.GetObjectStats():
+        assert count > 0, (path, type_name, count)
+        assert size > 0, (path, type_name, size)
+
+        if path == account.object_path:
+            counts[type_name] = count
+
+    return counts
+
+def request_stats(bus, account):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+
+    for row in stats.GetRequestStats():
+        if row[0] == account.object_path:
+            return row
+
+    return None
+
+def test(q, bus, mc):
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    cm_name_ref, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    counts = object_stats(bus, account)
+    assert counts.get('McdConnection') == 1, counts
+    assert 'McdDispatchOperation' not in counts, counts
+
+    # nothing has been requested on the connection yet
+    row = request_stats(bus, account)
+    assert row is not None
+    queued, in_flight, max_queued, sent = row[1:5]
+    assert (queued, in_flight, max_queued, sent) == (0, 0, 0, 0), row
+
+    empathy = SimulatedClient(q, bus, 'Empathy',
+            observe=[text_fixed_properties], approve=[text_fixed_properties],
+            handle=[text_fixed_properties], bypass_approval=False)
+    expect_client_setup(q, [empathy])
+
+    cd = bus.get_object(cs.CD, cs.CD_PATH)
+    cd_props = dbus.Interface(cd, cs.PROPERTIES_IFACE)
+    assert cd_props.Get(cs.CD_IFACE_OP_LIST, 'DispatchOperations') == []
+
+    channel_properties = dbus.Dictionary(text_fixed_properties,
+            signature='sv')
+    channel_properties[cs.CHANNEL + '.TargetID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.InitiatorID'] = 'juliet'
+    channel_properties[cs.CHANNEL + '.InitiatorHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, 'juliet')
+    channel_properties[cs.CHANNEL + '.Requested'] = False
+    channel_properties[cs.CHANNEL + '.Interfaces'] = dbus.Array(signature='s')
+
+    chan = SimulatedChannel(conn, channel_properties)
+    chan.announce()
+
+    e, o = q.expect_many(
+            EventPattern('dbus-signal',
+                path=cs.CD_PATH,
+                interface=cs.CD_IFACE_OP_LIST,
+                signal='NewDispatchOperation'),
+            EventPattern('dbus-method-call',
+                path=empathy.object_path,
+                interface=cs.OBSERVER, method='ObserveChannels',
+                handled=False),
+            )
+    cdo_path = e.args[0]
+    q.dbus_return(o.message, signature='')
+
+    e = q.expect('dbus-method-call',
+            path=empathy.object_path,
+            interface=cs.APPROVER, method='AddDispatchOperation',
+            handled=False)
+    q.dbus_return(e.message, signature='')
+
+    # While the channel is being dispatched, there is a dispatch operation
+    # for it, as well as the channel itself
+    counts = object_stats(bus, account)
+    assert counts.get('McdConnection') == 1, counts
+    assert counts.get('McdChannel') >= 1, counts
+    assert counts.get('McdDispatchOperation') == 1, counts
+
+    cdo_iface = dbus.Interface(bus.get_object(cs.CD, cdo_path), cs.CDO)
+    call_async(q, cdo_iface, 'HandleWith',
+            cs.tp_name_prefix + '.Client.Empathy')
+
+    e = q.expect('dbus-method-call',
+            path=empathy.object_path,
+            interface=cs.HANDLER, method='HandleChannels',
+            handled=False)
+    q.dbus_return(e.message, signature='')
+
+    q.expect_many(
+            EventPattern('dbus-return', method='HandleWith'),
+            EventPattern('dbus-signal', interface=cs.CD_IFACE_OP_LIST,
+                signal='DispatchOperationFinished'),
+            )
+
+    # Once it has been handled, the dispatch operation is gone
+    counts = object_stats(bus, account)
+    assert counts.get('McdConnection') == 1, counts
+    assert 'McdDispatchOperation' not in counts, counts
+
+    # While MC is sending a message, it makes an internal request...
+    call_async(q, cd, 'SendMessage', account.object_path, 'romeo',
+            dbus.Array([
+                dbus.Dictionary({'message-type': dbus.UInt32(0)},
+                    signature='sv'),
+                dbus.Dictionary({'content-type': 'text/plain',
+                    'content': 'hello'}, signature='sv'),
+                ], signature='a{sv}'),
+            0, dbus_interface=cs.CD + '.Interface.Messages1')
+    ensure = q.expect('dbus-method-call', path=conn.object_path,
+            interface=cs.CONN_IFACE_REQUESTS, method='EnsureChannel',
+            handled=False)
+
+    # ... which other requests on the account have to wait for
+    request = dbus.Dictionary(text_fixed_properties, signature='sv')
+    request[cs.CHANNEL + '.TargetID'] = 'mercutio'
+    call_async(q, cd, 'CreateChannel', account.object_path, request,
+            dbus.Int64(0), empathy.bus_name, dbus_interface=cs.CD)
+    ret = q.expect('dbus-return', method='CreateChannel')
+    cr_path = ret.value[0]
+    cr = bus.get_object(cs.AM, cr_path)
+    call_async(q, cr, 'Proceed', dbus_interface=cs.CR)
+    q.expect('dbus-return', method='Proceed')
+
+    # The waiting request isn't in the tree of missions yet, but it is
+    # counted, as is the internal request
+    counts = object_stats(bus, account)
+    assert counts.get('McdRequest') == 2, counts
+
+    # When the internal request fails (after MC has tried again), the other
+    # request carries on
+    q.dbus_raise(ensure.message, cs.NOT_AVAILABLE, 'No')
+    ensure = q.expect('dbus-method-call', path=conn.object_path,
+            interface=cs.CONN_IFACE_REQUESTS, method='EnsureChannel',
+            handled=False)
+    q.dbus_raise(ensure.message, cs.NOT_AVAILABLE, 'Still no')
+    e = q.expect('dbus-method-call', path=conn.object_path,
+            interface=cs.CONN_IFACE_REQUESTS, method='CreateChannel',
+            handled=False)
+    assert e.args[0][cs.CHANNEL + '.TargetID'] == 'mercutio', e.args
+    q.dbus_raise(e.message, cs.NOT_AVAILABLE, 'No')
+    q.expect('dbus-signal', path=cr_path, interface=cs.CR, signal='Failed')
+
+    # and then neither request exists
+    for i in range(10):
+        counts = object_stats(bus, account)
+
+        if 'McdRequest' not in counts:
+            break
+
+        sync_dbus(bus, q, account)
+
+    assert 'McdRequest' not in counts, counts
+
+if __name__ == '__main__':
+    exec_test(test, {})
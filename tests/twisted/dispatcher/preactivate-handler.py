@@ -0,0 +1,155 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for MC_PREACTIVATE_HANDLERS: AbiWord, which is
+activatable and has X-MissionControl-Preactivate=true in its .client file,
+is started as soon as a channel it could handle arrives, while the
+approver is still deciding. Whether it then handles the channel or not is
+counted.
+"""
+
+import dbus
+
+from servicetest import EventPattern, call_async, sync_dbus
+from mctest import exec_test, SimulatedClient, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, expect_client_setup, \
+        MC
+import constants as cs
+
+ABIWORD = cs.tp_name_prefix + '.Client.AbiWord'
+EMPATHY = cs.tp_name_prefix + '.Client.Empathy'
+
+# this must match the .client file
+abiword_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_STREAM_TUBE,
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL_TYPE_STREAM_TUBE + '.Service': 'x-abiword',
+    }, signature='sv')
+tube_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_STREAM_TUBE,
+    }, signature='sv')
+
+def announce(conn, jid):
+    channel_properties = dbus.Dictionary(abiword_fixed_properties,
+            signature='sv')
+    channel_properties[cs.CHANNEL + '.TargetID'] = jid
+    channel_properties[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, jid)
+    channel_properties[cs.CHANNEL + '.InitiatorID'] = jid
+    channel_properties[cs.CHANNEL + '.InitiatorHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, jid)
+    channel_properties[cs.CHANNEL + '.Requested'] = False
+    channel_properties[cs.CHANNEL + '.Interfaces'] = dbus.Array(signature='s')
+
+    chan = SimulatedChannel(conn, channel_properties)
+    chan.announce()
+    return chan
+
+def expect_preactivation(q, empathy):
+    # AbiWord is started before the approver has replied
+    startup, add = q.expect_many(
+            EventPattern('dbus-signal',
+                path=cs.tp_path_prefix + '/RegressionTests',
+                interface=cs.tp_name_prefix + '.RegressionTests',
+                signal='FakeStartup', args=[ABIWORD]),
+            EventPattern('dbus-method-call',
+                path=empathy.object_path,
+                interface=cs.APPROVER, method='AddDispatchOperation',
+                handled=False),
+            )
+    return add
+
+def handle_with(q, bus, add, handler_name, handler):
+    cdo_path = add.args[1]
+    q.dbus_return(add.message, signature='')
+
+    cdo_iface = dbus.Interface(bus.get_object(cs.CD, cdo_path), cs.CDO)
+    call_async(q, cdo_iface, 'HandleWith', handler_name)
+
+    e = q.expect('dbus-method-call',
+            path=handler.object_path,
+            interface=cs.HANDLER, method='HandleChannels',
+            handled=False)
+    q.dbus_return(e.message, signature='')
+
+    q.expect_many(
+            EventPattern('dbus-return', method='HandleWith'),
+            EventPattern('dbus-signal', path=cdo_path, interface=cs.CDO,
+                signal='Finished'),
+            )
+
+def preactivation_stats(bus):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+    return [tuple(row) for row in stats.GetPreactivationStats()]
+
+def test(q, bus, unused, **kwargs):
+    # MC is service-activated, so it gets its environment from the bus
+    bus_daemon = bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+    bus_daemon.UpdateActivationEnvironment({'MC_PREACTIVATE_HANDLERS': '1'},
+            dbus_interface=dbus.BUS_DAEMON_IFACE)
+
+    mc = MC(q, bus, wait_for_names=False)
+    mc.wait_for_names(
+        EventPattern('dbus-signal',
+            path=cs.TEST_DBUS_ACCOUNT_PLUGIN_PATH,
+            interface=cs.TEST_DBUS_ACCOUNT_PLUGIN_IFACE,
+            signal='Active'))
+
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    simulated_cm, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    # Empathy approves and can handle any stream tube, but AbiWord's filter
+    # is a better match for AbiWord tubes
+    empathy = SimulatedClient(q, bus, 'Empathy',
+            observe=[], approve=[tube_fixed_properties],
+            handle=[tube_fixed_properties], bypass_approval=False)
+    expect_client_setup(q, [empathy])
+
+    assert preactivation_stats(bus) == []
+
+    # A channel for AbiWord arrives: AbiWord is started straight away
+    announce(conn, 'juliet')
+    add = expect_preactivation(q, empathy)
+
+    # We take on its identity to be able to continue with the test
+    abiword = SimulatedClient(q, bus, 'AbiWord',
+            handle=[abiword_fixed_properties])
+
+    # AbiWord handles the channel, so the pre-activation was worth it
+    handle_with(q, bus, add, ABIWORD, abiword)
+    assert preactivation_stats(bus) == [(ABIWORD, 1, 0)]
+
+    # AbiWord exits
+    abiword.release_name()
+    del abiword
+    sync_dbus(bus, q, mc)
+
+    # Another channel for AbiWord arrives, and AbiWord is started again;
+    # this time it doesn't get as far as taking its name
+    announce(conn, 'romeo')
+    add = expect_preactivation(q, empathy)
+
+    # The user would rather use Empathy, so the pre-activation was wasted
+    handle_with(q, bus, add, EMPATHY, empathy)
+    assert preactivation_stats(bus) == [(ABIWORD, 1, 1)]
+
+if __name__ == '__main__':
+    exec_test(test, {}, preload_mc=False, use_fake_accounts_service=True,
+            pass_kwargs=True)
@@ -0,0 +1,127 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for a request policy plugin that never makes up its
+mind, with MC_REQUEST_POLICY_TIMEOUT set.
+"""
+
+import dbus
+import dbus.service
+
+from servicetest import EventPattern, call_async, sync_dbus
+from mctest import exec_test, SimulatedClient, create_fakecm_account, \
+        enable_fakecm_account, expect_client_setup, MC
+import constants as cs
+
+# Delayed by the plugin until com.example.Policy replies
+DELAYED_CTYPE = 'com.example.QuestionableChannel'
+
+def assert_no_requests(q, bus, account):
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+
+    for i in range(10):
+        requests = [s for s in stats.GetObjectStats()
+                if s[0] == account.object_path and s[1] == 'McdRequest']
+
+        if not requests:
+            return
+
+        sync_dbus(bus, q, account)
+
+    assert not requests, requests
+
+def test(q, bus, unused, **kwargs):
+    # MC is service-activated, so it gets its environment from the bus
+    bus_daemon = bus.get_object(dbus.BUS_DAEMON_NAME, dbus.BUS_DAEMON_PATH)
+    bus_daemon.UpdateActivationEnvironment({'MC_REQUEST_POLICY_TIMEOUT': '1'},
+            dbus_interface=dbus.BUS_DAEMON_IFACE)
+
+    mc = MC(q, bus, wait_for_names=False)
+    mc.wait_for_names(
+        EventPattern('dbus-signal',
+            path=cs.TEST_DBUS_ACCOUNT_PLUGIN_PATH,
+            interface=cs.TEST_DBUS_ACCOUNT_PLUGIN_IFACE,
+            signal='Active'))
+
+    policy_bus_name_ref = dbus.service.BusName('com.example.Policy', bus)
+
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    simulated_cm, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    fixed_properties = dbus.Dictionary({
+        cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+        cs.CHANNEL + '.ChannelType': DELAYED_CTYPE,
+        }, signature='sv')
+
+    client = SimulatedClient(q, bus, 'Empathy',
+            observe=[fixed_properties], approve=[fixed_properties],
+            handle=[fixed_properties], bypass_approval=False)
+    expect_client_setup(q, [client])
+
+    cd = bus.get_object(cs.CD, cs.CD_PATH)
+    request = dbus.Dictionary({
+            cs.CHANNEL + '.ChannelType': DELAYED_CTYPE,
+            cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+            cs.CHANNEL + '.TargetID': 'juliet',
+            }, signature='sv')
+    call_async(q, cd, 'CreateChannel',
+            account.object_path, request, dbus.Int64(1238582606),
+            client.bus_name, dbus_interface=cs.CD)
+    ret = q.expect('dbus-return', method='CreateChannel')
+
+    cr = bus.get_object(cs.AM, ret.value[0])
+    call_async(q, cr, 'Proceed', dbus_interface=cs.CR)
+    q.expect('dbus-return', method='Proceed')
+
+    # The policy service is asked, but never replies...
+    permission = q.expect('dbus-method-call', path='/com/example/Policy',
+            interface='com.example.Policy', method='RequestRequest')
+
+    # ... so after a second, MC gives up on it and carries on
+    cm_request_call = q.expect('dbus-method-call',
+            interface=cs.CONN_IFACE_REQUESTS,
+            method='CreateChannel',
+            path=conn.object_path, args=[request], handled=False)
+    q.dbus_raise(cm_request_call.message, cs.INVALID_ARGUMENT, 'No')
+
+    q.expect('dbus-signal', path=ret.value[0], interface=cs.CR,
+            signal='Failed', args=[cs.INVALID_ARGUMENT, 'No'])
+
+    # Although the policy still hasn't finished with it, MC is no longer
+    # keeping the request alive
+    assert_no_requests(q, bus, account)
+
+    # A late denial from the policy makes no difference
+    q.dbus_raise(permission.message, cs.PERMISSION_DENIED, 'Too late')
+
+    # The timeout is counted against the policy plugin
+    stats = dbus.Interface(bus.get_object(cs.MC, cs.MC_PATH),
+            'org.freedesktop.Telepathy.MissionControl5.Stats')
+    policies = [s for s in stats.GetRequestDelayStats()
+            if s[1] == 'RequestPolicy']
+    assert [s for s in policies if s[3] == 1], policies
+
+    # and not as a client call
+    assert not [s for s in stats.GetClientStats()
+            if s[1] == 'RequestPolicy'], stats.GetClientStats()
+
+if __name__ == '__main__':
+    exec_test(test, {}, preload_mc=False, use_fake_accounts_service=True,
+            pass_kwargs=True)
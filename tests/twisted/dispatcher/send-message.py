@@ -0,0 +1,250 @@
+# Copyright (C) 2014 Collabora Ltd.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+# 02110-1301 USA
+
+"""Regression test for ChannelDispatcher.Interface.Messages1.SendMessage:
+channels that MC handles itself are closed after each message, channels
+that a Handler already has are reused for the next message until they have
+been idle for a while, messages wait (up to a limit) while a channel is
+being ensured, and a failed send is retried once with a new request.
+"""
+
+import time
+
+import dbus
+
+from servicetest import EventPattern, call_async
+from mctest import exec_test, SimulatedClient, SimulatedChannel, \
+        create_fakecm_account, enable_fakecm_account, expect_client_setup
+import constants as cs
+
+MESSAGES = cs.CD + '.Interface.Messages1'
+
+# Keep in sync with mcd-dispatcher.c
+MESSAGE_CHANNEL_IDLE_SECONDS = 5
+MAX_QUEUED_MESSAGES = 64
+
+text_fixed_properties = dbus.Dictionary({
+    cs.CHANNEL + '.TargetHandleType': cs.HT_CONTACT,
+    cs.CHANNEL + '.ChannelType': cs.CHANNEL_TYPE_TEXT,
+    }, signature='sv')
+
+def make_channel(conn, target_id, requested):
+    props = dbus.Dictionary(text_fixed_properties, signature='sv')
+    props[cs.CHANNEL + '.TargetID'] = target_id
+    props[cs.CHANNEL + '.TargetHandle'] = \
+            conn.ensure_handle(cs.HT_CONTACT, target_id)
+    props[cs.CHANNEL + '.Requested'] = requested
+
+    if requested:
+        props[cs.CHANNEL + '.InitiatorID'] = conn.self_ident
+        props[cs.CHANNEL + '.InitiatorHandle'] = conn.self_handle
+    else:
+        props[cs.CHANNEL + '.InitiatorID'] = target_id
+        props[cs.CHANNEL + '.InitiatorHandle'] = props[cs.CHANNEL +
+                '.TargetHandle']
+
+    props[cs.CHANNEL + '.Interfaces'] = dbus.Array(
+            [cs.CHANNEL_IFACE_MESSAGES], signature='s')
+    return SimulatedChannel(conn, props)
+
+def message(text):
+    return dbus.Array([
+        dbus.Dictionary({'message-type': dbus.UInt32(0)}, signature='sv'),
+        dbus.Dictionary({'content-type': 'text/plain', 'content': text},
+            signature='sv'),
+        ], signature='a{sv}')
+
+def send_message(q, cd, account, target_id, text):
+    call_async(q, cd, 'SendMessage', account.object_path, target_id,
+            message(text), 0, dbus_interface=MESSAGES)
+
+def expect_ensure(q, conn, target_id):
+    e = q.expect('dbus-method-call', path=conn.object_path,
+            interface=cs.CONN_IFACE_REQUESTS, method='EnsureChannel',
+            handled=False)
+    assert e.args[0][cs.CHANNEL + '.TargetID'] == target_id, e.args
+    return e
+
+def expect_send(q, chan, text):
+    e = q.expect('dbus-method-call', path=chan.object_path,
+            interface=cs.CHANNEL_IFACE_MESSAGES, method='SendMessage',
+            handled=False)
+    assert e.args[0][1]['content'] == text, e.args
+    return e
+
+def test(q, bus, mc):
+    params = dbus.Dictionary({"account": "someguy@example.com",
+        "password": "secrecy"}, signature='sv')
+    cm_name_ref, account = create_fakecm_account(q, bus, mc, params)
+    conn = enable_fakecm_account(q, bus, mc, account, params)
+
+    empathy = SimulatedClient(q, bus, 'Empathy',
+            observe=[], approve=[], handle=[text_fixed_properties],
+            bypass_approval=True)
+    expect_client_setup(q, [empathy])
+
+    cd = bus.get_object(cs.CD, cs.CD_PATH)
+
+    # Nobody is handling a channel to Juliet, so MC ensures one, handles
+    # it itself, sends the message and closes it again
+    send_message(q, cd, account, 'juliet', 'hello')
+    e = expect_ensure(q, conn, 'juliet')
+    juliet = make_channel(conn, 'juliet', True)
+    q.dbus_return(e.message, True, juliet.object_path, juliet.immutable,
+            signature='boa{sv}')
+    juliet.announce()
+
+    e = expect_send(q, juliet, 'hello')
+    q.dbus_return(e.message, 'token-1', signature='s')
+    q.expect_many(
+            EventPattern('dbus-return', method='SendMessage',
+                value=('token-1',)),
+            EventPattern('dbus-method-call', path=juliet.object_path,
+                interface=cs.CHANNEL, method='Close'),
+            )
+
+    # The next message to Juliet needs a new channel
+    send_message(q, cd, account, 'juliet', 'again')
+    e = expect_ensure(q, conn, 'juliet')
+    juliet = make_channel(conn, 'juliet', True)
+    q.dbus_return(e.message, True, juliet.object_path, juliet.immutable,
+            signature='boa{sv}')
+    juliet.announce()
+
+    e = expect_send(q, juliet, 'again')
+    q.dbus_return(e.message, 'token-2', signature='s')
+    q.expect_many(
+            EventPattern('dbus-return', method='SendMessage',
+                value=('token-2',)),
+            EventPattern('dbus-method-call', path=juliet.object_path,
+                interface=cs.CHANNEL, method='Close'),
+            )
+
+    # Romeo opens a channel to us, which Empathy handles
+    romeo = make_channel(conn, 'romeo', False)
+    romeo.announce()
+    e = q.expect('dbus-method-call', path=empathy.object_path,
+            interface=cs.HANDLER, method='HandleChannels', handled=False)
+    assert e.args[2][0][0] == romeo.object_path, e.args
+    q.dbus_return(e.message, signature='')
+
+    # MC must not close a channel that Empathy is handling
+    forbidden = [EventPattern('dbus-method-call', path=romeo.object_path,
+        interface=cs.CHANNEL, method='Close')]
+    q.forbid_events(forbidden)
+
+    # The first message to Romeo finds Empathy's channel
+    send_message(q, cd, account, 'romeo', 'one')
+    e = expect_ensure(q, conn, 'romeo')
+    q.dbus_return(e.message, False, romeo.object_path, romeo.immutable,
+            signature='boa{sv}')
+    e = expect_send(q, romeo, 'one')
+    q.dbus_return(e.message, 'token-3', signature='s')
+    q.expect('dbus-return', method='SendMessage', value=('token-3',))
+
+    # The second is sent straight to the same channel
+    no_ensure = [EventPattern('dbus-method-call',
+        interface=cs.CONN_IFACE_REQUESTS, method='EnsureChannel')]
+    q.forbid_events(no_ensure)
+
+    send_message(q, cd, account, 'romeo', 'two')
+    e = expect_send(q, romeo, 'two')
+    q.dbus_return(e.message, 'token-4', signature='s')
+    q.expect('dbus-return', method='SendMessage', value=('token-4',))
+
+    q.unforbid_events(no_ensure)
+
+    # If sending on the cached channel fails, MC forgets it and tries
+    # once more with a new request
+    send_message(q, cd, account, 'romeo', 'three')
+    e = expect_send(q, romeo, 'three')
+    q.dbus_raise(e.message, cs.NOT_AVAILABLE, 'try again')
+
+    e = expect_ensure(q, conn, 'romeo')
+    q.dbus_return(e.message, False, romeo.object_path, romeo.immutable,
+            signature='boa{sv}')
+    e = expect_send(q, romeo, 'three')
+    q.dbus_return(e.message, 'token-5', signature='s')
+    q.expect('dbus-return', method='SendMessage', value=('token-5',))
+
+    # The retry's channel was not cached, so the next message makes a new
+    # request again; its channel is cached, but failing to send on it is
+    # not retried, as before
+    send_message(q, cd, account, 'romeo', 'four')
+    e = expect_ensure(q, conn, 'romeo')
+    q.dbus_return(e.message, False, romeo.object_path, romeo.immutable,
+            signature='boa{sv}')
+    e = expect_send(q, romeo, 'four')
+    q.dbus_raise(e.message, cs.NOT_AVAILABLE, 'no')
+    q.expect('dbus-error', method='SendMessage', name=cs.NOT_AVAILABLE)
+
+    # If sending on the cached channel fails, and so does the retry, the
+    # caller gets the error
+    send_message(q, cd, account, 'romeo', 'five')
+    e = expect_send(q, romeo, 'five')
+    q.dbus_raise(e.message, cs.NOT_AVAILABLE, 'still no')
+
+    e = expect_ensure(q, conn, 'romeo')
+    q.dbus_return(e.message, False, romeo.object_path, romeo.immutable,
+            signature='boa{sv}')
+    e = expect_send(q, romeo, 'five')
+    q.dbus_raise(e.message, cs.NOT_AVAILABLE, 'really not')
+    q.expect('dbus-error', method='SendMessage', name=cs.NOT_AVAILABLE)
+
+    # While MC is ensuring a channel, further messages to the same contact
+    # wait for it...
+    send_message(q, cd, account, 'romeo', 'six')
+    e = expect_ensure(q, conn, 'romeo')
+    q.forbid_events(no_ensure)
+
+    queued = ['queued %d' % i for i in range(MAX_QUEUED_MESSAGES)]
+
+    for text in queued:
+        send_message(q, cd, account, 'romeo', text)
+
+    # ... but only up to a point
+    send_message(q, cd, account, 'romeo', 'one too many')
+    q.expect('dbus-error', method='SendMessage', name=cs.NOT_AVAILABLE)
+
+    # When the channel turns up, they are all sent on it, in order
+    q.dbus_return(e.message, False, romeo.object_path, romeo.immutable,
+            signature='boa{sv}')
+
+    for text in ['six'] + queued:
+        e = expect_send(q, romeo, text)
+        q.dbus_return(e.message, 'token-' + text, signature='s')
+
+    q.expect('dbus-return', method='SendMessage',
+            value=('token-' + queued[-1],))
+    q.unforbid_events(no_ensure)
+
+    # Once the channel has been idle for a while, MC forgets it, so the next
+    # message makes a new request
+    time.sleep(MESSAGE_CHANNEL_IDLE_SECONDS + 1)
+
+    send_message(q, cd, account, 'romeo', 'seven')
+    e = expect_ensure(q, conn, 'romeo')
+    q.dbus_return(e.message, False, romeo.object_path, romeo.immutable,
+            signature='boa{sv}')
+    e = expect_send(q, romeo, 'seven')
+    q.dbus_return(e.message, 'token-7', signature='s')
+    q.expect('dbus-return', method='SendMessage', value=('token-7',))
+
+    q.unforbid_events(forbidden)
+
+if __name__ == '__main__':
+    exec_test(test, {})
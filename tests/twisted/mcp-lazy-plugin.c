@@ -0,0 +1,89 @@
+/*
+ * A plugin with a manifest, which is only loaded when Mission Control
+ * needs a dispatch operation policy.
+ *
+ * Copyright © 2014 Collabora Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "config.h"
+
+#include <mission-control-plugins/mission-control-plugins.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include <telepathy-glib/telepathy-glib.h>
+
+#define DEBUG g_debug
+
+/* ------ TestLazyPlugin -------------------------------------- */
+/* doesn't do anything, apart from saying that it has been loaded */
+
+typedef struct {
+    GObject parent;
+} TestLazyPlugin;
+
+typedef struct {
+    GObjectClass parent_class;
+} TestLazyPluginClass;
+
+GType test_lazy_plugin_get_type (void) G_GNUC_CONST;
+
+G_DEFINE_TYPE_WITH_CODE (TestLazyPlugin, test_lazy_plugin,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (MCP_TYPE_DISPATCH_OPERATION_POLICY, NULL))
+
+static void
+test_lazy_plugin_init (TestLazyPlugin *self)
+{
+}
+
+static void
+test_lazy_plugin_class_init (TestLazyPluginClass *cls)
+{
+}
+
+/* ------ Initialization -------------------------------------------- */
+
+GObject *
+mcp_plugin_ref_nth_object (guint n)
+{
+  TpDBusDaemon *dbus_daemon;
+  DBusGConnection *gconn;
+  DBusMessage *message;
+
+  DEBUG ("Initializing mcp-lazy-plugin (n=%u)", n);
+
+  if (n > 0)
+    return NULL;
+
+  /* let the test know that we have been loaded */
+  dbus_daemon = tp_dbus_daemon_dup (NULL);
+  gconn = tp_proxy_get_dbus_connection (dbus_daemon);
+  message = dbus_message_new_signal ("/com/example/LazyPlugin",
+      "com.example.LazyPlugin", "Loaded");
+
+  if (message == NULL ||
+      !dbus_connection_send (dbus_g_connection_get_connection (gconn),
+        message, NULL))
+    g_error ("out of memory");
+
+  dbus_message_unref (message);
+  g_object_unref (dbus_daemon);
+
+  return g_object_new (test_lazy_plugin_get_type (), NULL);
+}
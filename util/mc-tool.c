@@ -47,6 +47,10 @@ show_help (gchar * err)
 	    "    %1$s list\n"
 	    "    %1$s summary\n"
 	    "    %1$s dump\n"
+	    "    %1$s client-stats\n"
+	    "    %1$s object-stats\n"
+	    "    %1$s trace\n"
+	    "    %1$s plugin-stats\n"
 	    "    %1$s add <manager>/<protocol> <display name> [<param> ...]\n"
 	    "    %1$s update <account name> [<param>|clear:key] ...\n"
 	    "    %1$s display <account name> <display name>\n"
@@ -844,6 +848,409 @@ command_dump (TpAccountManager *manager)
     return FALSE; /* stop mainloop */
 }
 
+/* the smallest latency (in us) that at least a fraction @p of the calls
+ * took no more than, as precisely as the histogram says */
+static guint64
+histogram_percentile (GVariant *histogram,
+                      guint32 count,
+                      gdouble p)
+{
+    GVariantIter iter;
+    guint64 limit = 0;
+    guint32 n;
+    guint32 seen = 0;
+    guint32 wanted = (guint32) (p * count + 0.5);
+
+    g_variant_iter_init (&iter, histogram);
+
+    while (g_variant_iter_next (&iter, "(tu)", &limit, &n)) {
+	seen += n;
+
+	if (seen >= wanted)
+	    break;
+    }
+
+    return limit;
+}
+
+/* @stats is of type a(ssuutta(tu)), as returned by GetClientStats */
+static void
+print_latency_stats (GVariant *stats,
+		     const gchar *heading)
+{
+    GVariant *histogram;
+    GVariantIter iter;
+    const gchar *client, *call;
+    guint32 count, failures;
+    guint64 total, max;
+
+    /* latencies are in ms; percentiles are upper bounds */
+    printf ("%-40s %-20s %7s %6s %8s %8s %8s %8s %8s\n",
+	    heading, "Call", "Calls", "Errors", "Mean", "p50", "p90", "p99",
+	    "Max");
+
+    g_variant_iter_init (&iter, stats);
+
+    while (g_variant_iter_next (&iter, "(&s&suut@a(tu))", &client, &call,
+				&count, &failures, &total, &max, &histogram)) {
+	const gchar *name = strip_prefix (client, TP_CLIENT_BUS_NAME_BASE);
+
+	/* only successful calls are timed */
+	guint32 timed = count - failures;
+
+	printf ("%-40s %-20s %7u %6u %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+		name != NULL ? name : client, call, count, failures,
+		timed > 0 ? total / 1000.0 / timed : 0.0,
+		histogram_percentile (histogram, timed, 0.5) / 1000.0,
+		histogram_percentile (histogram, timed, 0.9) / 1000.0,
+		histogram_percentile (histogram, timed, 0.99) / 1000.0,
+		max / 1000.0);
+	g_variant_unref (histogram);
+    }
+}
+
+static gboolean
+command_client_stats (TpAccountManager *manager)
+{
+    GDBusConnection *bus;
+    GVariant *reply, *stats;
+    GVariantIter iter;
+    const gchar *client;
+    GError *error = NULL;
+
+    bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+
+    if (bus == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	return FALSE;
+    }
+
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats", "GetClientStats",
+	NULL, G_VARIANT_TYPE ("(a(ssuutta(tu)))"), G_DBUS_CALL_FLAGS_NONE,
+	-1, NULL, &error);
+
+    if (reply == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	g_object_unref (bus);
+	return FALSE;
+    }
+
+    command.common.ret = 0;
+
+    stats = g_variant_get_child_value (reply, 0);
+    print_latency_stats (stats, "Client");
+    g_variant_unref (stats);
+    g_variant_unref (reply);
+
+    /* only present if request policies or internal requests delayed some
+     * channel requests */
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats",
+	"GetRequestDelayStats", NULL, G_VARIANT_TYPE ("(a(ssuutta(tu)))"),
+	G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+
+    if (reply != NULL) {
+	stats = g_variant_get_child_value (reply, 0);
+
+	if (g_variant_n_children (stats) > 0) {
+	    printf ("\n");
+	    print_latency_stats (stats, "Request delayed by");
+	}
+
+	g_variant_unref (stats);
+	g_variant_unref (reply);
+    }
+
+    /* only present if some Handlers' capabilities were announced */
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats",
+	"GetCapabilitiesStats", NULL, G_VARIANT_TYPE ("(a(suu))"),
+	G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+
+    if (reply != NULL) {
+	stats = g_variant_get_child_value (reply, 0);
+
+	if (g_variant_n_children (stats) > 0) {
+	    guint32 announced, suppressed;
+
+	    printf ("\n%-40s %9s %9s\n", "Handler capabilities", "Announced",
+		    "Unchanged");
+	    g_variant_iter_init (&iter, stats);
+
+	    while (g_variant_iter_next (&iter, "(&suu)", &client, &announced,
+					&suppressed)) {
+		const gchar *name = strip_prefix (client,
+						  TP_CLIENT_BUS_NAME_BASE);
+
+		printf ("%-40s %9u %9u\n", name != NULL ? name : client,
+			announced, suppressed);
+	    }
+	}
+
+	g_variant_unref (stats);
+	g_variant_unref (reply);
+    }
+
+    /* only present if some Handlers were pre-activated */
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats",
+	"GetPreactivationStats", NULL, G_VARIANT_TYPE ("(a(suu))"),
+	G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+    g_object_unref (bus);
+
+    if (reply == NULL)
+	return FALSE;
+
+    stats = g_variant_get_child_value (reply, 0);
+
+    if (g_variant_n_children (stats) > 0) {
+	guint32 hits, misses;
+
+	printf ("\n%-40s %7s %7s\n", "Pre-activated handler", "Hits",
+		"Misses");
+	g_variant_iter_init (&iter, stats);
+
+	while (g_variant_iter_next (&iter, "(&suu)", &client, &hits,
+				    &misses)) {
+	    const gchar *name = strip_prefix (client, TP_CLIENT_BUS_NAME_BASE);
+
+	    printf ("%-40s %7u %7u\n", name != NULL ? name : client, hits,
+		    misses);
+	}
+    }
+
+    g_variant_unref (stats);
+    g_variant_unref (reply);
+    return FALSE; /* stop mainloop */
+}
+
+static gboolean
+command_object_stats (TpAccountManager *manager)
+{
+    GDBusConnection *bus;
+    GVariant *reply, *stats;
+    GVariantIter iter;
+    const gchar *account, *type;
+    guint32 count;
+    guint64 bytes;
+    GError *error = NULL;
+
+    bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+
+    if (bus == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	return FALSE;
+    }
+
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats", "GetObjectStats",
+	NULL, G_VARIANT_TYPE ("(a(ssut))"), G_DBUS_CALL_FLAGS_NONE,
+	-1, NULL, &error);
+
+    if (reply == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	g_object_unref (bus);
+	return FALSE;
+    }
+
+    command.common.ret = 0;
+
+    printf ("%-40s %-24s %7s %10s\n", "Account", "Type", "Count", "Bytes");
+
+    stats = g_variant_get_child_value (reply, 0);
+    g_variant_iter_init (&iter, stats);
+
+    while (g_variant_iter_next (&iter, "(&s&sut)", &account, &type, &count,
+				&bytes)) {
+	const gchar *name = strip_prefix (account, TP_ACCOUNT_OBJECT_PATH_BASE);
+
+	if (name == NULL)
+	    name = (account[0] != '\0' ? account : "-");
+
+	printf ("%-40s %-24s %7u %10" G_GUINT64_FORMAT "\n", name, type,
+		count, bytes);
+    }
+
+    g_variant_unref (stats);
+    g_variant_unref (reply);
+
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats", "GetRequestStats",
+	NULL, G_VARIANT_TYPE ("(a(suuutttttttt))"), G_DBUS_CALL_FLAGS_NONE,
+	-1, NULL, NULL);
+    g_object_unref (bus);
+
+    if (reply == NULL)
+	return FALSE;
+
+    stats = g_variant_get_child_value (reply, 0);
+
+    if (g_variant_n_children (stats) > 0) {
+	guint32 queued, in_flight, max_queued;
+	guint64 sent, coalesced, waited, total_wait, max_wait;
+	guint64 replied, total_round_trip, max_round_trip;
+
+	/* times are in ms */
+	printf ("\n%-40s %6s %6s %6s %7s %7s %8s %8s %8s %8s\n",
+		"Connection", "Queued", "Active", "MaxQ", "Sent", "Merged",
+		"Wait", "MaxWait", "Reply", "MaxReply");
+	g_variant_iter_init (&iter, stats);
+
+	while (g_variant_iter_next (&iter, "(&suuutttttttt)", &account,
+				    &queued, &in_flight, &max_queued, &sent,
+				    &coalesced, &waited, &total_wait,
+				    &max_wait, &replied, &total_round_trip,
+				    &max_round_trip)) {
+	    const gchar *name = strip_prefix (account,
+					      TP_ACCOUNT_OBJECT_PATH_BASE);
+
+	    if (name == NULL)
+		name = (account[0] != '\0' ? account : "-");
+
+	    printf ("%-40s %6u %6u %6u %7" G_GUINT64_FORMAT " %7"
+		    G_GUINT64_FORMAT " %8.1f %8.1f %8.1f %8.1f\n",
+		    name, queued, in_flight, max_queued, sent, coalesced,
+		    waited > 0 ? total_wait / 1000.0 / waited : 0.0,
+		    max_wait / 1000.0,
+		    replied > 0 ? total_round_trip / 1000.0 / replied : 0.0,
+		    max_round_trip / 1000.0);
+	}
+    }
+
+    g_variant_unref (stats);
+    g_variant_unref (reply);
+    return FALSE; /* stop mainloop */
+}
+
+static gboolean
+command_trace (TpAccountManager *manager)
+{
+    GDBusConnection *bus;
+    GVariant *reply, *events;
+    GVariantIter iter;
+    const gchar *event, *detail;
+    gint64 time, first = -1;
+    guint64 subject;
+    GError *error = NULL;
+
+    bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+
+    if (bus == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	return FALSE;
+    }
+
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats", "GetTrace",
+	NULL, G_VARIANT_TYPE ("(a(xsts))"), G_DBUS_CALL_FLAGS_NONE,
+	-1, NULL, &error);
+    g_object_unref (bus);
+
+    if (reply == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	return FALSE;
+    }
+
+    command.common.ret = 0;
+
+    /* times are in ms since the oldest event */
+    printf ("%10s %-20s %-18s %s\n", "Time", "Event", "Subject", "Detail");
+
+    events = g_variant_get_child_value (reply, 0);
+    g_variant_iter_init (&iter, events);
+
+    while (g_variant_iter_next (&iter, "(x&st&s)", &time, &event, &subject,
+				&detail)) {
+	if (first < 0)
+	    first = time;
+
+	printf ("%10.3f %-20s 0x%016" G_GINT64_MODIFIER "x %s\n",
+		(time - first) / 1000.0, event, subject, detail);
+    }
+
+    g_variant_unref (events);
+    g_variant_unref (reply);
+    return FALSE; /* stop mainloop */
+}
+
+static gboolean
+command_plugin_stats (TpAccountManager *manager)
+{
+    GDBusConnection *bus;
+    GVariant *reply, *stats;
+    GVariantIter iter;
+    const gchar *plugin, *vfunc;
+    guint64 calls, total_usec, max_usec;
+    guint32 in_progress;
+    GError *error = NULL;
+
+    bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+
+    if (bus == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	return FALSE;
+    }
+
+    reply = g_dbus_connection_call_sync (bus,
+	"org.freedesktop.Telepathy.MissionControl5",
+	"/org/freedesktop/Telepathy/MissionControl5",
+	"org.freedesktop.Telepathy.MissionControl5.Stats",
+	"GetPluginCallStats",
+	NULL, G_VARIANT_TYPE ("(a(sstttu))"), G_DBUS_CALL_FLAGS_NONE,
+	-1, NULL, &error);
+    g_object_unref (bus);
+
+    if (reply == NULL) {
+	fprintf (stderr, "%s: %s\n", app_name, error->message);
+	g_error_free (error);
+	return FALSE;
+    }
+
+    command.common.ret = 0;
+
+    /* times are in ms */
+    printf ("%-32s %-28s %8s %10s %10s %8s\n", "Plugin", "Method",
+	    "Calls", "Mean", "Max", "Pending");
+
+    stats = g_variant_get_child_value (reply, 0);
+    g_variant_iter_init (&iter, stats);
+
+    while (g_variant_iter_next (&iter, "(&s&stttu)", &plugin, &vfunc,
+				&calls, &total_usec, &max_usec,
+				&in_progress)) {
+	printf ("%-32s %-28s %8" G_GUINT64_FORMAT " %10.3f %10.3f %8u\n",
+		plugin, vfunc, calls,
+		calls > 0 ? total_usec / 1000.0 / calls : 0.0,
+		max_usec / 1000.0, in_progress);
+    }
+
+    g_variant_unref (stats);
+    g_variant_unref (reply);
+    return FALSE; /* stop mainloop */
+}
+
 static gboolean
 command_connection (TpAccount *account)
 {
@@ -1146,6 +1553,38 @@ parse (int argc, char **argv)
 
         command.ready.manager = command_dump;
     }
+    else if (strcmp (argv[1], "client-stats") == 0)
+    {
+        /* Show how quickly clients reply to MC */
+        if (argc != 2)
+            show_help ("Invalid client-stats command.");
+
+        command.ready.manager = command_client_stats;
+    }
+    else if (strcmp (argv[1], "object-stats") == 0)
+    {
+        /* Show what MC is holding on to */
+        if (argc != 2)
+            show_help ("Invalid object-stats command.");
+
+        command.ready.manager = command_object_stats;
+    }
+    else if (strcmp (argv[1], "trace") == 0)
+    {
+        /* Show the recent dispatching events */
+        if (argc != 2)
+            show_help ("Invalid trace command.");
+
+        command.ready.manager = command_trace;
+    }
+    else if (strcmp (argv[1], "plugin-stats") == 0)
+    {
+        /* Show the time spent in each plugin */
+        if (argc != 2)
+            show_help ("Invalid plugin-stats command.");
+
+        command.ready.manager = command_plugin_stats;
+    }
     else if (strcmp  (argv[1], "remove") == 0
 	     || strcmp (argv[1], "delete") == 0)
     {